@@ -0,0 +1,99 @@
+// adaptive.cpp
+#include "adaptive.h"
+#include "log.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace {
+
+// libx264 can only retune rate control on the fly, so the ladder trades bits
+// first, then frame rate, and only drops frames as a last resort.
+const QualityLevel LEVELS[] = {
+        {"full", 0, 1, false},
+        {"reduced-bitrate", 1, 1, false},
+        {"half-rate", 1, 2, false},
+        {"half-rate-low-bitrate", 2, 2, false},
+        {"quarter-rate", 2, 4, false},
+        {"drop-frames", 2, 4, true},
+};
+const int LEVEL_COUNT = sizeof(LEVELS) / sizeof(LEVELS[0]);
+
+} // namespace
+
+AdaptiveQualityController::AdaptiveQualityController() {
+    Reset();
+}
+
+void AdaptiveQualityController::Reset() {
+    m_level = 0;
+    m_calmEvaluations = 0;
+    m_samples = 0;
+    m_levelChanges = 0;
+    m_stepsDown = 0;
+    m_stepsUp = 0;
+    m_maxQueueSeen = 0;
+    m_maxEncodeMs = 0.0;
+}
+
+const QualityLevel& AdaptiveQualityController::Level() const {
+    return LEVELS[m_level];
+}
+
+bool AdaptiveQualityController::Update(const PipelineSample& sample) {
+    m_samples++;
+    m_maxQueueSeen = std::max(m_maxQueueSeen, sample.queueDepth);
+    m_maxEncodeMs = std::max(m_maxEncodeMs, sample.encodeMs);
+    if (m_samples % QUALITY_EVALUATE_INTERVAL != 0) {
+        return false;
+    }
+
+    // Each encoder has this long per submitted frame at the current level
+    double budget = sample.frameIntervalMs * LEVELS[m_level].frameStride;
+    double betterBudget = m_level > 0 ? sample.frameIntervalMs * LEVELS[m_level - 1].frameStride : budget;
+
+    std::stringstream reason;
+    reason.precision(1);
+    reason << std::fixed << "queue " << sample.queueDepth << ", encode " << sample.encodeMs
+           << " ms, capture " << sample.captureMs << " ms, budget " << budget << " ms";
+
+    bool behind = sample.queueDepth > QUALITY_QUEUE_HIGH ||
+                  sample.encodeMs > budget * 0.9 ||
+                  sample.captureMs > sample.frameIntervalMs * 0.8;
+    if (behind) {
+        m_calmEvaluations = 0;
+        if (m_level + 1 < LEVEL_COUNT) {
+            m_stepsDown++;
+            return ChangeLevel(m_level + 1, reason.str());
+        }
+        return false;
+    }
+
+    bool calm = sample.queueDepth <= 1 &&
+                sample.encodeMs < betterBudget * 0.6 &&
+                sample.captureMs < sample.frameIntervalMs * 0.5;
+    m_calmEvaluations = calm ? m_calmEvaluations + 1 : 0;
+    if (m_level > 0 && m_calmEvaluations >= QUALITY_RECOVER_EVALUATIONS) {
+        m_calmEvaluations = 0;
+        m_stepsUp++;
+        return ChangeLevel(m_level - 1, reason.str());
+    }
+    return false;
+}
+
+bool AdaptiveQualityController::ChangeLevel(int level, const std::string& reason) {
+    std::string message = std::string(LEVELS[m_level].name) + " -> " + LEVELS[level].name + " (" + reason + ")";
+    m_level = level;
+    m_levelChanges++;
+    LogConcise("Quality", message);
+    LogDebug("Quality level changed: " + message);
+    return true;
+}
+
+std::string AdaptiveQualityController::Summary() const {
+    std::stringstream ss;
+    ss << "level " << LEVELS[m_level].name << ", " << m_levelChanges << " changes ("
+       << m_stepsDown << " down, " << m_stepsUp << " up), max queue " << m_maxQueueSeen
+       << ", max encode " << m_maxEncodeMs << " ms over " << m_samples << " samples";
+    return ss.str();
+}
@@ -0,0 +1,55 @@
+// adaptive.h
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#define QUALITY_EVALUATE_INTERVAL 15     // frames between decisions
+#define QUALITY_QUEUE_HIGH 10            // queued frames that count as falling behind
+#define QUALITY_RECOVER_EVALUATIONS 6    // consecutive calm evaluations before stepping back up
+#define QUALITY_CRF_STEP 4               // CRF added per quality step
+#define QUALITY_BITRATE_STEP 0.7         // bitrate multiplier per quality step
+
+// One snapshot of the pipeline, taken by the capture thread.
+struct PipelineSample {
+    size_t queueDepth;      // deepest encoder queue
+    double captureMs;       // capture thread time for the last frame (grab and convert)
+    double encodeMs;        // slowest encoder's average time per frame
+    double frameIntervalMs; // nominal capture interval
+};
+
+// Settings for one rung of the degradation ladder.
+struct QualityLevel {
+    const char* name;
+    int qualityStep;   // rate-control step applied to every encoder
+    int frameStride;   // capture every Nth frame tick
+    bool dropFrames;   // let full encoder queues drop new frames
+};
+
+// Closed-loop controller that walks down the ladder when the encoders fall
+// behind and climbs back once there has been headroom for a while.
+class AdaptiveQualityController {
+public:
+    AdaptiveQualityController();
+
+    void Reset();
+    // Returns true when the level changed.
+    bool Update(const PipelineSample& sample);
+
+    const QualityLevel& Level() const;
+    int LevelIndex() const { return m_level; }
+    int64_t LevelChanges() const { return m_levelChanges; }
+    std::string Summary() const;
+
+private:
+    bool ChangeLevel(int level, const std::string& reason);
+
+    int m_level;
+    int m_calmEvaluations;
+    int64_t m_samples;
+    int64_t m_levelChanges;
+    int64_t m_stepsDown;
+    int64_t m_stepsUp;
+    size_t m_maxQueueSeen;
+    double m_maxEncodeMs;
+};
@@ -0,0 +1,354 @@
+// animation.cpp
+#include "animation.h"
+#include "damage.h"
+#include "log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/time.h>
+}
+
+namespace {
+
+bool EndsWith(const std::string& text, const std::string& suffix) {
+    if (text.size() < suffix.size()) return false;
+    for (size_t i = 0; i < suffix.size(); i++) {
+        char c = text[text.size() - suffix.size() + i];
+        if ((c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c) != suffix[i]) return false;
+    }
+    return true;
+}
+
+} // namespace
+
+AnimationExporter::AnimationExporter()
+        : FrameWorker("Animation"), m_webp(false), m_frameRate(0), m_maxPts(0), m_width(0), m_height(0),
+          m_columns(0), m_rows(0), m_scaler(nullptr), m_storedBytes(0), m_nextTick(0), m_endPts(0), m_full(false),
+          m_codec(nullptr), m_format(nullptr), m_stream(nullptr), m_packet(nullptr), m_encoded(0) {
+}
+
+AnimationExporter::~AnimationExporter() {
+    Finish();
+    Release();
+}
+
+bool AnimationExporter::Open(const std::string& filename, int width, int height, int frameRate, int maxSeconds) {
+    Release();
+    m_filename = filename;
+    m_webp = EndsWith(filename, ".webp");
+    m_frameRate = frameRate;
+    m_maxPts = static_cast<int64_t>(maxSeconds > 0 ? maxSeconds : ANIMATION_DEFAULT_SECONDS) * frameRate;
+    m_frames.clear();
+    m_previousHashes.clear();
+    m_storedBytes = 0;
+    m_nextTick = 0;
+    m_endPts = 0;
+    m_full = false;
+
+    // Even sizes so the WebP path can go through YUV 4:2:0
+    m_width = (width < ANIMATION_MAX_WIDTH ? width : ANIMATION_MAX_WIDTH) & ~1;
+    m_height = static_cast<int>(static_cast<int64_t>(height) * m_width / width) & ~1;
+    if (m_width < 2 || m_height < 2 || frameRate <= 0) {
+        return false;
+    }
+    m_columns = (m_width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    m_rows = (m_height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    m_scaler = sws_getContext(width, height, AV_PIX_FMT_YUV420P, m_width, m_height, AV_PIX_FMT_BGRA,
+                              SWS_AREA, NULL, NULL, NULL);
+    if (!m_scaler) {
+        LogDebug("Animation: could not set up the scaler");
+        return false;
+    }
+    m_scaled.resize(static_cast<size_t>(m_width) * m_height * 4);
+
+    SetLowPriority(true);
+    // A late frame only makes the previous one stay up longer
+    SetMaxQueueDepth(4);
+    Start();
+    return true;
+}
+
+void AnimationExporter::TileRect(uint32_t tile, int& x, int& y, int& width, int& height) const {
+    x = static_cast<int>(tile % m_columns) * DAMAGE_TILE_SIZE;
+    y = static_cast<int>(tile / m_columns) * DAMAGE_TILE_SIZE;
+    width = std::min(DAMAGE_TILE_SIZE, m_width - x);
+    height = std::min(DAMAGE_TILE_SIZE, m_height - y);
+}
+
+void AnimationExporter::ApplyTiles(const std::vector<uint32_t>& tiles, const uint8_t* data, int bytesPerPixel,
+                                   uint8_t* canvas) const {
+    size_t canvasStride = static_cast<size_t>(m_width) * bytesPerPixel;
+    for (uint32_t tile : tiles) {
+        int x, y, width, height;
+        TileRect(tile, x, y, width, height);
+        size_t rowBytes = static_cast<size_t>(width) * bytesPerPixel;
+        for (int row = 0; row < height; row++) {
+            memcpy(canvas + (y + row) * canvasStride + static_cast<size_t>(x) * bytesPerPixel, data, rowBytes);
+            data += rowBytes;
+        }
+    }
+}
+
+bool AnimationExporter::ProcessFrame(AVFrame* frame) {
+    if (m_full || frame->pts >= m_maxPts) {
+        return true;
+    }
+    int64_t tick = av_rescale(frame->pts, ANIMATION_FRAME_RATE, m_frameRate);
+    if (tick < m_nextTick) {
+        return true;
+    }
+    m_nextTick = tick + 1;
+    int64_t pts = av_rescale(tick, 100, ANIMATION_FRAME_RATE);
+
+    uint8_t* dst[4] = { m_scaled.data(), nullptr, nullptr, nullptr };
+    int dstStride[4] = { m_width * 4, 0, 0, 0 };
+    sws_scale(m_scaler, frame->data, frame->linesize, 0, frame->height, dst, dstStride);
+    HashTiles(m_scaled.data(), m_width, m_height, m_width * 4, m_hashes);
+
+    StoredFrame stored;
+    stored.pts = pts;
+    for (uint32_t tile = 0; tile < m_hashes.size(); tile++) {
+        if (m_previousHashes.empty() || m_hashes[tile] != m_previousHashes[tile]) {
+            stored.tiles.push_back(tile);
+        }
+    }
+    if (!stored.tiles.empty()) {
+        for (uint32_t tile : stored.tiles) {
+            int x, y, width, height;
+            TileRect(tile, x, y, width, height);
+            for (int row = 0; row < height; row++) {
+                const uint8_t* src = m_scaled.data() + (static_cast<size_t>(y + row) * m_width + x) * 4;
+                stored.pixels.insert(stored.pixels.end(), src, src + width * 4);
+            }
+        }
+        int64_t bytes = static_cast<int64_t>(stored.pixels.size() + stored.tiles.size() * sizeof(uint32_t));
+        if (m_storedBytes + bytes > ANIMATION_MAX_BYTES) {
+            m_full = true;
+            LogConcise("Animation", "Memory budget reached at " + std::to_string(pts / 100.0) + " s; the clip ends there");
+            return true;
+        }
+        m_storedBytes += bytes;
+        m_frames.push_back(std::move(stored));
+        m_previousHashes.swap(m_hashes);
+    }
+    m_endPts = av_rescale(tick + 1, 100, ANIMATION_FRAME_RATE);
+    return true;
+}
+
+bool AnimationExporter::WriteGif() {
+    std::vector<PixelSpan> spans;
+    for (const StoredFrame& frame : m_frames) {
+        spans.push_back(PixelSpan{frame.pixels.data(), frame.pixels.size() / 4});
+    }
+    std::vector<uint32_t> histogram;
+    BuildHistogram(spans, 0, histogram);
+    Palette palette = MedianCutPalette(histogram, ANIMATION_GIF_COLORS);
+    std::vector<uint8_t> lut;
+    BuildColorLut(palette, 0, lut);
+
+    // Frames differ wildly in how many tiles they carry, so threads take
+    // them one at a time rather than in fixed ranges
+    std::atomic<size_t> next(0);
+    auto dither = [this, &next, &lut]() {
+        for (size_t i = next++; i < m_frames.size(); i = next++) {
+            StoredFrame& frame = m_frames[i];
+            frame.indices.resize(frame.pixels.size() / 4);
+            size_t offset = 0;
+            for (uint32_t tile : frame.tiles) {
+                int x, y, width, height;
+                TileRect(tile, x, y, width, height);
+                DitherOrdered(frame.pixels.data() + offset * 4, width, height, width * 4, x, y, lut,
+                              frame.indices.data() + offset, width);
+                offset += static_cast<size_t>(width) * height;
+            }
+            std::vector<uint8_t>().swap(frame.pixels);
+        }
+    };
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++) {
+        pool.emplace_back(dither);
+    }
+    dither();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_GIF);
+    AVFrame* image = av_frame_alloc();
+    if (!codec || !image || !OpenOutput(codec, AV_PIX_FMT_PAL8, NULL)) {
+        av_frame_free(&image);
+        return false;
+    }
+    image->format = AV_PIX_FMT_PAL8;
+    image->width = m_width;
+    image->height = m_height;
+    bool ok = av_frame_get_buffer(image, 32) >= 0;
+    std::vector<uint8_t> canvas(static_cast<size_t>(m_width) * m_height);
+    for (size_t i = 0; ok && i < m_frames.size(); i++) {
+        ApplyTiles(m_frames[i].tiles, m_frames[i].indices.data(), 1, canvas.data());
+        if (av_frame_make_writable(image) < 0) {
+            ok = false;
+            break;
+        }
+        for (int y = 0; y < m_height; y++) {
+            memcpy(image->data[0] + static_cast<size_t>(y) * image->linesize[0],
+                   canvas.data() + static_cast<size_t>(y) * m_width, m_width);
+        }
+        // Unused entries stay fully transparent
+        memset(image->data[1], 0, AVPALETTE_SIZE);
+        memcpy(image->data[1], palette.colors, palette.count * sizeof(uint32_t));
+        image->pts = m_frames[i].pts;
+        ok = EncodeFrame(image);
+    }
+    av_frame_free(&image);
+    return ok && EncodeFrame(NULL) && CloseOutput();
+}
+
+bool AnimationExporter::WriteWebP() {
+    const AVCodec* codec = avcodec_find_encoder_by_name("libwebp_anim");
+    if (!codec) {
+        LogDebug("Animation: no animated WebP encoder in this FFmpeg build");
+        return false;
+    }
+    SwsContext* converter = sws_getContext(m_width, m_height, AV_PIX_FMT_BGRA, m_width, m_height, AV_PIX_FMT_YUV420P,
+                                           SWS_POINT, NULL, NULL, NULL);
+    AVFrame* image = av_frame_alloc();
+    AVDictionary* options = NULL;
+    av_dict_set(&options, "quality", "75", 0);
+    bool ok = converter && image && OpenOutput(codec, AV_PIX_FMT_YUV420P, &options);
+    av_dict_free(&options);
+    if (ok) {
+        image->format = AV_PIX_FMT_YUV420P;
+        image->width = m_width;
+        image->height = m_height;
+        ok = av_frame_get_buffer(image, 32) >= 0;
+    }
+    std::vector<uint8_t> canvas(static_cast<size_t>(m_width) * m_height * 4);
+    for (size_t i = 0; ok && i < m_frames.size(); i++) {
+        ApplyTiles(m_frames[i].tiles, m_frames[i].pixels.data(), 4, canvas.data());
+        if (av_frame_make_writable(image) < 0) {
+            ok = false;
+            break;
+        }
+        const uint8_t* src[4] = { canvas.data(), nullptr, nullptr, nullptr };
+        int srcStride[4] = { m_width * 4, 0, 0, 0 };
+        sws_scale(converter, src, srcStride, 0, m_height, image->data, image->linesize);
+        image->pts = m_frames[i].pts;
+        ok = EncodeFrame(image);
+    }
+    av_frame_free(&image);
+    sws_freeContext(converter);
+    return ok && EncodeFrame(NULL) && CloseOutput();
+}
+
+bool AnimationExporter::OpenOutput(const AVCodec* codec, AVPixelFormat format, AVDictionary** codecOptions) {
+    avformat_alloc_output_context2(&m_format, NULL, NULL, m_filename.c_str());
+    m_codec = avcodec_alloc_context3(codec);
+    m_packet = av_packet_alloc();
+    if (!m_format || !m_codec || !m_packet) {
+        LogDebug("Animation: could not set up " + m_filename);
+        return false;
+    }
+    m_codec->width = m_width;
+    m_codec->height = m_height;
+    m_codec->pix_fmt = format;
+    m_codec->time_base = AVRational{1, 100};
+    if (m_format->oformat->flags & AVFMT_GLOBALHEADER) {
+        m_codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(m_codec, codec, codecOptions) < 0 || !(m_stream = avformat_new_stream(m_format, NULL)) ||
+        avcodec_parameters_from_context(m_stream->codecpar, m_codec) < 0) {
+        LogDebug("Animation: could not open the " + std::string(codec->name) + " encoder");
+        return false;
+    }
+    m_stream->time_base = m_codec->time_base;
+    // Loop forever, as chat clients expect
+    AVDictionary* muxerOptions = NULL;
+    av_dict_set(&muxerOptions, "loop", "0", 0);
+    int ret = avio_open(&m_format->pb, m_filename.c_str(), AVIO_FLAG_WRITE);
+    if (ret >= 0) {
+        ret = avformat_write_header(m_format, &muxerOptions);
+    }
+    av_dict_free(&muxerOptions);
+    if (ret < 0) {
+        LogDebug("Animation: could not open " + m_filename);
+        return false;
+    }
+    m_encoded = 0;
+    return true;
+}
+
+bool AnimationExporter::EncodeFrame(AVFrame* frame) {
+    if (avcodec_send_frame(m_codec, frame) < 0) {
+        return false;
+    }
+    while (avcodec_receive_packet(m_codec, m_packet) >= 0) {
+        // Frames that changed nothing were dropped, so each one lasts until the next
+        if (m_packet->duration <= 0 && m_encoded < m_frames.size()) {
+            m_packet->duration = Duration(m_encoded);
+        }
+        m_encoded++;
+        av_packet_rescale_ts(m_packet, m_codec->time_base, m_stream->time_base);
+        m_packet->stream_index = m_stream->index;
+        if (av_interleaved_write_frame(m_format, m_packet) < 0) {
+            LogDebug("Animation: error writing to " + m_filename);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AnimationExporter::CloseOutput() {
+    return av_write_trailer(m_format) >= 0;
+}
+
+int64_t AnimationExporter::Duration(size_t frame) const {
+    int64_t end = frame + 1 < m_frames.size() ? m_frames[frame + 1].pts : m_endPts;
+    return std::max<int64_t>(1, end - m_frames[frame].pts);
+}
+
+bool AnimationExporter::OnFinish() {
+    if (m_frames.empty()) {
+        return true;
+    }
+    int64_t start = av_gettime_relative();
+    bool ok = m_webp ? WriteWebP() : WriteGif();
+    Release();
+    if (!ok) {
+        LogDebug("Animation: could not write " + m_filename);
+        std::remove(m_filename.c_str());
+        return false;
+    }
+    size_t tiles = 0;
+    for (const StoredFrame& frame : m_frames) {
+        tiles += frame.tiles.size();
+    }
+    LogConcise("Animation", m_filename + ": " + std::to_string(m_frames.size()) + " frames, " +
+                            std::to_string(m_endPts / 100.0) + " s, " + std::to_string(tiles) + " of " +
+                            std::to_string(m_frames.size() * m_columns * m_rows) + " tiles stored, written in " +
+                            std::to_string((av_gettime_relative() - start) / 1000) + " ms, " +
+                            std::to_string(Dropped()) + " frames skipped");
+    m_frames.clear();
+    return true;
+}
+
+void AnimationExporter::Release() {
+    sws_freeContext(m_scaler);
+    m_scaler = nullptr;
+    avcodec_free_context(&m_codec);
+    if (m_format) {
+        avio_closep(&m_format->pb);
+        avformat_free_context(m_format);
+        m_format = nullptr;
+    }
+    m_stream = nullptr;
+    av_packet_free(&m_packet);
+}
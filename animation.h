@@ -0,0 +1,90 @@
+// animation.h
+#pragma once
+
+#include "pipeline.h"
+#include "palette.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#define ANIMATION_FRAME_RATE 15
+#define ANIMATION_MAX_WIDTH 800
+#define ANIMATION_DEFAULT_SECONDS 15
+#define ANIMATION_MAX_BYTES (256 * 1024 * 1024)  // changed tiles kept until the clip is written
+#define ANIMATION_GIF_COLORS 255                 // leaves one index for the encoder's transparency
+
+// Exports the start of a recording as an animated GIF or WebP, for pasting
+// into chats and tickets, from frames already in the pipeline. Frames are
+// downscaled and thinned to ANIMATION_FRAME_RATE, and only the tiles that
+// changed since the previous kept frame are stored; frames with none are
+// dropped and the previous one is shown longer.
+//
+// GIFs get one palette for the whole clip, built in parallel from every
+// stored tile, and ordered dithering, which keeps static areas identical
+// from frame to frame so the encoder's own cropping and transparency leave
+// only the changed rectangle in each frame. Tiles are dithered in parallel.
+// A .webp filename uses FFmpeg's libwebp_anim encoder instead.
+class AnimationExporter : public FrameWorker {
+public:
+    AnimationExporter();
+    ~AnimationExporter() override;
+
+    bool Open(const std::string& filename, int width, int height, int frameRate, int maxSeconds);
+
+    const std::string& Filename() const { return m_filename; }
+
+protected:
+    bool ProcessFrame(AVFrame* frame) override;
+    bool OnFinish() override;
+
+private:
+    struct StoredFrame {
+        int64_t pts;                   // in 1/100 s, the GIF delay unit
+        std::vector<uint32_t> tiles;   // changed tiles, row-major tile numbers
+        std::vector<uint8_t> pixels;   // their BGRA pixels, tile after tile
+        std::vector<uint8_t> indices;  // the same, dithered to the palette
+    };
+
+    void TileRect(uint32_t tile, int& x, int& y, int& width, int& height) const;
+    // Copies a frame's tiles into a full-size canvas of bytesPerPixel
+    void ApplyTiles(const std::vector<uint32_t>& tiles, const uint8_t* data, int bytesPerPixel,
+                    uint8_t* canvas) const;
+    bool WriteGif();
+    bool WriteWebP();
+    bool OpenOutput(const AVCodec* codec, AVPixelFormat format, AVDictionary** codecOptions);
+    bool EncodeFrame(AVFrame* frame);
+    bool CloseOutput();
+    int64_t Duration(size_t frame) const;
+    void Release();
+
+    std::string m_filename;
+    bool m_webp;
+    int m_frameRate;
+    int64_t m_maxPts;
+    int m_width;
+    int m_height;
+    int m_columns;
+    int m_rows;
+
+    SwsContext* m_scaler;
+    std::vector<uint8_t> m_scaled;
+    std::vector<uint32_t> m_hashes;
+    std::vector<uint32_t> m_previousHashes;
+    std::vector<StoredFrame> m_frames;
+    int64_t m_storedBytes;
+    int64_t m_nextTick;
+    int64_t m_endPts;                  // just past the last frame, in 1/100 s
+    bool m_full;
+
+    AVCodecContext* m_codec;
+    AVFormatContext* m_format;
+    AVStream* m_stream;
+    AVPacket* m_packet;
+    size_t m_encoded;
+};
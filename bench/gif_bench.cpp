@@ -0,0 +1,187 @@
+// gif_bench.cpp
+// Synthetic UI benchmark for the animated GIF export: tile deltas, parallel
+// palette building, and scalar versus SIMD ordered dithering throughput.
+#include "damage.h"
+#include "palette.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const int WIDTH = 800;
+const int HEIGHT = 450;
+const int FRAME_COUNT = 90;
+const int SIDEBAR_WIDTH = 180;
+const int TITLE_HEIGHT = 28;
+const int LINE_HEIGHT = 16;
+
+uint32_t Lcg(uint32_t& state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+double MsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// A window with a title bar, a gradient sidebar, a document that is being
+// typed into line by line, a progress bar and a moving mouse pointer.
+void RenderUi(std::vector<uint8_t>& bgra, int frame) {
+    uint32_t* pixels = reinterpret_cast<uint32_t*>(bgra.data());
+    int typed = frame * 6;
+    for (int y = 0; y < HEIGHT; y++) {
+        uint32_t* row = pixels + static_cast<size_t>(y) * WIDTH;
+        for (int x = 0; x < WIDTH; x++) {
+            if (y < TITLE_HEIGHT) {
+                row[x] = x > WIDTH - 90 && (x / 30) % 2 ? 0xFF4A4D50u : 0xFF3C3F41u;
+            } else if (x < SIDEBAR_WIDTH) {
+                uint32_t shade = 0x30 + static_cast<uint32_t>(y - TITLE_HEIGHT) * 0x40 / HEIGHT;
+                row[x] = 0xFF000000u | (shade << 16) | ((shade + 8) << 8) | (shade + 24);
+            } else {
+                row[x] = 0xFFF5F5F5u;
+            }
+        }
+        if (y >= TITLE_HEIGHT) {
+            int docY = y - TITLE_HEIGHT;
+            int line = docY / LINE_HEIGHT;
+            int glyphRow = docY % LINE_HEIGHT;
+            if (glyphRow < 3 || glyphRow > 12) continue;
+            uint32_t state = static_cast<uint32_t>(line) * 2654435761u + 7;
+            int shown = typed - line * 70;
+            for (int x = SIDEBAR_WIDTH + 16, g = 0; x + 6 < WIDTH - 16 && g < shown; x += 8, g++) {
+                uint32_t glyph = Lcg(state);
+                if ((glyph & 7) == 0) continue;
+                uint32_t color = (glyph & 0x300) == 0 ? 0xFF0B61A4u : 0xFF202020u;
+                for (int gx = 0; gx < 6; gx++) {
+                    if ((glyph >> ((glyphRow + gx) % 16)) & 1) row[x + gx] = color;
+                }
+            }
+        }
+    }
+    // Progress bar
+    int barWidth = (WIDTH - SIDEBAR_WIDTH - 40) * (frame + 1) / FRAME_COUNT;
+    for (int y = HEIGHT - 24; y < HEIGHT - 14; y++) {
+        for (int x = SIDEBAR_WIDTH + 20; x < SIDEBAR_WIDTH + 20 + barWidth; x++) {
+            pixels[static_cast<size_t>(y) * WIDTH + x] = 0xFF2E9E4Fu;
+        }
+    }
+    // Pointer drifting across the document
+    int px = SIDEBAR_WIDTH + 40 + frame * 5, py = 120 + (frame % 30) * 3;
+    for (int y = 0; y < 16; y++) {
+        for (int x = 0; x <= y / 2 && px + x < WIDTH; x++) {
+            pixels[static_cast<size_t>(py + y) * WIDTH + px + x] = x == y / 2 ? 0xFFFFFFFFu : 0xFF000000u;
+        }
+    }
+}
+
+// Changed tiles of one frame packed tile after tile, as the exporter keeps them
+void PackTiles(const std::vector<uint8_t>& bgra, const std::vector<uint32_t>& tiles, std::vector<uint8_t>& packed) {
+    int columns = (WIDTH + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    packed.clear();
+    for (uint32_t tile : tiles) {
+        int x = static_cast<int>(tile % columns) * DAMAGE_TILE_SIZE;
+        int y = static_cast<int>(tile / columns) * DAMAGE_TILE_SIZE;
+        int w = WIDTH - x < DAMAGE_TILE_SIZE ? WIDTH - x : DAMAGE_TILE_SIZE;
+        int h = HEIGHT - y < DAMAGE_TILE_SIZE ? HEIGHT - y : DAMAGE_TILE_SIZE;
+        for (int row = 0; row < h; row++) {
+            const uint8_t* src = bgra.data() + (static_cast<size_t>(y + row) * WIDTH + x) * 4;
+            packed.insert(packed.end(), src, src + w * 4);
+        }
+    }
+}
+
+} // namespace
+
+int main() {
+    std::vector<std::vector<uint8_t>> frames(FRAME_COUNT, std::vector<uint8_t>(WIDTH * HEIGHT * 4));
+    for (int i = 0; i < FRAME_COUNT; i++) {
+        RenderUi(frames[i], i);
+    }
+    int threads = static_cast<int>(std::thread::hardware_concurrency());
+    if (threads < 1) threads = 1;
+
+    // Tile deltas
+    std::vector<std::vector<uint8_t>> packed(FRAME_COUNT);
+    std::vector<uint32_t> previous, current;
+    size_t changedTiles = 0, totalTiles = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < FRAME_COUNT; i++) {
+        HashTiles(frames[i].data(), WIDTH, HEIGHT, WIDTH * 4, current);
+        std::vector<uint32_t> tiles;
+        for (uint32_t t = 0; t < current.size(); t++) {
+            if (previous.empty() || current[t] != previous[t]) tiles.push_back(t);
+        }
+        PackTiles(frames[i], tiles, packed[i]);
+        changedTiles += tiles.size();
+        totalTiles += current.size();
+        previous.swap(current);
+    }
+    double deltaMs = MsSince(start);
+
+    std::vector<PixelSpan> spans;
+    size_t storedPixels = 0;
+    for (const std::vector<uint8_t>& tiles : packed) {
+        spans.push_back(PixelSpan{tiles.data(), tiles.size() / 4});
+        storedPixels += tiles.size() / 4;
+    }
+
+    // Palette: histogram on one thread and on all of them, then median cut and LUT
+    std::vector<uint32_t> histogram;
+    start = std::chrono::steady_clock::now();
+    BuildHistogram(spans, 1, histogram);
+    double histogramSerialMs = MsSince(start);
+    start = std::chrono::steady_clock::now();
+    BuildHistogram(spans, threads, histogram);
+    double histogramParallelMs = MsSince(start);
+    start = std::chrono::steady_clock::now();
+    Palette palette = MedianCutPalette(histogram, 255);
+    double medianCutMs = MsSince(start);
+    std::vector<uint8_t> lut;
+    start = std::chrono::steady_clock::now();
+    BuildColorLut(palette, 1, lut);
+    double lutSerialMs = MsSince(start);
+    start = std::chrono::steady_clock::now();
+    BuildColorLut(palette, threads, lut);
+    double lutParallelMs = MsSince(start);
+
+    // Dithering full frames, scalar reference against the SIMD path
+    std::vector<uint8_t> scalar(WIDTH * HEIGHT), simd(WIDTH * HEIGHT);
+    double scalarMs = 0.0, simdMs = 0.0, squaredError = 0.0;
+    bool identical = true;
+    for (int i = 0; i < FRAME_COUNT; i++) {
+        start = std::chrono::steady_clock::now();
+        DitherOrderedScalar(frames[i].data(), WIDTH, HEIGHT, WIDTH * 4, 0, 0, lut, scalar.data(), WIDTH);
+        scalarMs += MsSince(start);
+        start = std::chrono::steady_clock::now();
+        DitherOrdered(frames[i].data(), WIDTH, HEIGHT, WIDTH * 4, 0, 0, lut, simd.data(), WIDTH);
+        simdMs += MsSince(start);
+        identical = identical && memcmp(scalar.data(), simd.data(), simd.size()) == 0;
+        for (size_t p = 0; p < simd.size(); p++) {
+            uint32_t color = palette.colors[simd[p]];
+            for (int c = 0; c < 3; c++) {
+                double d = static_cast<double>(frames[i][p * 4 + c]) - ((color >> (8 * c)) & 0xFF);
+                squaredError += d * d;
+            }
+        }
+    }
+    double mse = squaredError / (3.0 * WIDTH * HEIGHT * FRAME_COUNT);
+    double megapixels = static_cast<double>(WIDTH) * HEIGHT * FRAME_COUNT / 1e6;
+
+    printf("{\"benchmark\":\"gif\",\"width\":%d,\"height\":%d,\"frames\":%d,\"threads\":%d,"
+           "\"changed_tile_pct\":%.1f,\"delta_ms_per_frame\":%.3f,\"stored_mpixels\":%.2f,"
+           "\"histogram_ms\":{\"serial\":%.2f,\"parallel\":%.2f},\"median_cut_ms\":%.2f,"
+           "\"lut_ms\":{\"serial\":%.2f,\"parallel\":%.2f},\"colors\":%d,"
+           "\"dither_mpix_per_s\":{\"scalar\":%.1f,\"simd\":%.1f},\"simd_matches_scalar\":%s,"
+           "\"dither_psnr_db\":%.2f}\n",
+           WIDTH, HEIGHT, FRAME_COUNT, threads,
+           100.0 * changedTiles / totalTiles, deltaMs / FRAME_COUNT, storedPixels / 1e6,
+           histogramSerialMs, histogramParallelMs, medianCutMs, lutSerialMs, lutParallelMs, palette.count,
+           scalarMs > 0 ? megapixels / (scalarMs / 1000.0) : 0.0, simdMs > 0 ? megapixels / (simdMs / 1000.0) : 0.0,
+           identical ? "true" : "false", mse > 0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 99.0);
+    return identical ? 0 : 1;
+}
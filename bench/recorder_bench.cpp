@@ -0,0 +1,1078 @@
+// recorder_bench.cpp
+// Headless benchmarks of the recording pipeline on a synthetic desktop:
+// capture-buffer handling, BGRA to YUV conversion, encoding across presets
+// and resolutions, and the whole analyze/convert/encode pipeline as the
+// recorder runs it. Prints one JSON document to stdout so runs can be diffed.
+//     recorder_bench [--quick] [--filter=<name substring>]
+// The latency cases run in real time; --filter=latency runs only those.
+// tracing/overhead compares the pipeline with the trace recorder off and on;
+// metrics/scrape fetches /metrics over loopback; shmring/roundtrip reads the
+// shared frame ring back on another thread and checks every byte.
+//
+// --golden turns it into a regression check instead: fixed static, typing,
+// scrolling and video sequences run through capture, analysis, conversion,
+// encoding and a decode, and each stage is held to its stored checksum,
+// quality floor, time and memory budget. Failures name the stage on stderr
+// and make the exit code 1.
+//     recorder_bench --golden [--budget-scale=<factor>] [--filter=<scenario>]
+#include "adaptive.h"
+#include "damage.h"
+#include "encoder.h"
+#include "framecode.h"
+#include "log.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "quality.h"
+#include "scroll.h"
+#include "shmring.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavutil/log.h>
+#include <libavutil/time.h>
+}
+
+namespace {
+
+const int FRAME_RATE = 30;
+const int TITLE_HEIGHT = 32;
+const int LINE_HEIGHT = 18;
+const int GLYPH_WIDTH = 9;
+const int SCROLL_BURST = 30;          // frames of scrolling, then as many of reading
+const size_t PIPELINE_MAX_QUEUE = 8;  // the producer waits instead of dropping frames
+const int TRACING_ROUNDS = 3;         // untraced/traced pairs per resolution
+const int METRICS_BENCH_PORT = METRICS_DEFAULT_PORT + 1;  // clear of a recorder running alongside
+const int METRICS_SCRAPES = 20;
+const int SHMRING_BENCH_FRAMES = 240;
+const int TYPING_FRAMES_PER_CHAR = 2;
+const int TYPING_LINES = 4;
+const int CARET_BLINK_FRAMES = 15;
+
+struct Resolution {
+    const char* name;
+    int width;
+    int height;
+};
+
+const Resolution RESOLUTIONS[] = {
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"1440p", 2560, 1440},
+    {"4k", 3840, 2160},
+};
+
+struct Result {
+    std::string name;
+    int width;
+    int height;
+    int frames;
+    double totalMs;
+    std::string extra;   // more JSON members, each with a leading comma
+};
+
+struct Options {
+    bool quick;
+    bool golden;
+    double budgetScale;   // golden time budgets are multiplied by this
+    std::string filter;
+};
+
+enum Scene {
+    SCENE_STATIC,         // nothing moves
+    SCENE_TYPING,         // text appears under a blinking caret
+    SCENE_SCROLLING,      // the document scrolls in bursts and the pointer wanders
+    SCENE_VIDEO,          // a player window with full motion
+};
+
+uint32_t Lcg(uint32_t& state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+double MsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string Member(const char* name, double value) {
+    char text[96];
+    snprintf(text, sizeof(text), ",\"%s\":%.3f", name, value);
+    return text;
+}
+
+std::string Member(const char* name, int64_t value) {
+    return std::string(",\"") + name + "\":" + std::to_string(value);
+}
+
+uint64_t Fnv1a(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// A document window under a fixed title bar, with a sidebar and a pointer.
+// The document is rendered once; capturing a frame is a row copy out of it,
+// about what GetDIBits costs, plus whatever the scene draws on top.
+class SyntheticScreen {
+public:
+    SyntheticScreen(int width, int height, Scene scene = SCENE_SCROLLING)
+            : m_width(width), m_height(height), m_scene(scene) {
+        int documentHeight = height * 2;
+        m_document.resize(static_cast<size_t>(width) * documentHeight);
+        int sidebar = width / 8;
+        for (int y = 0; y < documentHeight; y++) {
+            uint32_t* row = m_document.data() + static_cast<size_t>(y) * width;
+            int line = y / LINE_HEIGHT;
+            int glyphRow = y % LINE_HEIGHT;
+            uint32_t lineState = 0x9e3779b9u * (line + 1);
+            int lineLength = sidebar + 40 + static_cast<int>(Lcg(lineState) % (width - sidebar - 80));
+            for (int x = 0; x < width; x++) {
+                if (x < sidebar) {
+                    uint32_t shade = 0x30 + (y * 0x40 / documentHeight);
+                    row[x] = 0xff000000u | (shade << 16) | (shade << 8) | (shade + 0x20);
+                    continue;
+                }
+                bool ink = false;
+                if (glyphRow >= 4 && glyphRow < 14 && x >= sidebar + 16 && x < lineLength) {
+                    uint32_t glyph = static_cast<uint32_t>((x - sidebar - 16) / GLYPH_WIDTH) * 2654435761u ^ lineState;
+                    int column = (x - sidebar - 16) % GLYPH_WIDTH;
+                    ink = glyph % 6 != 0 && column < GLYPH_WIDTH - 2 && ((glyph >> (glyphRow + column)) & 1);
+                }
+                row[x] = ink ? 0xff202020u : 0xfffafafau;
+            }
+        }
+    }
+
+    void Capture(int frame, uint8_t* bgra) const {
+        uint32_t* pixels = reinterpret_cast<uint32_t*>(bgra);
+        int documentHeight = m_height * 2;
+        int bursts = frame / (2 * SCROLL_BURST);
+        int scroll = 0;
+        if (m_scene == SCENE_SCROLLING) {
+            scroll = (bursts * SCROLL_BURST + std::min(frame % (2 * SCROLL_BURST), SCROLL_BURST)) * 3 * LINE_HEIGHT / 2;
+        }
+        for (int y = 0; y < m_height; y++) {
+            uint32_t* row = pixels + static_cast<size_t>(y) * m_width;
+            if (y < TITLE_HEIGHT) {
+                std::fill(row, row + m_width, 0xff3c78d8u);
+                continue;
+            }
+            const uint32_t* source = m_document.data() + static_cast<size_t>((y + scroll) % documentHeight) * m_width;
+            memcpy(row, source, static_cast<size_t>(m_width) * 4);
+        }
+        if (m_scene == SCENE_TYPING) {
+            DrawTyping(frame, pixels);
+        } else if (m_scene == SCENE_VIDEO) {
+            DrawVideo(frame, pixels);
+        }
+        // Only scrolling moves the pointer; otherwise the hand is on the keyboard
+        int moved = m_scene == SCENE_SCROLLING ? frame : 0;
+        int pointerX = (moved * 7) % (m_width - 16) + (m_scene == SCENE_SCROLLING ? 0 : m_width / 2);
+        int pointerY = TITLE_HEIGHT + (moved * 3) % (m_height - TITLE_HEIGHT - 24);
+        for (int y = 0; y < 24; y++) {
+            uint32_t* row = pixels + static_cast<size_t>(pointerY + y) * m_width + pointerX;
+            for (int x = 0; x <= y * 2 / 3 && x < 16; x++) {
+                row[x] = (x == 0 || x == y * 2 / 3) ? 0xffffffffu : 0xff000000u;
+            }
+        }
+    }
+
+private:
+    // A page of TYPING_LINES lines near the top, filled one glyph at a time
+    void DrawTyping(int frame, uint32_t* pixels) const {
+        int left = m_width / 8 + 16;
+        int top = TITLE_HEIGHT + 2 * LINE_HEIGHT;
+        int perLine = (m_width - left - 40) / GLYPH_WIDTH;
+        int typed = frame / TYPING_FRAMES_PER_CHAR;
+        int pageStart = typed / (perLine * TYPING_LINES) * (perLine * TYPING_LINES);
+        for (int y = top; y < top + TYPING_LINES * LINE_HEIGHT; y++) {
+            uint32_t* row = pixels + static_cast<size_t>(y) * m_width;
+            std::fill(row + left - 16, row + m_width, 0xfffafafau);
+        }
+        for (int k = pageStart; k < typed; k++) {
+            uint32_t glyph = 0x9e3779b9u * static_cast<uint32_t>(k + 7);
+            glyph ^= glyph >> 13;
+            if (k % 6 == 5) {
+                continue;   // a space between words
+            }
+            int x0 = left + (k - pageStart) % perLine * GLYPH_WIDTH;
+            int y0 = top + (k - pageStart) / perLine * LINE_HEIGHT;
+            for (int glyphRow = 4; glyphRow < 14; glyphRow++) {
+                uint32_t* row = pixels + static_cast<size_t>(y0 + glyphRow) * m_width + x0;
+                for (int column = 0; column < GLYPH_WIDTH - 2; column++) {
+                    if ((glyph >> (glyphRow + column)) & 1) {
+                        row[column] = 0xff202020u;
+                    }
+                }
+            }
+        }
+        if ((frame / CARET_BLINK_FRAMES) % 2 == 0) {
+            int x = left + (typed - pageStart) % perLine * GLYPH_WIDTH;
+            int y0 = top + (typed - pageStart) / perLine * LINE_HEIGHT;
+            for (int y = y0 + 2; y < y0 + LINE_HEIGHT - 2; y++) {
+                pixels[static_cast<size_t>(y) * m_width + x] = 0xff000000u;
+                pixels[static_cast<size_t>(y) * m_width + x + 1] = 0xff000000u;
+            }
+        }
+    }
+
+    // A panning, textured picture in the middle half of the screen
+    void DrawVideo(int frame, uint32_t* pixels) const {
+        int left = m_width / 4 & ~1;
+        int top = m_height / 4 & ~1;
+        for (int y = top; y < m_height - top; y++) {
+            uint32_t* row = pixels + static_cast<size_t>(y) * m_width;
+            int v = y - top + frame * 2;
+            for (int x = left; x < m_width - left; x++) {
+                int u = x - left + frame * 4;
+                uint32_t texture = (static_cast<uint32_t>(u >> 3) * 73856093u ^
+                                    static_cast<uint32_t>(v >> 3) * 19349663u) * 2654435761u >> 26;
+                uint32_t r = (u + texture) & 0xff;
+                uint32_t g = (v * 2 + texture) & 0xff;
+                uint32_t b = ((u + v) / 2 + 0x80) & 0xff;
+                row[x] = 0xff000000u | (r << 16) | (g << 8) | b;
+            }
+        }
+    }
+
+    int m_width;
+    int m_height;
+    Scene m_scene;
+    std::vector<uint32_t> m_document;
+};
+
+// A fresh buffer per frame, as CaptureScreen hands out, against one reused buffer
+void BenchCapture(const Resolution& resolution, int frames, std::vector<Result>& results) {
+    SyntheticScreen screen(resolution.width, resolution.height);
+    size_t size = static_cast<size_t>(resolution.width) * resolution.height * 4;
+    uint64_t checksum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        std::vector<uint8_t> buffer(size);
+        screen.Capture(i, buffer.data());
+        checksum += buffer[size / 2];
+    }
+    double allocMs = MsSince(start);
+
+    std::vector<uint8_t> buffer(size);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        screen.Capture(i, buffer.data());
+        checksum += buffer[size / 2];
+    }
+    double reuseMs = MsSince(start);
+
+    double gigabytes = static_cast<double>(size) * frames / 1e9;
+    results.push_back(Result{std::string("capture/alloc/") + resolution.name, resolution.width, resolution.height,
+                             frames, allocMs, Member("gb_per_s", gigabytes / (allocMs / 1000.0))});
+    results.push_back(Result{std::string("capture/reuse/") + resolution.name, resolution.width, resolution.height,
+                             frames, reuseMs, Member("gb_per_s", gigabytes / (reuseMs / 1000.0)) +
+                                              Member("checksum", static_cast<int64_t>(checksum))});
+}
+
+// Scroll and damage analysis, then the sws BGRA to YUV420P conversion
+void BenchAnalyzeConvert(const Resolution& resolution, int frames, std::vector<Result>& results) {
+    SyntheticScreen screen(resolution.width, resolution.height);
+    int width = resolution.width;
+    int height = resolution.height;
+    std::vector<uint8_t> bgra(static_cast<size_t>(width) * height * 4);
+    std::vector<uint32_t> rowHashes;
+    std::vector<uint32_t> prevRowHashes;
+    DamageTracker damage;
+    FrameConverter converter;
+    if (!converter.Open(width, height)) {
+        return;
+    }
+
+    double analyzeMs = 0.0;
+    double convertMs = 0.0;
+    int scrolls = 0;
+    int64_t changedTiles = 0;
+    for (int i = 0; i < frames; i++) {
+        screen.Capture(i, bgra.data());
+
+        auto start = std::chrono::steady_clock::now();
+        HashRows(bgra.data(), width, height, width * 4, rowHashes);
+        if (!prevRowHashes.empty() && EstimateVerticalShift(prevRowHashes, rowHashes).isScroll) {
+            scrolls++;
+        }
+        prevRowHashes.swap(rowHashes);
+        changedTiles += damage.Update(bgra.data(), width, height, width * 4).changedTiles;
+        analyzeMs += MsSince(start);
+
+        start = std::chrono::steady_clock::now();
+        AVFrame* frame = converter.Convert(bgra.data(), width * 4, i);
+        convertMs += MsSince(start);
+        av_frame_free(&frame);
+    }
+
+    double megapixels = static_cast<double>(width) * height * frames / 1e6;
+    results.push_back(Result{std::string("analyze/") + resolution.name, width, height, frames, analyzeMs,
+                             Member("scrolls", static_cast<int64_t>(scrolls)) +
+                             Member("changed_tiles", changedTiles)});
+    results.push_back(Result{std::string("convert/sws_bicubic/") + resolution.name, width, height, frames, convertMs,
+                             Member("mpix_per_s", megapixels / (convertMs / 1000.0))});
+}
+
+// Encoding alone, to memory; conversion happens outside the timer
+void BenchEncode(const Resolution& resolution, const char* preset, int frames, std::vector<Result>& results) {
+    SyntheticScreen screen(resolution.width, resolution.height);
+    std::vector<uint8_t> bgra(static_cast<size_t>(resolution.width) * resolution.height * 4);
+    FrameConverter converter;
+    if (!converter.Open(resolution.width, resolution.height)) {
+        return;
+    }
+    EncoderProfile profile = DefaultEncoderProfiles()[0];
+    profile.name = std::string("bench ") + preset;
+    profile.preset = preset;
+    profile.fragmented = false;
+    profile.frameIndex = false;
+
+    VideoEncoder encoder;
+    encoder.SetPooled(false);
+    if (!encoder.Open("", resolution.width, resolution.height, FRAME_RATE, profile, 0)) {
+        return;
+    }
+    double encodeMs = 0.0;
+    bool ok = true;
+    for (int i = 0; i < frames && ok; i++) {
+        screen.Capture(i, bgra.data());
+        AVFrame* frame = converter.Convert(bgra.data(), resolution.width * 4, i);
+        auto start = std::chrono::steady_clock::now();
+        ok = frame && encoder.Encode(frame);
+        encodeMs += MsSince(start);
+        av_frame_free(&frame);
+    }
+    // The flush belongs to the encode; lookahead frames come out here
+    auto start = std::chrono::steady_clock::now();
+    ok = encoder.Finish() && ok;
+    encodeMs += MsSince(start);
+
+    int64_t bytes = encoder.BytesWritten();
+    double seconds = static_cast<double>(frames) / FRAME_RATE;
+    results.push_back(Result{std::string("encode/") + profile.codec + "_" + preset + "/" + resolution.name,
+                             resolution.width, resolution.height, frames, encodeMs,
+                             Member("bytes", bytes) + Member("kbps", bytes * 8 / seconds / 1000.0) +
+                             Member("ok", static_cast<int64_t>(ok))});
+}
+
+// The recorder's own path: capture copy, analysis, one conversion shared by
+// the default encoder workers, each muxing to a file. Timed until the last
+// output is closed.
+// One run of the whole pipeline with the default profiles, outputs removed
+struct PipelineRun {
+    double totalMs;
+    int64_t outputs;
+    int64_t bytes;
+    bool ok;
+};
+
+PipelineRun RunPipeline(const Resolution& resolution, int frames, const std::string& prefix) {
+    PipelineRun run = {0.0, 0, 0, false};
+    int width = resolution.width;
+    int height = resolution.height;
+    SyntheticScreen screen(width, height);
+    FrameConverter converter;
+    if (!converter.Open(width, height)) {
+        return run;
+    }
+    std::vector<std::unique_ptr<EncoderWorker>> workers;
+    std::vector<std::string> outputs;
+    for (const EncoderProfile& profile : DefaultEncoderProfiles()) {
+        std::string output = ProfileFilename(prefix + resolution.name + ".mp4", profile);
+        std::unique_ptr<EncoderWorker> worker(new EncoderWorker(profile));
+        if (!worker->Open(output, width, height, FRAME_RATE, 0)) {
+            return run;
+        }
+        outputs.push_back(output);
+        workers.push_back(std::move(worker));
+    }
+
+    std::vector<uint8_t> bgra(static_cast<size_t>(width) * height * 4);
+    std::vector<uint32_t> rowHashes;
+    std::vector<uint32_t> prevRowHashes;
+    DamageTracker damage;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        for (auto& worker : workers) {
+            while (worker->QueueDepth() >= PIPELINE_MAX_QUEUE) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        int64_t captureUs = av_gettime_relative();
+        screen.Capture(i, bgra.data());
+
+        ScrollEstimate scroll = {0, 0, 0, 0, 0, false};
+        HashRows(bgra.data(), width, height, width * 4, rowHashes);
+        if (!prevRowHashes.empty()) {
+            scroll = EstimateVerticalShift(prevRowHashes, rowHashes);
+        }
+        prevRowHashes.swap(rowHashes);
+        DamageStats stats = damage.Update(bgra.data(), width, height, width * 4);
+
+        AVFrame* frame = converter.Convert(bgra.data(), width * 4, i);
+        if (!frame) {
+            break;
+        }
+        AttachScrollRoi(frame, scroll);
+        SetCaptureInfo(frame, CaptureInfo{captureUs, stats.changedTiles, stats.totalTiles});
+        for (auto& worker : workers) {
+            worker->Submit(frame);
+        }
+        av_frame_free(&frame);
+    }
+    for (auto& worker : workers) {
+        worker->RequestFinish();
+    }
+    run.ok = true;
+    for (auto& worker : workers) {
+        worker->Finish();
+        run.ok = run.ok && !worker->Failed();
+        run.bytes += worker->Encoder().BytesWritten();
+    }
+    run.totalMs = MsSince(start);
+    run.outputs = static_cast<int64_t>(workers.size());
+    workers.clear();
+    for (const std::string& output : outputs) {
+        std::remove(output.c_str());
+        std::remove(FrameIndexFilename(output).c_str());
+    }
+    return run;
+}
+
+void BenchPipeline(const Resolution& resolution, int frames, std::vector<Result>& results) {
+    StageStats::Instance().Reset();
+    PipelineRun run = RunPipeline(resolution, frames, "recorder_bench_");
+    if (run.outputs == 0) {
+        return;
+    }
+    LatencySummary latency = StageStats::Instance().Stage(STAGE_GLASS_TO_PACKET).Summary();
+    results.push_back(Result{std::string("pipeline/default_profiles/") + resolution.name, resolution.width,
+                             resolution.height, frames, run.totalMs,
+                             Member("outputs", run.outputs) + Member("bytes", run.bytes) +
+                             Member("glass_to_packet_p50_ms", latency.p50Ms) +
+                             Member("glass_to_packet_p99_ms", latency.p99Ms) +
+                             Member("ok", static_cast<int64_t>(run.ok))});
+}
+
+// The same pipeline with the trace recorder off and on, alternating so drift
+// in clocks and caches hits both alike; the fastest of each is compared. Only
+// meaningful in a build with ENABLE_TRACING.
+void BenchTracing(const Resolution& resolution, int frames, std::vector<Result>& results) {
+    if (!StartTrace()) {
+        return;
+    }
+    StopTrace();
+    std::string trace = std::string("recorder_trace_") + resolution.name + TRACE_EXTENSION;
+    WriteTrace(trace);
+    double untracedMs = 0.0;
+    double tracedMs = 0.0;
+    double writeMs = 0.0;
+    bool ok = true;
+    for (int round = 0; round < TRACING_ROUNDS; round++) {
+        PipelineRun untraced = RunPipeline(resolution, frames, "recorder_untraced_");
+        StartTrace();
+        PipelineRun traced = RunPipeline(resolution, frames, "recorder_traced_");
+        StopTrace();
+        auto start = std::chrono::steady_clock::now();
+        ok = ok && untraced.ok && traced.ok && WriteTrace(trace);
+        writeMs = std::max(writeMs, MsSince(start));
+        untracedMs = round == 0 ? untraced.totalMs : std::min(untracedMs, untraced.totalMs);
+        tracedMs = round == 0 ? traced.totalMs : std::min(tracedMs, traced.totalMs);
+    }
+    std::remove(trace.c_str());
+    double overhead = untracedMs > 0.0 ? (tracedMs - untracedMs) * 100.0 / untracedMs : 0.0;
+    results.push_back(Result{std::string("tracing/overhead/") + resolution.name, resolution.width, resolution.height,
+                             frames, tracedMs, Member("untraced_ms", untracedMs) +
+                             Member("overhead_percent", overhead) + Member("write_ms", writeMs) +
+                             Member("ok", static_cast<int64_t>(ok))});
+}
+
+// Glass to file in real time: a painter thread shows a new frame code every
+// frame interval, half an interval out of phase with the capture ticks, and
+// the pipeline records it with the default profiles as the recorder would
+// once it has fallen behind, dropping frames past QUALITY_QUEUE_HIGH queued.
+// The first output is then decoded and its codes matched against its frame
+// index.
+void BenchLatency(const Resolution& resolution, int frames, std::vector<Result>& results) {
+    int width = resolution.width;
+    int height = resolution.height;
+    SyntheticScreen screen(width, height);
+    FrameConverter converter;
+    if (!converter.Open(width, height)) {
+        return;
+    }
+    std::vector<std::unique_ptr<EncoderWorker>> workers;
+    std::vector<std::string> outputs;
+    for (const EncoderProfile& profile : DefaultEncoderProfiles()) {
+        std::string output = ProfileFilename(std::string("recorder_latency_") + resolution.name + ".mp4", profile);
+        std::unique_ptr<EncoderWorker> worker(new EncoderWorker(profile));
+        if (!worker->Open(output, width, height, FRAME_RATE, 0)) {
+            return;
+        }
+        worker->SetMaxQueueDepth(QUALITY_QUEUE_HIGH);
+        outputs.push_back(output);
+        workers.push_back(std::move(worker));
+    }
+
+    auto interval = std::chrono::microseconds(1000000 / FRAME_RATE);
+    auto start = std::chrono::steady_clock::now();
+    std::mutex codeMutex;
+    FrameCode shown = {0, av_gettime_relative()};
+    std::atomic<bool> painting(true);
+    std::thread painter([&]() {
+        auto next = start + interval / 2;
+        uint32_t sequence = 1;
+        while (painting) {
+            std::this_thread::sleep_until(next);
+            next += interval;
+            std::lock_guard<std::mutex> lock(codeMutex);
+            shown = FrameCode{sequence++, av_gettime_relative()};
+        }
+    });
+
+    std::vector<uint8_t> bgra(static_cast<size_t>(width) * height * 4);
+    uint8_t* corner = bgra.data() + (static_cast<size_t>(FRAME_CODE_MARGIN) * width + FRAME_CODE_MARGIN) * 4;
+    std::vector<uint32_t> rowHashes;
+    std::vector<uint32_t> prevRowHashes;
+    DamageTracker damage;
+    for (int i = 0; i < frames; i++) {
+        std::this_thread::sleep_until(start + interval * i);
+        int64_t captureUs = av_gettime_relative();
+        screen.Capture(i, bgra.data());
+        {
+            std::lock_guard<std::mutex> lock(codeMutex);
+            PaintFrameCode(shown, corner, width * 4);
+        }
+
+        ScrollEstimate scroll = {0, 0, 0, 0, 0, false};
+        HashRows(bgra.data(), width, height, width * 4, rowHashes);
+        if (!prevRowHashes.empty()) {
+            scroll = EstimateVerticalShift(prevRowHashes, rowHashes);
+        }
+        prevRowHashes.swap(rowHashes);
+        DamageStats stats = damage.Update(bgra.data(), width, height, width * 4);
+
+        AVFrame* frame = converter.Convert(bgra.data(), width * 4, i);
+        if (!frame) {
+            break;
+        }
+        AttachScrollRoi(frame, scroll);
+        SetCaptureInfo(frame, CaptureInfo{captureUs, stats.changedTiles, stats.totalTiles});
+        for (auto& worker : workers) {
+            worker->Submit(frame);
+        }
+        av_frame_free(&frame);
+    }
+    painting = false;
+    painter.join();
+    bool ok = true;
+    int64_t dropped = 0;
+    for (auto& worker : workers) {
+        worker->Finish();
+        ok = ok && !worker->Failed();
+        dropped += worker->Dropped();
+    }
+    double totalMs = MsSince(start);
+    workers.clear();
+
+    FrameCodeReport report;
+    ok = AnalyzeFrameCodes(outputs[0], report) && ok;
+    LatencySummary capture = report.glassToCapture.Summary();
+    LatencySummary file = report.glassToFile.Summary();
+    results.push_back(Result{std::string("latency/glass_to_file/") + resolution.name, width, height, frames,
+                             totalMs, Member("decoded", report.frames) + Member("coded", report.coded) +
+                             Member("skipped", report.skipped) + Member("duplicates", report.duplicates) +
+                             Member("dropped", dropped) + Member("glass_to_capture_p50_ms", capture.p50Ms) +
+                             Member("glass_to_file_p50_ms", file.p50Ms) + Member("glass_to_file_p90_ms", file.p90Ms) +
+                             Member("glass_to_file_p99_ms", file.p99Ms) + Member("glass_to_file_max_ms", file.maxMs) +
+                             Member("ok", static_cast<int64_t>(ok))});
+    for (const std::string& output : outputs) {
+        std::remove(output.c_str());
+        std::remove(FrameIndexFilename(output).c_str());
+    }
+}
+
+// The /metrics endpoint over loopback, as Prometheus or curl would scrape it,
+// after a scraper that resets the connection mid-request
+void BenchMetrics(std::vector<Result>& results) {
+    MetricsServer server;
+    if (!server.Start(METRICS_BENCH_PORT)) {
+        results.push_back(Result{"metrics/scrape", 0, 0, 0, 0.0, Member("ok", static_cast<int64_t>(0))});
+        return;
+    }
+    FetchMetrics(METRICS_BENCH_PORT, true);
+    bool ok = true;
+    int64_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < METRICS_SCRAPES; i++) {
+        std::string response = FetchMetrics(METRICS_BENCH_PORT, false);
+        ok = ok && response.compare(0, 15, "HTTP/1.0 200 OK") == 0 &&
+             response.find("\nscreenrecorder_frames_captured_total ") != std::string::npos;
+        bytes += static_cast<int64_t>(response.size());
+    }
+    double totalMs = MsSince(start);
+    server.Stop();
+    results.push_back(Result{"metrics/scrape", 0, 0, METRICS_SCRAPES, totalMs,
+                             Member("bytes", bytes) + Member("ok", static_cast<int64_t>(ok))});
+}
+
+// Byte of a shared-ring test frame; anything the reader gets wrong shows up
+uint8_t SharedFramePattern(int64_t pts, int plane, int x, int y) {
+    return static_cast<uint8_t>(pts * 7 + plane * 61 + x * 3 + y * 5);
+}
+
+// The shared-memory frame ring end to end: the recorder's writer publishes
+// while a reader on another thread takes the newest frame, checks every byte
+// and discards what the seqlock says was overwritten under it
+void BenchSharedRing(const Resolution& resolution, std::vector<Result>& results) {
+    std::string name = std::string(SHMRING_DEFAULT_NAME) + "Bench" + std::to_string(av_gettime_relative());
+    std::unique_ptr<SharedFrameRing> ring(new SharedFrameRing());
+    SharedFrameReader reader;
+    std::string resultName = std::string("shmring/roundtrip/") + resolution.name;
+    if (!ring->Open(name, resolution.width, resolution.height, FRAME_RATE) || !reader.Open(name)) {
+        results.push_back(Result{resultName, resolution.width, resolution.height, 0, 0.0,
+                                 Member("ok", static_cast<int64_t>(0))});
+        return;
+    }
+
+    std::atomic<bool> writing(true);
+    int64_t seen = 0;
+    int64_t torn = 0;
+    int64_t mismatched = 0;
+    uint64_t newest = 0;
+    std::thread readerThread([&] {
+        SharedFrameView view;
+        while (writing.load() || reader.WriterActive()) {
+            if (!reader.Acquire(view)) {
+                std::this_thread::yield();
+                continue;
+            }
+            newest = view.frameIndex + 1;
+            int64_t pts = (view.ptsUs * FRAME_RATE + 500000) / 1000000;
+            bool match = view.width == resolution.width && view.height == resolution.height;
+            for (int plane = 0; plane < 3 && match; plane++) {
+                int rows = plane == 0 ? view.height : (view.height + 1) / 2;
+                int columns = plane == 0 ? view.width : (view.width + 1) / 2;
+                for (int y = 0; y < rows && match; y++) {
+                    const uint8_t* row = view.planes[plane] + static_cast<size_t>(y) * view.strides[plane];
+                    for (int x = 0; x < columns; x++) {
+                        if (row[x] != SharedFramePattern(pts, plane, x, y)) {
+                            match = false;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (!reader.Validate(view)) {
+                torn++;
+            } else if (!match) {
+                mismatched++;
+            } else {
+                seen++;
+            }
+        }
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < SHMRING_BENCH_FRAMES; i++) {
+        AVFrame* frame = av_frame_alloc();
+        frame->format = AV_PIX_FMT_YUV420P;
+        frame->width = resolution.width;
+        frame->height = resolution.height;
+        frame->pts = i;
+        if (av_frame_get_buffer(frame, 0) < 0) {
+            av_frame_free(&frame);
+            break;
+        }
+        for (int plane = 0; plane < 3; plane++) {
+            int rows = plane == 0 ? frame->height : (frame->height + 1) / 2;
+            int columns = plane == 0 ? frame->width : (frame->width + 1) / 2;
+            for (int y = 0; y < rows; y++) {
+                uint8_t* row = frame->data[plane] + static_cast<size_t>(y) * frame->linesize[plane];
+                for (int x = 0; x < columns; x++) {
+                    row[x] = SharedFramePattern(i, plane, x, y);
+                }
+            }
+        }
+        ring->Submit(frame);
+        av_frame_free(&frame);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ring->Finish();
+    double totalMs = MsSince(start);
+    writing = false;
+    readerThread.join();
+
+    // Every frame the writer did not drop was published, the last one included
+    SharedFrameView view;
+    if (reader.Acquire(view)) {
+        newest = view.frameIndex + 1;
+    }
+    int64_t published = SHMRING_BENCH_FRAMES - ring->Dropped();
+    bool ok = seen > 0 && mismatched == 0 && static_cast<int64_t>(newest) == published;
+    ring.reset();
+    results.push_back(Result{resultName, resolution.width, resolution.height, SHMRING_BENCH_FRAMES, totalMs,
+                             Member("frames_read", seen) + Member("published", published) + Member("torn", torn) +
+                             Member("mismatched", mismatched) + Member("ok", static_cast<int64_t>(ok))});
+}
+
+// Golden runs: one fixed size and length, so checksums can be stored
+const int GOLDEN_WIDTH = 1280;
+const int GOLDEN_HEIGHT = 720;
+const int GOLDEN_FRAMES = 90;
+
+enum GoldenStage {
+    GOLDEN_CAPTURE,
+    GOLDEN_ANALYZE,
+    GOLDEN_CONVERT,
+    GOLDEN_ENCODE,
+    GOLDEN_STAGE_COUNT
+};
+
+const char* const GOLDEN_STAGE_NAMES[GOLDEN_STAGE_COUNT] = {"capture", "analyze", "convert", "encode"};
+
+struct StageBudget {
+    double msPerFrame;
+    int64_t megabytes;    // resident memory the stage may add over the run
+};
+
+// Loose enough for a loaded machine; they are there to catch a stage that
+// suddenly costs several times what it did
+const StageBudget GOLDEN_BUDGETS[GOLDEN_STAGE_COUNT] = {
+    {4.0, 16},
+    {6.0, 16},
+    {8.0, 32},
+    {40.0, 384},
+};
+
+// The captured pixels and the analysis are ours and must match exactly.
+// Conversion and encoding depend on the FFmpeg build and CPU, so the decoded
+// output is held to quality floors instead of a checksum.
+struct GoldenCase {
+    const char* name;
+    Scene scene;
+    uint64_t captureChecksum;
+    uint64_t analysisChecksum;
+    double minPsnr;
+    double minSsim;
+};
+
+const GoldenCase GOLDEN_CASES[] = {
+    {"static", SCENE_STATIC, 0x60eefd4106cd8ae5ull, 0x054eac79e5fee0ccull, 40.0, 0.98},
+    {"typing", SCENE_TYPING, 0xfaf55f929c841b55ull, 0x7e60f90b938e42fcull, 38.0, 0.97},
+    {"scrolling", SCENE_SCROLLING, 0xf73dd766447fc67full, 0x1020f50e6799a925ull, 34.0, 0.95},
+    {"video", SCENE_VIDEO, 0x85d25a16577da96dull, 0xa9cdebb4d5b4cfbfull, 30.0, 0.90},
+};
+
+struct StageUsage {
+    double ms;
+    int64_t memoryBytes;
+};
+
+// Times one call of a stage and charges it with the resident memory it added.
+// Memory is read outside the timed part. Resident memory is process-wide, so
+// the caller keeps other threads quiet while a meter runs: the verifier is
+// drained between frames and the encoder uses sliced threads, which finish
+// each frame inside the encode call.
+class StageMeter {
+public:
+    explicit StageMeter(StageUsage& usage) : m_usage(usage) {
+        m_resident = ResidentBytes();
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    ~StageMeter() {
+        m_usage.ms += MsSince(m_start);
+        int64_t grown = ResidentBytes() - m_resident;
+        if (grown > 0) {
+            m_usage.memoryBytes += grown;
+        }
+    }
+
+private:
+    StageUsage& m_usage;
+    int64_t m_resident;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Scroll and damage analysis as the recorder runs it, folded into a checksum
+struct FrameAnalysis {
+    std::vector<uint32_t> rowHashes;
+    std::vector<uint32_t> prevRowHashes;
+    DamageTracker damage;
+    uint64_t checksum;
+};
+
+void AnalyzeFrame(FrameAnalysis& analysis, const uint8_t* bgra, int width, int height) {
+    ScrollEstimate scroll = {0, 0, 0, 0, 0, false};
+    HashRows(bgra, width, height, width * 4, analysis.rowHashes);
+    if (!analysis.prevRowHashes.empty()) {
+        scroll = EstimateVerticalShift(analysis.prevRowHashes, analysis.rowHashes);
+    }
+    analysis.prevRowHashes.swap(analysis.rowHashes);
+    DamageStats stats = analysis.damage.Update(bgra, width, height, width * 4);
+    int32_t values[] = {scroll.shift, scroll.movedRows, scroll.changedRows, scroll.exposedTop,
+                        scroll.exposedBottom, scroll.isScroll ? 1 : 0, stats.changedTiles, stats.totalTiles};
+    analysis.checksum = Fnv1a(analysis.checksum, values, sizeof(values));
+}
+
+std::string Hex(uint64_t value) {
+    char text[24];
+    snprintf(text, sizeof(text), "0x%016llx", static_cast<unsigned long long>(value));
+    return text;
+}
+
+// Runs one sequence and returns the JSON object describing it; every broken
+// expectation is appended to failures as "<scenario>/<stage>: <what>"
+std::string RunGoldenCase(const GoldenCase& golden, double budgetScale, std::vector<std::string>& failures) {
+    int width = GOLDEN_WIDTH;
+    int height = GOLDEN_HEIGHT;
+    std::string name = golden.name;
+    size_t failuresBefore = failures.size();
+    StageUsage usage[GOLDEN_STAGE_COUNT] = {};
+
+    SyntheticScreen screen(width, height, golden.scene);
+    std::vector<uint8_t> bgra(static_cast<size_t>(width) * height * 4);
+    FrameAnalysis analysis;
+    analysis.checksum = 14695981039346656037ull;
+    uint64_t captureChecksum = 14695981039346656037ull;
+
+    FrameConverter converter;
+    EncoderProfile profile = DefaultEncoderProfiles()[0];
+    profile.name = "golden " + name;
+    profile.fragmented = false;
+    profile.frameIndex = false;
+    profile.options = "sliced-threads=1";
+    // Decoded on its own thread as in a recording; the output name only places the report
+    std::string output = "recorder_golden_" + name + ".mp4";
+    QualityVerifier verifier;
+    verifier.SetMaxQueueDepth(0);
+    VideoEncoder encoder;
+    encoder.SetPooled(false);
+    encoder.AddObserver(&verifier);
+    bool ok;
+    double verifyMs = 0.0;
+    {
+        StageMeter meter(usage[GOLDEN_CONVERT]);
+        ok = converter.Open(width, height);
+    }
+    {
+        StageMeter meter(usage[GOLDEN_ENCODE]);
+        ok = ok && encoder.Open("", width, height, FRAME_RATE, profile, 0);
+    }
+    ok = ok && verifier.Open(output, profile.name);
+    if (!ok) {
+        failures.push_back(name + "/encode: could not open the converter, encoder or decoder");
+    }
+
+    for (int i = 0; i < GOLDEN_FRAMES && ok; i++) {
+        {
+            StageMeter meter(usage[GOLDEN_CAPTURE]);
+            screen.Capture(i, bgra.data());
+        }
+        captureChecksum = Fnv1a(captureChecksum, bgra.data(), bgra.size());
+        {
+            StageMeter meter(usage[GOLDEN_ANALYZE]);
+            AnalyzeFrame(analysis, bgra.data(), width, height);
+        }
+        AVFrame* frame;
+        {
+            StageMeter meter(usage[GOLDEN_CONVERT]);
+            frame = converter.Convert(bgra.data(), width * 4, i);
+        }
+        {
+            StageMeter meter(usage[GOLDEN_ENCODE]);
+            ok = frame && encoder.Encode(frame);
+        }
+        if (frame) {
+            auto verifyStart = std::chrono::steady_clock::now();
+            verifier.Submit(frame);
+            verifier.WaitIdle();
+            verifyMs += MsSince(verifyStart);
+        }
+        av_frame_free(&frame);
+        if (!ok) {
+            failures.push_back(name + "/encode: frame " + std::to_string(i) + " failed");
+        }
+    }
+    {
+        StageMeter meter(usage[GOLDEN_ENCODE]);
+        if (!encoder.Finish() && ok) {
+            failures.push_back(name + "/encode: flushing the encoder failed");
+        }
+    }
+    auto verifyStart = std::chrono::steady_clock::now();
+    verifier.RequestFinish();
+    verifier.Finish();
+    verifyMs += MsSince(verifyStart);
+    const QualitySummary& quality = verifier.Summary();
+
+    if (captureChecksum != golden.captureChecksum) {
+        failures.push_back(name + "/capture: checksum " + Hex(captureChecksum) + ", expected " +
+                           Hex(golden.captureChecksum));
+    }
+    if (analysis.checksum != golden.analysisChecksum) {
+        failures.push_back(name + "/analyze: checksum " + Hex(analysis.checksum) + ", expected " +
+                           Hex(golden.analysisChecksum));
+    }
+    char text[160];
+    if (ok && (quality.frames != GOLDEN_FRAMES || quality.unmatched != 0)) {
+        snprintf(text, sizeof(text), "/encode: %lld of %d frames decoded and matched, %lld unmatched",
+                 static_cast<long long>(quality.frames), GOLDEN_FRAMES, static_cast<long long>(quality.unmatched));
+        failures.push_back(name + text);
+    }
+    if (ok && (quality.psnr < golden.minPsnr || quality.ssim < golden.minSsim)) {
+        snprintf(text, sizeof(text), "/encode: PSNR %.2f dB, SSIM %.4f, floors %.2f dB and %.4f", quality.psnr,
+                 quality.ssim, golden.minPsnr, golden.minSsim);
+        failures.push_back(name + text);
+    }
+
+    std::string stages;
+    for (int stage = 0; stage < GOLDEN_STAGE_COUNT; stage++) {
+        const StageBudget& budget = GOLDEN_BUDGETS[stage];
+        double msPerFrame = usage[stage].ms / GOLDEN_FRAMES;
+        double megabytes = usage[stage].memoryBytes / (1024.0 * 1024.0);
+        if (msPerFrame > budget.msPerFrame * budgetScale) {
+            snprintf(text, sizeof(text), "/%s: %.3f ms per frame, budget %.3f", GOLDEN_STAGE_NAMES[stage],
+                     msPerFrame, budget.msPerFrame * budgetScale);
+            failures.push_back(name + text);
+        }
+        if (megabytes > budget.megabytes) {
+            snprintf(text, sizeof(text), "/%s: %.1f MB more resident memory, budget %lld MB",
+                     GOLDEN_STAGE_NAMES[stage], megabytes, static_cast<long long>(budget.megabytes));
+            failures.push_back(name + text);
+        }
+        stages += std::string(stage > 0 ? "," : "") + "\"" + GOLDEN_STAGE_NAMES[stage] + "\":{" +
+                  Member("ms_per_frame", msPerFrame).substr(1) + Member("memory_mb", megabytes) + "}";
+    }
+
+    // The report is only worth keeping when something is wrong
+    bool passed = failures.size() == failuresBefore;
+    if (passed) {
+        std::remove(QualityFilename(output).c_str());
+    }
+    return "{\"name\":\"" + name + "\",\"capture_checksum\":\"" + Hex(captureChecksum) +
+           "\",\"analysis_checksum\":\"" + Hex(analysis.checksum) + "\"" +
+           Member("decoded", quality.frames) + Member("unmatched", quality.unmatched) +
+           Member("psnr", quality.psnr) + Member("ssim", quality.ssim) + Member("verify_ms", verifyMs) +
+           ",\"stages\":{" + stages + "},\"passed\":" + (passed ? "true" : "false") + "}";
+}
+
+int RunGolden(const Options& options) {
+    std::vector<std::string> failures;
+    std::string scenarios;
+    for (const GoldenCase& golden : GOLDEN_CASES) {
+        if (!options.filter.empty() && std::string(golden.name).find(options.filter) == std::string::npos) {
+            continue;
+        }
+        scenarios += (scenarios.empty() ? "\n" : ",\n") + RunGoldenCase(golden, options.budgetScale, failures);
+    }
+    printf("{\"benchmark\":\"recorder_golden\",\"width\":%d,\"height\":%d,\"frames\":%d,\"budget_scale\":%.2f,"
+           "\"scenarios\":[%s\n],\"passed\":%s}\n",
+           GOLDEN_WIDTH, GOLDEN_HEIGHT, GOLDEN_FRAMES, options.budgetScale, scenarios.c_str(),
+           failures.empty() ? "true" : "false");
+    for (const std::string& failure : failures) {
+        fprintf(stderr, "FAIL %s\n", failure.c_str());
+    }
+    return failures.empty() ? 0 : 1;
+}
+
+bool Selected(const Options& options, const std::string& name) {
+    return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+void PrintResults(const Options& options, const std::vector<Result>& results) {
+    printf("{\"benchmark\":\"recorder\",\"quick\":%s,\"threads\":%u,\"results\":[",
+           options.quick ? "true" : "false", std::thread::hardware_concurrency());
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& result = results[i];
+        double msPerFrame = result.frames > 0 ? result.totalMs / result.frames : 0.0;
+        printf("%s\n{\"name\":\"%s\",\"width\":%d,\"height\":%d,\"frames\":%d,\"total_ms\":%.3f,"
+               "\"ms_per_frame\":%.3f,\"fps\":%.2f%s}",
+               i > 0 ? "," : "", result.name.c_str(), result.width, result.height, result.frames, result.totalMs,
+               msPerFrame, msPerFrame > 0.0 ? 1000.0 / msPerFrame : 0.0, result.extra.c_str());
+    }
+    printf("\n]}\n");
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options = {false, false, 1.0, ""};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            options.quick = true;
+        } else if (strcmp(argv[i], "--golden") == 0) {
+            options.golden = true;
+        } else if (strncmp(argv[i], "--budget-scale=", 15) == 0 && atof(argv[i] + 15) > 0.0) {
+            options.budgetScale = atof(argv[i] + 15);
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            options.filter = argv[i] + 9;
+        } else {
+            fprintf(stderr, "Usage: recorder_bench [--quick] [--filter=<name substring>]\n"
+                            "       recorder_bench --golden [--budget-scale=<factor>] [--filter=<scenario>]\n");
+            return 2;
+        }
+    }
+    // stdout carries the JSON
+    SetConsoleLog(false);
+    av_log_set_level(AV_LOG_ERROR);
+    if (options.golden) {
+        return RunGolden(options);
+    }
+
+    const char* presets[] = {"ultrafast", "veryfast", "medium"};
+    int presetCount = options.quick ? 2 : 3;
+    int frames = options.quick ? 30 : 120;
+    int encodeFrames = options.quick ? 15 : 60;
+    int pipelineFrames = options.quick ? 60 : 300;
+
+    std::vector<Result> results;
+    for (const Resolution& resolution : RESOLUTIONS) {
+        std::string suffix = std::string("/") + resolution.name;
+        if (Selected(options, "capture" + suffix)) {
+            BenchCapture(resolution, frames, results);
+        }
+        if (Selected(options, "analyze" + suffix) || Selected(options, "convert/sws_bicubic" + suffix)) {
+            BenchAnalyzeConvert(resolution, frames, results);
+        }
+        for (int p = 0; p < presetCount; p++) {
+            if (Selected(options, std::string("encode/libx264_") + presets[p] + suffix)) {
+                BenchEncode(resolution, presets[p], encodeFrames, results);
+            }
+        }
+        if (Selected(options, "pipeline/default_profiles" + suffix)) {
+            BenchPipeline(resolution, pipelineFrames, results);
+        }
+        if (Selected(options, "tracing/overhead" + suffix)) {
+            BenchTracing(resolution, pipelineFrames, results);
+        }
+        if (Selected(options, "latency/glass_to_file" + suffix)) {
+            BenchLatency(resolution, pipelineFrames, results);
+        }
+        if (Selected(options, "shmring/roundtrip" + suffix)) {
+            BenchSharedRing(resolution, results);
+        }
+    }
+    if (Selected(options, "metrics/scrape")) {
+        BenchMetrics(results);
+    }
+    PrintResults(options, results);
+    return 0;
+}
@@ -0,0 +1,171 @@
+// scroll_bench.cpp
+// Synthetic scrolling-text benchmark: measures row-hash scroll detection cost
+// and what the scroll hints do to libx264 encode time and output size.
+#include "scroll.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+}
+
+namespace {
+
+const int WIDTH = 1280;
+const int HEIGHT = 720;
+const int FRAME_COUNT = 150;
+const int LINE_HEIGHT = 18;
+const int HEADER_HEIGHT = 32;
+
+uint32_t Lcg(uint32_t& state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// Renders a page of pseudo-text: a static toolbar and document lines of
+// glyph-like blocks, scrolled down by `offset` pixels.
+void RenderScrolledText(std::vector<uint8_t>& bgra, int offset) {
+    uint32_t* pixels = reinterpret_cast<uint32_t*>(bgra.data());
+    for (int y = 0; y < HEIGHT; y++) {
+        uint32_t* row = pixels + static_cast<size_t>(y) * WIDTH;
+        if (y < HEADER_HEIGHT) {
+            for (int x = 0; x < WIDTH; x++) row[x] = (x / 96) % 2 ? 0xFF3C3F41u : 0xFF2B2B2Bu;
+            continue;
+        }
+        int docY = y - HEADER_HEIGHT + offset;
+        int line = docY / LINE_HEIGHT;
+        int glyphRow = docY % LINE_HEIGHT;
+        uint32_t state = static_cast<uint32_t>(line) * 2654435761u + 1;
+        int lineLength = 200 + static_cast<int>(Lcg(state) % (WIDTH - 240));
+        for (int x = 0; x < WIDTH; x++) row[x] = 0xFF1E1E1Eu;
+        if (glyphRow < 3 || glyphRow > 14) continue;
+        for (int x = 40; x < lineLength; x += 8) {
+            uint32_t glyph = Lcg(state);
+            if ((glyph & 7) == 0) continue;  // word gap
+            uint32_t color = (glyph & 0x100) ? 0xFFA9B7C6u : 0xFFCC7832u;
+            for (int gx = 0; gx < 6; gx++) {
+                if ((glyph >> ((glyphRow + gx) % 16)) & 1) row[x + gx] = color;
+            }
+        }
+    }
+}
+
+struct EncodeResult {
+    double encodeMs;
+    size_t bytes;
+};
+
+EncodeResult EncodeSequence(const std::vector<std::vector<uint8_t>>& frames,
+                            const std::vector<ScrollEstimate>* hints) {
+    EncodeResult result = {0.0, 0};
+    const AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) {
+        fprintf(stderr, "libx264 not available\n");
+        return result;
+    }
+
+    AVCodecContext* ctx = avcodec_alloc_context3(codec);
+    ctx->width = WIDTH;
+    ctx->height = HEIGHT;
+    ctx->time_base = av_make_q(1, 30);
+    ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    ctx->gop_size = 60;
+    ctx->max_b_frames = 1;
+    ctx->thread_count = 1;
+    av_opt_set(ctx->priv_data, "preset", "veryfast", 0);
+    av_opt_set(ctx->priv_data, "crf", "23", 0);
+    if (hints) {
+        int range = SuggestMotionRange(*hints);
+        if (range > 0) ctx->me_range = range;
+    }
+    if (avcodec_open2(ctx, codec, NULL) < 0) {
+        fprintf(stderr, "Could not open libx264\n");
+        avcodec_free_context(&ctx);
+        return result;
+    }
+
+    SwsContext* sws = sws_getContext(WIDTH, HEIGHT, AV_PIX_FMT_BGRA, WIDTH, HEIGHT, AV_PIX_FMT_YUV420P,
+                                     SWS_BICUBIC, NULL, NULL, NULL);
+    AVFrame* frame = av_frame_alloc();
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = WIDTH;
+    frame->height = HEIGHT;
+    av_frame_get_buffer(frame, 32);
+    AVPacket* pkt = av_packet_alloc();
+
+    for (size_t i = 0; i <= frames.size(); i++) {
+        AVFrame* input = nullptr;
+        if (i < frames.size()) {
+            const uint8_t* srcSlice[1] = { frames[i].data() };
+            int srcStride[1] = { WIDTH * 4 };
+            av_frame_make_writable(frame);
+            sws_scale(sws, srcSlice, srcStride, 0, HEIGHT, frame->data, frame->linesize);
+            frame->pts = static_cast<int64_t>(i);
+            if (hints) AttachScrollRoi(frame, (*hints)[i]);
+            input = frame;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        int ret = avcodec_send_frame(ctx, input);
+        while (ret >= 0) {
+            ret = avcodec_receive_packet(ctx, pkt);
+            if (ret < 0) break;
+            result.bytes += pkt->size;
+            av_packet_unref(pkt);
+        }
+        result.encodeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    sws_freeContext(sws);
+    avcodec_free_context(&ctx);
+    return result;
+}
+
+} // namespace
+
+int main() {
+    std::vector<std::vector<uint8_t>> frames(FRAME_COUNT, std::vector<uint8_t>(WIDTH * HEIGHT * 4));
+    int offset = 0;
+    for (int i = 0; i < FRAME_COUNT; i++) {
+        // Bursts of wheel scrolling separated by reading pauses
+        if ((i / 20) % 2 == 0) offset += 3 * LINE_HEIGHT / 2;
+        RenderScrolledText(frames[i], offset);
+    }
+
+    std::vector<ScrollEstimate> estimates(FRAME_COUNT, ScrollEstimate{0, 0, 0, 0, 0, false});
+    std::vector<uint32_t> prevHashes;
+    std::vector<uint32_t> curHashes;
+    int detected = 0;
+    auto detectStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < FRAME_COUNT; i++) {
+        HashRows(frames[i].data(), WIDTH, HEIGHT, WIDTH * 4, curHashes);
+        if (!prevHashes.empty()) {
+            estimates[i] = EstimateVerticalShift(prevHashes, curHashes);
+            if (estimates[i].isScroll) detected++;
+        }
+        prevHashes.swap(curHashes);
+    }
+    double detectMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - detectStart).count();
+
+    EncodeResult baseline = EncodeSequence(frames, nullptr);
+    EncodeResult hinted = EncodeSequence(frames, &estimates);
+
+    printf("{\"benchmark\":\"scroll\",\"width\":%d,\"height\":%d,\"frames\":%d,"
+           "\"scrolls_detected\":%d,\"detect_ms_per_frame\":%.3f,\"motion_range\":%d,"
+           "\"baseline\":{\"encode_ms\":%.1f,\"bytes\":%zu},"
+           "\"hinted\":{\"encode_ms\":%.1f,\"bytes\":%zu},"
+           "\"encode_time_change_pct\":%.1f,\"size_change_pct\":%.1f}\n",
+           WIDTH, HEIGHT, FRAME_COUNT, detected, detectMs / FRAME_COUNT, SuggestMotionRange(estimates),
+           baseline.encodeMs, baseline.bytes, hinted.encodeMs, hinted.bytes,
+           baseline.encodeMs > 0 ? 100.0 * (hinted.encodeMs - baseline.encodeMs) / baseline.encodeMs : 0.0,
+           baseline.bytes > 0 ? 100.0 * (double(hinted.bytes) - double(baseline.bytes)) / double(baseline.bytes) : 0.0);
+    return 0;
+}
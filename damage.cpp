@@ -0,0 +1,55 @@
+// damage.cpp
+#include "damage.h"
+#include "rowhash.h"
+
+#include <algorithm>
+
+void HashTiles(const uint8_t* pixels, int width, int height, int stride, std::vector<uint32_t>& hashes) {
+    int columns = (width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    int rows = (height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    hashes.resize(static_cast<size_t>(columns) * rows);
+
+    // Rows are walked top to bottom so the image is read once, in order
+    std::vector<uint32_t> lanes(static_cast<size_t>(columns) * 4);
+    for (int tileRow = 0; tileRow < rows; tileRow++) {
+        for (int c = 0; c < columns; c++) {
+            InitHashLanes(&lanes[c * 4]);
+        }
+        int bottom = std::min(height, (tileRow + 1) * DAMAGE_TILE_SIZE);
+        for (int y = tileRow * DAMAGE_TILE_SIZE; y < bottom; y++) {
+            const uint32_t* row = reinterpret_cast<const uint32_t*>(pixels + static_cast<size_t>(y) * stride);
+            for (int c = 0; c < columns; c++) {
+                int left = c * DAMAGE_TILE_SIZE;
+                MixHashLanes(&lanes[c * 4], row + left, std::min(DAMAGE_TILE_SIZE, width - left));
+            }
+        }
+        for (int c = 0; c < columns; c++) {
+            hashes[static_cast<size_t>(tileRow) * columns + c] = FinishHashLanes(&lanes[c * 4]);
+        }
+    }
+}
+
+DamageTracker::DamageTracker() : m_width(0), m_height(0) {
+}
+
+DamageStats DamageTracker::Update(const uint8_t* bgra, int width, int height, int stride) {
+    HashTiles(bgra, width, height, stride, m_current);
+    DamageStats stats = {0, static_cast<int>(m_current.size())};
+    if (width != m_width || height != m_height || m_previous.size() != m_current.size()) {
+        stats.changedTiles = stats.totalTiles;
+    } else {
+        for (size_t i = 0; i < m_current.size(); i++) {
+            if (m_current[i] != m_previous[i]) stats.changedTiles++;
+        }
+    }
+    m_width = width;
+    m_height = height;
+    m_previous.swap(m_current);
+    return stats;
+}
+
+void DamageTracker::Reset() {
+    m_previous.clear();
+    m_width = 0;
+    m_height = 0;
+}
@@ -0,0 +1,33 @@
+// damage.h
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#define DAMAGE_TILE_SIZE 32
+
+struct DamageStats {
+    int changedTiles;
+    int totalTiles;
+};
+
+// One 32-bit hash per DAMAGE_TILE_SIZE square tile of a BGRA image, row-major.
+// Edge tiles cover whatever is left. Uses SSE2 when available; the scalar
+// path produces identical hashes.
+void HashTiles(const uint8_t* pixels, int width, int height, int stride, std::vector<uint32_t>& hashes);
+
+// Counts the tiles that changed since the previous frame. The first frame
+// after Reset, or after a size change, counts as fully changed.
+class DamageTracker {
+public:
+    DamageTracker();
+
+    DamageStats Update(const uint8_t* bgra, int width, int height, int stride);
+    void Reset();
+
+private:
+    std::vector<uint32_t> m_previous;
+    std::vector<uint32_t> m_current;
+    int m_width;
+    int m_height;
+};
@@ -0,0 +1,837 @@
+// encoder.cpp
+#include "encoder.h"
+#include "log.h"
+#include "probes.h"
+
+#include "adaptive.h"
+#include "damage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+extern "C" {
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+}
+
+namespace {
+
+std::string AvErrorToString(int errnum) {
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(errnum, errbuf, AV_ERROR_MAX_STRING_SIZE);
+    return std::string(errbuf);
+}
+
+int RoundToEven(int n) {
+    return n & ~1;
+}
+
+AVCodecContext* OpenEncoderContext(int width, int height, int frameRate, const EncoderProfile& profile,
+                                   bool globalHeader, int motionRangeHint) {
+    // Find the encoder
+    const AVCodec *codec = avcodec_find_encoder_by_name(profile.codec.c_str());
+    if (!codec) {
+        LogDebug("Could not find " + profile.codec + " encoder");
+        return nullptr;
+    }
+
+    // Allocate an encoding context
+    AVCodecContext* context = avcodec_alloc_context3(codec);
+    if (!context) {
+        LogDebug("Could not allocate encoding context");
+        return nullptr;
+    }
+
+    // Set codec parameters
+    context->width = width;
+    context->height = height;
+    context->time_base.num = 1;
+    context->time_base.den = frameRate;
+    context->pix_fmt = AV_PIX_FMT_YUV420P;
+    context->gop_size = profile.gopSize;
+    context->max_b_frames = profile.maxBFrames;
+    if (profile.crf >= 0) {
+        av_opt_set_int(context->priv_data, "crf", profile.crf, 0);
+    } else {
+        context->bit_rate = profile.bitRate;
+        context->qmin = 10;
+        context->qmax = 51;
+    }
+    if (!profile.preset.empty()) {
+        av_opt_set(context->priv_data, "preset", profile.preset.c_str(), 0);
+    }
+    // A reused context starts each recording with a forced I frame; make it an IDR
+    av_opt_set_int(context->priv_data, "forced-idr", 1, 0);
+    if (profile.threads > 0) {
+        context->thread_count = profile.threads;
+    }
+
+    // Scrolled content only needs a search range that covers the scroll distance
+    if (motionRangeHint > 0) {
+        context->me_range = motionRangeHint;
+        LogDebug("Motion search range hint: " + std::to_string(motionRangeHint));
+    }
+
+    // Set global header flags if needed
+    if (globalHeader)
+        context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    AVDictionary* codecOptions = NULL;
+    if (!profile.options.empty() &&
+        av_dict_parse_string(&codecOptions, profile.options.c_str(), "=", ":", 0) < 0) {
+        LogDebug("Ignoring malformed codec options: " + profile.options);
+    }
+
+    // Open the codec
+    int ret = avcodec_open2(context, codec, &codecOptions);
+    if (av_dict_count(codecOptions) > 0) {
+        LogDebug("Unused codec options for " + profile.codec + ": " + profile.options);
+    }
+    av_dict_free(&codecOptions);
+    if (ret < 0) {
+        LogDebug("Could not open codec: " + AvErrorToString(ret));
+        avcodec_free_context(&context);
+        return nullptr;
+    }
+    return context;
+}
+
+bool IsMp4Family(const AVOutputFormat* format) {
+    std::string name = format->name;
+    return name.find("mp4") != std::string::npos || name.find("mov") != std::string::npos;
+}
+
+bool NeedsGlobalHeader(const std::string& filename) {
+    const AVOutputFormat* format = av_guess_format(NULL, filename.c_str(), NULL);
+    return format && (format->flags & AVFMT_GLOBALHEADER);
+}
+
+} // namespace
+
+std::vector<EncoderProfile> DefaultEncoderProfiles() {
+    std::vector<EncoderProfile> profiles;
+    EncoderProfile archive{"archive", "", "libx264", "veryfast", 18, 0, 10, 1};
+    archive.fragmented = true;
+    archive.frameIndex = true;
+    profiles.push_back(archive);
+    profiles.push_back(EncoderProfile{"share", "_share", "libx264", "veryfast", -1, 1000000, 10, 1});
+    return profiles;
+}
+
+EncoderProfile LosslessIntermediateProfile() {
+    // FFV1 with many independent slices encodes in parallel at a fraction of
+    // the CPU cost of realtime x264; every frame is intra.
+    EncoderProfile profile{"intermediate", "_lossless", "ffv1", "", -1, 0, 1, 0};
+    profile.options = "level=3:slices=12:slicecrc=0:coder=0";
+    profile.extension = ".mkv";
+    return profile;
+}
+
+EncoderProfile LiveEncoderProfile(const std::string& url, int frameRate) {
+    // No B-frames and no lookahead, so each frame leaves the encoder as soon as
+    // it is encoded; a rolling intra refresh replaces big keyframes and a
+    // one-frame VBV keeps the bitrate flat enough for UDP.
+    EncoderProfile profile{"live", "_live", "libx264", "ultrafast", -1, LIVE_BIT_RATE, 60, 0};
+    profile.options = "tune=zerolatency:intra-refresh=1:maxrate=" + std::to_string(LIVE_BIT_RATE) +
+                      ":bufsize=" + std::to_string(LIVE_BIT_RATE / frameRate);
+    profile.url = url;
+    // Seven TS packets per datagram, so none is split across two
+    if (url.compare(0, 6, "udp://") == 0 && url.find("pkt_size") == std::string::npos) {
+        profile.url += std::string(url.find('?') == std::string::npos ? "?" : "&") + "pkt_size=1316";
+    }
+    return profile;
+}
+
+std::string ProfileFilename(const std::string& baseFilename, const EncoderProfile& profile) {
+    if (!profile.url.empty()) {
+        return profile.url;
+    }
+    size_t dot = baseFilename.find_last_of('.');
+    size_t slash = baseFilename.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = baseFilename.size();
+    }
+    std::string extension = profile.extension.empty() ? baseFilename.substr(dot) : profile.extension;
+    if (profile.segments.Enabled()) {
+        extension = SEGMENT_PLAYLIST_EXTENSION;
+    }
+    return baseFilename.substr(0, dot) + profile.suffix + extension;
+}
+
+EncoderPool& EncoderPool::Instance() {
+    static EncoderPool pool;
+    return pool;
+}
+
+EncoderPool::~EncoderPool() {
+    Clear();
+}
+
+std::string EncoderPool::Key(int width, int height, int frameRate, const EncoderProfile& profile,
+                             bool globalHeader) {
+    std::stringstream ss;
+    ss << width << "x" << height << "@" << frameRate << "/" << profile.codec << "/" << profile.preset
+       << "/" << profile.crf << "/" << profile.bitRate << "/" << profile.gopSize << "/" << profile.maxBFrames
+       << "/" << profile.options << "/" << profile.threads << "/" << globalHeader;
+    return ss.str();
+}
+
+void EncoderPool::Prepare(const std::string& baseFilename, int width, int height, int frameRate,
+                          const std::vector<EncoderProfile>& profiles, int motionRangeHint) {
+    width = RoundToEven(width);
+    height = RoundToEven(height);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    JoinFinishedThreads();
+
+    for (const EncoderProfile& profile : profiles) {
+        // Segments are MPEG-TS, which carries its headers in-band
+        bool globalHeader = !profile.segments.Enabled() && NeedsGlobalHeader(ProfileFilename(baseFilename, profile));
+        std::string key = Key(width, height, frameRate, profile, globalHeader);
+        bool idle = false;
+        for (const PooledEncoder& encoder : m_idle) {
+            if (encoder.key == key) idle = true;
+        }
+        if (idle || m_pending[key] > 0) {
+            continue;
+        }
+
+        m_pending[key]++;
+        m_threads.emplace_back([this, key, width, height, frameRate, profile, globalHeader, motionRangeHint] {
+            auto start = std::chrono::steady_clock::now();
+            AVCodecContext* context = OpenEncoderContext(width, height, frameRate, profile, globalHeader, motionRangeHint);
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            LogConcise("EncoderPool", "Prepared " + key + " in " + std::to_string(elapsed.count()) + " ms");
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (context) {
+                m_idle.push_back(PooledEncoder{key, context, motionRangeHint, 0, false});
+            }
+            m_pending[key]--;
+            m_condition.notify_all();
+        });
+    }
+}
+
+PooledEncoder EncoderPool::Acquire(int width, int height, int frameRate, const EncoderProfile& profile,
+                                   bool globalHeader, int motionRangeHint) {
+    std::string key = Key(width, height, frameRate, profile, globalHeader);
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            auto match = m_idle.end();
+            for (auto it = m_idle.begin(); it != m_idle.end(); ++it) {
+                if (it->key == key && (match == m_idle.end() || it->motionRangeHint == motionRangeHint)) {
+                    match = it;
+                }
+            }
+            if (match != m_idle.end()) {
+                PooledEncoder encoder = *match;
+                m_idle.erase(match);
+                if (encoder.motionRangeHint != motionRangeHint) {
+                    LogDebug("Reusing a context opened with motion range hint " +
+                             std::to_string(encoder.motionRangeHint) + " instead of " + std::to_string(motionRangeHint));
+                }
+                return encoder;
+            }
+            if (m_pending[key] == 0) {
+                break;
+            }
+            m_condition.wait(lock);
+        }
+    }
+
+    AVCodecContext* context = OpenEncoderContext(width, height, frameRate, profile, globalHeader, motionRangeHint);
+    return PooledEncoder{key, context, motionRangeHint, 0, false};
+}
+
+void EncoderPool::Release(const PooledEncoder& encoder) {
+    AVCodecContext* context = encoder.context;
+    if (!context) {
+        return;
+    }
+    if (!(context->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)) {
+        avcodec_free_context(&context);
+        return;
+    }
+
+    // Leaves the drained encoder ready for new frames without reopening it
+    avcodec_flush_buffers(context);
+    PooledEncoder idle = encoder;
+    idle.reused = true;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_idle.push_back(idle);
+    while (m_idle.size() > ENCODER_POOL_MAX_IDLE) {
+        avcodec_free_context(&m_idle.front().context);
+        m_idle.pop_front();
+    }
+}
+
+void EncoderPool::Clear() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::list<std::thread> threads;
+    threads.swap(m_threads);
+    lock.unlock();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    lock.lock();
+    for (PooledEncoder& encoder : m_idle) {
+        avcodec_free_context(&encoder.context);
+    }
+    m_idle.clear();
+    m_pending.clear();
+}
+
+void EncoderPool::JoinFinishedThreads() {
+    // Called with the mutex held; once nothing is pending every thread has returned
+    for (const auto& pending : m_pending) {
+        if (pending.second > 0) return;
+    }
+    for (std::thread& thread : m_threads) {
+        thread.join();
+    }
+    m_threads.clear();
+}
+
+VideoEncoder::VideoEncoder()
+        : m_formatContext(nullptr), m_videoStream(nullptr), m_codecContext(nullptr),
+          m_packet(nullptr), m_encoder{std::string(), nullptr, 0, 0, false}, m_qualityStep(0), m_pooled(true),
+          m_projectedBitRate(0), m_segmentStartPts(AV_NOPTS_VALUE), m_segmentEndPts(AV_NOPTS_VALUE), m_segmentBytes(0),
+          m_forceKeyframe(false), m_lastPts(-1), m_framesEncoded(0), m_bytesWritten(0), m_segmentNumber(0),
+          m_metrics(nullptr), m_stageStats(&StageStats::Instance()), m_bitRateWindowStartUs(0),
+          m_bitRateWindowBytes(0) {
+}
+
+VideoEncoder::~VideoEncoder() {
+    Release();
+}
+
+bool VideoEncoder::Open(const std::string& filename, int width, int height, int frameRate,
+                        const EncoderProfile& profile, int motionRangeHint) {
+    LogDebug("Initializing " + profile.name + " encoder for " + filename);
+    LogDebug("Original dimensions: " + std::to_string(width) + "x" + std::to_string(height));
+
+    width = RoundToEven(width);
+    height = RoundToEven(height);
+    m_filename = filename;
+    m_profile = profile;
+    m_qualityStep = 0;
+    m_framesEncoded = 0;
+    m_bytesWritten = 0;
+    m_captureInfo.clear();
+    m_latency.Reset();
+    m_recentLatency.Reset();
+    m_segmentNumber = 0;
+    m_metrics = PipelineMetrics::Instance().Worker("Encoder " + profile.name);
+    m_bitRateWindowStartUs = 0;
+    m_bitRateWindowBytes = 0;
+
+    LogDebug("Adjusted dimensions: " + std::to_string(width) + "x" + std::to_string(height));
+
+    // Segmented outputs are named after their playlist; each segment gets its own muxer
+    // Screen content rarely needs more than ~0.1 bits per pixel at CRF
+    m_projectedBitRate = profile.bitRate > 0 ? profile.bitRate : static_cast<int64_t>(width) * height * frameRate / 10;
+    m_segments.reset();
+    std::string firstOutput = filename;
+    if (!filename.empty() && profile.segments.Enabled()) {
+        m_segments.reset(new SegmentPlaylist(filename, profile.segments,
+                                             profile.gopSize > 0 ? static_cast<double>(profile.gopSize) / frameRate : 0.0,
+                                             m_projectedBitRate));
+        firstOutput = m_segments->NextSegmentFilename();
+    }
+
+    // Without an output, keep the headers out of band so observers can mux the packets anywhere
+    bool globalHeader = filename.empty() || NeedsGlobalHeader(firstOutput);
+    if (m_pooled) {
+        m_encoder = EncoderPool::Instance().Acquire(width, height, frameRate, profile, globalHeader, motionRangeHint);
+    } else {
+        m_encoder = PooledEncoder{std::string(), OpenEncoderContext(width, height, frameRate, profile, globalHeader,
+                                                                    motionRangeHint), motionRangeHint, 0, false};
+    }
+    m_codecContext = m_encoder.context;
+    if (!m_codecContext) {
+        Release();
+        return false;
+    }
+    m_forceKeyframe = m_encoder.reused;
+    m_lastPts = m_encoder.ptsOffset - 1;
+    LogDebug(std::string(m_encoder.reused ? "Reusing" : "Opened") + " " + profile.codec + " context");
+
+    if (!filename.empty() && !OpenMuxer(firstOutput)) {
+        Release();
+        return false;
+    }
+    // A missing sidecar is not worth losing the recording over
+    m_index.reset();
+    if (profile.frameIndex && !filename.empty()) {
+        m_index.reset(new FrameIndexWriter());
+        if (!m_index->Open(FrameIndexFilename(filename), m_codecContext->time_base.num,
+                           m_codecContext->time_base.den, DAMAGE_TILE_SIZE)) {
+            m_index.reset();
+        }
+    }
+    for (PacketObserver* observer : m_observers) {
+        observer->OnStreamOpened(m_codecContext);
+    }
+
+    m_packet = av_packet_alloc();
+    if (!m_packet) {
+        LogDebug("Could not allocate packet");
+        Release();
+        return false;
+    }
+
+    LogDebug("Video encoder initialized successfully");
+    return true;
+}
+
+bool VideoEncoder::OpenMuxer(const std::string& filename) {
+    int ret;
+    m_muxerFilename = filename;
+    m_segmentStartPts = AV_NOPTS_VALUE;
+    m_segmentEndPts = AV_NOPTS_VALUE;
+    m_segmentBytes = 0;
+    m_sampleLocator.reset();
+    m_unplacedEntries.clear();
+
+    // Allocate the output media context; a URL says nothing about the container
+    bool live = !m_profile.url.empty();
+    avformat_alloc_output_context2(&m_formatContext, NULL, live ? "mpegts" : NULL, filename.c_str());
+    if (!m_formatContext) {
+        LogDebug("Could not allocate output context");
+        return false;
+    }
+
+    // Every failure from here on goes through AbandonMuxer: nothing was muxed,
+    // so there is no trailer to write and no segment to record
+
+    // Create a new video stream
+    m_videoStream = avformat_new_stream(m_formatContext, NULL);
+    if (!m_videoStream) {
+        LogDebug("Could not allocate stream");
+        AbandonMuxer();
+        return false;
+    }
+
+    // Copy codec parameters to the stream
+    ret = avcodec_parameters_from_context(m_videoStream->codecpar, m_codecContext);
+    if (ret < 0) {
+        LogDebug("Could not copy codec parameters: " + AvErrorToString(ret));
+        AbandonMuxer();
+        return false;
+    }
+
+    // Open the output file; the muxer writes through a background writer so
+    // the encoding thread never waits on the disk
+    if (live) {
+        ret = avio_open2(&m_formatContext->pb, filename.c_str(), AVIO_FLAG_WRITE, NULL, NULL);
+        if (ret < 0) {
+            LogDebug("Could not open stream " + filename + ": " + AvErrorToString(ret));
+            AbandonMuxer();
+            return false;
+        }
+    } else if (!(m_formatContext->oformat->flags & AVFMT_NOFILE)) {
+        m_writer.reset(new AsyncFileWriter());
+        if (!m_writer->Open(filename, m_projectedBitRate, m_profile.directIo)) {
+            LogDebug("Could not open output file " + filename);
+            AbandonMuxer();
+            return false;
+        }
+        m_formatContext->pb = m_writer->Context();
+        m_formatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    // Fragmented output starts with an empty moov and carries its own index in
+    // every fragment, so there is nothing to rewrite at the end
+    AVDictionary* muxerOptions = NULL;
+    if (m_profile.fragmented && IsMp4Family(m_formatContext->oformat)) {
+        if (m_profile.fragmentMs > 0) {
+            av_dict_set(&muxerOptions, "movflags", "empty_moov+default_base_moof", 0);
+            av_dict_set_int(&muxerOptions, "frag_duration", static_cast<int64_t>(m_profile.fragmentMs) * 1000, 0);
+        } else {
+            av_dict_set(&muxerOptions, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        }
+        m_formatContext->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        if (m_writer) {
+            m_writer->SetWriteThrough(true);
+            // Samples are buffered until their fragment is complete, so the
+            // sidecar takes their positions from the moof the muxer writes
+            if (m_profile.frameIndex) {
+                m_sampleLocator.reset(new FragmentSampleLocator());
+                m_writer->SetObserver(m_sampleLocator.get());
+            }
+        }
+        LogDebug("Writing fragmented MP4 to " + filename);
+    }
+
+    // Every packet goes to the network as soon as it is muxed, and the tables
+    // are repeated so a receiver can join at any time
+    if (live) {
+        m_formatContext->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        m_formatContext->max_delay = 0;
+        av_dict_set(&muxerOptions, "mpegts_flags", "resend_headers", 0);
+        LogDebug("Streaming MPEG-TS to " + filename);
+    }
+
+    // Write the stream header
+    ret = avformat_write_header(m_formatContext, &muxerOptions);
+    av_dict_free(&muxerOptions);
+    if (ret < 0) {
+        LogDebug("Error occurred when opening output file: " + AvErrorToString(ret));
+        AbandonMuxer();
+        return false;
+    }
+    return true;
+}
+
+bool VideoEncoder::CloseMuxer() {
+    if (!m_formatContext) {
+        return true;
+    }
+    bool ok = true;
+    int ret = av_write_trailer(m_formatContext);
+    if (ret < 0) {
+        LogDebug("Error writing trailer: " + AvErrorToString(ret));
+        ok = false;
+    }
+    // The trailer wrote the last fragment; push it through to the locator
+    if (m_sampleLocator) {
+        avio_flush(m_formatContext->pb);
+        PlaceIndexEntries(true);
+    }
+    if (!CloseOutput()) {
+        ok = false;
+    }
+    avformat_free_context(m_formatContext);
+    m_formatContext = nullptr;
+    m_videoStream = nullptr;
+
+    if (m_segments) {
+        double duration = 0.0;
+        if (m_segmentStartPts != AV_NOPTS_VALUE) {
+            duration = (m_segmentEndPts - m_segmentStartPts) * av_q2d(m_codecContext->time_base);
+        }
+        if (!m_segments->AddSegment(m_muxerFilename, duration, m_segmentBytes)) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool VideoEncoder::RotateSegment() {
+    if (!CloseMuxer()) {
+        return false;
+    }
+    m_segmentNumber++;
+    return OpenMuxer(m_segments->NextSegmentFilename());
+}
+
+bool VideoEncoder::Encode(AVFrame* frame) {
+    if (frame) {
+        frame->pts += m_encoder.ptsOffset;
+        m_lastPts = frame->pts;
+        CaptureInfo info = {0, 0, 0};
+        if (GetCaptureInfo(frame, info)) {
+            m_captureInfo[frame->pts] = info;
+        }
+        PROBE_ENCODE_SUBMIT(m_profile.name.c_str(), frame->pts, info.captureUs);
+        if (m_forceKeyframe) {
+            frame->pict_type = AV_PICTURE_TYPE_I;
+            m_forceKeyframe = false;
+        }
+    }
+    int ret;
+    {
+        ScopedStageTimer timer(STAGE_ENCODE_SEND, *m_stageStats);
+        ret = avcodec_send_frame(m_codecContext, frame);
+    }
+    if (ret < 0) {
+        LogDebug("Error sending frame for encoding: " + AvErrorToString(ret));
+        return false;
+    }
+    if (frame) {
+        m_framesEncoded++;
+    }
+    return DrainPackets();
+}
+
+void VideoEncoder::SetQualityStep(int step) {
+    if (!m_codecContext || step == m_qualityStep) {
+        return;
+    }
+    // libx264 picks up CRF and bitrate changes on the next frame; other codecs
+    // simply ignore them
+    if (m_profile.crf >= 0) {
+        int crf = std::min(51, m_profile.crf + step * QUALITY_CRF_STEP);
+        av_opt_set_int(m_codecContext->priv_data, "crf", crf, 0);
+        LogDebug(m_filename + ": CRF " + std::to_string(crf));
+    } else if (m_profile.bitRate > 0) {
+        m_codecContext->bit_rate = static_cast<int64_t>(m_profile.bitRate * std::pow(QUALITY_BITRATE_STEP, step));
+        LogDebug(m_filename + ": bitrate " + std::to_string(m_codecContext->bit_rate));
+    }
+    m_qualityStep = step;
+}
+
+bool VideoEncoder::DrainPackets() {
+    while (true) {
+        auto receiveStart = std::chrono::steady_clock::now();
+        int ret = avcodec_receive_packet(m_codecContext, m_packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return true;
+        } else if (ret < 0) {
+            LogDebug("Error during encoding: " + AvErrorToString(ret));
+            return false;
+        }
+        RecordStage(STAGE_ENCODE_RECEIVE, receiveStart, *m_stageStats);
+
+        // A failed segment rotation leaves no muxer to write to
+        if (!m_formatContext && !m_filename.empty()) {
+            av_packet_unref(m_packet);
+            return false;
+        }
+
+        // Segments start on keyframes so each one decodes on its own
+        if (m_segments && (m_packet->flags & AV_PKT_FLAG_KEY) && m_segmentStartPts != AV_NOPTS_VALUE &&
+            m_segments->ShouldRotate((m_packet->pts - m_segmentStartPts) * av_q2d(m_codecContext->time_base),
+                                     m_segmentBytes)) {
+            if (!RotateSegment()) {
+                av_packet_unref(m_packet);
+                return false;
+            }
+        }
+        if (m_segmentStartPts == AV_NOPTS_VALUE) {
+            m_segmentStartPts = m_packet->pts;
+        }
+        int64_t packetEnd = m_packet->pts + (m_packet->duration > 0 ? m_packet->duration : 1);
+        if (m_segmentEndPts == AV_NOPTS_VALUE || packetEnd > m_segmentEndPts) {
+            m_segmentEndPts = packetEnd;
+        }
+        m_segmentBytes += m_packet->size;
+
+        m_bytesWritten += m_packet->size;
+        CountOutputBytes(m_packet->size);
+        CaptureInfo info = {0, 0, 0};
+        auto captured = m_captureInfo.find(m_packet->pts);
+        if (captured != m_captureInfo.end()) {
+            info = captured->second;
+            m_captureInfo.erase(captured);
+        }
+        PROBE_PACKET_OUT(m_profile.name.c_str(), m_packet->pts, m_packet->size,
+                         (m_packet->flags & AV_PKT_FLAG_KEY) != 0, info.captureUs);
+        if (m_packet->pts != AV_NOPTS_VALUE) m_packet->pts -= m_encoder.ptsOffset;
+        if (m_packet->dts != AV_NOPTS_VALUE) m_packet->dts -= m_encoder.ptsOffset;
+        for (PacketObserver* observer : m_observers) {
+            observer->OnPacket(m_packet, m_codecContext->time_base);
+        }
+        if (!m_formatContext) {
+            av_packet_unref(m_packet);
+            RecordLatency(info.captureUs);
+            continue;
+        }
+
+        // The sidecar wants codec time base; the muxer may change the packet.
+        // Fragmented MP4 replaces the offset once the fragment is written
+        int64_t offset = m_formatContext->pb ? avio_tell(m_formatContext->pb) : -1;
+        if (m_index) {
+            IndexPacket(info, offset);
+        }
+        av_packet_rescale_ts(m_packet, m_codecContext->time_base, m_videoStream->time_base);
+        m_packet->stream_index = m_videoStream->index;
+        {
+            ScopedStageTimer timer(STAGE_MUX, *m_stageStats);
+            ret = av_interleaved_write_frame(m_formatContext, m_packet);
+            if (m_writer) {
+                m_writer->Flush();
+            }
+        }
+        if (m_sampleLocator) {
+            PlaceIndexEntries(false);
+        }
+        av_packet_unref(m_packet);
+        if (ret < 0) {
+            LogDebug("Error writing frame: " + AvErrorToString(ret));
+            return false;
+        }
+        RecordLatency(info.captureUs);
+    }
+}
+
+void VideoEncoder::IndexPacket(const CaptureInfo& info, int64_t offset) {
+    FrameIndexEntry entry;
+    entry.captureUs = info.captureUs;
+    entry.muxUs = av_gettime_relative();
+    entry.pts = m_packet->pts;
+    entry.dts = m_packet->dts != AV_NOPTS_VALUE ? m_packet->dts : m_packet->pts;
+    entry.offset = offset;
+    entry.size = static_cast<uint32_t>(m_packet->size);
+    entry.flags = (m_packet->flags & AV_PKT_FLAG_KEY) ? FRAME_INDEX_KEYFRAME : 0;
+    entry.changedTiles = static_cast<uint32_t>(info.changedTiles);
+    entry.segment = m_segmentNumber;
+    if (m_sampleLocator) {
+        m_unplacedEntries.emplace_back(entry, info.totalTiles);
+        return;
+    }
+    if (!m_index->Add(entry, info.totalTiles)) {
+        m_index.reset();
+    }
+}
+
+void VideoEncoder::PlaceIndexEntries(bool final) {
+    while (m_index && !m_unplacedEntries.empty()) {
+        FrameIndexEntry& entry = m_unplacedEntries.front().first;
+        uint32_t size = 0;
+        if (!m_sampleLocator->NextSample(entry.offset, size)) {
+            if (!final && !m_sampleLocator->Lost()) {
+                return;
+            }
+            entry.offset = -1;
+        }
+        if (!m_index->Add(entry, m_unplacedEntries.front().second)) {
+            m_index.reset();
+        }
+        m_unplacedEntries.pop_front();
+    }
+    m_unplacedEntries.clear();
+}
+
+void VideoEncoder::RecordLatency(int64_t captureUs) {
+    if (captureUs <= 0) {
+        return;
+    }
+    int64_t us = av_gettime_relative() - captureUs;
+    m_latency.Record(us);
+    m_recentLatency.Record(us);
+    m_stageStats->Record(STAGE_GLASS_TO_PACKET, us);
+    if (!m_profile.url.empty() && m_recentLatency.Count() >= LIVE_LATENCY_LOG_FRAMES) {
+        LogLatency(false);
+    }
+}
+
+void VideoEncoder::CountOutputBytes(int size) {
+    m_metrics->bytesWritten.fetch_add(size, std::memory_order_relaxed);
+    int64_t now = av_gettime_relative();
+    if (m_bitRateWindowStartUs == 0) {
+        m_bitRateWindowStartUs = now;
+    }
+    m_bitRateWindowBytes += size;
+    if (now - m_bitRateWindowStartUs >= METRICS_BITRATE_WINDOW_US) {
+        m_metrics->bitRate.store(m_bitRateWindowBytes * 8 * 1000000 / (now - m_bitRateWindowStartUs),
+                                 std::memory_order_relaxed);
+        m_bitRateWindowStartUs = now;
+        m_bitRateWindowBytes = 0;
+    }
+}
+
+void VideoEncoder::LogLatency(bool final) {
+    // Recent window while streaming, the whole recording at the end
+    LatencySummary summary = final ? m_latency.Summary() : m_recentLatency.Summary();
+    m_recentLatency.Reset();
+    if (summary.count == 0) {
+        return;
+    }
+    std::stringstream ss;
+    ss << m_profile.name << " glass-to-packet over " << summary.count << " frames: p50 " << summary.p50Ms
+       << " ms, p99 " << summary.p99Ms << " ms, max " << summary.maxMs << " ms";
+    LogConcise("Latency", ss.str());
+}
+
+bool VideoEncoder::Finish() {
+    if (!m_codecContext) {
+        return false;
+    }
+
+    // Flush the encoder
+    bool ok = Encode(NULL);
+    if (!CloseMuxer()) {
+        ok = false;
+    }
+    if (m_segments && !m_segments->Finish()) {
+        ok = false;
+    }
+
+    LogDebug("Encoded " + std::to_string(m_framesEncoded) + " frames, " +
+             std::to_string(m_bytesWritten) + " bytes to " + m_filename);
+    LogLatency(true);
+    m_captureInfo.clear();
+    if (m_index && !m_index->Close()) {
+        ok = false;
+    }
+    m_index.reset();
+
+    // Hand the drained context back for the next recording instead of freeing it
+    if (ok && m_pooled) {
+        SetQualityStep(0);
+        m_encoder.ptsOffset = m_lastPts + 1;
+        EncoderPool::Instance().Release(m_encoder);
+        m_codecContext = nullptr;
+        m_encoder.context = nullptr;
+    }
+    Release();
+    return ok;
+}
+
+void VideoEncoder::AbandonMuxer() {
+    CloseOutput();
+    avformat_free_context(m_formatContext);
+    m_formatContext = nullptr;
+    m_videoStream = nullptr;
+    if (m_profile.url.empty()) {
+        std::remove(m_muxerFilename.c_str());
+    }
+}
+
+bool VideoEncoder::CloseOutput() {
+    if (!m_writer) {
+        if (m_formatContext) avio_closep(&m_formatContext->pb);
+        return true;
+    }
+    if (m_formatContext) m_formatContext->pb = nullptr;
+    bool ok = m_writer->Close();
+    if (!ok) {
+        LogDebug("Writing " + m_filename + " failed");
+    }
+    m_writer.reset();
+    return ok;
+}
+
+void VideoEncoder::Release() {
+    av_packet_free(&m_packet);
+    avcodec_free_context(&m_codecContext);
+    m_encoder.context = nullptr;
+    CloseOutput();
+    if (m_formatContext) {
+        avformat_free_context(m_formatContext);
+        m_formatContext = nullptr;
+    }
+    m_videoStream = nullptr;
+    if (m_metrics) {
+        m_metrics->bitRate = 0;
+    }
+}
+
+EncoderWorker::EncoderWorker(const EncoderProfile& profile)
+        : FrameWorker("Encoder " + profile.name), m_profile(profile), m_requestedQualityStep(0) {
+}
+
+bool EncoderWorker::Open(const std::string& filename, int width, int height, int frameRate, int motionRangeHint) {
+    if (!m_encoder.Open(filename, width, height, frameRate, m_profile, motionRangeHint)) {
+        return false;
+    }
+    m_requestedQualityStep = 0;
+    Start();
+    return true;
+}
+
+bool EncoderWorker::ProcessFrame(AVFrame* frame) {
+    m_encoder.SetQualityStep(m_requestedQualityStep);
+    return m_encoder.Encode(frame);
+}
+
+bool EncoderWorker::OnFinish() {
+    return m_encoder.Finish();
+}
@@ -0,0 +1,229 @@
+// encoder.h
+#pragma once
+
+#include "frameindex.h"
+#include "metrics.h"
+#include "mp4fragment.h"
+#include "pipeline.h"
+#include "segment.h"
+#include "stats.h"
+#include "writer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+struct EncoderProfile {
+    std::string name;
+    std::string suffix;     // appended to the output filename, empty for the primary file
+    std::string codec;
+    std::string preset;
+    int crf;                // < 0 to use bitRate instead
+    int64_t bitRate;
+    int gopSize;
+    int maxBFrames;
+    std::string options = "";    // extra codec options, "key=value:key=value"
+    std::string extension = "";  // replaces the output extension when the codec needs another container
+    int threads = 0;             // 0 lets the codec decide
+    bool directIo = false;       // write the output around the OS cache
+    // MP4/MOV only: write self-contained fragments so the file stays playable
+    // while recording and survives a crash. 0 cuts a fragment at every
+    // keyframe, otherwise roughly every fragmentMs.
+    bool fragmented = false;
+    int fragmentMs = 0;
+    // Splits the output into MPEG-TS segments listed in an HLS playlist
+    SegmentPolicy segments = SegmentPolicy();
+    // Streams MPEG-TS to this URL (udp://, srt://) instead of writing a file
+    std::string url = "";
+    // Writes a FrameIndexWriter sidecar next to the output
+    bool frameIndex = false;
+};
+
+// Archive-quality primary output plus a small share-ready copy.
+std::vector<EncoderProfile> DefaultEncoderProfiles();
+
+// Cheap lossless capture format for recording now and transcoding later.
+EncoderProfile LosslessIntermediateProfile();
+
+#define LIVE_BIT_RATE 4000000
+#define LIVE_LATENCY_LOG_FRAMES 150   // live outputs log their latency this often
+
+// Zero-latency MPEG-TS stream to a udp:// or srt:// URL for watching live.
+EncoderProfile LiveEncoderProfile(const std::string& url, int frameRate);
+
+std::string ProfileFilename(const std::string& baseFilename, const EncoderProfile& profile);
+
+#define ENCODER_POOL_MAX_IDLE 4
+
+// An opened codec context that can outlive a single recording.
+struct PooledEncoder {
+    std::string key;
+    AVCodecContext* context;
+    int motionRangeHint;  // what the context was opened with; not part of the key
+    int64_t ptsOffset;  // timestamps keep increasing across reuses so the codec never sees them go back
+    bool reused;
+};
+
+// Keeps opened encoder contexts between recordings. Opening libx264 costs tens
+// of milliseconds and large lookahead allocations, so contexts are flushed and
+// reused instead of torn down, and can be opened in parallel ahead of time.
+// The motion range hint only narrows the search and cannot be changed on an
+// open libx264 context, so it is not part of the key: a context opened with
+// the requested hint is preferred, any other one of the same key is taken
+// before opening a new one.
+class EncoderPool {
+public:
+    static EncoderPool& Instance();
+    ~EncoderPool();
+
+    static std::string Key(int width, int height, int frameRate, const EncoderProfile& profile,
+                           bool globalHeader);
+
+    // Starts opening one context per profile in the background.
+    void Prepare(const std::string& baseFilename, int width, int height, int frameRate,
+                 const std::vector<EncoderProfile>& profiles, int motionRangeHint);
+    // Returns an idle context, waits for one being prepared, or opens a new one.
+    PooledEncoder Acquire(int width, int height, int frameRate, const EncoderProfile& profile,
+                          bool globalHeader, int motionRangeHint);
+    // Takes back a fully drained context; codecs that cannot be flushed are freed.
+    void Release(const PooledEncoder& encoder);
+    void Clear();
+
+private:
+    EncoderPool() {}
+    void JoinFinishedThreads();
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<PooledEncoder> m_idle;
+    std::map<std::string, int> m_pending;
+    std::list<std::thread> m_threads;
+};
+
+// Sees every encoded packet on the encoding thread, before it is muxed.
+// Timestamps are in the codec time base and start at 0 for each recording.
+class PacketObserver {
+public:
+    virtual ~PacketObserver() {}
+    virtual void OnStreamOpened(const AVCodecContext*) {}
+    virtual void OnPacket(const AVPacket* packet, AVRational timeBase) = 0;
+};
+
+class VideoEncoder {
+public:
+    VideoEncoder();
+    ~VideoEncoder();
+
+    // Contexts come from EncoderPool unless disabled (one-off jobs such as transcodes)
+    void SetPooled(bool pooled) { m_pooled = pooled; }
+    // Stage timings go to the current recording's StageStats unless set
+    void SetStageStats(StageStats* stats) { m_stageStats = stats; }
+
+    // Observers must outlive the encoder and be added before Open
+    void AddObserver(PacketObserver* observer) { m_observers.push_back(observer); }
+
+    // An empty filename encodes for the observers only, without writing a file
+    bool Open(const std::string& filename, int width, int height, int frameRate,
+              const EncoderProfile& profile, int motionRangeHint);
+    bool Encode(AVFrame* frame);
+    // Raises CRF (or lowers the bitrate) by the given number of steps from the
+    // profile's setting. Call between frames from the encoding thread.
+    void SetQualityStep(int step);
+    // Flushes the encoder, writes the trailer and releases everything.
+    bool Finish();
+
+    // The playlist for segmented outputs
+    const std::string& Filename() const { return m_filename; }
+    int64_t FramesEncoded() const { return m_framesEncoded; }
+    int64_t BytesWritten() const { return m_bytesWritten; }
+
+private:
+    void RecordLatency(int64_t captureUs);
+    void CountOutputBytes(int size);
+    void IndexPacket(const CaptureInfo& info, int64_t offset);
+    // Adds the held entries whose fragments have been written; final adds the
+    // rest without a position
+    void PlaceIndexEntries(bool final);
+    void LogLatency(bool final);
+
+    bool DrainPackets();
+    bool OpenMuxer(const std::string& filename);
+    bool CloseMuxer();
+    // Frees a muxer whose header was never written and deletes its file
+    void AbandonMuxer();
+    bool RotateSegment();
+    bool CloseOutput();
+    void Release();
+
+    AVFormatContext* m_formatContext;
+    std::unique_ptr<AsyncFileWriter> m_writer;
+    AVStream* m_videoStream;
+    AVCodecContext* m_codecContext;
+    AVPacket* m_packet;
+    PooledEncoder m_encoder;
+    EncoderProfile m_profile;
+    int m_qualityStep;
+    bool m_pooled;
+    int64_t m_projectedBitRate;
+    std::unique_ptr<SegmentPlaylist> m_segments;
+    std::string m_muxerFilename;
+    int64_t m_segmentStartPts;  // codec time base
+    int64_t m_segmentEndPts;
+    int64_t m_segmentBytes;
+    std::vector<PacketObserver*> m_observers;
+    bool m_forceKeyframe;
+    int64_t m_lastPts;
+    std::string m_filename;
+    int64_t m_framesEncoded;
+    int64_t m_bytesWritten;
+    // Capture details of each frame in flight, keyed by pts
+    std::map<int64_t, CaptureInfo> m_captureInfo;
+    std::unique_ptr<FrameIndexWriter> m_index;
+    // Fragmented MP4 only: where the muxer put each sample, and the entries
+    // waiting for their fragment to be written
+    std::unique_ptr<FragmentSampleLocator> m_sampleLocator;
+    std::deque<std::pair<FrameIndexEntry, int>> m_unplacedEntries;
+    uint32_t m_segmentNumber;
+    // Glass-to-packet, over the whole recording and since the last live report
+    LatencyHistogram m_latency;
+    LatencyHistogram m_recentLatency;
+    // Live counters, shared with the EncoderWorker of the same profile
+    WorkerMetrics* m_metrics;
+    StageStats* m_stageStats;
+    int64_t m_bitRateWindowStartUs;
+    int64_t m_bitRateWindowBytes;
+};
+
+class EncoderWorker : public FrameWorker {
+public:
+    explicit EncoderWorker(const EncoderProfile& profile);
+    ~EncoderWorker() override { Finish(); }
+
+    bool Open(const std::string& filename, int width, int height, int frameRate, int motionRangeHint);
+    void AddObserver(PacketObserver* observer) { m_encoder.AddObserver(observer); }
+    // Picked up by the worker thread before its next frame
+    void SetQualityStep(int step) { m_requestedQualityStep = step; }
+    const VideoEncoder& Encoder() const { return m_encoder; }
+    const EncoderProfile& Profile() const { return m_profile; }
+
+protected:
+    bool ProcessFrame(AVFrame* frame) override;
+    bool OnFinish() override;
+
+private:
+    EncoderProfile m_profile;
+    VideoEncoder m_encoder;
+    std::atomic<int> m_requestedQualityStep;
+};
@@ -0,0 +1,420 @@
+// framecode.cpp
+#include "framecode.h"
+#include "frameindex.h"
+#include "log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#endif
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+}
+
+namespace {
+
+#define FRAME_CODE_SYNC 0xB4u           // 10110100, both colours for the threshold
+#define FRAME_CODE_SYNC_CELLS 8
+#define FRAME_CODE_PAINT_BITS 48
+#define FRAME_CODE_CELLS (FRAME_CODE_COLUMNS * FRAME_CODE_ROWS)
+
+const int64_t PAINT_MASK = (static_cast<int64_t>(1) << FRAME_CODE_PAINT_BITS) - 1;
+
+// CRC-16/CCITT-FALSE
+uint16_t Crc16(const uint8_t* data, size_t size) {
+    uint16_t crc = 0xffff;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= static_cast<uint16_t>(data[i] << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = static_cast<uint16_t>(crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+// Sequence then paint time, big-endian, as the CRC covers them
+void Payload(const FrameCode& code, uint8_t payload[10]) {
+    for (int i = 0; i < 4; i++) {
+        payload[i] = static_cast<uint8_t>(code.sequence >> (24 - 8 * i));
+    }
+    int64_t paintUs = code.paintUs & PAINT_MASK;
+    for (int i = 0; i < 6; i++) {
+        payload[4 + i] = static_cast<uint8_t>(paintUs >> (40 - 8 * i));
+    }
+}
+
+// Cell values, most significant bit of each byte first
+void Cells(const FrameCode& code, bool cells[FRAME_CODE_CELLS]) {
+    uint8_t bytes[13];
+    bytes[0] = FRAME_CODE_SYNC;
+    Payload(code, bytes + 1);
+    uint16_t crc = Crc16(bytes + 1, 10);
+    bytes[11] = static_cast<uint8_t>(crc >> 8);
+    bytes[12] = static_cast<uint8_t>(crc);
+    for (int cell = 0; cell < FRAME_CODE_CELLS; cell++) {
+        cells[cell] = (bytes[cell / 8] >> (7 - cell % 8)) & 1;
+    }
+}
+
+// Mean luma of the middle of a cell, away from the edges the encoder smears
+int CellLuma(const uint8_t* luma, int stride, int cell) {
+    const int inset = FRAME_CODE_BLOCK / 4;
+    const uint8_t* origin = luma + static_cast<ptrdiff_t>(cell / FRAME_CODE_COLUMNS) * FRAME_CODE_BLOCK * stride +
+                            (cell % FRAME_CODE_COLUMNS) * FRAME_CODE_BLOCK;
+    int sum = 0;
+    for (int y = inset; y < FRAME_CODE_BLOCK - inset; y++) {
+        for (int x = inset; x < FRAME_CODE_BLOCK - inset; x++) {
+            sum += origin[static_cast<ptrdiff_t>(y) * stride + x];
+        }
+    }
+    return sum / ((FRAME_CODE_BLOCK - 2 * inset) * (FRAME_CODE_BLOCK - 2 * inset));
+}
+
+// The painter only keeps the low bits of its clock; take the rest from a
+// time known to be close by
+int64_t RestoreHighBits(int64_t lowBits, int64_t nearbyUs) {
+    int64_t full = (nearbyUs & ~PAINT_MASK) | (lowBits & PAINT_MASK);
+    if (full > nearbyUs + PAINT_MASK / 2) {
+        full -= PAINT_MASK + 1;
+    } else if (full < nearbyUs - PAINT_MASK / 2) {
+        full += PAINT_MASK + 1;
+    }
+    return full;
+}
+
+std::string JsonString(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            quoted += ' ';
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+void WriteSummary(std::ostream& out, const char* name, const LatencySummary& s) {
+    out << "  \"" << name << "\": {\"count\": " << s.count << ", \"mean_ms\": " << s.meanMs
+        << ", \"p50_ms\": " << s.p50Ms << ", \"p90_ms\": " << s.p90Ms << ", \"p99_ms\": " << s.p99Ms
+        << ", \"max_ms\": " << s.maxMs << "}";
+}
+
+} // namespace
+
+void PaintFrameCode(const FrameCode& code, uint8_t* bgra, int stride) {
+    bool cells[FRAME_CODE_CELLS];
+    Cells(code, cells);
+    for (int y = 0; y < FRAME_CODE_HEIGHT; y++) {
+        uint32_t* row = reinterpret_cast<uint32_t*>(bgra + static_cast<ptrdiff_t>(y) * stride);
+        const bool* rowCells = cells + (y / FRAME_CODE_BLOCK) * FRAME_CODE_COLUMNS;
+        for (int x = 0; x < FRAME_CODE_WIDTH; x++) {
+            row[x] = rowCells[x / FRAME_CODE_BLOCK] ? 0xffffffffu : 0xff000000u;
+        }
+    }
+}
+
+bool ReadFrameCode(const uint8_t* luma, int stride, FrameCode& code) {
+    int values[FRAME_CODE_CELLS];
+    for (int cell = 0; cell < FRAME_CODE_CELLS; cell++) {
+        values[cell] = CellLuma(luma, stride, cell);
+    }
+    int white = 0, black = 0;
+    for (int cell = 0; cell < FRAME_CODE_SYNC_CELLS; cell++) {
+        if ((FRAME_CODE_SYNC >> (7 - cell)) & 1) {
+            white += values[cell];
+        } else {
+            black += values[cell];
+        }
+    }
+    white /= 4;
+    black /= 4;
+    if (white - black < FRAME_CODE_MIN_CONTRAST) {
+        return false;
+    }
+    int threshold = (white + black) / 2;
+    uint8_t bytes[13] = {};
+    for (int cell = 0; cell < FRAME_CODE_CELLS; cell++) {
+        if (values[cell] > threshold) {
+            bytes[cell / 8] |= static_cast<uint8_t>(1u << (7 - cell % 8));
+        }
+    }
+    if (bytes[0] != FRAME_CODE_SYNC || Crc16(bytes + 1, 10) != ((bytes[11] << 8) | bytes[12])) {
+        return false;
+    }
+    code.sequence = 0;
+    for (int i = 0; i < 4; i++) {
+        code.sequence = (code.sequence << 8) | bytes[1 + i];
+    }
+    code.paintUs = 0;
+    for (int i = 0; i < 6; i++) {
+        code.paintUs = (code.paintUs << 8) | bytes[5 + i];
+    }
+    return true;
+}
+
+std::string LatencyFilename(const std::string& output) {
+    size_t dot = output.find_last_of('.');
+    size_t slash = output.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = output.size();
+    }
+    return output.substr(0, dot) + LATENCY_EXTENSION;
+}
+
+bool AnalyzeFrameCodes(const std::string& recording, FrameCodeReport& report) {
+    report.frames = 0;
+    report.coded = 0;
+    report.duplicates = 0;
+    report.skipped = 0;
+    report.reordered = 0;
+    report.firstSequence = 0;
+    report.lastSequence = 0;
+    report.glassToCapture.Reset();
+    report.glassToFile.Reset();
+
+    FrameIndexReader index;
+    report.timed = index.Open(FrameIndexFilename(recording)) && index.Header().firstCaptureUs > 0;
+    if (!report.timed) {
+        LogDebug("Latency: no frame index for " + recording + ", counting codes only");
+    }
+
+    AVFormatContext* input = NULL;
+    AVCodecContext* decoder = NULL;
+    AVPacket* packet = NULL;
+    AVFrame* frame = NULL;
+    auto cleanup = [&](bool result) {
+        av_frame_free(&frame);
+        av_packet_free(&packet);
+        avcodec_free_context(&decoder);
+        avformat_close_input(&input);
+        return result;
+    };
+
+    int ret = avformat_open_input(&input, recording.c_str(), NULL, NULL);
+    if (ret < 0 || avformat_find_stream_info(input, NULL) < 0) {
+        LogDebug("Latency: could not open " + recording);
+        return cleanup(false);
+    }
+    const AVCodec* codec = NULL;
+    int streamIndex = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (streamIndex < 0 || !codec) {
+        LogDebug("Latency: no decodable video stream in " + recording);
+        return cleanup(false);
+    }
+    decoder = avcodec_alloc_context3(codec);
+    if (!decoder || avcodec_parameters_to_context(decoder, input->streams[streamIndex]->codecpar) < 0) {
+        LogDebug("Latency: could not allocate decoder");
+        return cleanup(false);
+    }
+    decoder->thread_count = 0;
+    if (avcodec_open2(decoder, codec, NULL) < 0) {
+        LogDebug("Latency: could not open decoder");
+        return cleanup(false);
+    }
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!packet || !frame) {
+        return cleanup(false);
+    }
+
+    // Frames come out of the decoder in presentation order, as the index entries are
+    bool havePrevious = false;
+    auto inspect = [&](const AVFrame* decoded) {
+        int64_t frameNumber = report.frames++;
+        FrameCode code;
+        if ((decoded->format != AV_PIX_FMT_YUV420P && decoded->format != AV_PIX_FMT_YUVJ420P) ||
+            decoded->width < FRAME_CODE_MARGIN + FRAME_CODE_WIDTH ||
+            decoded->height < FRAME_CODE_MARGIN + FRAME_CODE_HEIGHT ||
+            !ReadFrameCode(decoded->data[0] + FRAME_CODE_MARGIN * decoded->linesize[0] + FRAME_CODE_MARGIN,
+                           decoded->linesize[0], code)) {
+            return;
+        }
+        report.coded++;
+        int32_t step = havePrevious ? static_cast<int32_t>(code.sequence - report.lastSequence) : 1;
+        if (!havePrevious) {
+            report.firstSequence = code.sequence;
+        }
+        havePrevious = true;
+        if (step == 0) {
+            report.duplicates++;
+            return;
+        }
+        if (step < 0) {
+            report.reordered++;
+            return;
+        }
+        report.skipped += step - 1;
+        report.lastSequence = code.sequence;
+        // Only the first frame to show a code says when that change reached the file
+        if (report.timed && frameNumber < index.Count()) {
+            const FrameIndexEntry& entry = index.Entry(frameNumber);
+            int64_t captureUs = index.Header().firstCaptureUs + entry.captureUs;
+            int64_t muxUs = index.Header().firstCaptureUs + entry.muxUs;
+            int64_t paintUs = RestoreHighBits(code.paintUs, captureUs);
+            report.glassToCapture.Record(std::max<int64_t>(0, captureUs - paintUs));
+            report.glassToFile.Record(std::max<int64_t>(0, muxUs - paintUs));
+        }
+    };
+
+    bool inputDone = false;
+    while (true) {
+        if (!inputDone) {
+            ret = av_read_frame(input, packet);
+            if (ret < 0) {
+                inputDone = true;
+                avcodec_send_packet(decoder, NULL);
+            } else {
+                if (packet->stream_index == streamIndex) {
+                    avcodec_send_packet(decoder, packet);
+                }
+                av_packet_unref(packet);
+            }
+        }
+        while ((ret = avcodec_receive_frame(decoder, frame)) >= 0) {
+            inspect(frame);
+            av_frame_unref(frame);
+        }
+        if (ret == AVERROR_EOF) {
+            break;
+        }
+        if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            LogDebug("Latency: decoding failed in " + recording);
+            return cleanup(false);
+        }
+    }
+    if (report.timed && report.frames != index.Count()) {
+        LogDebug("Latency: " + std::to_string(report.frames) + " frames decoded but " +
+                 std::to_string(index.Count()) + " indexed; times may be off");
+    }
+    return cleanup(report.coded > 0);
+}
+
+bool WriteLatencyReport(const std::string& recording, const FrameCodeReport& report) {
+    LatencySummary capture = report.glassToCapture.Summary();
+    LatencySummary file = report.glassToFile.Summary();
+    std::string filename = LatencyFilename(recording);
+    std::ofstream out(filename, std::ios::trunc);
+    out << std::fixed << std::setprecision(3);
+    out << "{\n  \"recording\": " << JsonString(recording) << ",\n  \"frames\": " << report.frames
+        << ",\n  \"coded\": " << report.coded << ",\n  \"first_code\": " << report.firstSequence
+        << ",\n  \"last_code\": " << report.lastSequence << ",\n  \"skipped\": " << report.skipped
+        << ",\n  \"duplicates\": " << report.duplicates << ",\n  \"reordered\": " << report.reordered
+        << ",\n  \"timed\": " << (report.timed ? "true" : "false") << ",\n";
+    WriteSummary(out, "glass_to_capture", capture);
+    out << ",\n";
+    WriteSummary(out, "glass_to_file", file);
+    out << "\n}\n";
+    if (!out) {
+        LogDebug("Could not write " + filename);
+        return false;
+    }
+
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2) << report.coded << " of " << report.frames << " frames coded, "
+       << report.skipped << " codes skipped, " << report.duplicates << " duplicated";
+    if (report.timed) {
+        ss << "; glass to file p50 " << file.p50Ms << " ms, p99 " << file.p99Ms << " ms, max " << file.maxMs
+           << " ms (glass to capture p50 " << capture.p50Ms << " ms)";
+    }
+    LogConcise("Latency", ss.str());
+    return true;
+}
+
+FrameCodePainter::FrameCodePainter() : m_running(false) {
+}
+
+FrameCodePainter::~FrameCodePainter() {
+    Stop();
+}
+
+bool FrameCodePainter::Start(int x, int y, int frameRate) {
+    Stop();
+#ifdef _WIN32
+    m_running = true;
+    m_thread = std::thread(&FrameCodePainter::Run, this, x, y, frameRate > 0 ? frameRate : 30);
+    return true;
+#else
+    (void)x;
+    (void)y;
+    (void)frameRate;
+    LogDebug("Frame codes need a window to paint into; use recorder_bench --latency here");
+    return false;
+#endif
+}
+
+void FrameCodePainter::Stop() {
+    m_running = false;
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void FrameCodePainter::Run(int x, int y, int frameRate) {
+#ifdef _WIN32
+    HINSTANCE instance = GetModuleHandle(NULL);
+    WNDCLASS wc = {};
+    wc.lpfnWndProc = DefWindowProc;
+    wc.hInstance = instance;
+    wc.lpszClassName = "FrameCodeWindowClass";
+    RegisterClass(&wc);
+
+    // Never takes focus, so it does not change what is being recorded
+    HWND window = CreateWindowEx(WS_EX_TOPMOST | WS_EX_TOOLWINDOW | WS_EX_NOACTIVATE, "FrameCodeWindowClass",
+                                 NULL, WS_POPUP, x, y, FRAME_CODE_WIDTH, FRAME_CODE_HEIGHT,
+                                 NULL, NULL, instance, NULL);
+    if (!window) {
+        LogDebug("Could not create the frame code window. Error: " + std::to_string(GetLastError()));
+        return;
+    }
+    ShowWindow(window, SW_SHOWNOACTIVATE);
+
+    BITMAPINFO info = {};
+    info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    info.bmiHeader.biWidth = FRAME_CODE_WIDTH;
+    info.bmiHeader.biHeight = -FRAME_CODE_HEIGHT;   // top-down
+    info.bmiHeader.biPlanes = 1;
+    info.bmiHeader.biBitCount = 32;
+    info.bmiHeader.biCompression = BI_RGB;
+    std::vector<uint8_t> pixels(static_cast<size_t>(FRAME_CODE_WIDTH) * FRAME_CODE_HEIGHT * 4);
+
+    auto interval = std::chrono::microseconds(1000000 / frameRate);
+    auto next = std::chrono::steady_clock::now();
+    uint32_t sequence = 0;
+    while (m_running) {
+        MSG msg;
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            DispatchMessage(&msg);
+        }
+        // Stamped before the blit, so composition counts as part of the latency
+        FrameCode code = {sequence++, av_gettime_relative()};
+        PaintFrameCode(code, pixels.data(), FRAME_CODE_WIDTH * 4);
+        HDC dc = GetDC(window);
+        SetDIBitsToDevice(dc, 0, 0, FRAME_CODE_WIDTH, FRAME_CODE_HEIGHT, 0, 0, 0, FRAME_CODE_HEIGHT,
+                          pixels.data(), &info, DIB_RGB_COLORS);
+        ReleaseDC(window, dc);
+        GdiFlush();
+
+        next += interval;
+        std::this_thread::sleep_until(next);
+    }
+    DestroyWindow(window);
+#else
+    (void)x;
+    (void)y;
+    (void)frameRate;
+#endif
+}
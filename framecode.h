@@ -0,0 +1,83 @@
+// framecode.h
+#pragma once
+
+#include "stats.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#define FRAME_CODE_BLOCK 8              // pixels per cell side; survives 4:2:0 and a lossy encode
+#define FRAME_CODE_COLUMNS 26
+#define FRAME_CODE_ROWS 4
+#define FRAME_CODE_WIDTH (FRAME_CODE_BLOCK * FRAME_CODE_COLUMNS)
+#define FRAME_CODE_HEIGHT (FRAME_CODE_BLOCK * FRAME_CODE_ROWS)
+#define FRAME_CODE_MARGIN 8             // from the top-left corner of the recorded area
+#define FRAME_CODE_MIN_CONTRAST 64      // luma between the white and black sync cells
+#define LATENCY_EXTENSION "_latency.json"
+
+// What a test source paints into the picture: which paint this is and when
+// it happened, as av_gettime_relative microseconds. The recorder stamps
+// captures and muxed packets with the same clock, so the difference is the
+// latency from the screen to the file.
+//
+// Cells are FRAME_CODE_BLOCK squares, row-major, white for 1: eight sync
+// cells, then the 32-bit sequence, the low 48 bits of paintUs and a CRC-16
+// of both, most significant bit first.
+struct FrameCode {
+    uint32_t sequence;
+    int64_t paintUs;
+};
+
+// Paints a FRAME_CODE_WIDTH x FRAME_CODE_HEIGHT BGRA block at bgra
+void PaintFrameCode(const FrameCode& code, uint8_t* bgra, int stride);
+// Reads a code painted at luma from an 8-bit luma plane, limited or full
+// range; false when the sync cells or the CRC do not match
+bool ReadFrameCode(const uint8_t* luma, int stride, FrameCode& code);
+
+// The report that belongs to an output: same name, LATENCY_EXTENSION.
+std::string LatencyFilename(const std::string& output);
+
+// Everything the analyzer learned from one recording. The painter runs at the
+// recording frame rate, so every frame should show the code after the one
+// before it; a frame that shows the same code again is a duplicate, and codes
+// jumped over are skipped. When the painter's phase sits right on the capture
+// tick, jitter shows up as a duplicate next to a skip.
+struct FrameCodeReport {
+    int64_t frames;           // decoded
+    int64_t coded;            // with a readable code
+    int64_t duplicates;
+    int64_t skipped;
+    int64_t reordered;        // showed an older code than the frame before
+    uint32_t firstSequence;
+    uint32_t lastSequence;
+    bool timed;               // the frame index was there, so the latencies are filled in
+    LatencyHistogram glassToCapture;
+    LatencyHistogram glassToFile;
+};
+
+// Decodes a recording made with the frame code on screen and matches the
+// codes against the capture and mux times in its frame index
+bool AnalyzeFrameCodes(const std::string& recording, FrameCodeReport& report);
+// Writes the report next to the recording and logs a summary
+bool WriteLatencyReport(const std::string& recording, const FrameCodeReport& report);
+
+// A small always-on-top window that shows a new frame code at the given rate
+// from its own thread, for measuring a real capture. Windows only; elsewhere
+// Start fails and recorder_bench --latency stands in with a synthetic screen.
+class FrameCodePainter {
+public:
+    FrameCodePainter();
+    ~FrameCodePainter();
+
+    // x and y are screen coordinates of the block's top-left corner
+    bool Start(int x, int y, int frameRate);
+    void Stop();
+
+private:
+    void Run(int x, int y, int frameRate);
+
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+};
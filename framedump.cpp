@@ -0,0 +1,274 @@
+// framedump.cpp
+#include "framedump.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_MAX_RUN 62
+
+void FreeVector(void* opaque, uint8_t*) {
+    delete static_cast<std::vector<uint8_t>*>(opaque);
+}
+
+void PutBigEndian32(std::vector<uint8_t>& out, uint32_t value) {
+    out.push_back(static_cast<uint8_t>(value >> 24));
+    out.push_back(static_cast<uint8_t>(value >> 16));
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+// QOI, RGB only: GDI leaves alpha undefined, so it is taken as opaque
+void EncodeQoi(const uint8_t* bgra, int width, int height, int stride, std::vector<uint8_t>& out) {
+    out.clear();
+    out.reserve(static_cast<size_t>(width) * height + 32);
+    out.insert(out.end(), {'q', 'o', 'i', 'f'});
+    PutBigEndian32(out, static_cast<uint32_t>(width));
+    PutBigEndian32(out, static_cast<uint32_t>(height));
+    out.push_back(3);   // channels
+    out.push_back(0);   // sRGB
+
+    uint32_t seen[64] = {};
+    uint8_t pr = 0, pg = 0, pb = 0;
+    int run = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = bgra + static_cast<size_t>(y) * stride;
+        for (int x = 0; x < width; x++) {
+            uint8_t b = row[x * 4], g = row[x * 4 + 1], r = row[x * 4 + 2];
+            if (r == pr && g == pg && b == pb) {
+                if (++run == QOI_MAX_RUN) {
+                    out.push_back(static_cast<uint8_t>(QOI_OP_RUN | (run - 1)));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                out.push_back(static_cast<uint8_t>(QOI_OP_RUN | (run - 1)));
+                run = 0;
+            }
+            uint32_t pixel = 0xFF000000u | (static_cast<uint32_t>(r) << 16) | (g << 8) | b;
+            int hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+            if (seen[hash] == pixel) {
+                out.push_back(static_cast<uint8_t>(QOI_OP_INDEX | hash));
+            } else {
+                seen[hash] = pixel;
+                int dr = static_cast<int8_t>(r - pr), dg = static_cast<int8_t>(g - pg), db = static_cast<int8_t>(b - pb);
+                int drg = dr - dg, dbg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out.push_back(static_cast<uint8_t>(QOI_OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2)));
+                } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                    out.push_back(static_cast<uint8_t>(QOI_OP_LUMA | (dg + 32)));
+                    out.push_back(static_cast<uint8_t>(((drg + 8) << 4) | (dbg + 8)));
+                } else {
+                    out.insert(out.end(), {static_cast<uint8_t>(QOI_OP_RGB), r, g, b});
+                }
+            }
+            pr = r;
+            pg = g;
+            pb = b;
+        }
+    }
+    if (run > 0) {
+        out.push_back(static_cast<uint8_t>(QOI_OP_RUN | (run - 1)));
+    }
+    out.insert(out.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+}
+
+bool WriteFile(const std::string& filename, const uint8_t* data, size_t size) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    bool ok = file && fwrite(data, 1, size, file) == size;
+    if (file && fclose(file) != 0) ok = false;
+    if (!ok) {
+        LogDebug("Frame dump: could not write " + filename);
+        std::remove(filename.c_str());
+    }
+    return ok;
+}
+
+} // namespace
+
+FrameDumpSink::FrameDumpSink()
+        : FrameWorker("FrameDump"), m_format(FRAMEDUMP_QOI), m_every(FRAMEDUMP_DEFAULT_EVERY),
+          m_pngConverter(nullptr), m_pngEncoder(nullptr), m_rgb(nullptr), m_packet(nullptr),
+          m_written(0), m_bytes(0) {
+}
+
+FrameDumpSink::~FrameDumpSink() {
+    Finish();
+    Release();
+}
+
+bool FrameDumpSink::Open(const std::string& baseFilename, FrameDumpFormat format, int every) {
+    Release();
+    size_t dot = baseFilename.find_last_of('.');
+    size_t slash = baseFilename.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = baseFilename.size();
+    }
+    m_stem = baseFilename.substr(0, dot);
+    m_format = format;
+    m_every = every > 0 ? every : FRAMEDUMP_DEFAULT_EVERY;
+    m_written = 0;
+    m_bytes = 0;
+    if (m_format == FRAMEDUMP_PNG && !avcodec_find_encoder(AV_CODEC_ID_PNG)) {
+        LogDebug("Frame dump: no PNG encoder in this FFmpeg build, writing QOI");
+        m_format = FRAMEDUMP_QOI;
+    }
+
+    SetLowPriority(true);
+    SetMaxQueueDepth(FRAMEDUMP_QUEUE_DEPTH);
+    Start();
+    return true;
+}
+
+bool FrameDumpSink::Dump(std::vector<uint8_t>& bgra, int width, int height, int64_t frameNumber) {
+    if (frameNumber % m_every != 0 || width < 1 || height < 1 ||
+        bgra.size() < static_cast<size_t>(width) * height * 4) {
+        return false;
+    }
+    // The frame takes over the capture buffer; whoever drops the last
+    // reference frees it
+    std::vector<uint8_t>* owned = new std::vector<uint8_t>();
+    owned->swap(bgra);
+    AVFrame* frame = av_frame_alloc();
+    if (frame) {
+        frame->buf[0] = av_buffer_create(owned->data(), owned->size(), FreeVector, owned, 0);
+    }
+    if (!frame || !frame->buf[0]) {
+        delete owned;
+        av_frame_free(&frame);
+        return false;
+    }
+    frame->data[0] = owned->data();
+    frame->linesize[0] = width * 4;
+    frame->format = AV_PIX_FMT_BGRA;
+    frame->width = width;
+    frame->height = height;
+    frame->pts = frameNumber;
+    bool queued = Submit(frame);
+    av_frame_free(&frame);
+    return queued;
+}
+
+bool FrameDumpSink::ProcessFrame(AVFrame* frame) {
+    // Corner pixels show at a glance whether the capture came back black or shifted
+    auto logPixel = [frame](int x, int y, const std::string& corner) {
+        const uint8_t* pixel = frame->data[0] + static_cast<size_t>(y) * frame->linesize[0] + x * 4;
+        LogDebug(corner + " pixel: R" + std::to_string(pixel[2]) + " G" + std::to_string(pixel[1]) +
+                 " B" + std::to_string(pixel[0]) + " A" + std::to_string(pixel[3]));
+    };
+    LogDebug("Frame dump " + std::to_string(frame->pts) + ":");
+    logPixel(0, 0, "TopLeft");
+    logPixel(frame->width - 1, 0, "TopRight");
+    logPixel(0, frame->height - 1, "BottomLeft");
+    logPixel(frame->width - 1, frame->height - 1, "BottomRight");
+
+    // A failed dump is logged and skipped; it never stops the recording
+    if (m_format == FRAMEDUMP_PNG) {
+        WritePng(frame);
+    } else {
+        WriteQoi(frame);
+    }
+    return true;
+}
+
+bool FrameDumpSink::WriteQoi(const AVFrame* frame) {
+    EncodeQoi(frame->data[0], frame->width, frame->height, frame->linesize[0], m_encoded);
+    if (!WriteFile(DumpFilename(frame->pts), m_encoded.data(), m_encoded.size())) {
+        return false;
+    }
+    m_written++;
+    m_bytes += static_cast<int64_t>(m_encoded.size());
+    return true;
+}
+
+bool FrameDumpSink::WritePng(const AVFrame* frame) {
+    if (!m_pngEncoder) {
+        const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
+        m_pngEncoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+        m_packet = av_packet_alloc();
+        if (!m_pngEncoder || !m_packet) {
+            return false;
+        }
+        m_pngEncoder->width = frame->width;
+        m_pngEncoder->height = frame->height;
+        m_pngEncoder->pix_fmt = AV_PIX_FMT_RGB24;
+        m_pngEncoder->time_base = AVRational{1, 1};
+        // Every PNG stands alone, so frame threads deflate several at once
+        m_pngEncoder->thread_count = 0;
+        m_pngEncoder->thread_type = FF_THREAD_FRAME;
+        if (avcodec_open2(m_pngEncoder, codec, NULL) < 0) {
+            LogDebug("Frame dump: could not open the PNG encoder");
+            avcodec_free_context(&m_pngEncoder);
+            return false;
+        }
+    }
+    m_pngConverter = sws_getCachedContext(m_pngConverter, frame->width, frame->height, AV_PIX_FMT_BGRA,
+                                          frame->width, frame->height, AV_PIX_FMT_RGB24, SWS_POINT, NULL, NULL, NULL);
+    if (!m_rgb) {
+        m_rgb = av_frame_alloc();
+        if (!m_rgb) return false;
+        m_rgb->format = AV_PIX_FMT_RGB24;
+        m_rgb->width = frame->width;
+        m_rgb->height = frame->height;
+        if (av_frame_get_buffer(m_rgb, 32) < 0) return false;
+    }
+    if (!m_pngConverter || frame->width != m_rgb->width || frame->height != m_rgb->height ||
+        av_frame_make_writable(m_rgb) < 0) {
+        return false;
+    }
+    sws_scale(m_pngConverter, frame->data, frame->linesize, 0, frame->height, m_rgb->data, m_rgb->linesize);
+    m_rgb->pts = frame->pts;
+    if (avcodec_send_frame(m_pngEncoder, m_rgb) < 0) {
+        return false;
+    }
+    return ReceivePngs();
+}
+
+bool FrameDumpSink::ReceivePngs() {
+    bool ok = true;
+    // Packets keep the frame number in pts, however late the threads hand them back
+    while (avcodec_receive_packet(m_pngEncoder, m_packet) >= 0) {
+        if (WriteFile(DumpFilename(m_packet->pts), m_packet->data, m_packet->size)) {
+            m_written++;
+            m_bytes += m_packet->size;
+        } else {
+            ok = false;
+        }
+        av_packet_unref(m_packet);
+    }
+    return ok;
+}
+
+bool FrameDumpSink::OnFinish() {
+    if (m_pngEncoder && avcodec_send_frame(m_pngEncoder, NULL) >= 0) {
+        ReceivePngs();
+    }
+    LogConcise("FrameDump", std::to_string(m_written) + " frames dumped for " + m_stem + ", " +
+                            std::to_string(m_bytes / 1024) + " KB, " + std::to_string(Dropped()) + " skipped");
+    return true;
+}
+
+std::string FrameDumpSink::DumpFilename(int64_t frameNumber) const {
+    std::stringstream ss;
+    ss << m_stem << "_frame_" << std::setw(6) << std::setfill('0') << frameNumber
+       << (m_format == FRAMEDUMP_PNG ? ".png" : ".qoi");
+    return ss.str();
+}
+
+void FrameDumpSink::Release() {
+    avcodec_free_context(&m_pngEncoder);
+    sws_freeContext(m_pngConverter);
+    m_pngConverter = nullptr;
+    av_frame_free(&m_rgb);
+    av_packet_free(&m_packet);
+}
@@ -0,0 +1,61 @@
+// framedump.h
+#pragma once
+
+#include "pipeline.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#define FRAMEDUMP_DEFAULT_EVERY 30   // one captured frame per second at 30 fps
+#define FRAMEDUMP_QUEUE_DEPTH 4      // dumps beyond this are skipped, never waited for
+
+enum FrameDumpFormat {
+    FRAMEDUMP_QOI,   // fast lossless, readable by most image viewers and ffmpeg
+    FRAMEDUMP_PNG    // smaller; FFmpeg's encoder deflates several dumps at once
+};
+
+// Saves every Nth captured frame, exactly as GDI returned it, for debugging
+// capture problems. The capture thread hands over its buffer after it has
+// been converted, so a dump costs it no copy and no disk access; encoding,
+// writing and the corner-pixel log happen on a background thread. When that
+// thread falls behind, dumps are skipped.
+//
+// For recording.mp4 it writes recording_frame_000030.qoi (or .png) and so on.
+class FrameDumpSink : public FrameWorker {
+public:
+    FrameDumpSink();
+    ~FrameDumpSink() override;
+
+    bool Open(const std::string& baseFilename, FrameDumpFormat format, int every);
+
+    // Takes the buffer when frameNumber is due for a dump
+    bool Dump(std::vector<uint8_t>& bgra, int width, int height, int64_t frameNumber);
+
+protected:
+    bool ProcessFrame(AVFrame* frame) override;
+    bool OnFinish() override;
+
+private:
+    bool WriteQoi(const AVFrame* frame);
+    bool WritePng(const AVFrame* frame);
+    bool ReceivePngs();
+    std::string DumpFilename(int64_t frameNumber) const;
+    void Release();
+
+    std::string m_stem;
+    FrameDumpFormat m_format;
+    int m_every;
+
+    SwsContext* m_pngConverter;
+    AVCodecContext* m_pngEncoder;
+    AVFrame* m_rgb;
+    AVPacket* m_packet;
+    std::vector<uint8_t> m_encoded;
+    int64_t m_written;
+    int64_t m_bytes;
+};
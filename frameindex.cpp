@@ -0,0 +1,249 @@
+// frameindex.cpp
+#include "frameindex.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const intptr_t NO_HANDLE = -1;
+
+} // namespace
+
+std::string FrameIndexFilename(const std::string& output) {
+    size_t dot = output.find_last_of('.');
+    size_t slash = output.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = output.size();
+    }
+    return output.substr(0, dot) + FRAME_INDEX_EXTENSION;
+}
+
+FrameIndexWriter::FrameIndexWriter() : m_file(nullptr), m_header(), m_failed(false) {
+}
+
+FrameIndexWriter::~FrameIndexWriter() {
+    Close();
+}
+
+bool FrameIndexWriter::Open(const std::string& filename, int timeBaseNum, int timeBaseDen, int tileSize) {
+    Close();
+    m_filename = filename;
+    m_failed = false;
+    m_pending.clear();
+    m_file = fopen(filename.c_str(), "wb");
+    if (!m_file) {
+        LogDebug("Could not create frame index " + filename);
+        return false;
+    }
+    m_header = FrameIndexHeader();
+    m_header.magic = FRAME_INDEX_MAGIC;
+    m_header.version = FRAME_INDEX_VERSION;
+    m_header.headerSize = sizeof(FrameIndexHeader);
+    m_header.entrySize = sizeof(FrameIndexEntry);
+    m_header.timeBaseNum = timeBaseNum;
+    m_header.timeBaseDen = timeBaseDen;
+    m_header.tileSize = tileSize;
+    if (fwrite(&m_header, sizeof(m_header), 1, m_file) != 1) {
+        LogDebug("Could not write frame index " + filename);
+        m_failed = true;
+    }
+    return !m_failed;
+}
+
+bool FrameIndexWriter::Add(const FrameIndexEntry& entry, int totalTiles) {
+    if (!m_file) {
+        return false;
+    }
+    FrameIndexEntry relative = entry;
+    if (m_header.firstCaptureUs == 0 && entry.captureUs > 0) {
+        m_header.firstCaptureUs = entry.captureUs;
+        m_header.tilesPerFrame = totalTiles;
+    }
+    if (relative.captureUs > 0) relative.captureUs -= m_header.firstCaptureUs;
+    if (relative.muxUs > 0) relative.muxUs -= m_header.firstCaptureUs;
+
+    // Kept sorted by pts; once the decoder has reached a dts, nothing still to
+    // come can be shown before it
+    auto position = std::upper_bound(m_pending.begin(), m_pending.end(), relative,
+                                     [](const FrameIndexEntry& a, const FrameIndexEntry& b) { return a.pts < b.pts; });
+    m_pending.insert(position, relative);
+    return WritePending(entry.dts);
+}
+
+bool FrameIndexWriter::WritePending(int64_t upToPts) {
+    size_t ready = 0;
+    while (ready < m_pending.size() && m_pending[ready].pts <= upToPts) {
+        ready++;
+    }
+    if (ready > 0 && !m_failed) {
+        if (fwrite(m_pending.data(), sizeof(FrameIndexEntry), ready, m_file) != ready) {
+            LogDebug("Could not write frame index " + m_filename);
+            m_failed = true;
+        }
+        m_header.entryCount += ready;
+        // Readers following a recording in progress see up to the last keyframe
+        for (size_t i = 0; i < ready; i++) {
+            if (m_pending[i].flags & FRAME_INDEX_KEYFRAME) {
+                fflush(m_file);
+                break;
+            }
+        }
+    }
+    m_pending.erase(m_pending.begin(), m_pending.begin() + ready);
+    return !m_failed;
+}
+
+bool FrameIndexWriter::Close() {
+    if (!m_file) {
+        return true;
+    }
+    WritePending(INT64_MAX);
+    m_header.complete = 1;
+    if (fseek(m_file, 0, SEEK_SET) != 0 || fwrite(&m_header, sizeof(m_header), 1, m_file) != 1) {
+        m_failed = true;
+    }
+    if (fclose(m_file) != 0) {
+        m_failed = true;
+    }
+    m_file = nullptr;
+    if (m_failed) {
+        LogDebug("Frame index " + m_filename + " is incomplete");
+    } else {
+        LogConcise("FrameIndex", "Wrote " + std::to_string(m_header.entryCount) + " frames to " + m_filename);
+    }
+    return !m_failed;
+}
+
+FrameIndexReader::FrameIndexReader()
+        : m_file(NO_HANDLE), m_mapping(NO_HANDLE), m_view(nullptr), m_viewSize(0),
+          m_header(nullptr), m_entries(nullptr), m_count(0) {
+}
+
+FrameIndexReader::~FrameIndexReader() {
+    Close();
+}
+
+bool FrameIndexReader::Open(const std::string& filename) {
+    Close();
+#ifdef _WIN32
+    // Shared for writing, so a recording in progress can be read
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    m_file = reinterpret_cast<intptr_t>(file);
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < static_cast<LONGLONG>(sizeof(FrameIndexHeader))) {
+        Close();
+        return false;
+    }
+    m_viewSize = static_cast<size_t>(size.QuadPart);
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) {
+        Close();
+        return false;
+    }
+    m_mapping = reinterpret_cast<intptr_t>(mapping);
+    m_view = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    m_file = fd;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(FrameIndexHeader))) {
+        Close();
+        return false;
+    }
+    m_viewSize = static_cast<size_t>(info.st_size);
+    void* view = mmap(nullptr, m_viewSize, PROT_READ, MAP_SHARED, fd, 0);
+    m_view = view == MAP_FAILED ? nullptr : static_cast<const uint8_t*>(view);
+#endif
+    if (!m_view) {
+        Close();
+        return false;
+    }
+
+    m_header = reinterpret_cast<const FrameIndexHeader*>(m_view);
+    if (m_header->magic != FRAME_INDEX_MAGIC || m_header->version != FRAME_INDEX_VERSION ||
+        m_header->entrySize != sizeof(FrameIndexEntry) || m_header->headerSize < sizeof(FrameIndexHeader)) {
+        LogDebug("Not a frame index: " + filename);
+        Close();
+        return false;
+    }
+    m_entries = reinterpret_cast<const FrameIndexEntry*>(m_view + m_header->headerSize);
+    int64_t available = static_cast<int64_t>((m_viewSize - m_header->headerSize) / sizeof(FrameIndexEntry));
+    m_count = m_header->complete ? std::min(m_header->entryCount, available) : available;
+    return true;
+}
+
+void FrameIndexReader::Close() {
+#ifdef _WIN32
+    if (m_view) UnmapViewOfFile(m_view);
+    if (m_mapping != NO_HANDLE) CloseHandle(reinterpret_cast<HANDLE>(m_mapping));
+    if (m_file != NO_HANDLE) CloseHandle(reinterpret_cast<HANDLE>(m_file));
+#else
+    if (m_view) munmap(const_cast<uint8_t*>(m_view), m_viewSize);
+    if (m_file != NO_HANDLE) close(static_cast<int>(m_file));
+#endif
+    m_file = NO_HANDLE;
+    m_mapping = NO_HANDLE;
+    m_view = nullptr;
+    m_viewSize = 0;
+    m_header = nullptr;
+    m_entries = nullptr;
+    m_count = 0;
+}
+
+int64_t FrameIndexReader::FindTime(double seconds) const {
+    if (m_count == 0 || m_header->timeBaseNum <= 0) {
+        return -1;
+    }
+    int64_t target = m_entries[0].pts +
+                     static_cast<int64_t>(std::floor(seconds * m_header->timeBaseDen / m_header->timeBaseNum));
+    if (target < m_entries[0].pts) {
+        return -1;
+    }
+    // Each frame is at least one tick after the previous one, so the answer
+    // is never past the constant-rate position
+    int64_t guess = std::min(m_count - 1, target - m_entries[0].pts);
+    if (m_entries[guess].pts <= target) {
+        return guess;
+    }
+    const FrameIndexEntry* found = std::upper_bound(m_entries, m_entries + guess, target,
+                                                    [](int64_t pts, const FrameIndexEntry& e) { return pts < e.pts; });
+    return (found - m_entries) - 1;
+}
+
+int64_t FrameIndexReader::PreviousKeyframe(int64_t frame) const {
+    for (frame = std::min(frame, m_count - 1); frame >= 0; frame--) {
+        if (m_entries[frame].flags & FRAME_INDEX_KEYFRAME) {
+            return frame;
+        }
+    }
+    return -1;
+}
+
+int64_t FrameIndexReader::NextChange(int64_t frame, uint32_t minTiles) const {
+    for (frame = std::max<int64_t>(frame, 0); frame < m_count; frame++) {
+        if (m_entries[frame].changedTiles >= minTiles) {
+            return frame;
+        }
+    }
+    return -1;
+}
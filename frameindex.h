@@ -0,0 +1,105 @@
+// frameindex.h
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#define FRAME_INDEX_MAGIC 0x58495246u   // "FRIX"
+#define FRAME_INDEX_VERSION 2    // 1 held fragment starts as fragmented MP4 offsets
+#define FRAME_INDEX_EXTENSION ".idx"
+#define FRAME_INDEX_KEYFRAME 0x1
+
+// Sidecar layout: one header, then one fixed-size entry per frame in
+// presentation order, so entry i is the i-th frame shown. Everything is
+// little-endian and naturally aligned, so a reader can map the file and use
+// it in place. While recording, entryCount is 0 and complete is 0; readers
+// then take the count from the file size.
+struct FrameIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t entrySize;
+    int32_t timeBaseNum;     // of pts and dts
+    int32_t timeBaseDen;
+    uint32_t tileSize;       // DAMAGE_TILE_SIZE when written
+    uint32_t tilesPerFrame;
+    int64_t firstCaptureUs;  // av_gettime_relative of the first frame; entry times are relative to it
+    int64_t entryCount;
+    uint32_t complete;
+    uint32_t reserved;
+};
+
+struct FrameIndexEntry {
+    int64_t captureUs;       // when the screen was grabbed
+    int64_t muxUs;           // when the packet was handed to the muxer
+    int64_t pts;
+    int64_t dts;
+    int64_t offset;          // where the muxer put the packet; for MP4, the sample
+                             // data itself, fragmented or not; -1 when unknown
+    uint32_t size;
+    uint32_t flags;          // FRAME_INDEX_KEYFRAME
+    uint32_t changedTiles;   // tiles that differ from the previous captured frame
+    uint32_t segment;        // which segment file holds it; 0 without segmenting
+};
+
+static_assert(sizeof(FrameIndexHeader) == 56, "frame index header layout changed");
+static_assert(sizeof(FrameIndexEntry) == 56, "frame index entry layout changed");
+
+// The sidecar that belongs to an output: same name, FRAME_INDEX_EXTENSION.
+std::string FrameIndexFilename(const std::string& output);
+
+// Writes the sidecar as packets are muxed. Packets arrive in decode order
+// and are held only until no later packet can be shown before them.
+class FrameIndexWriter {
+public:
+    FrameIndexWriter();
+    ~FrameIndexWriter();
+
+    bool Open(const std::string& filename, int timeBaseNum, int timeBaseDen, int tileSize);
+    // Entry times are absolute av_gettime_relative values here
+    bool Add(const FrameIndexEntry& entry, int totalTiles);
+    bool Close();
+
+    const std::string& Filename() const { return m_filename; }
+
+private:
+    bool WritePending(int64_t upToPts);
+
+    std::string m_filename;
+    FILE* m_file;
+    FrameIndexHeader m_header;
+    std::vector<FrameIndexEntry> m_pending;
+    bool m_failed;
+};
+
+// Maps a sidecar read-only. Lookups by frame number are O(1). Lookups by
+// time are O(1) while no frames were skipped, since the frame sits where
+// the constant frame rate puts it; otherwise they binary search below that.
+class FrameIndexReader {
+public:
+    FrameIndexReader();
+    ~FrameIndexReader();
+
+    bool Open(const std::string& filename);
+    void Close();
+
+    const FrameIndexHeader& Header() const { return *m_header; }
+    int64_t Count() const { return m_count; }
+    const FrameIndexEntry& Entry(int64_t frame) const { return m_entries[frame]; }
+    // Last frame shown at or before the given time, or -1 before the first
+    int64_t FindTime(double seconds) const;
+    int64_t PreviousKeyframe(int64_t frame) const;
+    // First frame from the given one on with at least minTiles changed tiles, or -1
+    int64_t NextChange(int64_t frame, uint32_t minTiles) const;
+
+private:
+    intptr_t m_file;
+    intptr_t m_mapping;
+    const uint8_t* m_view;
+    size_t m_viewSize;
+    const FrameIndexHeader* m_header;
+    const FrameIndexEntry* m_entries;
+    int64_t m_count;
+};
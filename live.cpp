@@ -0,0 +1,103 @@
+// live.cpp
+#include "live.h"
+#include "log.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+}
+
+namespace {
+
+struct Deadline {
+    int64_t us;
+};
+
+// Stops blocking reads once the probe is over, even if nothing arrives
+int InterruptAfterDeadline(void* opaque) {
+    return av_gettime_relative() > static_cast<Deadline*>(opaque)->us ? 1 : 0;
+}
+
+} // namespace
+
+bool ProbeLiveStream(const std::string& url, int seconds) {
+    avformat_network_init();
+    Deadline deadline = {av_gettime_relative() + static_cast<int64_t>(LIVE_PROBE_OPEN_TIMEOUT_SECONDS + seconds) * 1000000};
+
+    AVFormatContext* input = avformat_alloc_context();
+    if (!input) {
+        return false;
+    }
+    input->interrupt_callback.callback = InterruptAfterDeadline;
+    input->interrupt_callback.opaque = &deadline;
+    // Hand packets over as they arrive rather than buffering for analysis
+    AVDictionary* options = NULL;
+    av_dict_set(&options, "fflags", "nobuffer", 0);
+    av_dict_set(&options, "probesize", "65536", 0);
+    av_dict_set(&options, "analyzeduration", "500000", 0);
+    int ret = avformat_open_input(&input, url.c_str(), NULL, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        LogDebug("Live probe: could not open " + url);
+        std::cout << "No stream on " << url << std::endl;
+        return false;
+    }
+    avformat_find_stream_info(input, NULL);
+    int videoStream = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (videoStream < 0) {
+        LogDebug("Live probe: no video stream in " + url);
+        avformat_close_input(&input);
+        return false;
+    }
+    AVRational timeBase = input->streams[videoStream]->time_base;
+
+    // Arrival time minus presentation time is constant for a perfectly paced
+    // stream; its spread above the best packet is the jitter a player has to buffer
+    AVPacket* packet = av_packet_alloc();
+    int64_t start = av_gettime_relative();
+    deadline.us = start + static_cast<int64_t>(seconds) * 1000000;
+    int64_t packets = 0, keyframes = 0, bytes = 0, firstArrival = 0;
+    std::vector<double> offsetsMs;
+    while (packet && av_gettime_relative() < deadline.us && av_read_frame(input, packet) >= 0) {
+        if (packet->stream_index == videoStream) {
+            int64_t arrival = av_gettime_relative();
+            if (packets == 0) {
+                firstArrival = arrival - start;
+            }
+            packets++;
+            bytes += packet->size;
+            if (packet->flags & AV_PKT_FLAG_KEY) keyframes++;
+            if (packet->pts != AV_NOPTS_VALUE) {
+                offsetsMs.push_back(arrival / 1000.0 - packet->pts * av_q2d(timeBase) * 1000.0);
+            }
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    avformat_close_input(&input);
+
+    std::stringstream ss;
+    ss << url << ": " << packets << " video packets, " << keyframes << " keyframes, "
+       << (bytes * 8.0 / 1000.0) / seconds << " kbit/s";
+    if (packets > 0) {
+        ss << ", first packet after " << firstArrival / 1000 << " ms";
+    }
+    if (offsetsMs.size() > 1) {
+        double best = *std::min_element(offsetsMs.begin(), offsetsMs.end());
+        for (double& offset : offsetsMs) {
+            offset -= best;
+        }
+        std::sort(offsetsMs.begin(), offsetsMs.end());
+        ss << ", arrival jitter p50 " << offsetsMs[offsetsMs.size() / 2] << " ms, p99 "
+           << offsetsMs[std::min(offsetsMs.size() - 1, offsetsMs.size() * 99 / 100)] << " ms, max "
+           << offsetsMs.back() << " ms";
+    }
+    LogConcise("LiveProbe", ss.str());
+    std::cout << ss.str() << std::endl;
+    return packets > 0;
+}
@@ -0,0 +1,13 @@
+// live.h
+#pragma once
+
+#include <string>
+
+#define LIVE_PROBE_DEFAULT_SECONDS 10
+#define LIVE_PROBE_OPEN_TIMEOUT_SECONDS 10
+
+// Receives a live stream (for example the recorder's own udp:// output on
+// localhost) for a few seconds and reports what arrived: packet and
+// keyframe counts, bitrate and how unevenly packets arrive compared to
+// their timestamps. Prints the report and logs it under "LiveProbe".
+bool ProbeLiveStream(const std::string& url, int seconds);
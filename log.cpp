@@ -0,0 +1,34 @@
+// log.cpp
+#include "log.h"
+
+#include <atomic>
+#include <iostream>
+#include <mutex>
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+namespace {
+std::ofstream logFile("debug.log", std::ios_base::app);
+std::mutex logMutex;
+std::atomic<bool> consoleLog(true);
+}
+
+void LogDebug(const std::string& message) {
+#ifdef _WIN32
+    OutputDebugStringA((message + "\n").c_str());
+#endif
+    std::lock_guard<std::mutex> lock(logMutex);
+    logFile << message << std::endl;
+    logFile.flush();
+#ifdef _DEBUG
+    if (consoleLog) {
+        std::cout << message << std::endl;
+    }
+#endif
+}
+
+void SetConsoleLog(bool enabled) {
+    consoleLog = enabled;
+}
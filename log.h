@@ -0,0 +1,16 @@
+// log.h
+#pragma once
+
+#include <string>
+#include <fstream>
+
+// Appends to debug.log (and the debugger/console); safe to call from any thread.
+void LogDebug(const std::string& message);
+// Stops echoing to the console, for when stdout carries data instead of text.
+void SetConsoleLog(bool enabled);
+
+inline void LogConcise(const std::string& category, const std::string& message) {
+    std::ofstream logFile("concise_debug.log", std::ios_base::app);
+    logFile << "[" << category << "] " << message << std::endl;
+    logFile.close();
+}
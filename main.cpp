@@ -4,6 +4,7 @@
 HWND g_hwnd = NULL;
 HHOOK g_hook = NULL;
 ScreenRecorder* g_recorder = nullptr;
+MetricsServer g_metricsServer;
 
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
     switch (uMsg) {
@@ -42,6 +43,43 @@ HWND CreateOverlayWindow(HINSTANCE hInstance) {
     return hwnd;
 }
 
+// Start of the "--name" or "--name=value" token on the command line, matched
+// whole so "--gif" is not found in "--gif-webp" or "--replay" in "--replay-seconds=10"
+const char* FindCommandLineSwitch(const char* cmdLine, const char* name) {
+    if (!cmdLine) {
+        return nullptr;
+    }
+    size_t length = strlen(name);
+    for (const char* found = strstr(cmdLine, name); found; found = strstr(found + 1, name)) {
+        bool starts = found == cmdLine || found[-1] == ' ';
+        bool ends = found[length] == '\0' || found[length] == ' ' || found[length] == '=';
+        if (starts && ends) {
+            return found;
+        }
+    }
+    return nullptr;
+}
+
+// Whether the switch is there, with or without a value
+bool CommandLineFlag(const char* cmdLine, const char* name) {
+    return FindCommandLineSwitch(cmdLine, name) != nullptr;
+}
+
+// Value of a "--name=value" switch up to the next space, or fallback when absent
+std::string CommandLineString(const char* cmdLine, const char* name, const std::string& fallback) {
+    const char* found = FindCommandLineSwitch(cmdLine, name);
+    if (!found || found[strlen(name)] != '=') {
+        return fallback;
+    }
+    std::string value = found + strlen(name) + 1;
+    return value.substr(0, value.find(' '));
+}
+
+long long CommandLineValue(const char* cmdLine, const char* name, long long fallback) {
+    std::string value = CommandLineString(cmdLine, name, std::string());
+    return value.empty() ? fallback : atoll(value.c_str());
+}
+
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nShowCmd) {\
     // Check DPI awareness
     DPI_AWARENESS_CONTEXT context = GetThreadDpiAwarenessContext();
@@ -94,7 +132,67 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         return 0;
     }
 
+    RegisterProbes();
     g_recorder = new ScreenRecorder();
+    if (CommandLineFlag(lpCmdLine, "--intermediate")) {
+        g_recorder->SetLosslessIntermediate(true);
+    }
+    std::string url = CommandLineString(lpCmdLine, "--live", std::string());
+    if (!url.empty()) {
+        // Streams alongside the file outputs, e.g. --live=udp://192.168.1.20:5000
+        std::vector<EncoderProfile> profiles = DefaultEncoderProfiles();
+        profiles.push_back(LiveEncoderProfile(url, ScreenRecorder::FRAME_RATE));
+        avformat_network_init();
+        g_recorder->SetEncoderProfiles(profiles);
+    }
+    SegmentPolicy segments;
+    segments.durationSeconds = static_cast<int>(CommandLineValue(lpCmdLine, "--segment-seconds", 0));
+    segments.maxBytes = CommandLineValue(lpCmdLine, "--segment-max-mb", 0) * 1024 * 1024;
+    segments.maxSegments = static_cast<int>(CommandLineValue(lpCmdLine, "--keep-segments", 0));
+    segments.maxTotalBytes = CommandLineValue(lpCmdLine, "--keep-mb", 0) * 1024 * 1024;
+    g_recorder->SetSegmentPolicy(segments);
+    g_recorder->SetAutoTrim(static_cast<int>(CommandLineValue(lpCmdLine, "--trim-head-ms", 0)),
+                            static_cast<int>(CommandLineValue(lpCmdLine, "--trim-tail-ms", 0)));
+    g_recorder->SetThumbnails(CommandLineFlag(lpCmdLine, "--no-thumbnails") ? 0 :
+                              static_cast<int>(CommandLineValue(lpCmdLine, "--thumbnail-seconds", THUMBNAIL_DEFAULT_SECONDS)),
+                              CommandLineFlag(lpCmdLine, "--thumbnails-webp"));
+    bool gifWebp = CommandLineFlag(lpCmdLine, "--gif-webp");
+    if (gifWebp || CommandLineFlag(lpCmdLine, "--gif")) {
+        // --gif or --gif=<seconds>; --gif-webp[=<seconds>] writes an animated WebP instead
+        g_recorder->SetAnimationExport(static_cast<int>(CommandLineValue(lpCmdLine, gifWebp ? "--gif-webp" : "--gif",
+                                                                         ANIMATION_DEFAULT_SECONDS)),
+                                       gifWebp);
+    }
+    if (CommandLineFlag(lpCmdLine, "--trace")) {
+        StartTrace();
+    }
+    g_recorder->SetStageSummary(!CommandLineFlag(lpCmdLine, "--no-stats"));
+    if (CommandLineFlag(lpCmdLine, "--verify-quality")) {
+        // --verify-quality or --verify-quality=<profile name>; the first profile by default
+        g_recorder->SetQualityVerification(CommandLineString(lpCmdLine, "--verify-quality", DefaultEncoderProfiles()[0].name));
+    }
+    // A code block in the region's corner that --analyze-latency reads back from the file
+    g_recorder->SetFrameCode(CommandLineFlag(lpCmdLine, "--frame-code"));
+    if (CommandLineFlag(lpCmdLine, "--metrics")) {
+        // --metrics or --metrics=<port>; scrape http://127.0.0.1:<port>/metrics
+        g_metricsServer.Start(static_cast<int>(CommandLineValue(lpCmdLine, "--metrics", METRICS_DEFAULT_PORT)));
+    }
+    if (CommandLineFlag(lpCmdLine, "--dump-frames")) {
+        // --dump-frames or --dump-frames=<every Nth frame>; --dump-png for PNG instead of QOI
+        g_recorder->SetFrameDump(static_cast<int>(CommandLineValue(lpCmdLine, "--dump-frames", FRAMEDUMP_DEFAULT_EVERY)),
+                                 CommandLineFlag(lpCmdLine, "--dump-png") ? FRAMEDUMP_PNG : FRAMEDUMP_QOI);
+    }
+    if (CommandLineFlag(lpCmdLine, "--share-frames")) {
+        g_recorder->SetFrameSharing(CommandLineString(lpCmdLine, "--share-frames", SHMRING_DEFAULT_NAME));
+    }
+    std::string rawTarget = CommandLineString(lpCmdLine, "--raw-output", std::string());
+    if (!rawTarget.empty()) {
+        // The target runs to the next space; "-" is stdout
+        g_recorder->SetRawOutput(rawTarget, CommandLineFlag(lpCmdLine, "--raw-planar") ? RAW_FORMAT_PLANAR : RAW_FORMAT_Y4M);
+    } else if (CommandLineFlag(lpCmdLine, "--replay")) {
+        g_recorder->SetReplayMode(static_cast<int>(CommandLineValue(lpCmdLine, "--replay-seconds", REPLAY_DEFAULT_SECONDS)),
+                                  CommandLineValue(lpCmdLine, "--replay-mb", REPLAY_DEFAULT_MAX_BYTES / (1024 * 1024)) * 1024 * 1024);
+    }
     HWND overlayWindow = CreateOverlayWindow(hInstance);
     g_recorder->SetOverlayWindow(overlayWindow);
     if (g_recorder->GetOverlayWindow() == NULL) {
@@ -128,10 +226,47 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     }
 
     delete g_recorder;
+    UnregisterProbes();
 
     return (int)msg.wParam;
 }
 
+// Offline tools that run without the recorder UI
+int RunCommandLineTool(int argc, char* argv[]) {
+    if (strcmp(argv[1], "--trim") == 0 && argc >= 6) {
+        bool smartCut = !(argc > 6 && strcmp(argv[6], "--keyframes-only") == 0);
+        bool ok = TrimRecording(argv[2], argv[3], atof(argv[4]), atof(argv[5]), smartCut);
+        std::cout << (ok ? "Trimmed to " : "Failed to trim ") << argv[3] << std::endl;
+        return ok ? 0 : 1;
+    }
+    if (strcmp(argv[1], "--concat") == 0 && argc >= 4) {
+        std::vector<std::string> inputs(argv + 3, argv + argc);
+        bool ok = ConcatRecordings(inputs, argv[2]);
+        std::cout << (ok ? "Concatenated into " : "Failed to concatenate into ") << argv[2] << std::endl;
+        return ok ? 0 : 1;
+    }
+    if (strcmp(argv[1], "--probe-live") == 0 && argc >= 3) {
+        int seconds = argc > 3 ? atoi(argv[3]) : LIVE_PROBE_DEFAULT_SECONDS;
+        return ProbeLiveStream(argv[2], seconds > 0 ? seconds : LIVE_PROBE_DEFAULT_SECONDS) ? 0 : 1;
+    }
+    if (strcmp(argv[1], "--analyze-latency") == 0 && argc >= 3) {
+        FrameCodeReport report;
+        bool ok = AnalyzeFrameCodes(argv[2], report) && WriteLatencyReport(argv[2], report);
+        std::cout << (ok ? "Wrote " : "Found no frame codes for ") << LatencyFilename(argv[2]) << std::endl;
+        return ok ? 0 : 1;
+    }
+    std::cout << "Usage:\n"
+              << "  ScreenRecorder --trim <input> <output> <start seconds> <end seconds, 0 = end, negative = from end> [--keyframes-only]\n"
+              << "  ScreenRecorder --concat <output> <input> <input>...\n"
+              << "  ScreenRecorder --probe-live <url, e.g. udp://127.0.0.1:5000> [seconds]\n"
+              << "  ScreenRecorder --analyze-latency <recording made with --frame-code>\n";
+    return 2;
+}
+
 int main(int argc, char* argv[]) {
+    if (argc > 1 && (strcmp(argv[1], "--trim") == 0 || strcmp(argv[1], "--concat") == 0 ||
+                     strcmp(argv[1], "--probe-live") == 0 || strcmp(argv[1], "--analyze-latency") == 0)) {
+        return RunCommandLineTool(argc, argv);
+    }
     return WinMain(GetModuleHandle(NULL), NULL, GetCommandLineA(), SW_SHOWDEFAULT);
 }
\ No newline at end of file
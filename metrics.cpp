@@ -0,0 +1,374 @@
+// metrics.cpp
+#include "metrics.h"
+#include "log.h"
+#include "stats.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+#define METRICS_REQUEST_MAX 4096
+#define METRICS_POLL_MS 250          // how soon Stop is noticed
+#define METRICS_READ_TIMEOUT_MS 1000 // a client that sends nothing is dropped after this
+
+// A scraper that hangs up mid-response must not raise SIGPIPE
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;
+#endif
+
+std::string Label(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+void Header(std::ostream& out, const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+void ClearWorker(WorkerMetrics& worker) {
+    worker.submitted = 0;
+    worker.dropped = 0;
+    worker.processed = 0;
+    worker.queueDepth = 0;
+    worker.bytesWritten = 0;
+    worker.bitRate = 0;
+}
+
+void CloseSocket(intptr_t socket) {
+#ifdef _WIN32
+    closesocket(static_cast<SOCKET>(socket));
+#else
+    close(static_cast<int>(socket));
+#endif
+}
+
+} // namespace
+
+int64_t ResidentBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return static_cast<int64_t>(counters.WorkingSetSize);
+    }
+    return 0;
+#else
+    FILE* file = fopen("/proc/self/statm", "r");
+    long long size = 0, resident = 0;
+    if (!file) {
+        return 0;
+    }
+    int fields = fscanf(file, "%lld %lld", &size, &resident);
+    fclose(file);
+    return fields == 2 ? resident * sysconf(_SC_PAGESIZE) : 0;
+#endif
+}
+
+PipelineMetrics& PipelineMetrics::Instance() {
+    static PipelineMetrics instance;
+    return instance;
+}
+
+PipelineMetrics::PipelineMetrics()
+        : recording(0), framesCaptured(0), captureFps(0.0), qualityStep(0), m_workerCount(0), m_lastCaptureUs(0) {
+    for (int i = 0; i < METRICS_MAX_WORKERS; i++) {
+        ClearWorker(m_workers[i]);
+    }
+    ClearWorker(m_overflow);
+}
+
+WorkerMetrics* PipelineMetrics::Worker(const std::string& name) {
+    std::lock_guard<std::mutex> lock(m_addMutex);
+    int count = m_workerCount.load(std::memory_order_relaxed);
+    for (int i = 0; i < count; i++) {
+        if (m_workers[i].name == name) {
+            return &m_workers[i];
+        }
+    }
+    if (count == METRICS_MAX_WORKERS) {
+        return &m_overflow;
+    }
+    // The name is in place before the count lets readers see the slot
+    m_workers[count].name = name;
+    m_workerCount.store(count + 1, std::memory_order_release);
+    return &m_workers[count];
+}
+
+void PipelineMetrics::FrameCaptured(int64_t captureUs) {
+    framesCaptured.fetch_add(1, std::memory_order_relaxed);
+    int64_t last = m_lastCaptureUs.exchange(captureUs, std::memory_order_relaxed);
+    if (last > 0 && captureUs > last) {
+        // Only the capture thread writes this, so load and store are enough
+        double fps = 1000000.0 / (captureUs - last);
+        double smoothed = captureFps.load(std::memory_order_relaxed);
+        captureFps.store(smoothed > 0.0 ? smoothed * 0.9 + fps * 0.1 : fps, std::memory_order_relaxed);
+    }
+}
+
+std::string PipelineMetrics::Exposition() const {
+    std::stringstream out;
+    Header(out, "screenrecorder_recording", "gauge", "1 while a recording is running.");
+    out << "screenrecorder_recording " << recording.load(std::memory_order_relaxed) << "\n";
+    Header(out, "screenrecorder_frames_captured_total", "counter", "Frames captured and handed to the pipeline.");
+    out << "screenrecorder_frames_captured_total " << framesCaptured.load(std::memory_order_relaxed) << "\n";
+    Header(out, "screenrecorder_capture_fps", "gauge", "Smoothed capture rate of the current recording.");
+    out << "screenrecorder_capture_fps " << (recording.load(std::memory_order_relaxed) ?
+                                               captureFps.load(std::memory_order_relaxed) : 0.0) << "\n";
+    Header(out, "screenrecorder_quality_step", "gauge", "Rate-control step the adaptive quality controller applies.");
+    out << "screenrecorder_quality_step " << qualityStep.load(std::memory_order_relaxed) << "\n";
+
+    int count = m_workerCount.load(std::memory_order_acquire);
+    struct WorkerSeries {
+        const char* name;
+        const char* type;
+        const char* help;
+        std::atomic<int64_t> WorkerMetrics::*value;
+        bool outputsOnly;
+    };
+    const WorkerSeries series[] = {
+        {"screenrecorder_worker_frames_submitted_total", "counter", "Frames offered to a consumer.", &WorkerMetrics::submitted, false},
+        {"screenrecorder_worker_frames_dropped_total", "counter", "Frames a consumer's full queue turned away.", &WorkerMetrics::dropped, false},
+        {"screenrecorder_worker_frames_processed_total", "counter", "Frames a consumer finished.", &WorkerMetrics::processed, false},
+        {"screenrecorder_worker_queue_depth", "gauge", "Frames waiting for a consumer.", &WorkerMetrics::queueDepth, false},
+        {"screenrecorder_output_bytes_total", "counter", "Encoded bytes handed to an output.", &WorkerMetrics::bytesWritten, true},
+        {"screenrecorder_output_bitrate_bps", "gauge", "Output bitrate over the last second.", &WorkerMetrics::bitRate, true},
+    };
+    for (const WorkerSeries& s : series) {
+        Header(out, s.name, s.type, s.help);
+        for (int i = 0; i < count; i++) {
+            const WorkerMetrics& worker = m_workers[i];
+            if (s.outputsOnly && worker.bytesWritten.load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+            out << s.name << "{worker=\"" << Label(worker.name) << "\"} "
+                << (worker.*s.value).load(std::memory_order_relaxed) << "\n";
+        }
+    }
+
+    Header(out, "screenrecorder_stage_latency_seconds", "summary", "Per-stage latency of the current recording.");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        LatencySummary summary = StageStats::Instance().Stage(static_cast<PipelineStage>(stage)).Summary();
+        const char* name = StageName(static_cast<PipelineStage>(stage));
+        const double quantiles[3][2] = {{0.5, summary.p50Ms}, {0.9, summary.p90Ms}, {0.99, summary.p99Ms}};
+        for (const auto& quantile : quantiles) {
+            out << "screenrecorder_stage_latency_seconds{stage=\"" << name << "\",quantile=\"" << quantile[0]
+                << "\"} " << quantile[1] / 1000.0 << "\n";
+        }
+        out << "screenrecorder_stage_latency_seconds_sum{stage=\"" << name << "\"} "
+            << summary.meanMs * summary.count / 1000.0 << "\n";
+        out << "screenrecorder_stage_latency_seconds_count{stage=\"" << name << "\"} " << summary.count << "\n";
+    }
+
+    Header(out, "process_resident_memory_bytes", "gauge", "Resident memory size in bytes.");
+    out << "process_resident_memory_bytes " << ResidentBytes() << "\n";
+    return out.str();
+}
+
+MetricsServer::MetricsServer() : m_socket(-1), m_running(false) {
+}
+
+MetricsServer::~MetricsServer() {
+    Stop();
+}
+
+bool MetricsServer::Start(int port) {
+    Stop();
+#ifdef _WIN32
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+        LogDebug("Metrics: could not start Winsock");
+        return false;
+    }
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) {
+        LogDebug("Metrics: could not create a socket");
+        WSACleanup();
+        return false;
+    }
+    BOOL exclusive = TRUE;
+    setsockopt(listener, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, reinterpret_cast<const char*>(&exclusive), sizeof(exclusive));
+#else
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        LogDebug("Metrics: could not create a socket");
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+    m_socket = static_cast<intptr_t>(listener);
+
+    // Loopback only; the numbers are for local tools, not the network
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 4) != 0) {
+        LogDebug("Metrics: could not listen on 127.0.0.1:" + std::to_string(port));
+        CloseSocket(m_socket);
+        m_socket = -1;
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return false;
+    }
+    m_running = true;
+    m_thread = std::thread(&MetricsServer::Run, this);
+    LogDebug("Metrics: serving http://127.0.0.1:" + std::to_string(port) + "/metrics");
+    return true;
+}
+
+void MetricsServer::Stop() {
+    m_running = false;
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    if (m_socket != -1) {
+        CloseSocket(m_socket);
+        m_socket = -1;
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+}
+
+void MetricsServer::Run() {
+    while (m_running) {
+        // Polling with a timeout lets Stop end the thread without another connection
+        fd_set readable;
+        FD_ZERO(&readable);
+#ifdef _WIN32
+        SOCKET listener = static_cast<SOCKET>(m_socket);
+#else
+        int listener = static_cast<int>(m_socket);
+#endif
+        FD_SET(listener, &readable);
+        timeval timeout = {0, METRICS_POLL_MS * 1000};
+        int ready = select(static_cast<int>(m_socket + 1), &readable, NULL, NULL, &timeout);
+        if (ready <= 0) {
+            continue;
+        }
+#ifdef _WIN32
+        SOCKET client = accept(listener, NULL, NULL);
+        if (client == INVALID_SOCKET) continue;
+#else
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) continue;
+#endif
+        Serve(static_cast<intptr_t>(client));
+        CloseSocket(static_cast<intptr_t>(client));
+    }
+}
+
+void MetricsServer::Serve(intptr_t client) {
+#ifdef _WIN32
+    SOCKET socket = static_cast<SOCKET>(client);
+    DWORD timeout = METRICS_READ_TIMEOUT_MS;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+#else
+    int socket = static_cast<int>(client);
+    timeval timeout = {METRICS_READ_TIMEOUT_MS / 1000, (METRICS_READ_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+    int noSignal = 1;
+    setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &noSignal, sizeof(noSignal));
+#endif
+#endif
+    // Only the request line matters; read until the headers end
+    std::string request;
+    char buffer[1024];
+    while (request.size() < METRICS_REQUEST_MAX && request.find("\r\n\r\n") == std::string::npos) {
+        int received = static_cast<int>(recv(socket, buffer, sizeof(buffer), 0));
+        if (received <= 0) break;
+        request.append(buffer, received);
+    }
+
+    std::string status = "200 OK";
+    std::string body;
+    if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0) {
+        body = PipelineMetrics::Instance().Exposition();
+    } else {
+        status = "404 Not Found";
+        body = "Try /metrics\n";
+    }
+    std::string response = "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+        int count = static_cast<int>(send(socket, response.data() + sent, static_cast<int>(response.size() - sent), SEND_FLAGS));
+        if (count <= 0) break;
+        sent += count;
+    }
+}
+
+std::string FetchMetrics(int port, bool hangUp) {
+#ifdef _WIN32
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+        return std::string();
+    }
+    SOCKET client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    bool opened = client != INVALID_SOCKET;
+#else
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    bool opened = client >= 0;
+#endif
+    std::string response;
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (opened && connect(client, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+        std::string request = "GET /metrics HTTP/1.0\r\nHost: 127.0.0.1\r\n\r\n";
+        bool sent = send(client, request.data(), static_cast<int>(request.size()), SEND_FLAGS) ==
+                    static_cast<int>(request.size());
+        if (hangUp) {
+            // Closing with a zero linger sends a reset rather than a FIN
+            linger reset = {1, 0};
+            setsockopt(client, SOL_SOCKET, SO_LINGER, reinterpret_cast<const char*>(&reset), sizeof(reset));
+        } else if (sent) {
+            char buffer[4096];
+            int received;
+            while ((received = static_cast<int>(recv(client, buffer, sizeof(buffer), 0))) > 0) {
+                response.append(buffer, received);
+            }
+        }
+    }
+    if (opened) {
+        CloseSocket(static_cast<intptr_t>(client));
+    }
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return response;
+}
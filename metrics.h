@@ -0,0 +1,84 @@
+// metrics.h
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define METRICS_MAX_WORKERS 32
+#define METRICS_DEFAULT_PORT 9464
+#define METRICS_BITRATE_WINDOW_US 1000000   // outputs report the bitrate of the last second
+
+// Resident set size of this process, 0 if it cannot be read
+int64_t ResidentBytes();
+
+// Counters of one frame consumer, found by name. Slots are never freed or
+// renamed, so a worker of the same name in the next recording carries on
+// with the same counters, as Prometheus expects of a counter.
+struct WorkerMetrics {
+    std::string name;
+    std::atomic<int64_t> submitted;
+    std::atomic<int64_t> dropped;
+    std::atomic<int64_t> processed;
+    std::atomic<int64_t> queueDepth;
+    std::atomic<int64_t> bytesWritten;   // outputs only
+    std::atomic<int64_t> bitRate;        // outputs only, over METRICS_BITRATE_WINDOW_US
+};
+
+// Live numbers of the pipeline. Everything the hot path touches is a relaxed
+// atomic; the only lock is taken when a worker looks up its slot at startup.
+class PipelineMetrics {
+public:
+    static PipelineMetrics& Instance();
+
+    // Takes a lock; call once per worker, not per frame
+    WorkerMetrics* Worker(const std::string& name);
+    // Called by the capture thread for every frame it keeps
+    void FrameCaptured(int64_t captureUs);
+
+    std::atomic<int> recording;
+    std::atomic<int64_t> framesCaptured;
+    std::atomic<double> captureFps;      // smoothed over the last frames
+    std::atomic<int64_t> qualityStep;
+
+    // Prometheus text exposition of everything above, the stage histograms
+    // and the process RSS
+    std::string Exposition() const;
+
+private:
+    PipelineMetrics();
+
+    std::mutex m_addMutex;
+    WorkerMetrics m_workers[METRICS_MAX_WORKERS];
+    WorkerMetrics m_overflow;            // shared by workers past the limit, not exported
+    std::atomic<int> m_workerCount;
+    std::atomic<int64_t> m_lastCaptureUs;
+};
+
+// Serves PipelineMetrics::Exposition over HTTP on 127.0.0.1, one request per
+// connection, from its own thread:
+//     curl http://127.0.0.1:9464/metrics
+class MetricsServer {
+public:
+    MetricsServer();
+    ~MetricsServer();
+
+    bool Start(int port);
+    void Stop();
+
+private:
+    void Run();
+    void Serve(intptr_t client);
+
+    intptr_t m_socket;   // SOCKET on Windows, descriptor elsewhere; -1 when closed
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+};
+
+// Requests /metrics from a MetricsServer on 127.0.0.1 as a scraper would and
+// returns the whole HTTP response, empty on failure. With hangUp the
+// connection is reset right after the request instead, like a scraper that
+// gave up; the server has to shrug that off.
+std::string FetchMetrics(int port, bool hangUp);
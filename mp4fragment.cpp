@@ -0,0 +1,180 @@
+// mp4fragment.cpp
+#include "mp4fragment.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace {
+
+// ISO/IEC 14496-12 flags of the boxes that describe a fragment's samples
+const uint32_t TFHD_BASE_DATA_OFFSET = 0x000001;
+const uint32_t TFHD_SAMPLE_DESCRIPTION_INDEX = 0x000002;
+const uint32_t TFHD_DEFAULT_DURATION = 0x000008;
+const uint32_t TFHD_DEFAULT_SIZE = 0x000010;
+const uint32_t TRUN_DATA_OFFSET = 0x000001;
+const uint32_t TRUN_FIRST_SAMPLE_FLAGS = 0x000004;
+const uint32_t TRUN_DURATION = 0x000100;
+const uint32_t TRUN_SIZE = 0x000200;
+const uint32_t TRUN_FLAGS = 0x000400;
+const uint32_t TRUN_COMPOSITION_OFFSET = 0x000800;
+
+uint32_t ReadBE32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+uint64_t ReadBE64(const uint8_t* p) {
+    return (static_cast<uint64_t>(ReadBE32(p)) << 32) | ReadBE32(p + 4);
+}
+
+// Calls visit(type, payload, payloadSize) for each child box in [data, data + size)
+template <typename Visit>
+void ForEachBox(const uint8_t* data, size_t size, Visit visit) {
+    size_t position = 0;
+    while (position + 8 <= size) {
+        size_t boxSize = ReadBE32(data + position);
+        if (boxSize < 8 || boxSize > size - position) {
+            return;
+        }
+        visit(data + position + 4, data + position + 8, boxSize - 8);
+        position += boxSize;
+    }
+}
+
+} // namespace
+
+FragmentSampleLocator::FragmentSampleLocator()
+        : m_position(0), m_boxStart(0), m_boxSize(0), m_boxRead(0), m_keepBox(false), m_lost(false) {
+}
+
+void FragmentSampleLocator::OnWrite(int64_t offset, const uint8_t* data, int size) {
+    if (m_lost) {
+        return;
+    }
+    if (offset != m_position) {
+        Lose("the muxer seeked");
+        return;
+    }
+    m_position += size;
+
+    while (size > 0) {
+        if (m_boxSize == 0) {
+            // The header is 8 bytes, or 16 when a size of 1 says a 64-bit size follows
+            size_t headerSize = m_box.size() >= 8 && ReadBE32(m_box.data()) == 1 ? 16 : 8;
+            size_t count = std::min(static_cast<size_t>(size), headerSize - m_box.size());
+            m_box.insert(m_box.end(), data, data + count);
+            data += count;
+            size -= static_cast<int>(count);
+            m_boxRead += count;
+            headerSize = m_box.size() >= 8 && ReadBE32(m_box.data()) == 1 ? 16 : 8;
+            if (m_box.size() < headerSize) {
+                continue;
+            }
+            uint32_t size32 = ReadBE32(m_box.data());
+            if (size32 == 1) {
+                m_boxSize = static_cast<int64_t>(ReadBE64(m_box.data() + 8));
+            } else if (size32 == 0) {
+                m_boxSize = std::numeric_limits<int64_t>::max();   // runs to the end of the file
+            } else {
+                m_boxSize = size32;
+            }
+            if (m_boxSize < static_cast<int64_t>(headerSize)) {
+                Lose("bad box size");
+                return;
+            }
+            m_keepBox = memcmp(m_box.data() + 4, "moof", 4) == 0 && m_boxSize <= MP4_MAX_MOOF_SIZE;
+        } else {
+            size_t count = static_cast<size_t>(std::min(static_cast<int64_t>(size), m_boxSize - m_boxRead));
+            if (m_keepBox) {
+                m_box.insert(m_box.end(), data, data + count);
+            }
+            data += count;
+            size -= static_cast<int>(count);
+            m_boxRead += count;
+        }
+        if (m_boxRead == m_boxSize) {
+            if (m_keepBox) {
+                ParseMoof();
+            }
+            m_boxStart += m_boxSize;
+            m_boxSize = 0;
+            m_boxRead = 0;
+            m_box.clear();
+        }
+    }
+}
+
+void FragmentSampleLocator::ParseMoof() {
+    // Sample data offsets in a traf count from the moof (default-base-is-moof,
+    // or no base at all in the first traf) unless tfhd gives an absolute base
+    int64_t nextData = -1;
+    ForEachBox(m_box.data() + 8, m_box.size() - 8, [&](const uint8_t* type, const uint8_t* traf, size_t trafSize) {
+        if (memcmp(type, "traf", 4) != 0) {
+            return;
+        }
+        int64_t base = m_boxStart;
+        uint32_t defaultSize = 0;
+        ForEachBox(traf, trafSize, [&](const uint8_t* childType, const uint8_t* box, size_t boxSize) {
+            if (boxSize < 8) {
+                return;
+            }
+            uint32_t flags = ReadBE32(box) & 0xFFFFFF;
+            if (memcmp(childType, "tfhd", 4) == 0) {
+                const uint8_t* p = box + 8;
+                const uint8_t* end = box + boxSize;
+                if ((flags & TFHD_BASE_DATA_OFFSET) && p + 8 <= end) {
+                    base = static_cast<int64_t>(ReadBE64(p));
+                    p += 8;
+                }
+                if (flags & TFHD_SAMPLE_DESCRIPTION_INDEX) p += 4;
+                if (flags & TFHD_DEFAULT_DURATION) p += 4;
+                if ((flags & TFHD_DEFAULT_SIZE) && p + 4 <= end) {
+                    defaultSize = ReadBE32(p);
+                }
+            } else if (memcmp(childType, "trun", 4) == 0) {
+                uint32_t count = ReadBE32(box + 4);
+                const uint8_t* p = box + 8;
+                const uint8_t* end = box + boxSize;
+                int64_t data = nextData >= 0 ? nextData : base;
+                if (flags & TRUN_DATA_OFFSET) {
+                    if (p + 4 > end) return;
+                    data = base + static_cast<int32_t>(ReadBE32(p));
+                    p += 4;
+                }
+                if (flags & TRUN_FIRST_SAMPLE_FLAGS) p += 4;
+                size_t entrySize = 4 * (((flags & TRUN_DURATION) ? 1 : 0) + ((flags & TRUN_SIZE) ? 1 : 0) +
+                                        ((flags & TRUN_FLAGS) ? 1 : 0) + ((flags & TRUN_COMPOSITION_OFFSET) ? 1 : 0));
+                for (uint32_t i = 0; i < count && p + entrySize <= end; i++) {
+                    if (flags & TRUN_DURATION) p += 4;
+                    uint32_t size = defaultSize;
+                    if (flags & TRUN_SIZE) {
+                        size = ReadBE32(p);
+                        p += 4;
+                    }
+                    if (flags & TRUN_FLAGS) p += 4;
+                    if (flags & TRUN_COMPOSITION_OFFSET) p += 4;
+                    m_samples.emplace_back(data, size);
+                    data += size;
+                }
+                nextData = data;
+            }
+        });
+    });
+}
+
+bool FragmentSampleLocator::NextSample(int64_t& offset, uint32_t& size) {
+    if (m_samples.empty()) {
+        return false;
+    }
+    offset = m_samples.front().first;
+    size = m_samples.front().second;
+    m_samples.pop_front();
+    return true;
+}
+
+void FragmentSampleLocator::Lose(const char* reason) {
+    LogDebug(std::string("Fragment sample positions unavailable: ") + reason);
+    m_lost = true;
+}
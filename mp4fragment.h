@@ -0,0 +1,44 @@
+// mp4fragment.h
+#pragma once
+
+#include "writer.h"
+
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#define MP4_MAX_MOOF_SIZE (1024 * 1024)   // a moof this recorder writes lists a few hundred samples at most
+
+// Follows a fragmented MP4 as the muxer writes it and reports where each
+// sample's data landed, in decode order. A fragment's moof comes before its
+// mdat and lists every sample size, so positions are known as soon as the
+// fragment reaches the writer, without reading anything back. The muxer may
+// resize samples (Annex B start codes become length prefixes), which is why
+// packet sizes cannot be summed instead.
+//
+// Only sequential output can be followed; a write that does not continue the
+// previous one marks the locator lost, and no more samples are reported.
+class FragmentSampleLocator : public WriteObserver {
+public:
+    FragmentSampleLocator();
+
+    void OnWrite(int64_t offset, const uint8_t* data, int size) override;
+    // Position and size of the next sample in decode order; false until the
+    // fragment holding it has been written
+    bool NextSample(int64_t& offset, uint32_t& size);
+    bool Lost() const { return m_lost; }
+
+private:
+    void ParseMoof();
+    void Lose(const char* reason);
+
+    int64_t m_position;           // where the next write has to start
+    int64_t m_boxStart;
+    int64_t m_boxSize;            // 0 until the header is complete
+    int64_t m_boxRead;
+    bool m_keepBox;               // gathering a whole moof rather than skipping
+    std::vector<uint8_t> m_box;   // the header, then the rest of a moof
+    std::deque<std::pair<int64_t, uint32_t>> m_samples;
+    bool m_lost;
+};
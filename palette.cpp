@@ -0,0 +1,266 @@
+// palette.cpp
+#include "palette.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PALETTE_USE_SSE2 1
+#endif
+
+namespace {
+
+#define HISTOGRAM_CHUNK_PIXELS 65536   // work unit when spreading spans over threads
+
+const uint8_t BAYER[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+// Spreads the threshold over one 5-bit quantisation step: -4..3
+inline int Bias(int x, int y) {
+    return BAYER[y & 7][x & 7] / 8 - 4;
+}
+
+inline uint32_t Bin(uint8_t b, uint8_t g, uint8_t r) {
+    return (b >> 3) | ((g >> 3) << 5) | (static_cast<uint32_t>(r >> 3) << 10);
+}
+
+inline int Expand5(int v) {
+    return (v << 3) | (v >> 2);
+}
+
+inline int Clamp8(int v) {
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+struct BinCount {
+    uint16_t bin;
+    uint32_t count;
+};
+
+inline int Channel(uint16_t bin, int channel) {
+    return (bin >> (channel * 5)) & 31;
+}
+
+struct Box {
+    size_t begin;
+    size_t end;
+    uint64_t weight;
+    int low[3];
+    int high[3];
+
+    int LongestChannel() const {
+        int best = 0;
+        for (int c = 1; c < 3; c++) {
+            if (high[c] - low[c] > high[best] - low[best]) best = c;
+        }
+        return best;
+    }
+    int Extent() const {
+        int c = LongestChannel();
+        return high[c] - low[c];
+    }
+};
+
+Box MakeBox(const std::vector<BinCount>& bins, size_t begin, size_t end) {
+    Box box = {begin, end, 0, {31, 31, 31}, {0, 0, 0}};
+    for (size_t i = begin; i < end; i++) {
+        box.weight += bins[i].count;
+        for (int c = 0; c < 3; c++) {
+            box.low[c] = std::min(box.low[c], Channel(bins[i].bin, c));
+            box.high[c] = std::max(box.high[c], Channel(bins[i].bin, c));
+        }
+    }
+    return box;
+}
+
+} // namespace
+
+void BuildHistogram(const std::vector<PixelSpan>& spans, int threads, std::vector<uint32_t>& histogram) {
+    // Long spans are cut into chunks so a few big frames still spread out
+    std::vector<PixelSpan> chunks;
+    for (const PixelSpan& span : spans) {
+        for (size_t first = 0; first < span.pixels; first += HISTOGRAM_CHUNK_PIXELS) {
+            size_t pixels = std::min<size_t>(HISTOGRAM_CHUNK_PIXELS, span.pixels - first);
+            chunks.push_back(PixelSpan{span.bgra + first * 4, pixels});
+        }
+    }
+
+    threads = std::max(1, std::min(ThreadCount(threads), static_cast<int>(chunks.size())));
+    std::vector<std::vector<uint32_t>> partial(threads, std::vector<uint32_t>(PALETTE_HISTOGRAM_BINS, 0));
+    ParallelRanges(threads, threads, [&](int firstThread, int lastThread) {
+        for (int t = firstThread; t < lastThread; t++) {
+            uint32_t* counts = partial[t].data();
+            for (size_t c = t; c < chunks.size(); c += threads) {
+                const uint8_t* p = chunks[c].bgra;
+                for (size_t i = 0; i < chunks[c].pixels; i += PALETTE_SAMPLE_STEP) {
+                    counts[Bin(p[i * 4], p[i * 4 + 1], p[i * 4 + 2])]++;
+                }
+            }
+        }
+    });
+
+    histogram.assign(PALETTE_HISTOGRAM_BINS, 0);
+    for (const std::vector<uint32_t>& counts : partial) {
+        for (size_t i = 0; i < PALETTE_HISTOGRAM_BINS; i++) {
+            histogram[i] += counts[i];
+        }
+    }
+}
+
+Palette MedianCutPalette(const std::vector<uint32_t>& histogram, int maxColors) {
+    Palette palette = {};
+    maxColors = std::max(1, std::min(maxColors, PALETTE_MAX_COLORS));
+
+    std::vector<BinCount> bins;
+    for (size_t i = 0; i < histogram.size() && i < PALETTE_HISTOGRAM_BINS; i++) {
+        if (histogram[i] > 0) bins.push_back(BinCount{static_cast<uint16_t>(i), histogram[i]});
+    }
+    if (bins.empty()) {
+        palette.colors[0] = 0xFF000000u;
+        palette.count = 1;
+        return palette;
+    }
+
+    std::vector<Box> boxes;
+    boxes.push_back(MakeBox(bins, 0, bins.size()));
+    while (static_cast<int>(boxes.size()) < maxColors) {
+        // Weight times extent keeps large flat areas from hogging entries
+        // while still giving busy ranges the most colours
+        int pick = -1;
+        uint64_t best = 0;
+        for (size_t i = 0; i < boxes.size(); i++) {
+            uint64_t score = boxes[i].weight * static_cast<uint64_t>(boxes[i].Extent());
+            if (boxes[i].end - boxes[i].begin > 1 && score > best) {
+                best = score;
+                pick = static_cast<int>(i);
+            }
+        }
+        if (pick < 0) {
+            break;
+        }
+
+        Box box = boxes[pick];
+        int channel = box.LongestChannel();
+        std::sort(bins.begin() + box.begin, bins.begin() + box.end, [channel](const BinCount& a, const BinCount& b) {
+            return Channel(a.bin, channel) < Channel(b.bin, channel);
+        });
+        uint64_t half = box.weight / 2, running = 0;
+        size_t split = box.begin;
+        while (split < box.end - 1 && running + bins[split].count <= half) {
+            running += bins[split++].count;
+        }
+        if (split == box.begin) split++;
+        boxes[pick] = MakeBox(bins, box.begin, split);
+        boxes.push_back(MakeBox(bins, split, box.end));
+    }
+
+    for (const Box& box : boxes) {
+        uint64_t sums[3] = {0, 0, 0};
+        for (size_t i = box.begin; i < box.end; i++) {
+            for (int c = 0; c < 3; c++) {
+                sums[c] += static_cast<uint64_t>(Expand5(Channel(bins[i].bin, c))) * bins[i].count;
+            }
+        }
+        uint32_t b = static_cast<uint32_t>((sums[0] + box.weight / 2) / box.weight);
+        uint32_t g = static_cast<uint32_t>((sums[1] + box.weight / 2) / box.weight);
+        uint32_t r = static_cast<uint32_t>((sums[2] + box.weight / 2) / box.weight);
+        palette.colors[palette.count++] = 0xFF000000u | (r << 16) | (g << 8) | b;
+    }
+    return palette;
+}
+
+void BuildColorLut(const Palette& palette, int threads, std::vector<uint8_t>& lut) {
+    lut.resize(PALETTE_HISTOGRAM_BINS);
+    ParallelRanges(PALETTE_HISTOGRAM_BINS, ThreadCount(threads), [&](int first, int last) {
+        for (int bin = first; bin < last; bin++) {
+            int b = Expand5(bin & 31), g = Expand5((bin >> 5) & 31), r = Expand5((bin >> 10) & 31);
+            int best = 0, bestDistance = 1 << 30;
+            for (int i = 0; i < palette.count; i++) {
+                uint32_t color = palette.colors[i];
+                int db = b - static_cast<int>(color & 0xFF);
+                int dg = g - static_cast<int>((color >> 8) & 0xFF);
+                int dr = r - static_cast<int>((color >> 16) & 0xFF);
+                // Green weighs most and blue least, roughly as the eye does
+                int distance = 2 * dr * dr + 4 * dg * dg + db * db;
+                if (distance < bestDistance) {
+                    bestDistance = distance;
+                    best = i;
+                }
+            }
+            lut[bin] = static_cast<uint8_t>(best);
+        }
+    });
+}
+
+void DitherOrderedScalar(const uint8_t* bgra, int width, int height, int stride, int originX, int originY,
+                         const std::vector<uint8_t>& lut, uint8_t* indices, int indexStride) {
+    for (int y = 0; y < height; y++) {
+        const uint8_t* src = bgra + static_cast<size_t>(y) * stride;
+        uint8_t* dst = indices + static_cast<size_t>(y) * indexStride;
+        for (int x = 0; x < width; x++) {
+            int bias = Bias(originX + x, originY + y);
+            dst[x] = lut[Bin(static_cast<uint8_t>(Clamp8(src[x * 4] + bias)),
+                             static_cast<uint8_t>(Clamp8(src[x * 4 + 1] + bias)),
+                             static_cast<uint8_t>(Clamp8(src[x * 4 + 2] + bias)))];
+        }
+    }
+}
+
+void DitherOrdered(const uint8_t* bgra, int width, int height, int stride, int originX, int originY,
+                   const std::vector<uint8_t>& lut, uint8_t* indices, int indexStride) {
+#ifdef PALETTE_USE_SSE2
+    // Biases split into what to add and what to subtract, so saturating byte
+    // arithmetic clamps exactly like the scalar path. Alpha gets no bias.
+    // Twelve entries let any 8-phase start load four in a row.
+    alignas(16) uint8_t add[12 * 4];
+    alignas(16) uint8_t sub[12 * 4];
+    const __m128i mask5 = _mm_set1_epi32(0x1F);
+    const __m128i mask10 = _mm_set1_epi32(0x3E0);
+    const __m128i mask15 = _mm_set1_epi32(0x7C00);
+    alignas(16) uint32_t bins[4];
+    for (int y = 0; y < height; y++) {
+        for (int i = 0; i < 12; i++) {
+            int bias = Bias(i, originY + y);
+            for (int c = 0; c < 3; c++) {
+                add[i * 4 + c] = static_cast<uint8_t>(bias > 0 ? bias : 0);
+                sub[i * 4 + c] = static_cast<uint8_t>(bias < 0 ? -bias : 0);
+            }
+            add[i * 4 + 3] = 0;
+            sub[i * 4 + 3] = 0;
+        }
+        const uint8_t* src = bgra + static_cast<size_t>(y) * stride;
+        uint8_t* dst = indices + static_cast<size_t>(y) * indexStride;
+        int x = 0;
+        for (; x + 4 <= width; x += 4) {
+            int phase = (originX + x) & 7;
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+            v = _mm_adds_epu8(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(add + phase * 4)));
+            v = _mm_subs_epu8(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(sub + phase * 4)));
+            // Top five bits of B, G and R packed into a 15-bit bin
+            __m128i bin = _mm_and_si128(_mm_srli_epi32(v, 3), mask5);
+            bin = _mm_or_si128(bin, _mm_and_si128(_mm_srli_epi32(v, 6), mask10));
+            bin = _mm_or_si128(bin, _mm_and_si128(_mm_srli_epi32(v, 9), mask15));
+            _mm_store_si128(reinterpret_cast<__m128i*>(bins), bin);
+            dst[x] = lut[bins[0]];
+            dst[x + 1] = lut[bins[1]];
+            dst[x + 2] = lut[bins[2]];
+            dst[x + 3] = lut[bins[3]];
+        }
+        if (x < width) {
+            DitherOrderedScalar(src + x * 4, width - x, 1, stride, originX + x, originY + y, lut, dst + x, indexStride);
+        }
+    }
+#else
+    DitherOrderedScalar(bgra, width, height, stride, originX, originY, lut, indices, indexStride);
+#endif
+}
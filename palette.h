@@ -0,0 +1,42 @@
+// palette.h
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define PALETTE_MAX_COLORS 256
+#define PALETTE_HISTOGRAM_BINS 32768   // 5 bits per channel
+#define PALETTE_SAMPLE_STEP 2          // every other pixel is enough for a histogram
+
+struct Palette {
+    uint32_t colors[PALETTE_MAX_COLORS];   // 0xAARRGGBB, as FFmpeg's PAL8 wants
+    int count;
+};
+
+// A run of BGRA pixels to learn colours from.
+struct PixelSpan {
+    const uint8_t* bgra;
+    size_t pixels;
+};
+
+// 5:5:5 histogram of the spans, split across threads and merged. Every
+// PALETTE_SAMPLE_STEP-th pixel is counted.
+void BuildHistogram(const std::vector<PixelSpan>& spans, int threads, std::vector<uint32_t>& histogram);
+
+// Median cut: repeatedly splits the box with the most weight times extent at
+// its population median along its longest axis.
+Palette MedianCutPalette(const std::vector<uint32_t>& histogram, int maxColors);
+
+// Nearest palette entry for every 5:5:5 colour, computed in parallel.
+void BuildColorLut(const Palette& palette, int threads, std::vector<uint8_t>& lut);
+
+// 8x8 ordered dithering into palette indices through the LUT. Ordered
+// dithering depends only on position, so a tile can be dithered on its own
+// and still match the rest of the frame; originX/originY place it. Uses SSE2
+// when available; DitherOrderedScalar is the reference and gives identical
+// output.
+void DitherOrdered(const uint8_t* bgra, int width, int height, int stride, int originX, int originY,
+                   const std::vector<uint8_t>& lut, uint8_t* indices, int indexStride);
+void DitherOrderedScalar(const uint8_t* bgra, int width, int height, int stride, int originX, int originY,
+                         const std::vector<uint8_t>& lut, uint8_t* indices, int indexStride);
@@ -0,0 +1,33 @@
+// parallel.h
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Threads to use when the caller asked for 0: one per hardware thread
+inline int ThreadCount(int threads) {
+    if (threads > 0) return threads;
+    unsigned hardware = std::thread::hardware_concurrency();
+    return hardware > 0 ? static_cast<int>(hardware) : 1;
+}
+
+// Runs body(first, last) over [0, count) split evenly across threads
+template <typename Body>
+void ParallelRanges(int count, int threads, Body body) {
+    threads = std::max(1, std::min(threads, count));
+    if (threads == 1) {
+        body(0, count);
+        return;
+    }
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++) {
+        int first = static_cast<int>(static_cast<int64_t>(count) * t / threads);
+        int last = static_cast<int>(static_cast<int64_t>(count) * (t + 1) / threads);
+        pool.emplace_back([&body, first, last]() { body(first, last); });
+    }
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+}
@@ -0,0 +1,242 @@
+// pipeline.cpp
+#include "pipeline.h"
+#include "log.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
+
+#include <chrono>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+void LowerCurrentThreadPriority() {
+#ifdef _WIN32
+    // Background mode also lowers the thread's I/O and memory priority
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#elif defined(__linux__)
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+#endif
+}
+
+bool SetCaptureInfo(AVFrame* frame, const CaptureInfo& info) {
+    av_buffer_unref(&frame->opaque_ref);
+    frame->opaque_ref = av_buffer_alloc(sizeof(CaptureInfo));
+    if (!frame->opaque_ref) {
+        return false;
+    }
+    memcpy(frame->opaque_ref->data, &info, sizeof(CaptureInfo));
+    return true;
+}
+
+bool GetCaptureInfo(const AVFrame* frame, CaptureInfo& info) {
+    if (!frame->opaque_ref || frame->opaque_ref->size < sizeof(CaptureInfo)) {
+        return false;
+    }
+    memcpy(&info, frame->opaque_ref->data, sizeof(CaptureInfo));
+    return true;
+}
+
+FrameConverter::FrameConverter()
+        : m_swsContext(nullptr), m_bufferPool(nullptr), m_width(0), m_height(0) {
+}
+
+FrameConverter::~FrameConverter() {
+    Close();
+}
+
+bool FrameConverter::Open(int width, int height) {
+    if (m_swsContext && m_bufferPool && width == m_width && height == m_height) {
+        return true;
+    }
+    Close();
+    m_width = width;
+    m_height = height;
+
+    m_swsContext = sws_getContext(width, height, AV_PIX_FMT_BGRA,
+                                  width, height, AV_PIX_FMT_YUV420P,
+                                  SWS_BICUBIC, NULL, NULL, NULL);
+    if (!m_swsContext) {
+        LogDebug("Could not initialize the conversion context");
+        return false;
+    }
+
+    int size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 32);
+    m_bufferPool = av_buffer_pool_init(size, NULL);
+    if (!m_bufferPool) {
+        LogDebug("Could not allocate the frame buffer pool");
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void FrameConverter::Close() {
+    if (m_swsContext) {
+        sws_freeContext(m_swsContext);
+        m_swsContext = nullptr;
+    }
+    // Frames still held by consumers keep their buffers; the pool is freed
+    // once the last one is returned.
+    av_buffer_pool_uninit(&m_bufferPool);
+}
+
+AVFrame* FrameConverter::Convert(const uint8_t* bgra, int stride, int64_t pts) {
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) {
+        LogDebug("Could not allocate video frame");
+        return nullptr;
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = m_width;
+    frame->height = m_height;
+    frame->buf[0] = av_buffer_pool_get(m_bufferPool);
+    if (!frame->buf[0] ||
+        av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                             AV_PIX_FMT_YUV420P, m_width, m_height, 32) < 0) {
+        LogDebug("Could not allocate frame data.");
+        av_frame_free(&frame);
+        return nullptr;
+    }
+
+    const uint8_t* srcSlice[1] = { bgra };
+    int srcStride[1] = { stride };
+    sws_scale(m_swsContext, srcSlice, srcStride, 0, m_height, frame->data, frame->linesize);
+    frame->pts = pts;
+    return frame;
+}
+
+FrameWorker::FrameWorker(const std::string& name)
+        : m_name(name), m_maxQueueDepth(0), m_lowPriority(false), m_finishing(false), m_processing(false),
+          m_failed(false),
+          m_dropped(0), m_averageProcessMs(0.0), m_metrics(PipelineMetrics::Instance().Worker(name)) {
+}
+
+FrameWorker::~FrameWorker() {
+    Finish();
+}
+
+void FrameWorker::Start() {
+    m_finishing = false;
+    m_dropped = 0;
+    m_averageProcessMs = 0.0;
+    m_thread = std::thread(&FrameWorker::Run, this);
+}
+
+bool FrameWorker::Submit(const AVFrame* frame) {
+    if (m_failed) {
+        return false;
+    }
+    m_metrics->submitted.fetch_add(1, std::memory_order_relaxed);
+    {
+        // Drop the newest frame rather than stalling the capture thread
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_maxQueueDepth > 0 && m_queue.size() >= m_maxQueueDepth) {
+            m_dropped++;
+            m_metrics->dropped.fetch_add(1, std::memory_order_relaxed);
+            PROBE_FRAME_DROP(m_name.c_str(), frame->pts, m_queue.size());
+            return false;
+        }
+    }
+    AVFrame* ref = av_frame_clone(frame);
+    if (!ref) {
+        LogDebug(m_name + ": could not reference frame");
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(ref);
+        m_metrics->queueDepth.store(m_queue.size(), std::memory_order_relaxed);
+    }
+    m_condition.notify_one();
+    return true;
+}
+
+void FrameWorker::SetMaxQueueDepth(size_t depth) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_maxQueueDepth = depth;
+}
+
+void FrameWorker::RequestFinish() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_finishing = true;
+    }
+    m_condition.notify_one();
+}
+
+void FrameWorker::Finish() {
+    if (!m_thread.joinable()) {
+        return;
+    }
+    RequestFinish();
+    m_thread.join();
+}
+
+void FrameWorker::WaitIdle() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_thread.joinable()) {
+        return;
+    }
+    m_idleCondition.wait(lock, [this] { return m_queue.empty() && !m_processing; });
+}
+
+size_t FrameWorker::QueueDepth() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.size();
+}
+
+void FrameWorker::Run() {
+    if (m_lowPriority) {
+        LowerCurrentThreadPriority();
+    }
+    TRACE_THREAD_NAME(m_name);
+    while (true) {
+        AVFrame* frame = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this] { return m_finishing || !m_queue.empty(); });
+            if (m_queue.empty()) {
+                break;
+            }
+            frame = m_queue.front();
+            m_queue.pop_front();
+            m_processing = true;
+            m_metrics->queueDepth.store(m_queue.size(), std::memory_order_relaxed);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            TRACE_SCOPE_FRAME("ProcessFrame", frame->pts);
+            if (!m_failed && !ProcessFrame(frame)) {
+                LogDebug(m_name + ": frame " + std::to_string(frame->pts) + " failed, dropping the rest");
+                m_failed = true;
+            }
+        }
+        double elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        m_averageProcessMs = m_averageProcessMs * 0.9 + elapsedMs * 0.1;
+        m_metrics->processed.fetch_add(1, std::memory_order_relaxed);
+        av_frame_free(&frame);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_processing = false;
+        }
+        m_idleCondition.notify_all();
+    }
+
+    TRACE_SCOPE("OnFinish");
+    if (!OnFinish()) {
+        m_failed = true;
+    }
+}
@@ -0,0 +1,113 @@
+// pipeline.h
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct WorkerMetrics;
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+#include <libswscale/swscale.h>
+}
+
+// Background priority for CPU, and on Windows for I/O too.
+void LowerCurrentThreadPriority();
+
+// What the capture thread knew about a frame, for consumers further down.
+// It rides in AVFrame::opaque_ref, which every reference handed out keeps.
+struct CaptureInfo {
+    int64_t captureUs;      // av_gettime_relative when the screen was grabbed
+    int changedTiles;       // see DamageTracker
+    int totalTiles;
+};
+
+bool SetCaptureInfo(AVFrame* frame, const CaptureInfo& info);
+// False for frames that did not come from the capture thread
+bool GetCaptureInfo(const AVFrame* frame, CaptureInfo& info);
+
+// Converts captured BGRA buffers to YUV420P frames. Output frames come from a
+// buffer pool and are reference-counted, so they can be handed to any number
+// of consumers without copying the pixels.
+class FrameConverter {
+public:
+    FrameConverter();
+    ~FrameConverter();
+
+    // Keeps the existing context and buffer pool when the size is unchanged
+    bool Open(int width, int height);
+    void Close();
+    AVFrame* Convert(const uint8_t* bgra, int stride, int64_t pts);
+
+    int Width() const { return m_width; }
+    int Height() const { return m_height; }
+
+private:
+    SwsContext* m_swsContext;
+    AVBufferPool* m_bufferPool;
+    int m_width;
+    int m_height;
+};
+
+// Consumes converted frames on a dedicated thread so one slow consumer never
+// stalls the capture thread or the other consumers. Derived classes call
+// Finish() from their own destructor, while their overrides are still alive.
+class FrameWorker {
+public:
+    explicit FrameWorker(const std::string& name);
+    virtual ~FrameWorker();
+
+    void Start();
+    // Queues a new reference to the frame; the pixels are shared, not copied.
+    bool Submit(const AVFrame* frame);
+    // Lets the thread drain and finish without waiting for it, so several
+    // workers can wind down in parallel.
+    void RequestFinish();
+    // Drains everything queued so far, calls OnFinish and joins the thread.
+    void Finish();
+    // Blocks until every frame queued so far has been processed, for callers
+    // that need the worker quiet, such as a benchmark metering memory.
+    void WaitIdle();
+
+    // Frames submitted while this many are queued are dropped; 0 never drops.
+    void SetMaxQueueDepth(size_t depth);
+    // Runs the thread at background priority; call before Start.
+    void SetLowPriority(bool lowPriority) { m_lowPriority = lowPriority; }
+
+    const std::string& Name() const { return m_name; }
+    size_t QueueDepth() const;
+    int64_t Dropped() const { return m_dropped; }
+    // Smoothed time ProcessFrame takes per frame
+    double AverageProcessMs() const { return m_averageProcessMs; }
+    bool Failed() const { return m_failed; }
+
+protected:
+    virtual bool ProcessFrame(AVFrame* frame) = 0;
+    virtual bool OnFinish() { return true; }
+    // Live counters under this worker's name, for outputs to add their bytes
+    WorkerMetrics* Metrics() const { return m_metrics; }
+
+private:
+    void Run();
+
+    std::string m_name;
+    std::thread m_thread;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::condition_variable m_idleCondition;
+    std::deque<AVFrame*> m_queue;
+    size_t m_maxQueueDepth;
+    bool m_lowPriority;
+    bool m_finishing;
+    bool m_processing;
+    std::atomic<bool> m_failed;
+    std::atomic<int64_t> m_dropped;
+    std::atomic<double> m_averageProcessMs;
+    WorkerMetrics* m_metrics;
+};
@@ -0,0 +1,26 @@
+// probes.cpp
+#include "probes.h"
+
+#if !defined(SCREENRECORDER_USDT) && defined(_WIN32) && defined(SCREENRECORDER_TRACELOGGING)
+
+// The EventSource-style GUID of the name, so tools can ask for *ScreenRecorder
+TRACELOGGING_DEFINE_PROVIDER(g_probeProvider, "ScreenRecorder",
+                             (0x39b35e2f, 0x2810, 0x512b, 0x39, 0xd3, 0x4c, 0x40, 0x63, 0x26, 0x49, 0xd6));
+
+void RegisterProbes() {
+    TraceLoggingRegister(g_probeProvider);
+}
+
+void UnregisterProbes() {
+    TraceLoggingUnregister(g_probeProvider);
+}
+
+#else
+
+void RegisterProbes() {
+}
+
+void UnregisterProbes() {
+}
+
+#endif
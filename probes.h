@@ -0,0 +1,98 @@
+// probes.h
+#pragma once
+
+#include <cstdint>
+
+// Static tracepoints on the hot path for system profilers. Unlike trace.h,
+// which the recorder writes itself, these cost nothing until an outside tool
+// attaches:
+//
+// - Linux (SCREENRECORDER_USDT): USDT probes in provider "screenrecorder",
+//   a single NOP each while detached.
+//       bpftrace -e 'usdt:./ScreenRecorder:screenrecorder:packet_out { @[str(arg0)] = hist(arg2); }'
+//       perf buildid-cache --add ./ScreenRecorder && perf record -e sdt_screenrecorder:capture_end ...
+// - Windows (SCREENRECORDER_TRACELOGGING): TraceLogging events from provider
+//   "ScreenRecorder", a flag test each while no ETW session listens.
+//       wpr -start screenrecorder.wprp / tracelog -start sr -guid *ScreenRecorder
+//
+// Arguments are plain integers and C strings so both back ends can take them.
+// Timestamps are av_gettime_relative microseconds, like CaptureInfo.
+
+// Registers the TraceLogging provider; nothing to do for USDT
+void RegisterProbes();
+void UnregisterProbes();
+
+#if defined(SCREENRECORDER_USDT)
+
+#include <sys/sdt.h>
+
+#define PROBE_CAPTURE_START(frame, captureUs) \
+    DTRACE_PROBE2(screenrecorder, capture_start, static_cast<int64_t>(frame), static_cast<int64_t>(captureUs))
+#define PROBE_CAPTURE_END(frame, bytes, width, height) \
+    DTRACE_PROBE4(screenrecorder, capture_end, static_cast<int64_t>(frame), static_cast<int64_t>(bytes), width, height)
+#define PROBE_CONVERT_START(pts, width, height) \
+    DTRACE_PROBE3(screenrecorder, convert_start, static_cast<int64_t>(pts), width, height)
+#define PROBE_CONVERT_END(pts) \
+    DTRACE_PROBE1(screenrecorder, convert_end, static_cast<int64_t>(pts))
+#define PROBE_ENCODE_SUBMIT(encoder, pts, captureUs) \
+    DTRACE_PROBE3(screenrecorder, encode_submit, encoder, static_cast<int64_t>(pts), static_cast<int64_t>(captureUs))
+#define PROBE_PACKET_OUT(encoder, pts, size, keyframe, captureUs) \
+    DTRACE_PROBE5(screenrecorder, packet_out, encoder, static_cast<int64_t>(pts), static_cast<int64_t>(size), \
+                  static_cast<int>(keyframe), static_cast<int64_t>(captureUs))
+#define PROBE_FRAME_DROP(worker, pts, queueDepth) \
+    DTRACE_PROBE3(screenrecorder, frame_drop, worker, static_cast<int64_t>(pts), static_cast<int64_t>(queueDepth))
+#define PROBE_FINISH_START(frames) \
+    DTRACE_PROBE1(screenrecorder, finish_start, static_cast<int64_t>(frames))
+#define PROBE_FINISH_END(frames, ok) \
+    DTRACE_PROBE2(screenrecorder, finish_end, static_cast<int64_t>(frames), static_cast<int>(ok))
+
+#elif defined(_WIN32) && defined(SCREENRECORDER_TRACELOGGING)
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#include <TraceLoggingProvider.h>
+
+TRACELOGGING_DECLARE_PROVIDER(g_probeProvider);
+
+#define PROBE_CAPTURE_START(frame, captureUs) \
+    TraceLoggingWrite(g_probeProvider, "capture_start", TraceLoggingInt64(frame, "frame"), \
+                      TraceLoggingInt64(captureUs, "captureUs"))
+#define PROBE_CAPTURE_END(frame, bytes, width, height) \
+    TraceLoggingWrite(g_probeProvider, "capture_end", TraceLoggingInt64(frame, "frame"), \
+                      TraceLoggingInt64(static_cast<int64_t>(bytes), "bytes"), TraceLoggingInt32(width, "width"), \
+                      TraceLoggingInt32(height, "height"))
+#define PROBE_CONVERT_START(pts, width, height) \
+    TraceLoggingWrite(g_probeProvider, "convert_start", TraceLoggingInt64(pts, "pts"), \
+                      TraceLoggingInt32(width, "width"), TraceLoggingInt32(height, "height"))
+#define PROBE_CONVERT_END(pts) \
+    TraceLoggingWrite(g_probeProvider, "convert_end", TraceLoggingInt64(pts, "pts"))
+#define PROBE_ENCODE_SUBMIT(encoder, pts, captureUs) \
+    TraceLoggingWrite(g_probeProvider, "encode_submit", TraceLoggingString(encoder, "encoder"), \
+                      TraceLoggingInt64(pts, "pts"), TraceLoggingInt64(captureUs, "captureUs"))
+#define PROBE_PACKET_OUT(encoder, pts, size, keyframe, captureUs) \
+    TraceLoggingWrite(g_probeProvider, "packet_out", TraceLoggingString(encoder, "encoder"), \
+                      TraceLoggingInt64(pts, "pts"), TraceLoggingInt64(size, "size"), \
+                      TraceLoggingBool(keyframe, "keyframe"), TraceLoggingInt64(captureUs, "captureUs"))
+#define PROBE_FRAME_DROP(worker, pts, queueDepth) \
+    TraceLoggingWrite(g_probeProvider, "frame_drop", TraceLoggingString(worker, "worker"), \
+                      TraceLoggingInt64(pts, "pts"), TraceLoggingInt64(static_cast<int64_t>(queueDepth), "queueDepth"))
+#define PROBE_FINISH_START(frames) \
+    TraceLoggingWrite(g_probeProvider, "finish_start", TraceLoggingInt64(frames, "frames"))
+#define PROBE_FINISH_END(frames, ok) \
+    TraceLoggingWrite(g_probeProvider, "finish_end", TraceLoggingInt64(frames, "frames"), TraceLoggingBool(ok, "ok"))
+
+#else
+
+#define PROBE_CAPTURE_START(frame, captureUs) do {} while (0)
+#define PROBE_CAPTURE_END(frame, bytes, width, height) do {} while (0)
+#define PROBE_CONVERT_START(pts, width, height) do {} while (0)
+#define PROBE_CONVERT_END(pts) do {} while (0)
+#define PROBE_ENCODE_SUBMIT(encoder, pts, captureUs) do {} while (0)
+#define PROBE_PACKET_OUT(encoder, pts, size, keyframe, captureUs) do {} while (0)
+#define PROBE_FRAME_DROP(worker, pts, queueDepth) do {} while (0)
+#define PROBE_FINISH_START(frames) do {} while (0)
+#define PROBE_FINISH_END(frames, ok) do {} while (0)
+
+#endif
@@ -0,0 +1,561 @@
+// quality.cpp
+#include "quality.h"
+#include "log.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QUALITY_USE_SSE2 1
+#endif
+
+namespace {
+
+// x264's constants for a 64-pixel window
+const int64_t SSIM_C1 = 416;      // .01^2 * 255^2 * 64
+const int64_t SSIM_C2 = 235963;   // .03^2 * 255^2 * 64 * 63
+
+struct PlaneView {
+    const uint8_t* a;
+    int strideA;
+    const uint8_t* b;
+    int strideB;
+    int width;
+    int height;
+};
+
+// s1 = sum of a, s2 = sum of b, ss = sum of a^2 + b^2, s12 = sum of a*b
+struct BlockSums {
+    int32_t s1;
+    int32_t s2;
+    int32_t ss;
+    int32_t s12;
+};
+
+uint64_t SquaredErrorRowScalar(const uint8_t* a, const uint8_t* b, int x, int width) {
+    uint64_t sse = 0;
+    for (; x < width; x++) {
+        int d = a[x] - b[x];
+        sse += d * d;
+    }
+    return sse;
+}
+
+void BlockSumsRowScalar(const uint8_t* a, int strideA, const uint8_t* b, int strideB, int block, int blocks,
+                        BlockSums* sums) {
+    for (; block < blocks; block++) {
+        BlockSums s = {0, 0, 0, 0};
+        for (int y = 0; y < 4; y++) {
+            for (int x = block * 4; x < block * 4 + 4; x++) {
+                int pa = a[y * strideA + x];
+                int pb = b[y * strideB + x];
+                s.s1 += pa;
+                s.s2 += pb;
+                s.ss += pa * pa + pb * pb;
+                s.s12 += pa * pb;
+            }
+        }
+        sums[block] = s;
+    }
+}
+
+#ifdef QUALITY_USE_SSE2
+
+uint64_t SquaredErrorRow(const uint8_t* a, const uint8_t* b, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+    // Each lane holds at most width / 16 * 4 * 255^2, well inside 31 bits
+    alignas(16) uint32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    uint64_t sse = static_cast<uint64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    return sse + SquaredErrorRowScalar(a, b, x, width);
+}
+
+// Adds neighbouring lanes: pixel pairs 0-1 and 2-3 make one 4x4 block, 4-5 and 6-7 the next
+inline void StoreBlockPairs(__m128i v, int32_t& first, int32_t& second) {
+    alignas(16) int32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), v);
+    first = lanes[0] + lanes[1];
+    second = lanes[2] + lanes[3];
+}
+
+// Four 4x4 blocks per step, as 16-bit pairs through pmaddwd
+void BlockSumsRow(const uint8_t* a, int strideA, const uint8_t* b, int strideB, int blocks, BlockSums* sums) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    int block = 0;
+    for (; block + 4 <= blocks; block += 4) {
+        __m128i s1[2] = {zero, zero}, s2[2] = {zero, zero}, ss[2] = {zero, zero}, s12[2] = {zero, zero};
+        for (int y = 0; y < 4; y++) {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + y * strideA + block * 4));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + y * strideB + block * 4));
+            __m128i pa[2] = {_mm_unpacklo_epi8(va, zero), _mm_unpackhi_epi8(va, zero)};
+            __m128i pb[2] = {_mm_unpacklo_epi8(vb, zero), _mm_unpackhi_epi8(vb, zero)};
+            for (int h = 0; h < 2; h++) {
+                s1[h] = _mm_add_epi32(s1[h], _mm_madd_epi16(pa[h], ones));
+                s2[h] = _mm_add_epi32(s2[h], _mm_madd_epi16(pb[h], ones));
+                ss[h] = _mm_add_epi32(ss[h], _mm_add_epi32(_mm_madd_epi16(pa[h], pa[h]), _mm_madd_epi16(pb[h], pb[h])));
+                s12[h] = _mm_add_epi32(s12[h], _mm_madd_epi16(pa[h], pb[h]));
+            }
+        }
+        for (int h = 0; h < 2; h++) {
+            BlockSums* pair = sums + block + h * 2;
+            StoreBlockPairs(s1[h], pair[0].s1, pair[1].s1);
+            StoreBlockPairs(s2[h], pair[0].s2, pair[1].s2);
+            StoreBlockPairs(ss[h], pair[0].ss, pair[1].ss);
+            StoreBlockPairs(s12[h], pair[0].s12, pair[1].s12);
+        }
+    }
+    BlockSumsRowScalar(a, strideA, b, strideB, block, blocks, sums);
+}
+
+#endif
+
+// One 8x8 window from its four 4x4 blocks
+double SsimWindow(const BlockSums& b0, const BlockSums& b1, const BlockSums& b2, const BlockSums& b3) {
+    int64_t s1 = b0.s1 + b1.s1 + b2.s1 + b3.s1;
+    int64_t s2 = b0.s2 + b1.s2 + b2.s2 + b3.s2;
+    int64_t ss = b0.ss + b1.ss + b2.ss + b3.ss;
+    int64_t s12 = b0.s12 + b1.s12 + b2.s12 + b3.s12;
+    int64_t vars = ss * 64 - s1 * s1 - s2 * s2;
+    int64_t covar = s12 * 64 - s1 * s2;
+    return static_cast<double>(2 * s1 * s2 + SSIM_C1) * static_cast<double>(2 * covar + SSIM_C2) /
+           (static_cast<double>(s1 * s1 + s2 * s2 + SSIM_C1) * static_cast<double>(vars + SSIM_C2));
+}
+
+// Rows [firstRow, lastRow) of a plane; firstRow is a multiple of 4, and so is
+// lastRow unless it is the plane's last row
+PlaneQuality CompareRows(const PlaneView& view, int firstRow, int lastRow, bool simd) {
+    PlaneQuality quality = {0, static_cast<int64_t>(view.width) * (lastRow - firstRow), 0.0, 0};
+    for (int y = firstRow; y < lastRow; y++) {
+        const uint8_t* a = view.a + static_cast<size_t>(y) * view.strideA;
+        const uint8_t* b = view.b + static_cast<size_t>(y) * view.strideB;
+#ifdef QUALITY_USE_SSE2
+        quality.sse += simd ? SquaredErrorRow(a, b, view.width) : SquaredErrorRowScalar(a, b, 0, view.width);
+#else
+        quality.sse += SquaredErrorRowScalar(a, b, 0, view.width);
+#endif
+    }
+
+    // Windows at block row r cover blocks r and r + 1, so the tile reads one block row past its end
+    int blocksWide = view.width / 4;
+    int blocksHigh = view.height / 4;
+    int firstWindowRow = firstRow / 4;
+    int lastWindowRow = std::min(lastRow / 4, blocksHigh - 1);
+    if (blocksWide < 2 || firstWindowRow >= lastWindowRow) {
+        return quality;
+    }
+    std::vector<BlockSums> top(blocksWide);
+    std::vector<BlockSums> bottom(blocksWide);
+    auto sumRow = [&](int blockRow, BlockSums* sums) {
+        const uint8_t* a = view.a + static_cast<size_t>(blockRow) * 4 * view.strideA;
+        const uint8_t* b = view.b + static_cast<size_t>(blockRow) * 4 * view.strideB;
+#ifdef QUALITY_USE_SSE2
+        if (simd) {
+            BlockSumsRow(a, view.strideA, b, view.strideB, blocksWide, sums);
+            return;
+        }
+#endif
+        BlockSumsRowScalar(a, view.strideA, b, view.strideB, 0, blocksWide, sums);
+    };
+    sumRow(firstWindowRow, top.data());
+    for (int row = firstWindowRow; row < lastWindowRow; row++) {
+        sumRow(row + 1, bottom.data());
+        for (int x = 0; x + 1 < blocksWide; x++) {
+            quality.ssimSum += SsimWindow(top[x], top[x + 1], bottom[x], bottom[x + 1]);
+        }
+        quality.windows += blocksWide - 1;
+        top.swap(bottom);
+    }
+    return quality;
+}
+
+void Accumulate(PlaneQuality& total, const PlaneQuality& part) {
+    total.sse += part.sse;
+    total.pixels += part.pixels;
+    total.ssimSum += part.ssimSum;
+    total.windows += part.windows;
+}
+
+struct Tile {
+    int plane;
+    int firstRow;
+    int lastRow;
+    PlaneQuality result;
+};
+
+void AddTiles(int plane, int height, std::vector<Tile>& tiles) {
+    for (int row = 0; row < height; row += QUALITY_TILE_ROWS) {
+        tiles.push_back(Tile{plane, row, std::min(row + QUALITY_TILE_ROWS, height), PlaneQuality{0, 0, 0.0, 0}});
+    }
+}
+
+// Tiles are summed in order afterwards, so the result is the same for any thread count
+void CompareTiles(const PlaneView* views, std::vector<Tile>& tiles, int threads) {
+    ParallelRanges(static_cast<int>(tiles.size()), ThreadCount(threads), [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            tiles[i].result = CompareRows(views[tiles[i].plane], tiles[i].firstRow, tiles[i].lastRow, true);
+        }
+    });
+}
+
+double Ssim(const PlaneQuality& quality) {
+    return quality.windows > 0 ? quality.ssimSum / quality.windows : 1.0;
+}
+
+std::string Number(double value) {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(4) << value;
+    return ss.str();
+}
+
+} // namespace
+
+double PsnrFromSse(uint64_t sse, int64_t pixels) {
+    if (pixels <= 0 || sse == 0) {
+        return QUALITY_PSNR_MAX;
+    }
+    double psnr = 10.0 * std::log10(255.0 * 255.0 * pixels / static_cast<double>(sse));
+    return std::min(psnr, QUALITY_PSNR_MAX);
+}
+
+PlaneQuality ComparePlane(const uint8_t* a, int strideA, const uint8_t* b, int strideB,
+                          int width, int height, int threads) {
+    PlaneView view = {a, strideA, b, strideB, width, height};
+    std::vector<Tile> tiles;
+    AddTiles(0, height, tiles);
+    CompareTiles(&view, tiles, threads);
+    PlaneQuality total = {0, 0, 0.0, 0};
+    for (const Tile& tile : tiles) {
+        Accumulate(total, tile.result);
+    }
+    return total;
+}
+
+PlaneQuality ComparePlaneScalar(const uint8_t* a, int strideA, const uint8_t* b, int strideB,
+                                int width, int height) {
+    PlaneView view = {a, strideA, b, strideB, width, height};
+    PlaneQuality total = {0, 0, 0.0, 0};
+    // Same tiling as ComparePlane, so the floating-point sums add up in the same order
+    for (int row = 0; row < height; row += QUALITY_TILE_ROWS) {
+        Accumulate(total, CompareRows(view, row, std::min(row + QUALITY_TILE_ROWS, height), false));
+    }
+    return total;
+}
+
+bool CompareFrames(const AVFrame* source, const AVFrame* decoded, int threads, FrameQuality& quality) {
+    if (source->format != AV_PIX_FMT_YUV420P || decoded->format != AV_PIX_FMT_YUV420P) {
+        return false;
+    }
+    int width = std::min(source->width, decoded->width);
+    int height = std::min(source->height, decoded->height);
+    PlaneView views[3];
+    std::vector<Tile> tiles;
+    for (int plane = 0; plane < 3; plane++) {
+        int planeWidth = plane == 0 ? width : (width + 1) / 2;
+        int planeHeight = plane == 0 ? height : (height + 1) / 2;
+        views[plane] = PlaneView{source->data[plane], source->linesize[plane], decoded->data[plane],
+                                 decoded->linesize[plane], planeWidth, planeHeight};
+        AddTiles(plane, planeHeight, tiles);
+    }
+    CompareTiles(views, tiles, threads);
+
+    PlaneQuality planes[3] = {};
+    for (const Tile& tile : tiles) {
+        Accumulate(planes[tile.plane], tile.result);
+    }
+    uint64_t sse = 0;
+    int64_t pixels = 0;
+    double ssimWeighted = 0.0;
+    for (int plane = 0; plane < 3; plane++) {
+        quality.psnr[plane] = PsnrFromSse(planes[plane].sse, planes[plane].pixels);
+        quality.ssim[plane] = Ssim(planes[plane]);
+        quality.sse[plane] = planes[plane].sse;
+        quality.pixels[plane] = planes[plane].pixels;
+        sse += planes[plane].sse;
+        pixels += planes[plane].pixels;
+        ssimWeighted += quality.ssim[plane] * planes[plane].pixels;
+    }
+    quality.psnr[3] = PsnrFromSse(sse, pixels);
+    quality.ssim[3] = pixels > 0 ? ssimWeighted / pixels : 1.0;
+    return true;
+}
+
+std::string QualityFilename(const std::string& output) {
+    size_t dot = output.find_last_of('.');
+    size_t slash = output.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = output.size();
+    }
+    return output.substr(0, dot) + QUALITY_EXTENSION;
+}
+
+QualityVerifier::QualityVerifier()
+        : FrameWorker("Quality"), m_decoder(nullptr), m_decoded(nullptr), m_timeBase{1, 1}, m_threads(1),
+          m_newestSourcePts(AV_NOPTS_VALUE), m_unmatched(0), m_summary{0, 0, 0.0, 0.0, 0.0, 0.0, 0.0} {
+    // Measuring must not starve the encoders it measures
+    m_threads = std::max(1, ThreadCount(0) / 2);
+    for (int plane = 0; plane < 3; plane++) {
+        m_sse[plane] = 0;
+        m_pixels[plane] = 0;
+    }
+}
+
+QualityVerifier::~QualityVerifier() {
+    Finish();
+    Release();
+}
+
+bool QualityVerifier::Open(const std::string& output, const std::string& encoderName) {
+    m_output = output;
+    m_encoderName = encoderName;
+    if (!m_decoder) {
+        LogDebug("Quality verification disabled: no decoder for the " + encoderName + " encoder");
+        return false;
+    }
+    SetLowPriority(true);
+    Start();
+    return true;
+}
+
+void QualityVerifier::OnStreamOpened(const AVCodecContext* context) {
+    Release();
+    const AVCodec* codec = avcodec_find_decoder(context->codec_id);
+    AVCodecParameters* parameters = avcodec_parameters_alloc();
+    m_decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    m_decoded = av_frame_alloc();
+    if (!m_decoder || !parameters || !m_decoded ||
+        avcodec_parameters_from_context(parameters, context) < 0 ||
+        avcodec_parameters_to_context(m_decoder, parameters) < 0) {
+        avcodec_parameters_free(&parameters);
+        Release();
+        return;
+    }
+    avcodec_parameters_free(&parameters);
+    m_timeBase = context->time_base;
+    m_decoder->pkt_timebase = context->time_base;
+    m_decoder->thread_count = 0;
+    int ret = avcodec_open2(m_decoder, codec, NULL);
+    if (ret < 0) {
+        LogDebug("Could not open the " + std::string(codec->name) + " decoder: " + std::to_string(ret));
+        Release();
+    }
+}
+
+void QualityVerifier::OnPacket(const AVPacket* packet, AVRational) {
+    if (!m_decoder) {
+        return;
+    }
+    // The encoding thread only queues; decoding happens on the worker
+    AVPacket* copy = av_packet_clone(packet);
+    if (copy) {
+        std::lock_guard<std::mutex> lock(m_packetMutex);
+        m_packets.push_back(copy);
+    }
+}
+
+bool QualityVerifier::ProcessFrame(AVFrame* frame) {
+    AVFrame* source = av_frame_clone(frame);
+    if (!source) {
+        return false;
+    }
+    AVFrame*& slot = m_sources[frame->pts];
+    av_frame_free(&slot);
+    slot = source;
+    if (m_newestSourcePts == AV_NOPTS_VALUE || frame->pts > m_newestSourcePts) {
+        m_newestSourcePts = frame->pts;
+    }
+    // Bounded in case the encoder never returns some frames
+    while (m_sources.size() > QUALITY_MAX_PENDING_FRAMES) {
+        av_frame_free(&m_sources.begin()->second);
+        m_sources.erase(m_sources.begin());
+        m_unmatched++;
+    }
+    DecodePending(false);
+    return true;
+}
+
+bool QualityVerifier::OnFinish() {
+    // Runs after the encoder has finished, so every packet is queued by now
+    DecodePending(true);
+    DropSourcesBefore(INT64_MAX);
+    Summarize();
+    bool ok = m_frames.empty() || WriteReport();
+    m_frames.clear();
+    return ok;
+}
+
+void QualityVerifier::DecodePending(bool flush) {
+    // When this worker lags the encoder, packets arrive before their source
+    // frames. Decoding them then would run the decoded pts past the sources and
+    // drop both as unmatched, so they wait, in decode order, until it catches up.
+    std::deque<AVPacket*> packets;
+    {
+        std::lock_guard<std::mutex> lock(m_packetMutex);
+        if (flush) {
+            packets.swap(m_packets);
+        } else {
+            while (!m_packets.empty() && m_newestSourcePts != AV_NOPTS_VALUE &&
+                   m_packets.front()->pts <= m_newestSourcePts) {
+                packets.push_back(m_packets.front());
+                m_packets.pop_front();
+            }
+        }
+    }
+    for (AVPacket*& packet : packets) {
+        m_packetBytes[packet->pts] = packet->size;
+        int ret = avcodec_send_packet(m_decoder, packet);
+        while (ret == AVERROR(EAGAIN)) {
+            ReceiveFrames();
+            ret = avcodec_send_packet(m_decoder, packet);
+        }
+        if (ret < 0) {
+            LogDebug("Quality: could not decode packet " + std::to_string(packet->pts) + ": " + std::to_string(ret));
+        }
+        av_packet_free(&packet);
+        ReceiveFrames();
+    }
+    if (flush) {
+        avcodec_send_packet(m_decoder, NULL);
+        ReceiveFrames();
+    }
+}
+
+void QualityVerifier::ReceiveFrames() {
+    while (avcodec_receive_frame(m_decoder, m_decoded) == 0) {
+        Measure(m_decoded);
+        av_frame_unref(m_decoded);
+    }
+}
+
+void QualityVerifier::Measure(const AVFrame* decoded) {
+    int64_t pts = decoded->best_effort_timestamp != AV_NOPTS_VALUE ? decoded->best_effort_timestamp : decoded->pts;
+    // Frames come out in presentation order, so older sources will never match
+    DropSourcesBefore(pts);
+    auto source = m_sources.find(pts);
+    if (source == m_sources.end()) {
+        m_unmatched++;
+        return;
+    }
+    FrameQuality quality;
+    quality.pts = pts;
+    quality.type = av_get_picture_type_char(decoded->pict_type);
+    auto bytes = m_packetBytes.find(pts);
+    quality.bytes = bytes != m_packetBytes.end() ? bytes->second : 0;
+    if (bytes != m_packetBytes.end()) {
+        m_packetBytes.erase(bytes);
+    }
+    if (CompareFrames(source->second, decoded, m_threads, quality)) {
+        m_frames.push_back(quality);
+        for (int plane = 0; plane < 3; plane++) {
+            m_sse[plane] += quality.sse[plane];
+            m_pixels[plane] += quality.pixels[plane];
+        }
+    }
+    av_frame_free(&source->second);
+    m_sources.erase(source);
+}
+
+void QualityVerifier::DropSourcesBefore(int64_t pts) {
+    while (!m_sources.empty() && m_sources.begin()->first < pts) {
+        av_frame_free(&m_sources.begin()->second);
+        m_sources.erase(m_sources.begin());
+        m_unmatched++;
+    }
+}
+
+void QualityVerifier::Summarize() {
+    m_summary = QualitySummary{static_cast<int64_t>(m_frames.size()), m_unmatched, QUALITY_PSNR_MAX,
+                               QUALITY_PSNR_MAX, 1.0, 1.0, 0.0};
+    if (m_frames.empty()) {
+        return;
+    }
+    double ssimMean = 0.0;
+    int64_t bytes = 0;
+    for (const FrameQuality& frame : m_frames) {
+        m_summary.psnrMin = std::min(m_summary.psnrMin, frame.psnr[3]);
+        m_summary.ssimMin = std::min(m_summary.ssimMin, frame.ssim[3]);
+        ssimMean += frame.ssim[3];
+        bytes += frame.bytes;
+    }
+    m_summary.ssim = ssimMean / m_frames.size();
+    m_summary.psnr = PsnrFromSse(m_sse[0] + m_sse[1] + m_sse[2], m_pixels[0] + m_pixels[1] + m_pixels[2]);
+    double seconds = (m_frames.back().pts - m_frames.front().pts + 1) * av_q2d(m_timeBase);
+    m_summary.bitRate = seconds > 0.0 ? bytes * 8 / seconds : 0.0;
+}
+
+bool QualityVerifier::WriteReport() const {
+    double psnrMean = 0.0;
+    for (const FrameQuality& frame : m_frames) {
+        psnrMean += frame.psnr[3];
+    }
+    psnrMean /= m_frames.size();
+    double ssimDb = m_summary.ssim < 1.0 ? -10.0 * std::log10(1.0 - m_summary.ssim) : QUALITY_PSNR_MAX;
+
+    std::string filename = QualityFilename(m_output);
+    std::ofstream file(filename, std::ios::trunc);
+    file << "{\n  \"recording\": \"" << m_output << "\",\n  \"encoder\": \"" << m_encoderName << "\",\n"
+         << "  \"frames\": " << m_frames.size() << ",\n  \"unmatched\": " << m_unmatched << ",\n"
+         << "  \"summary\": {\"psnr\": " << Number(m_summary.psnr)
+         << ", \"psnr_y\": " << Number(PsnrFromSse(m_sse[0], m_pixels[0]))
+         << ", \"psnr_u\": " << Number(PsnrFromSse(m_sse[1], m_pixels[1]))
+         << ", \"psnr_v\": " << Number(PsnrFromSse(m_sse[2], m_pixels[2]))
+         << ", \"psnr_mean\": " << Number(psnrMean) << ", \"psnr_min\": " << Number(m_summary.psnrMin)
+         << ", \"ssim\": " << Number(m_summary.ssim) << ", \"ssim_min\": " << Number(m_summary.ssimMin)
+         << ", \"ssim_db\": " << Number(ssimDb)
+         << ", \"bitrate_bps\": " << static_cast<int64_t>(m_summary.bitRate) << "},\n"
+         << "  \"per_frame\": [";
+    for (size_t i = 0; i < m_frames.size(); i++) {
+        const FrameQuality& frame = m_frames[i];
+        file << (i > 0 ? ",\n" : "\n") << "    {\"pts\": " << frame.pts << ", \"type\": \"" << frame.type
+             << "\", \"bytes\": " << frame.bytes << ", \"psnr\": " << Number(frame.psnr[3])
+             << ", \"psnr_y\": " << Number(frame.psnr[0]) << ", \"psnr_u\": " << Number(frame.psnr[1])
+             << ", \"psnr_v\": " << Number(frame.psnr[2]) << ", \"ssim\": " << Number(frame.ssim[3])
+             << ", \"ssim_y\": " << Number(frame.ssim[0]) << "}";
+    }
+    file << "\n  ]\n}\n";
+    if (!file) {
+        LogDebug("Could not write " + filename);
+        return false;
+    }
+
+    std::stringstream ss;
+    ss << m_encoderName << ": PSNR " << Number(m_summary.psnr) << " dB (min " << Number(m_summary.psnrMin)
+       << "), SSIM " << Number(m_summary.ssim) << " (min " << Number(m_summary.ssimMin) << ") over "
+       << m_frames.size() << " frames at " << static_cast<int64_t>(m_summary.bitRate / 1000) << " kbps";
+    LogConcise("Quality", ss.str());
+    return true;
+}
+
+void QualityVerifier::Release() {
+    for (auto& source : m_sources) {
+        av_frame_free(&source.second);
+    }
+    m_sources.clear();
+    m_newestSourcePts = AV_NOPTS_VALUE;
+    std::lock_guard<std::mutex> lock(m_packetMutex);
+    for (AVPacket*& packet : m_packets) {
+        av_packet_free(&packet);
+    }
+    m_packets.clear();
+    avcodec_free_context(&m_decoder);
+    av_frame_free(&m_decoded);
+}
@@ -0,0 +1,124 @@
+// quality.h
+#pragma once
+
+#include "encoder.h"
+#include "pipeline.h"
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#define QUALITY_EXTENSION "_quality.json"
+#define QUALITY_PSNR_MAX 100.0          // reported for identical planes instead of infinity
+#define QUALITY_TILE_ROWS 64            // rows per work unit; a multiple of 4 so SSIM windows never straddle tiles
+#define QUALITY_MAX_PENDING_FRAMES 256  // source frames kept while their packets are in the encoder
+#define QUALITY_MAX_QUEUED_FRAMES 64    // source frames waiting for the worker before it drops them
+
+// Squared error and SSIM sums of one 8-bit plane. SSIM is computed the way
+// x264 does: 8x8 windows on a 4-pixel grid, built from 4x4 block sums, with
+// the partial blocks at the right and bottom edges left out.
+struct PlaneQuality {
+    uint64_t sse;
+    int64_t pixels;
+    double ssimSum;
+    int64_t windows;
+};
+
+double PsnrFromSse(uint64_t sse, int64_t pixels);
+
+// Split into QUALITY_TILE_ROWS tiles across threads (0 = all cores). Uses SSE2
+// when available; the sums do not depend on the thread count and equal the
+// scalar reference exactly.
+PlaneQuality ComparePlane(const uint8_t* a, int strideA, const uint8_t* b, int strideB,
+                          int width, int height, int threads);
+PlaneQuality ComparePlaneScalar(const uint8_t* a, int strideA, const uint8_t* b, int strideB,
+                                int width, int height);
+
+// Index 0-2 are the Y, U and V planes, 3 all of them weighted by pixel count
+struct FrameQuality {
+    int64_t pts;
+    char type;          // picture type of the decoded frame, 'I', 'P' or 'B'
+    int64_t bytes;      // size of the packet that carried it
+    double psnr[4];
+    double ssim[4];
+    uint64_t sse[3];
+    int64_t pixels[3];
+};
+
+// The whole recording: PSNR from the summed squared error, SSIM the mean of the frames
+struct QualitySummary {
+    int64_t frames;
+    int64_t unmatched;  // sources without a decoded frame and decoded frames without a source
+    double psnr;
+    double psnrMin;
+    double ssim;
+    double ssimMin;
+    double bitRate;
+};
+
+// Both frames YUV420P; compares the area they have in common
+bool CompareFrames(const AVFrame* source, const AVFrame* decoded, int threads, FrameQuality& quality);
+
+// The report that belongs to an output: same name, QUALITY_EXTENSION.
+std::string QualityFilename(const std::string& output);
+
+// Decodes what one encoder produced and measures it against the frames it was
+// given, so encoder settings can be traded against objective numbers. Source
+// frames arrive like any other consumer's; packets arrive as an observer of
+// the encoder and are only queued on the encoding thread. Decoding and the
+// comparisons run here, at background priority. The per-frame and overall
+// numbers are written next to the recording when it finishes.
+class QualityVerifier : public FrameWorker, public PacketObserver {
+public:
+    QualityVerifier();
+    ~QualityVerifier() override;
+
+    // Add as an observer to the encoder first; Open needs its stream
+    bool Open(const std::string& output, const std::string& encoderName);
+    bool Active() const { return m_decoder != nullptr; }
+
+    void OnStreamOpened(const AVCodecContext* context) override;
+    void OnPacket(const AVPacket* packet, AVRational timeBase) override;
+
+    // Valid after Finish
+    const QualitySummary& Summary() const { return m_summary; }
+
+protected:
+    bool ProcessFrame(AVFrame* frame) override;
+    bool OnFinish() override;
+
+private:
+    void DecodePending(bool flush);
+    void ReceiveFrames();
+    void Measure(const AVFrame* decoded);
+    void DropSourcesBefore(int64_t pts);
+    void Summarize();
+    bool WriteReport() const;
+    void Release();
+
+    std::string m_output;
+    std::string m_encoderName;
+    AVCodecContext* m_decoder;
+    AVFrame* m_decoded;
+    AVRational m_timeBase;
+    int m_threads;
+
+    std::mutex m_packetMutex;
+    std::deque<AVPacket*> m_packets;
+    std::map<int64_t, AVFrame*> m_sources;
+    int64_t m_newestSourcePts;      // packets after it wait until their source arrives
+    std::map<int64_t, int64_t> m_packetBytes;
+
+    std::vector<FrameQuality> m_frames;
+    uint64_t m_sse[3];
+    int64_t m_pixels[3];
+    int64_t m_unmatched;
+    QualitySummary m_summary;
+};
@@ -0,0 +1,288 @@
+// rawsink.cpp
+#include "rawsink.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <chrono>
+#include <cstring>
+#include <sstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const intptr_t INVALID_TARGET = -1;
+
+bool IsNamedPipePath(const std::string& target) {
+    return target.compare(0, 9, "\\\\.\\pipe\\") == 0;
+}
+
+} // namespace
+
+RawFrameSink::RawFrameSink()
+        : FrameWorker("Raw sink"), m_format(RAW_FORMAT_Y4M), m_width(0), m_height(0), m_frameRate(0),
+          m_handle(INVALID_TARGET), m_isPipe(false), m_connected(false), m_ownsHandle(false),
+          m_frames(0), m_writes(0), m_bytesWritten(0), m_writeMs(0.0) {
+}
+
+RawFrameSink::~RawFrameSink() {
+    Finish();
+    CloseTarget();
+}
+
+bool RawFrameSink::Open(const std::string& target, RawFrameFormat format, int width, int height, int frameRate) {
+    m_target = target;
+    m_format = format;
+    m_width = width;
+    m_height = height;
+    m_frameRate = frameRate;
+    m_frames = 0;
+    m_writes = 0;
+    m_bytesWritten = 0;
+    m_writeMs = 0.0;
+    m_batch.clear();
+    m_batch.reserve(RAWSINK_BATCH_BYTES);
+
+    if (target == RAWSINK_STDOUT) {
+#ifdef _WIN32
+        m_handle = reinterpret_cast<intptr_t>(GetStdHandle(STD_OUTPUT_HANDLE));
+#else
+        m_handle = STDOUT_FILENO;
+#endif
+        m_isPipe = false;
+        m_connected = true;
+        m_ownsHandle = false;
+        // Log lines echoed to the console would corrupt the stream
+        SetConsoleLog(false);
+    } else {
+#ifdef _WIN32
+        m_isPipe = IsNamedPipePath(target);
+        HANDLE handle;
+        if (m_isPipe) {
+            handle = CreateNamedPipeA(target.c_str(), PIPE_ACCESS_OUTBOUND, PIPE_TYPE_BYTE | PIPE_WAIT,
+                                      1, RAWSINK_BATCH_BYTES, 0, 0, NULL);
+        } else {
+            handle = CreateFileA(target.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                                 CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        }
+        if (handle == INVALID_HANDLE_VALUE) {
+            LogDebug("Raw sink: could not open " + target + ". Error: " + std::to_string(GetLastError()));
+            return false;
+        }
+        m_handle = reinterpret_cast<intptr_t>(handle);
+        m_connected = !m_isPipe;
+#else
+        struct stat info;
+        m_isPipe = stat(target.c_str(), &info) == 0 && S_ISFIFO(info.st_mode);
+        if (m_isPipe) {
+            // Opening a FIFO for writing blocks until a reader appears; that happens in Connect
+            m_handle = INVALID_TARGET;
+            m_connected = false;
+        } else {
+            int fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                LogDebug("Raw sink: could not open " + target + ". Error: " + std::to_string(errno));
+                return false;
+            }
+            m_handle = fd;
+            m_connected = true;
+        }
+#endif
+        m_ownsHandle = true;
+    }
+#ifndef _WIN32
+    // A reader that closes its end turns into EPIPE from write() rather than a
+    // signal that kills the recorder; stdout may be a pipe too
+    if (m_isPipe || !m_ownsHandle) {
+        signal(SIGPIPE, SIG_IGN);
+    }
+#endif
+
+    if (m_format == RAW_FORMAT_Y4M) {
+        // 4:2:0 with centred chroma, which is what the converter's YUV420P is
+        std::stringstream header;
+        header << "YUV4MPEG2 W" << m_width << " H" << m_height << " F" << m_frameRate << ":1 Ip A1:1 C420jpeg"
+               << " XYSCSS=420JPEG XCOLORRANGE=LIMITED\n";
+        std::string text = header.str();
+        m_batch.insert(m_batch.end(), text.begin(), text.end());
+    }
+
+    LogConcise("RawSink", "Writing " + std::string(m_format == RAW_FORMAT_Y4M ? "Y4M" : "raw YUV420P") + " " +
+                          std::to_string(m_width) + "x" + std::to_string(m_height) + " to " + target);
+    SetMaxQueueDepth(RAWSINK_MAX_QUEUED_FRAMES);
+    Start();
+    return true;
+}
+
+bool RawFrameSink::ProcessFrame(AVFrame* frame) {
+    size_t chromaWidth = (m_width + 1) / 2;
+    size_t chromaHeight = (m_height + 1) / 2;
+    size_t frameSize = static_cast<size_t>(m_width) * m_height + 2 * chromaWidth * chromaHeight;
+    if (frame->width != m_width || frame->height != m_height) {
+        LogDebug("Raw sink: frame size changed to " + std::to_string(frame->width) + "x" +
+                 std::to_string(frame->height));
+        return false;
+    }
+
+    std::string frameHeader;
+    if (m_format == RAW_FORMAT_Y4M) {
+        // Timestamps in microseconds, so gaps from skipped ticks survive into the stream
+        int64_t us = m_frameRate > 0 ? frame->pts * 1000000 / m_frameRate : frame->pts;
+        frameHeader = "FRAME XPTS=" + std::to_string(us) + "\n";
+    }
+    if (!m_batch.empty() && m_batch.size() + frameHeader.size() + frameSize > m_batch.capacity()) {
+        if (!Flush()) {
+            return false;
+        }
+    }
+
+    m_batch.insert(m_batch.end(), frameHeader.begin(), frameHeader.end());
+    // Planes are padded to the buffer pool's alignment; only the visible rows go out
+    const size_t widths[3] = {static_cast<size_t>(m_width), chromaWidth, chromaWidth};
+    const size_t heights[3] = {static_cast<size_t>(m_height), chromaHeight, chromaHeight};
+    for (int plane = 0; plane < 3; plane++) {
+        const uint8_t* row = frame->data[plane];
+        for (size_t y = 0; y < heights[plane]; y++) {
+            m_batch.insert(m_batch.end(), row, row + widths[plane]);
+            row += frame->linesize[plane];
+        }
+    }
+    m_frames++;
+    return true;
+}
+
+bool RawFrameSink::OnFinish() {
+    // Nobody ever opened the pipe; stopping should not wait for someone to
+    if (!Connect(false)) {
+        LogConcise("RawSink", "No reader on " + m_target + ", " + std::to_string(m_frames) + " frames discarded");
+        m_batch.clear();
+        CloseTarget();
+        return false;
+    }
+    bool ok = Flush();
+    double seconds = m_writeMs / 1000.0;
+    std::stringstream ss;
+    ss << m_frames << " frames, " << m_bytesWritten << " bytes in " << m_writes << " writes to " << m_target;
+    if (seconds > 0) {
+        ss << ", " << (m_bytesWritten / (1024.0 * 1024.0)) / seconds << " MB/s while writing";
+    }
+    LogConcise("RawSink", ss.str());
+    CloseTarget();
+    return ok;
+}
+
+bool RawFrameSink::Connect(bool wait) {
+    if (m_connected) {
+        return true;
+    }
+    if (wait) {
+        LogDebug("Raw sink: waiting for a reader on " + m_target);
+    }
+#ifdef _WIN32
+    HANDLE pipe = reinterpret_cast<HANDLE>(m_handle);
+    // A non-blocking pipe reports ERROR_PIPE_LISTENING instead of waiting
+    DWORD mode = PIPE_READMODE_BYTE | (wait ? PIPE_WAIT : PIPE_NOWAIT);
+    SetNamedPipeHandleState(pipe, &mode, NULL, NULL);
+    bool connected = ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED;
+    DWORD error = GetLastError();
+    mode = PIPE_READMODE_BYTE | PIPE_WAIT;
+    SetNamedPipeHandleState(pipe, &mode, NULL, NULL);
+    if (!connected) {
+        if (wait) {
+            LogDebug("Raw sink: no reader connected to " + m_target + ". Error: " + std::to_string(error));
+        }
+        return false;
+    }
+#else
+    // Opening a FIFO without O_NONBLOCK blocks until a reader appears; with it,
+    // it fails with ENXIO when there is none
+    int fd = open(m_target.c_str(), O_WRONLY | (wait ? 0 : O_NONBLOCK));
+    if (fd < 0) {
+        if (wait || errno != ENXIO) {
+            LogDebug("Raw sink: could not open " + m_target + ". Error: " + std::to_string(errno));
+        }
+        return false;
+    }
+    if (!wait) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    }
+    m_handle = fd;
+#endif
+    m_connected = true;
+    return true;
+}
+
+bool RawFrameSink::Flush() {
+    if (m_batch.empty()) {
+        return true;
+    }
+    if (!Connect(true)) {
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool ok = WriteAll(m_batch.data(), m_batch.size());
+    m_writeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (ok) {
+        m_writes++;
+        m_bytesWritten += m_batch.size();
+        Metrics()->bytesWritten.fetch_add(m_batch.size(), std::memory_order_relaxed);
+    }
+    m_batch.clear();
+    return ok;
+}
+
+bool RawFrameSink::WriteAll(const uint8_t* data, size_t size) {
+    while (size > 0) {
+#ifdef _WIN32
+        DWORD chunk = static_cast<DWORD>(size > 0x40000000 ? 0x40000000 : size);
+        DWORD written = 0;
+        if (!WriteFile(reinterpret_cast<HANDLE>(m_handle), data, chunk, &written, NULL) || written == 0) {
+            LogDebug("Raw sink: write to " + m_target + " failed. Error: " + std::to_string(GetLastError()));
+            return false;
+        }
+#else
+        ssize_t written = write(static_cast<int>(m_handle), data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            LogDebug("Raw sink: write to " + m_target + " failed. Error: " + std::to_string(errno));
+            return false;
+        }
+#endif
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+void RawFrameSink::CloseTarget() {
+    if (m_handle == INVALID_TARGET) {
+        return;
+    }
+    if (m_ownsHandle) {
+#ifdef _WIN32
+        HANDLE handle = reinterpret_cast<HANDLE>(m_handle);
+        if (m_isPipe && m_connected) {
+            FlushFileBuffers(handle);
+            DisconnectNamedPipe(handle);
+        }
+        CloseHandle(handle);
+#else
+        close(static_cast<int>(m_handle));
+#endif
+    } else {
+        SetConsoleLog(true);
+    }
+    m_handle = INVALID_TARGET;
+    m_connected = false;
+}
@@ -0,0 +1,67 @@
+// rawsink.h
+#pragma once
+
+#include "pipeline.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define RAWSINK_BATCH_BYTES (8 * 1024 * 1024)  // frames are gathered up to this size per write
+#define RAWSINK_MAX_QUEUED_FRAMES 30             // about a second; later frames are dropped while the reader lags
+#define RAWSINK_STDOUT "-"
+
+enum RawFrameFormat {
+    RAW_FORMAT_Y4M,     // YUV4MPEG2 stream; every FRAME header carries the timestamp
+    RAW_FORMAT_PLANAR   // bare YUV420P planes, as read by ffmpeg -f rawvideo
+};
+
+// Writes converted frames out uncompressed instead of encoding them, to a
+// file, a named pipe or stdout. Used to measure capture and conversion on
+// their own and to feed external encoders or analysis tools.
+//
+// Targets: "-" is stdout; "\\.\pipe\name" creates a named pipe on Windows
+// and an existing FIFO is opened as-is elsewhere; anything else is a file.
+// Pipes are connected from the worker thread, so a reader that attaches
+// late only delays the sink, never the capture: at most
+// RAWSINK_MAX_QUEUED_FRAMES wait for it and the rest are dropped. A reader
+// that goes away fails the sink instead of raising SIGPIPE, and one that
+// never comes does not hold up the stop.
+class RawFrameSink : public FrameWorker {
+public:
+    RawFrameSink();
+    ~RawFrameSink() override;
+
+    bool Open(const std::string& target, RawFrameFormat format, int width, int height, int frameRate);
+
+    const std::string& Target() const { return m_target; }
+    int64_t BytesWritten() const { return m_bytesWritten; }
+
+protected:
+    bool ProcessFrame(AVFrame* frame) override;
+    bool OnFinish() override;
+
+private:
+    // Without wait, fails at once when no reader is there yet
+    bool Connect(bool wait);
+    bool Flush();
+    bool WriteAll(const uint8_t* data, size_t size);
+    void CloseTarget();
+
+    std::string m_target;
+    RawFrameFormat m_format;
+    int m_width;
+    int m_height;
+    int m_frameRate;
+
+    intptr_t m_handle;     // HANDLE on Windows, file descriptor elsewhere
+    bool m_isPipe;
+    bool m_connected;
+    bool m_ownsHandle;
+
+    std::vector<uint8_t> m_batch;
+    int64_t m_frames;
+    int64_t m_writes;
+    int64_t m_bytesWritten;
+    double m_writeMs;
+};
@@ -4,22 +4,37 @@
 ScreenRecorder* ScreenRecorder::s_instance = nullptr;
 const std::chrono::milliseconds ScreenRecorder::FRAME_INTERVAL(1000 / FRAME_RATE);
 
-std::ofstream logFile("debug.log", std::ios_base::app);
-std::string av_error_to_string(int errnum) {
-    char errbuf[AV_ERROR_MAX_STRING_SIZE];
-    av_strerror(errnum, errbuf, AV_ERROR_MAX_STRING_SIZE);
-    return std::string(errbuf);
-}
 ScreenRecorder::ScreenRecorder()
-        : m_isRecording(false), m_isSelecting(false),
-          m_formatContext(nullptr), m_videoStream(nullptr),
-          m_codecContext(nullptr), m_swsContext(nullptr),
-          m_overlayWindow(nullptr), m_selectionFeedbackWindow(nullptr) {
+        : m_isRecording(false), m_isSelecting(false), m_selectedRegion(),
+          m_overlayWindow(nullptr), m_indicatorWindow(nullptr), m_selectionFeedbackWindow(nullptr),
+          m_framesCaptured(0), m_profiles(DefaultEncoderProfiles()),
+          m_losslessIntermediate(false), m_trimHeadMs(0), m_trimTailMs(0), m_motionRangeHint(0),
+          m_rawFormat(RAW_FORMAT_Y4M),
+          m_thumbnailSeconds(THUMBNAIL_DEFAULT_SECONDS), m_thumbnailWebp(false),
+          m_animationSeconds(0), m_animationWebp(false),
+          m_dumpEvery(0), m_dumpFormat(FRAMEDUMP_QOI), m_stageSummary(true),
+          m_frameCode(false), m_replaySaving(false) {
     s_instance = this;
     InitializeDrawingResources();
 }
 
 ScreenRecorder::~ScreenRecorder() {
+    m_isRecording = false;
+    if (m_captureThread.joinable()) {
+        m_captureThread.join();
+    }
+    if (m_replaySaveThread.joinable()) {
+        m_replaySaveThread.join();
+    }
+    CancelTranscodes();
+    m_encoderWorkers.clear();
+    m_rawSink.reset();
+    m_frameRing.reset();
+    m_thumbnails.reset();
+    m_animation.reset();
+    m_frameDump.reset();
+    m_qualityVerifier.reset();
+    EncoderPool::Instance().Clear();
     CleanupDrawingResources();
     s_instance = nullptr;
 }
@@ -64,17 +79,16 @@ void ScreenRecorder::CleanupDrawingResources() {
 }
 
 void ScreenRecorder::LogDebug(const std::string& message) {
-    OutputDebugStringA((message + "\n").c_str());
-    logFile << message << std::endl;
-    logFile.flush();
-#ifdef _DEBUG
-    std::cout << message << std::endl;
-#endif
+    ::LogDebug(message);
 }
 
 void ScreenRecorder::StartRegionSelection() {
     if (!m_isRecording && !m_isSelecting) {
         m_isSelecting = true;
+        // Most recordings repeat the previous region, so its contexts open
+        // while the user drags; a different size is prepared on release
+        PrepareEncoders(m_selectedRegion.right - m_selectedRegion.left,
+                        m_selectedRegion.bottom - m_selectedRegion.top);
         ShowWindow(m_overlayWindow, SW_SHOW);
         SetForegroundWindow(m_overlayWindow);
         LogDebug("Region selection started");
@@ -84,13 +98,21 @@ void ScreenRecorder::StartRegionSelection() {
 void ScreenRecorder::StopRecording() {
     if (m_isRecording) {
         m_isRecording = false;
-        LogDebug("Recording stopped. Frames captured: " + std::to_string(m_capturedFrames.size()));
+        if (m_captureThread.joinable()) {
+            m_captureThread.join();
+        }
+        m_frameCodePainter.Stop();
+        PipelineMetrics::Instance().recording = 0;
+        LogDebug("Recording stopped. Frames captured: " + std::to_string(m_framesCaptured));
         HideRecordingIndicator();
         if (m_selectionFeedbackWindow) {
             DestroyWindow(m_selectionFeedbackWindow);
             m_selectionFeedbackWindow = nullptr;
         }
-        EncodeAndSaveVideo(GenerateUniqueFilename().c_str());
+        EncodeAndSaveVideo();
+        if (m_frameCode) {
+            LogDebug("Frame codes were painted; ScreenRecorder --analyze-latency <recording> measures them");
+        }
     }
 }
 void ScreenRecorder::ToggleRecording() {
@@ -110,17 +132,40 @@ void ScreenRecorder::ToggleRecording() {
 void ScreenRecorder::CaptureFrames() {
     LogCaptureDetails();
     LogConcise("CaptureFrames", "Entering CaptureFrames function");
-    auto startTime = std::chrono::high_resolution_clock::now();
+    TRACE_THREAD_NAME("Capture");
+    // Runs until the stop hotkey clears m_isRecording
     int frameCount = 0;
     while (m_isRecording) {
         auto frameStart = std::chrono::high_resolution_clock::now();
 
-        LogConcise("CaptureFrames", "Starting capture of frame " + std::to_string(frameCount));
-        std::vector<BYTE> frame = CaptureScreen();
-        LogConcise("CaptureFrames", "Finished capture of frame " + std::to_string(frameCount) +
-                                    ". Frame size: " + std::to_string(frame.size()) + " bytes");
+        // At reduced frame rates whole ticks are skipped; the gaps stay in the timestamps
+        if (frameCount % m_qualityController.Level().frameStride == 0) {
+            TRACE_SCOPE_FRAME("Frame", frameCount);
+            LogConcise("CaptureFrames", "Starting capture of frame " + std::to_string(frameCount));
+            int64_t captureUs = av_gettime_relative();
+            PROBE_CAPTURE_START(frameCount, captureUs);
+            std::vector<BYTE> frame = CaptureScreen();
+            PROBE_CAPTURE_END(frameCount, frame.size(), m_selectedRegion.right - m_selectedRegion.left,
+                              m_selectedRegion.bottom - m_selectedRegion.top);
+            LogConcise("CaptureFrames", "Finished capture of frame " + std::to_string(frameCount) +
+                                        ". Frame size: " + std::to_string(frame.size()) + " bytes");
+
+            if (!frame.empty() && SubmitFrame(frame, frameCount, captureUs)) {
+                m_framesCaptured++;
+                PipelineMetrics::Instance().FrameCaptured(captureUs);
+            }
+            // The dump takes the buffer itself once the frame is converted
+            if (m_frameDump) {
+                m_frameDump->Dump(frame, m_selectedRegion.right - m_selectedRegion.left,
+                                  m_selectedRegion.bottom - m_selectedRegion.top, frameCount);
+            }
 
-        m_capturedFrames.push_back(std::move(frame));
+            double captureMs = std::chrono::duration<double, std::milli>(
+                    std::chrono::high_resolution_clock::now() - frameStart).count();
+            if (m_qualityController.Update(SamplePipeline(captureMs))) {
+                ApplyQualityLevel();
+            }
+        }
         frameCount++;
 
         auto frameEnd = std::chrono::high_resolution_clock::now();
@@ -129,14 +174,8 @@ void ScreenRecorder::CaptureFrames() {
         if (frameDuration < FRAME_INTERVAL) {
             std::this_thread::sleep_for(FRAME_INTERVAL - frameDuration);
         }
-
-        // Ensure we capture for at least 1 second
-        auto elapsedTime = std::chrono::duration_cast<std::chrono::milliseconds>(frameEnd - startTime);
-        if (elapsedTime >= std::chrono::seconds(1)) {
-            break;
-        }
     }
-    LogConcise("CaptureFrames", "Exiting CaptureFrames function. Frames captured: " + std::to_string(m_capturedFrames.size()));
+    LogConcise("CaptureFrames", "Exiting CaptureFrames function. Frames captured: " + std::to_string(m_framesCaptured));
     LogCaptureDetails();
 }
 std::vector<BYTE> ScreenRecorder::CaptureScreen() {
@@ -172,9 +211,14 @@ std::vector<BYTE> ScreenRecorder::CaptureScreen() {
 
     HBITMAP hOldBitmap = (HBITMAP)SelectObject(hMemoryDC, hBitmap);
 
-    if (!BitBlt(hMemoryDC, 0, 0, width, height,
-                hScreenDC, m_selectedRegion.left, m_selectedRegion.top,
-                SRCCOPY | CAPTUREBLT)) {
+    BOOL blitted;
+    {
+        ScopedStageTimer timer(STAGE_CAPTURE);
+        blitted = BitBlt(hMemoryDC, 0, 0, width, height,
+                         hScreenDC, m_selectedRegion.left, m_selectedRegion.top,
+                         SRCCOPY | CAPTUREBLT);
+    }
+    if (!blitted) {
         LogDebug("BitBlt failed. Error: " + std::to_string(GetLastError()));
         SelectObject(hMemoryDC, hOldBitmap);
         DeleteObject(hBitmap);
@@ -193,7 +237,12 @@ std::vector<BYTE> ScreenRecorder::CaptureScreen() {
 
     std::vector<BYTE> buffer(width * height * 4);
 
-    if (!GetDIBits(hMemoryDC, hBitmap, 0, height, buffer.data(), (BITMAPINFO*)&bi, DIB_RGB_COLORS)) {
+    int copied;
+    {
+        ScopedStageTimer timer(STAGE_COPY);
+        copied = GetDIBits(hMemoryDC, hBitmap, 0, height, buffer.data(), (BITMAPINFO*)&bi, DIB_RGB_COLORS);
+    }
+    if (!copied) {
         LogDebug("GetDIBits failed. Error: " + std::to_string(GetLastError()));
         SelectObject(hMemoryDC, hOldBitmap);
         DeleteObject(hBitmap);
@@ -202,20 +251,6 @@ std::vector<BYTE> ScreenRecorder::CaptureScreen() {
         return {};
     }
 
-    // Log corner pixel colors for debugging
-    auto logPixel = [&](int x, int y, const std::string& corner) {
-        int index = (y * width + x) * 4;
-        LogDebug(corner + " pixel: R" + std::to_string(buffer[index + 2]) +
-                 " G" + std::to_string(buffer[index + 1]) +
-                 " B" + std::to_string(buffer[index]) +
-                 " A" + std::to_string(buffer[index + 3]));
-    };
-
-    logPixel(0, 0, "TopLeft");
-    logPixel(width - 1, 0, "TopRight");
-    logPixel(0, height - 1, "BottomLeft");
-    logPixel(width - 1, height - 1, "BottomRight");
-
     SelectObject(hMemoryDC, hOldBitmap);
     DeleteObject(hBitmap);
     DeleteDC(hMemoryDC);
@@ -224,218 +259,461 @@ std::vector<BYTE> ScreenRecorder::CaptureScreen() {
     LogDebug("Capture completed. Buffer size: " + std::to_string(buffer.size()) + " bytes");
     return buffer;
 }
+void ScreenRecorder::SetReplayMode(int seconds, int64_t maxBytes) {
+    if (m_isRecording) {
+        return;
+    }
+    if (seconds > 0) {
+        m_replayRing.reset(new ReplayRing(seconds, maxBytes));
+        LogDebug("Replay mode: keeping the last " + std::to_string(seconds) + " s, at most " +
+                 std::to_string(maxBytes) + " bytes");
+    } else {
+        m_replayRing.reset();
+    }
+}
+void ScreenRecorder::SaveReplay() {
+    if (!m_replayRing) {
+        return;
+    }
+    // Muxing runs off the hook thread, one save at a time
+    if (m_replaySaving) {
+        LogDebug("Replay save already in progress");
+        return;
+    }
+    if (m_replaySaveThread.joinable()) {
+        m_replaySaveThread.join();
+    }
+    std::string filename = ProfileFilename(GenerateUniqueFilename(), EncoderProfile{"replay", "_replay"});
+    ReplayRing* ring = m_replayRing.get();
+    m_replaySaving = true;
+    m_replaySaveThread = std::thread([this, ring, filename] {
+        bool saved = ring->Save(filename);
+        m_replaySaving = false;
+        // The message box gets its own thread so it never holds up the next save
+        std::thread([saved, filename] {
+            if (saved) {
+                LogDebug("Replay saved to " + filename);
+                MessageBox(NULL, ("Replay saved!\n" + filename).c_str(), "Success", MB_OK | MB_ICONINFORMATION);
+            } else {
+                MessageBox(NULL, "Failed to save the replay buffer!", "Error", MB_OK | MB_ICONERROR);
+            }
+        }).detach();
+    });
+}
+void ScreenRecorder::SetRawOutput(const std::string& target, RawFrameFormat format) {
+    if (m_isRecording) {
+        return;
+    }
+    m_rawTarget = target;
+    m_rawFormat = format;
+    if (!target.empty()) {
+        LogDebug("Raw mode: frames go to " + target + " without encoding");
+    }
+}
+void ScreenRecorder::SetSegmentPolicy(const SegmentPolicy& policy) {
+    for (EncoderProfile& profile : m_profiles) {
+        if (profile.url.empty()) {
+            profile.segments = policy;
+        }
+    }
+    if (policy.Enabled()) {
+        LogDebug("Segmenting outputs every " + std::to_string(policy.durationSeconds) + " s / " +
+                 std::to_string(policy.maxBytes) + " bytes, keeping " + std::to_string(policy.maxSegments) +
+                 " segments / " + std::to_string(policy.maxTotalBytes) + " bytes (0 = unlimited)");
+    }
+}
+void ScreenRecorder::PrepareEncoders(int width, int height) {
+    if (width < 2 || height < 2 || !m_rawTarget.empty()) {
+        return;
+    }
+    std::vector<EncoderProfile> profiles = m_profiles;
+    if (m_replayRing) {
+        profiles.resize(1);
+    } else if (m_losslessIntermediate) {
+        profiles.assign(1, LosslessIntermediateProfile());
+    }
+    EncoderPool::Instance().Prepare(GenerateUniqueFilename(), width, height, FRAME_RATE, profiles, m_motionRangeHint);
+}
 bool ScreenRecorder::InitializeVideoEncoder(const char* filename, int width, int height) {
     LogDebug("Initializing video encoder...");
-    LogDebug("Original dimensions: " + std::to_string(width) + "x" + std::to_string(height));
-
-    width = roundToEven(width);
-    height = roundToEven(height);
-
-    LogDebug("Adjusted dimensions: " + std::to_string(width) + "x" + std::to_string(height));
-
     LogDebug("FFmpeg version: " + std::string(av_version_info()));
-    char error[AV_ERROR_MAX_STRING_SIZE];
-    int ret;
 
-    // Allocate the output media context
-    avformat_alloc_output_context2(&m_formatContext, NULL, NULL, filename);
-    if (!m_formatContext) {
-        LogDebug("Could not allocate output context");
+    if (!m_converter.Open(roundToEven(width), roundToEven(height))) {
         return false;
     }
 
-    // Find the encoder
-    const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
-    if (!codec) {
-        LogDebug("Could not find libx264 encoder");
-        return false;
+    m_outputFilename = filename;
+    std::vector<EncoderProfile> profiles = m_profiles;
+    if (!m_rawTarget.empty()) {
+        profiles.clear();
+    } else if (m_replayRing) {
+        profiles.resize(1);
+        LogDebug("Encoding into the replay buffer; press Win+Shift+R to save it");
+    } else if (m_losslessIntermediate) {
+        profiles.assign(1, LosslessIntermediateProfile());
+        LogDebug("Recording to a lossless intermediate; delivery encodes run after stop");
     }
 
-    // Create a new video stream
-    m_videoStream = avformat_new_stream(m_formatContext, NULL);
-    if (!m_videoStream) {
-        LogDebug("Could not allocate stream");
-        return false;
+    m_encoderWorkers.clear();
+    // Observers go in before the encoders open
+    m_qualityVerifier.reset();
+    if (!m_verifyProfile.empty() && !m_replayRing && m_rawTarget.empty()) {
+        m_qualityVerifier.reset(new QualityVerifier());
+        // Behind at low priority, it drops frames rather than hold every one in memory
+        m_qualityVerifier->SetMaxQueueDepth(QUALITY_MAX_QUEUED_FRAMES);
     }
-
-    // Allocate an encoding context
-    m_codecContext = avcodec_alloc_context3(codec);
-    if (!m_codecContext) {
-        LogDebug("Could not allocate encoding context");
-        return false;
+    std::string verifiedOutput;
+    for (const EncoderProfile& profile : profiles) {
+        std::unique_ptr<EncoderWorker> worker(new EncoderWorker(profile));
+        std::string output = ProfileFilename(filename, profile);
+        if (m_replayRing) {
+            worker->AddObserver(m_replayRing.get());
+            output.clear();
+        }
+        if (m_qualityVerifier && profile.name == m_verifyProfile) {
+            worker->AddObserver(m_qualityVerifier.get());
+            verifiedOutput = output;
+        }
+        if (!worker->Open(output, width, height, FRAME_RATE, m_motionRangeHint)) {
+            LogDebug("Failed to open the " + profile.name + " encoder");
+            for (auto& opened : m_encoderWorkers) {
+                opened->Finish();
+            }
+            m_encoderWorkers.clear();
+            m_converter.Close();
+            return false;
+        }
+        m_encoderWorkers.push_back(std::move(worker));
+    }
+    // Left in place when it cannot start: the encoder already holds it as an observer
+    if (m_qualityVerifier) {
+        m_qualityVerifier->Open(verifiedOutput, m_verifyProfile);
+    }
+    if (!m_rawTarget.empty()) {
+        m_rawSink.reset(new RawFrameSink());
+        if (!m_rawSink->Open(m_rawTarget, m_rawFormat, m_converter.Width(), m_converter.Height(), FRAME_RATE)) {
+            m_rawSink.reset();
+            m_converter.Close();
+            return false;
+        }
+    }
+    if (m_thumbnailSeconds > 0 && !m_replayRing && m_rawTarget.empty()) {
+        m_thumbnails.reset(new ThumbnailWorker());
+        if (!m_thumbnails->Open(filename, m_converter.Width(), m_converter.Height(), FRAME_RATE,
+                                m_thumbnailSeconds, m_thumbnailWebp)) {
+            LogDebug("Thumbnails disabled for this recording");
+            m_thumbnails.reset();
+        }
+    }
+    if (m_animationSeconds > 0 && !m_replayRing && m_rawTarget.empty()) {
+        std::string stem = filename;
+        size_t dot = stem.find_last_of('.');
+        if (dot != std::string::npos && dot > stem.find_last_of("/\\") + 1) {
+            stem.resize(dot);
+        }
+        m_animation.reset(new AnimationExporter());
+        if (!m_animation->Open(stem + (m_animationWebp ? ".webp" : ".gif"), m_converter.Width(), m_converter.Height(),
+                               FRAME_RATE, m_animationSeconds)) {
+            LogDebug("Animation export disabled for this recording");
+            m_animation.reset();
+        }
+    }
+    if (m_dumpEvery > 0) {
+        m_frameDump.reset(new FrameDumpSink());
+        if (!m_frameDump->Open(filename, m_dumpFormat, m_dumpEvery)) {
+            m_frameDump.reset();
+        }
+    }
+    if (!m_shareName.empty()) {
+        // Sharing is a side channel; the recording goes ahead without it
+        m_frameRing.reset(new SharedFrameRing());
+        if (!m_frameRing->Open(m_shareName, m_converter.Width(), m_converter.Height(), FRAME_RATE)) {
+            LogDebug("Frame sharing disabled for this recording");
+            m_frameRing.reset();
+        }
     }
 
-    // Set codec parameters
-    m_codecContext->codec_id = AV_CODEC_ID_H264;
-    m_codecContext->codec_type = AVMEDIA_TYPE_VIDEO;
-    m_codecContext->width = width;
-    m_codecContext->height = height;
-    m_codecContext->time_base.num = 1;
-    m_codecContext->time_base.den = FRAME_RATE;
-    m_codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
-    m_codecContext->bit_rate = 1000000;  // Increase bitrate to 1 Mbps
-    m_codecContext->gop_size = 10;
-    m_codecContext->max_b_frames = 1;
-    m_codecContext->qmin = 10;
-    m_codecContext->qmax = 51;
-
-    // Set global header flags if needed
-    if (m_formatContext->oformat->flags & AVFMT_GLOBALHEADER)
-        m_codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-    // Open the codec
-    ret = avcodec_open2(m_codecContext, codec, NULL);
-    if (ret < 0) {
-        av_strerror(ret, error, AV_ERROR_MAX_STRING_SIZE);
-        LogDebug("Could not open codec: " + std::string(error));
+    m_framesCaptured = 0;
+    m_prevRowHashes.clear();
+    m_scrollEstimates.clear();
+    m_damage.Reset();
+    StageStats::Instance().Reset();
+    m_qualityController.Reset();
+    LogDebug("Video encoder initialized successfully");
+    return true;
+}
+bool ScreenRecorder::SubmitFrame(const std::vector<BYTE>& bgra, int64_t pts, int64_t captureUs) {
+    int width = m_selectedRegion.right - m_selectedRegion.left;
+    int height = m_selectedRegion.bottom - m_selectedRegion.top;
+    if (bgra.size() < static_cast<size_t>(width) * height * 4) {
         return false;
     }
 
-    // Copy codec parameters to the stream
-    ret = avcodec_parameters_from_context(m_videoStream->codecpar, m_codecContext);
-    if (ret < 0) {
-        av_strerror(ret, error, AV_ERROR_MAX_STRING_SIZE);
-        LogDebug("Could not copy codec parameters: " + std::string(error));
+    // Detect pure scrolls against the previous frame so the encoder can be hinted
+    auto analyzeStart = std::chrono::steady_clock::now();
+    ScrollEstimate scroll = {0, 0, 0, 0, 0, false};
+    std::vector<uint32_t> rowHashes;
+    HashRows(bgra.data(), width, height, width * 4, rowHashes);
+    if (!m_prevRowHashes.empty()) {
+        scroll = EstimateVerticalShift(m_prevRowHashes, rowHashes);
+        if (scroll.isScroll) {
+            LogConcise("Scroll", "Frame " + std::to_string(pts) + " shift " + std::to_string(scroll.shift) +
+                                 " exposed rows " + std::to_string(scroll.exposedTop) + "-" +
+                                 std::to_string(scroll.exposedBottom));
+        }
+    }
+    m_prevRowHashes.swap(rowHashes);
+    m_scrollEstimates.push_back(scroll);
+    DamageStats damage = m_damage.Update(bgra.data(), width, height, width * 4);
+    RecordStage(STAGE_ANALYZE, analyzeStart);
+
+    // Convert once; every encoder gets a reference to the same pixels
+    AVFrame* frame;
+    {
+        ScopedStageTimer timer(STAGE_CONVERT);
+        PROBE_CONVERT_START(pts, width, height);
+        frame = m_converter.Convert(bgra.data(), width * 4, pts);
+        PROBE_CONVERT_END(pts);
+    }
+    if (!frame) {
         return false;
     }
+    AttachScrollRoi(frame, scroll);
+    SetCaptureInfo(frame, CaptureInfo{captureUs, damage.changedTiles, damage.totalTiles});
 
-    // Open the output file
-    ret = avio_open(&m_formatContext->pb, filename, AVIO_FLAG_WRITE);
-    if (ret < 0) {
-        av_strerror(ret, error, AV_ERROR_MAX_STRING_SIZE);
-        LogDebug("Could not open output file: " + std::string(error));
-        return false;
+    TRACE_SCOPE_FRAME("Submit", pts);
+    bool submitted = false;
+    for (auto& worker : m_encoderWorkers) {
+        submitted = worker->Submit(frame) || submitted;
+    }
+    if (m_rawSink) {
+        submitted = m_rawSink->Submit(frame) || submitted;
+    }
+    if (m_frameRing) {
+        m_frameRing->Submit(frame);
     }
+    if (m_thumbnails) {
+        m_thumbnails->Submit(frame);
+    }
+    if (m_animation) {
+        m_animation->Submit(frame);
+    }
+    if (m_qualityVerifier && m_qualityVerifier->Active()) {
+        m_qualityVerifier->Submit(frame);
+    }
+    av_frame_free(&frame);
+    return submitted;
+}
+PipelineSample ScreenRecorder::SamplePipeline(double captureMs) const {
+    PipelineSample sample = {0, captureMs, 0.0, static_cast<double>(FRAME_INTERVAL.count())};
+    for (const auto& worker : m_encoderWorkers) {
+        sample.queueDepth = (std::max)(sample.queueDepth, worker->QueueDepth());
+        sample.encodeMs = (std::max)(sample.encodeMs, worker->AverageProcessMs());
+    }
+    if (m_rawSink) {
+        sample.queueDepth = (std::max)(sample.queueDepth, m_rawSink->QueueDepth());
+        sample.encodeMs = (std::max)(sample.encodeMs, m_rawSink->AverageProcessMs());
+    }
+    return sample;
+}
+void ScreenRecorder::ApplyQualityLevel() {
+    const QualityLevel& level = m_qualityController.Level();
+    PipelineMetrics::Instance().qualityStep.store(level.qualityStep, std::memory_order_relaxed);
+    for (auto& worker : m_encoderWorkers) {
+        worker->SetQualityStep(level.qualityStep);
+        worker->SetMaxQueueDepth(level.dropFrames ? QUALITY_QUEUE_HIGH : 0);
+    }
+    if (m_rawSink) {
+        m_rawSink->SetMaxQueueDepth(level.dropFrames ? QUALITY_QUEUE_HIGH : RAWSINK_MAX_QUEUED_FRAMES);
+    }
+}
+void ScreenRecorder::EncodeAndSaveVideo() {
+    LogDebug("Starting to encode and save video...");
+    PROBE_FINISH_START(m_framesCaptured);
+#ifdef SCREENRECORDER_TRACING
+    auto finishStart = std::chrono::steady_clock::now();
+#endif
 
-    // Write the stream header
-    ret = avformat_write_header(m_formatContext, NULL);
-    if (ret < 0) {
-        av_strerror(ret, error, AV_ERROR_MAX_STRING_SIZE);
-        LogDebug("Error occurred when opening output file: " + std::string(error));
-        return false;
+    bool ok = true;
+    std::string savedFiles;
+    std::vector<std::pair<std::string, EncoderProfile>> outputs;
+    for (auto& worker : m_encoderWorkers) {
+        worker->RequestFinish();
+    }
+    if (m_rawSink) {
+        m_rawSink->RequestFinish();
+        m_rawSink->Finish();
+        if (m_rawSink->Dropped() > 0) {
+            LogConcise("Quality", m_rawSink->Name() + " dropped " + std::to_string(m_rawSink->Dropped()) + " frames");
+        }
+        if (m_rawSink->Failed()) {
+            LogDebug(m_rawSink->Name() + " failed");
+            ok = false;
+        } else if (m_framesCaptured > 0) {
+            savedFiles += "\n" + m_rawSink->Target();
+        }
+        m_rawSink.reset();
+    }
+    m_frameRing.reset();
+    m_thumbnails.reset();
+    m_frameDump.reset();
+    if (m_animation) {
+        // Best effort, like the thumbnails: a failed clip does not fail the recording
+        m_animation->RequestFinish();
+        m_animation->Finish();
+        if (!m_animation->Failed() && m_framesCaptured > 0) {
+            savedFiles += "\n" + m_animation->Filename();
+        }
+        m_animation.reset();
+    }
+    for (auto& worker : m_encoderWorkers) {
+        worker->Finish();
+        outputs.emplace_back(worker->Encoder().Filename(), worker->Profile());
+        if (worker->Dropped() > 0) {
+            LogConcise("Quality", worker->Name() + " dropped " + std::to_string(worker->Dropped()) + " frames");
+        }
+        if (worker->Failed()) {
+            LogDebug(worker->Name() + " failed");
+            ok = false;
+        } else if (m_framesCaptured > 0) {
+            savedFiles += "\n" + worker->Encoder().Filename();
+        }
+    }
+    if (m_qualityVerifier) {
+        // After the encoders, so the packets of their final flush are measured too
+        m_qualityVerifier->RequestFinish();
+        m_qualityVerifier->Finish();
+        m_qualityVerifier.reset();
     }
 
-    // Initialize the SwsContext for pixel format conversion
-    m_swsContext = sws_getContext(width, height, AV_PIX_FMT_BGRA,
-                                  width, height, AV_PIX_FMT_YUV420P,
-                                  SWS_BICUBIC, NULL, NULL, NULL);
+    // Files are opened when recording starts, so drop the empty ones
+    if (m_framesCaptured == 0 && !m_replayRing) {
+        for (auto& worker : m_encoderWorkers) {
+            std::remove(worker->Encoder().Filename().c_str());
+            std::remove(FrameIndexFilename(worker->Encoder().Filename()).c_str());
+        }
+    }
+    // The converter stays open for the next recording of the same size
+    m_encoderWorkers.clear();
+    LogConcise("Quality", m_qualityController.Summary());
+    if (m_stageSummary && m_framesCaptured > 0) {
+        StageStats::Instance().WriteSummary(StatsFilename(m_outputFilename), m_outputFilename, m_framesCaptured);
+    }
+#ifdef SCREENRECORDER_TRACING
+    TraceComplete("FinishOutputs", finishStart, std::chrono::steady_clock::now(), -1);
+#endif
+    PROBE_FINISH_END(m_framesCaptured, ok);
+    // Written before any message box, which would hold the trace open
+    if (TracingActive() && m_framesCaptured > 0) {
+        WriteTrace(TraceFilename(m_outputFilename));
+    }
 
-    if (!m_swsContext) {
-        LogDebug("Could not initialize the conversion context");
-        return false;
+    m_motionRangeHint = SuggestMotionRange(m_scrollEstimates);
+    int scrolls = 0;
+    for (const ScrollEstimate& estimate : m_scrollEstimates) {
+        if (estimate.isScroll) scrolls++;
     }
+    LogDebug("Scroll detection: " + std::to_string(scrolls) + " of " + std::to_string(m_scrollEstimates.size()) +
+             " frames are pure scrolls, next motion range hint " + std::to_string(m_motionRangeHint));
 
-    LogDebug("Video encoder initialized successfully");
-    return true;
-}
-void ScreenRecorder::EncodeAndSaveVideo(const char* filename) {
-    LogDebug("Starting to encode and save video...");
-    if (m_capturedFrames.empty()) {
+    if (m_framesCaptured == 0) {
         LogDebug("No frames captured!");
         MessageBox(NULL, "No frames captured!", "Error", MB_OK | MB_ICONERROR);
         return;
     }
-
-    int width = m_selectedRegion.right - m_selectedRegion.left;
-    int height = m_selectedRegion.bottom - m_selectedRegion.top;
-
-    LogDebug("Encoding video with dimensions: " + std::to_string(width) + "x" + std::to_string(height));
-    if (!InitializeVideoEncoder(filename, width, height)) {
-        LogDebug("Failed to initialize video encoder!");
-        MessageBox(NULL, "Failed to initialize video encoder!", "Error", MB_OK | MB_ICONERROR);
+    if (!ok) {
+        MessageBox(NULL, "Failed to encode video!", "Error", MB_OK | MB_ICONERROR);
         return;
     }
 
-    AVFrame *frame = av_frame_alloc();
-    if (!frame) {
-        LogDebug("Could not allocate video frame");
+    if (m_replayRing) {
+        LogDebug("Replay buffer stopped with " + std::to_string(m_replayRing->Seconds()) + " s buffered");
         return;
     }
-    frame->format = m_codecContext->pix_fmt;
-    frame->width  = m_codecContext->width;
-    frame->height = m_codecContext->height;
-    int ret = av_frame_get_buffer(frame, 32);
-    if (ret < 0) {
-        LogDebug("Could not allocate frame data.");
+    if (m_trimHeadMs > 0 || m_trimTailMs > 0) {
+        for (const auto& output : outputs) {
+            TrimOutput(output.first, output.second);
+        }
+    }
+    if (m_losslessIntermediate) {
+        StartTranscode(ProfileFilename(m_outputFilename, LosslessIntermediateProfile()));
         return;
     }
 
-    AVPacket *pkt = av_packet_alloc();
-    if (!pkt) {
-        LogDebug("Could not allocate packet");
+    LogDebug("Video saved successfully!" + savedFiles);
+    MessageBox(NULL, ("Video saved successfully!" + savedFiles).c_str(), "Success", MB_OK | MB_ICONINFORMATION);
+}
+void ScreenRecorder::TrimOutput(const std::string& filename, const EncoderProfile& profile) {
+    // Segmented outputs are already split at keyframes and streams are gone;
+    // trimming applies to single files
+    if (filename.find("://") != std::string::npos) {
         return;
     }
-
-    AVRational src_tb;
-    src_tb.num = 1;
-    src_tb.den = FRAME_RATE;
-
-    for (size_t i = 0; i < m_capturedFrames.size(); i++) {
-        const uint8_t *srcSlice[1] = { m_capturedFrames[i].data() };
-        int srcStride[1] = { width * 4 };  // 4 bytes per pixel for BGRA
-
-        sws_scale(m_swsContext, srcSlice, srcStride, 0, height,
-                  frame->data, frame->linesize);
-
-        frame->pts = i;
-
-        ret = avcodec_send_frame(m_codecContext, frame);
-        if (ret < 0) {
-            LogDebug("Error sending frame for encoding: " + av_error_to_string(ret));
-            break;
-        }
-
-        while (ret >= 0) {
-            ret = avcodec_receive_packet(m_codecContext, pkt);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                break;
-            } else if (ret < 0) {
-                LogDebug("Error during encoding: " + av_error_to_string(ret));
-                break;
-            }
-
-            LogDebug("Encoded frame " + std::to_string(i) + ", size: " + std::to_string(pkt->size) + " bytes");
-
-            av_packet_rescale_ts(pkt, src_tb, m_videoStream->time_base);
-            pkt->stream_index = m_videoStream->index;
-            ret = av_interleaved_write_frame(m_formatContext, pkt);
-            if (ret < 0) {
-                LogDebug("Error writing frame: " + av_error_to_string(ret));
-            }
-            av_packet_unref(pkt);
-        }
+    if (filename.size() >= strlen(SEGMENT_PLAYLIST_EXTENSION) &&
+        filename.compare(filename.size() - strlen(SEGMENT_PLAYLIST_EXTENSION), std::string::npos,
+                         SEGMENT_PLAYLIST_EXTENSION) == 0) {
+        return;
     }
-
-    // Flush the encoder
-    avcodec_send_frame(m_codecContext, NULL);
-    while (true) {
-        ret = avcodec_receive_packet(m_codecContext, pkt);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            break;
-        } else if (ret < 0) {
-            LogDebug("Error flushing encoder");
-            break;
+    std::string trimmed = ProfileFilename(filename, EncoderProfile{"trim", "_trimming"});
+    if (!TrimRecording(filename, trimmed, m_trimHeadMs / 1000.0, m_trimTailMs > 0 ? -m_trimTailMs / 1000.0 : 0.0, true, &profile)) {
+        LogDebug("Keeping untrimmed " + filename);
+        return;
+    }
+    std::remove(filename.c_str());
+    if (std::rename(trimmed.c_str(), filename.c_str()) != 0) {
+        LogDebug("Could not replace " + filename + " with its trimmed copy " + trimmed);
+    }
+    // Offsets and frame numbers in the sidecar no longer match the trimmed file
+    std::remove(FrameIndexFilename(filename).c_str());
+}
+void ScreenRecorder::StartTranscode(const std::string& intermediateFile) {
+    // Forget jobs that have already finished
+    for (auto it = m_transcodeJobs.begin(); it != m_transcodeJobs.end();) {
+        if ((*it)->IsRunning()) {
+            ++it;
+        } else {
+            (*it)->Wait();
+            it = m_transcodeJobs.erase(it);
         }
-
-        LogDebug("Flushed frame, size: " + std::to_string(pkt->size) + " bytes");
-
-        av_packet_rescale_ts(pkt, src_tb, m_videoStream->time_base);
-        pkt->stream_index = m_videoStream->index;
-        av_interleaved_write_frame(m_formatContext, pkt);
-        av_packet_unref(pkt);
     }
 
-    av_write_trailer(m_formatContext);
-
-    avcodec_free_context(&m_codecContext);
-    av_frame_free(&frame);
-    av_packet_free(&pkt);
-    sws_freeContext(m_swsContext);
-    avio_closep(&m_formatContext->pb);
-    avformat_free_context(m_formatContext);
-
-    LogDebug("Video saved successfully!");
-    MessageBox(NULL, "Video saved successfully!", "Success", MB_OK | MB_ICONINFORMATION);
+    std::unique_ptr<TranscodeJob> job(new TranscodeJob(intermediateFile, m_outputFilename, m_profiles));
+    job->SetThrottle(FRAME_RATE * 2);
+    bool started = job->Start(
+            [intermediateFile](double progress) {
+                LogConcise("Transcode", intermediateFile + " " + std::to_string(static_cast<int>(progress * 100)) + "%");
+            },
+            [window = m_overlayWindow](bool success, const std::vector<std::string>& outputs) {
+                if (!success) {
+                    LogDebug("Background transcode failed or was cancelled");
+                    return;
+                }
+                std::string savedFiles;
+                for (const std::string& output : outputs) {
+                    savedFiles += "\n" + output;
+                }
+                LogDebug("Video saved successfully!" + savedFiles);
+                // This runs on the job thread; the message box belongs to the UI thread
+                std::string* message = new std::string("Video saved successfully!" + savedFiles);
+                if (!PostMessage(window, WM_TRANSCODE_DONE, 0, reinterpret_cast<LPARAM>(message))) {
+                    delete message;
+                }
+            });
+    if (!started) {
+        LogDebug("Failed to start background transcode of " + intermediateFile);
+        return;
+    }
+    LogDebug("Background transcode started for " + intermediateFile);
+    m_transcodeJobs.push_back(std::move(job));
+}
+void ScreenRecorder::CancelTranscodes() {
+    for (auto& job : m_transcodeJobs) {
+        job->Cancel();
+    }
+    for (auto& job : m_transcodeJobs) {
+        job->Wait();
+    }
+    m_transcodeJobs.clear();
 }
     std::string ScreenRecorder::GenerateUniqueFilename() {
         auto now = std::chrono::system_clock::now();
@@ -549,6 +827,12 @@ void ScreenRecorder::EncodeAndSaveVideo(const char* filename) {
                 }
                 return 1; // Prevent further processing
             }
+            if (wParam == WM_KEYDOWN && pKbdStruct->vkCode == REPLAY_SAVE_KEY && bWinKeyDown &&
+                (GetAsyncKeyState(VK_SHIFT) & 0x8000) && s_instance && s_instance->m_replayRing) {
+                LogDebug("Hotkey Win+Shift+R detected");
+                s_instance->SaveReplay();
+                return 1;
+            }
         }
         return CallNextHookEx(NULL, nCode, wParam, lParam);
     }
@@ -558,6 +842,11 @@ void ScreenRecorder::EncodeAndSaveVideo(const char* filename) {
         static POINT end = {0, 0};
         static bool isDrawing = false;
 
+        if (uMsg == WM_TRANSCODE_DONE) {
+            std::unique_ptr<std::string> message(reinterpret_cast<std::string*>(lParam));
+            MessageBox(NULL, message->c_str(), "Success", MB_OK | MB_ICONINFORMATION);
+            return 0;
+        }
         if (s_instance == nullptr) return DefWindowProc(hwnd, uMsg, wParam, lParam);
 
         switch (uMsg) {
@@ -597,6 +886,12 @@ void ScreenRecorder::EncodeAndSaveVideo(const char* filename) {
                     s_instance->m_selectedRegion.right = static_cast<LONG>(max(start.x, end.x) / scaleFactor);
                     s_instance->m_selectedRegion.bottom = static_cast<LONG>(max(start.y, end.y) / scaleFactor);
 
+                    // Nothing to do when the region kept the size prepared at selection
+                    // start; otherwise the profiles open in parallel while the rest of
+                    // the recording is set up, and InitializeVideoEncoder waits for them
+                    s_instance->PrepareEncoders(s_instance->m_selectedRegion.right - s_instance->m_selectedRegion.left,
+                                                s_instance->m_selectedRegion.bottom - s_instance->m_selectedRegion.top);
+
                     std::stringstream ss;
                     ss << "Visual: " << min(start.x, end.x) << "," << min(start.y, end.y)
                        << " to " << max(start.x, end.x) << "," << max(start.y, end.y)
@@ -609,11 +904,25 @@ void ScreenRecorder::EncodeAndSaveVideo(const char* filename) {
 
                     ShowWindow(hwnd, SW_HIDE);
                     s_instance->m_isSelecting = false;
+
+                    int width = s_instance->m_selectedRegion.right - s_instance->m_selectedRegion.left;
+                    int height = s_instance->m_selectedRegion.bottom - s_instance->m_selectedRegion.top;
+                    std::string filename = s_instance->GenerateUniqueFilename();
+                    if (!s_instance->InitializeVideoEncoder(filename.c_str(), width, height)) {
+                        LogDebug("Failed to initialize video encoder!");
+                        MessageBox(NULL, "Failed to initialize video encoder!", "Error", MB_OK | MB_ICONERROR);
+                        return 0;
+                    }
+
+                    if (s_instance->m_frameCode) {
+                        s_instance->m_frameCodePainter.Start(s_instance->m_selectedRegion.left + FRAME_CODE_MARGIN,
+                                                             s_instance->m_selectedRegion.top + FRAME_CODE_MARGIN,
+                                                             FRAME_RATE);
+                    }
                     s_instance->m_isRecording = true;
-                    s_instance->m_capturedFrames.clear();
+                    PipelineMetrics::Instance().recording = 1;
                     s_instance->DrawSelectionRect();
-                    std::thread captureThread(&ScreenRecorder::CaptureFrames, s_instance);
-                    captureThread.detach();
+                    s_instance->m_captureThread = std::thread(&ScreenRecorder::CaptureFrames, s_instance);
                     s_instance->ShowRecordingIndicator();
                 }
                 return 0;
@@ -2,11 +2,15 @@
 #pragma once
 
 #include <Windows.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include <chrono>
 #include <thread>
 #include <atomic>
+#include <memory>
 #include <sstream>
 #include <fstream>
 #include <iomanip>
@@ -18,10 +22,33 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/time.h>
 }
 
+#include "log.h"
+#include "adaptive.h"
+#include "animation.h"
+#include "damage.h"
+#include "encoder.h"
+#include "framecode.h"
+#include "framedump.h"
+#include "live.h"
+#include "metrics.h"
+#include "probes.h"
+#include "quality.h"
+#include "rawsink.h"
+#include "remux.h"
+#include "replay.h"
+#include "shmring.h"
+#include "stats.h"
+#include "thumbnail.h"
+#include "scroll.h"
+#include "transcode.h"
+
 #define VK_LWIN 0x5B
 #define ID_HOTKEY 1
+#define REPLAY_SAVE_KEY 'R'  // Win+Shift+R saves the replay buffer
+#define WM_TRANSCODE_DONE (WM_APP + 1)  // lParam owns a std::string with the saved files
 
 #define DARKENING_ALPHA 128
 #define SELECTION_ALPHA 64
@@ -29,6 +56,8 @@ extern "C" {
 
 class ScreenRecorder {
 public:
+    static const int FRAME_RATE = 30;
+
     ScreenRecorder();
     ~ScreenRecorder();
 
@@ -36,6 +65,33 @@ public:
     void StopRecording();
     void ToggleRecording();
     void LogCaptureDetails();
+    void SetEncoderProfiles(const std::vector<EncoderProfile>& profiles) { m_profiles = profiles; }
+    // Writes every profile as rolling segments plus a playlist instead of one file
+    void SetSegmentPolicy(const SegmentPolicy& policy);
+    // Record to a lossless intermediate and transcode to the profiles after stop
+    void SetLosslessIntermediate(bool enabled) { m_losslessIntermediate = enabled; }
+    void CancelTranscodes();
+    // Selected regions feed an in-memory ring of the last seconds instead of a file
+    void SetReplayMode(int seconds, int64_t maxBytes);
+    void SaveReplay();
+    // Sends converted frames to a file, named pipe or stdout instead of the encoders
+    void SetRawOutput(const std::string& target, RawFrameFormat format);
+    // Publishes every converted frame to a shared-memory ring for other processes
+    void SetFrameSharing(const std::string& name) { m_shareName = name; }
+    // Sprite-sheet thumbnails every intervalSeconds and on scene changes; 0 turns them off
+    void SetThumbnails(int intervalSeconds, bool webp) { m_thumbnailSeconds = intervalSeconds; m_thumbnailWebp = webp; }
+    // Also exports the first seconds as an animated GIF, or WebP; 0 turns it off
+    void SetAnimationExport(int seconds, bool webp) { m_animationSeconds = seconds; m_animationWebp = webp; }
+    // Saves every Nth captured frame as an image in the background; 0 turns it off
+    void SetFrameDump(int every, FrameDumpFormat format) { m_dumpEvery = every; m_dumpFormat = format; }
+    // Writes per-stage latency percentiles next to each recording
+    void SetStageSummary(bool enabled) { m_stageSummary = enabled; }
+    // Decodes the named profile's output while recording and writes PSNR/SSIM next to it; empty turns it off
+    void SetQualityVerification(const std::string& profileName) { m_verifyProfile = profileName; }
+    // Paints a frame code into the corner of the region while recording, for ScreenRecorder --analyze-latency
+    void SetFrameCode(bool enabled) { m_frameCode = enabled; }
+    // Cuts this much off each saved recording, by stream copy plus a smart cut
+    void SetAutoTrim(int headMs, int tailMs) { m_trimHeadMs = headMs; m_trimTailMs = tailMs; }
     bool IsRecording() const { return m_isRecording; }
     bool IsSelecting() const { return m_isSelecting; }
 
@@ -51,39 +107,84 @@ private:
     void CleanupDrawingResources();
     void CaptureFrames();
     std::vector<BYTE> CaptureScreen();
+    void PrepareEncoders(int width, int height);
     bool InitializeVideoEncoder(const char* filename, int width, int height);
-    void EncodeAndSaveVideo(const char* filename);
+    bool SubmitFrame(const std::vector<BYTE>& bgra, int64_t pts, int64_t captureUs);
+    PipelineSample SamplePipeline(double captureMs) const;
+    void ApplyQualityLevel();
+    void EncodeAndSaveVideo();
+    void StartTranscode(const std::string& intermediateFile);
+    void TrimOutput(const std::string& filename, const EncoderProfile& profile);
     std::string GenerateUniqueFilename();
     void ShowRecordingIndicator();
     void HideRecordingIndicator();
     void DrawSelectionRect();
 
-    std::vector<std::vector<BYTE>> m_capturedFrames;
     std::atomic<bool> m_isRecording;
     std::atomic<bool> m_isSelecting;
     RECT m_selectedRegion;
     HWND m_overlayWindow;
     HWND m_indicatorWindow;
     HWND m_selectionFeedbackWindow;
+    std::thread m_captureThread;
+    std::atomic<int> m_framesCaptured;
 
     HBRUSH m_hDarkenBrush;
     HBRUSH m_hSelectionBrush;
     HPEN m_hBorderPen;
 
-    static const int FRAME_RATE = 30;
     static const std::chrono::milliseconds FRAME_INTERVAL;
 
-    // FFmpeg contexts
-    AVFormatContext* m_formatContext;
-    AVStream* m_videoStream;
-    AVCodecContext* m_codecContext;
-    SwsContext* m_swsContext;
+    // Capture is converted once and fanned out to one encoder thread per profile
+    FrameConverter m_converter;
+    std::vector<EncoderProfile> m_profiles;
+    std::vector<std::unique_ptr<EncoderWorker>> m_encoderWorkers;
+    std::string m_outputFilename;
+    bool m_losslessIntermediate;
+    int m_trimHeadMs;
+    int m_trimTailMs;
+    std::vector<std::unique_ptr<TranscodeJob>> m_transcodeJobs;
+
+    // Scroll detection; the hint for each recording comes from the previous one
+    std::vector<uint32_t> m_prevRowHashes;
+    std::vector<ScrollEstimate> m_scrollEstimates;
+    int m_motionRangeHint;
+    // Changed tiles per frame, for the sidecar index
+    DamageTracker m_damage;
+
+    std::string m_rawTarget;
+    RawFrameFormat m_rawFormat;
+    std::unique_ptr<RawFrameSink> m_rawSink;
+
+    std::string m_shareName;
+    std::unique_ptr<SharedFrameRing> m_frameRing;
+
+    int m_thumbnailSeconds;
+    bool m_thumbnailWebp;
+    std::unique_ptr<ThumbnailWorker> m_thumbnails;
+
+    int m_animationSeconds;
+    bool m_animationWebp;
+    std::unique_ptr<AnimationExporter> m_animation;
+
+    int m_dumpEvery;
+    FrameDumpFormat m_dumpFormat;
+    std::unique_ptr<FrameDumpSink> m_frameDump;
+
+    bool m_stageSummary;
+
+    std::string m_verifyProfile;
+    std::unique_ptr<QualityVerifier> m_qualityVerifier;
+    bool m_frameCode;
+    FrameCodePainter m_frameCodePainter;
+
+    std::unique_ptr<ReplayRing> m_replayRing;
+    std::thread m_replaySaveThread;
+    std::atomic<bool> m_replaySaving;
+
+    // Trades quality, then frame rate, then whole frames when encoders fall behind
+    AdaptiveQualityController m_qualityController;
 
     static ScreenRecorder* s_instance;
 };
-inline void LogConcise(const std::string& category, const std::string& message) {
-    std::ofstream logFile("concise_debug.log", std::ios_base::app);
-    logFile << "[" << category << "] " << message << std::endl;
-    logFile.close();
-}
 void ShowInstructions();
\ No newline at end of file
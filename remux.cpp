@@ -0,0 +1,490 @@
+// remux.cpp
+#include "remux.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+}
+
+namespace {
+
+struct InputFile {
+    AVFormatContext* format = nullptr;
+    AVStream* stream = nullptr;
+    int streamIndex = -1;
+
+    ~InputFile() { avformat_close_input(&format); }
+
+    bool Open(const std::string& filename) {
+        if (avformat_open_input(&format, filename.c_str(), NULL, NULL) < 0 ||
+            avformat_find_stream_info(format, NULL) < 0) {
+            LogDebug("Remux: could not open " + filename);
+            return false;
+        }
+        streamIndex = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if (streamIndex < 0) {
+            LogDebug("Remux: no video stream in " + filename);
+            return false;
+        }
+        stream = format->streams[streamIndex];
+        return true;
+    }
+
+    // One frame in the stream time base, or 1 tick when the rate is unknown
+    int64_t FrameDuration() const {
+        if (stream->avg_frame_rate.num <= 0 || stream->avg_frame_rate.den <= 0) return 1;
+        return std::max<int64_t>(1, av_rescale_q(1, av_inv_q(stream->avg_frame_rate), stream->time_base));
+    }
+};
+
+struct OutputFile {
+    AVFormatContext* format = nullptr;
+    AVStream* stream = nullptr;
+    std::string filename;
+
+    ~OutputFile() {
+        if (format) {
+            avio_closep(&format->pb);
+            avformat_free_context(format);
+        }
+    }
+
+    bool Open(const std::string& name, const AVCodecParameters* parameters, AVRational timeBase) {
+        filename = name;
+        avformat_alloc_output_context2(&format, NULL, NULL, name.c_str());
+        if (!format || !(stream = avformat_new_stream(format, NULL)) ||
+            avcodec_parameters_copy(stream->codecpar, parameters) < 0) {
+            LogDebug("Remux: could not set up " + name);
+            return false;
+        }
+        // Let the muxer pick a tag valid for its container
+        stream->codecpar->codec_tag = 0;
+        stream->time_base = timeBase;
+        if (avio_open(&format->pb, name.c_str(), AVIO_FLAG_WRITE) < 0 || avformat_write_header(format, NULL) < 0) {
+            LogDebug("Remux: could not open " + name);
+            return false;
+        }
+        return true;
+    }
+
+    bool Write(AVPacket* packet, AVRational timeBase) {
+        av_packet_rescale_ts(packet, timeBase, stream->time_base);
+        packet->stream_index = stream->index;
+        packet->pos = -1;
+        if (av_interleaved_write_frame(format, packet) < 0) {
+            LogDebug("Remux: error writing to " + filename);
+            return false;
+        }
+        return true;
+    }
+
+    bool Close() {
+        return av_write_trailer(format) >= 0;
+    }
+};
+
+bool SameExtradata(const uint8_t* a, int aSize, const uint8_t* b, int bSize) {
+    return aSize == bSize && (aSize == 0 || memcmp(a, b, aSize) == 0);
+}
+
+int64_t PacketTime(const AVPacket* packet) {
+    return packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+}
+
+// Keyframe timestamps, first pts and end of the video stream, in its time base
+struct StreamLayout {
+    std::vector<int64_t> keyframes;
+    int64_t firstPts = AV_NOPTS_VALUE;
+    int64_t end = 0;
+};
+
+bool ScanStream(const std::string& filename, StreamLayout& layout) {
+    InputFile input;
+    if (!input.Open(filename)) {
+        return false;
+    }
+    AVPacket* packet = av_packet_alloc();
+    if (!packet) {
+        return false;
+    }
+    int64_t frameDuration = input.FrameDuration();
+    while (av_read_frame(input.format, packet) >= 0) {
+        if (packet->stream_index == input.streamIndex && packet->pts != AV_NOPTS_VALUE) {
+            if (packet->flags & AV_PKT_FLAG_KEY) {
+                layout.keyframes.push_back(packet->pts);
+            }
+            if (layout.firstPts == AV_NOPTS_VALUE || packet->pts < layout.firstPts) {
+                layout.firstPts = packet->pts;
+            }
+            layout.end = std::max(layout.end, packet->pts + (packet->duration > 0 ? packet->duration : frameDuration));
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    std::sort(layout.keyframes.begin(), layout.keyframes.end());
+    return !layout.keyframes.empty();
+}
+
+// The profile a recording was most likely made with: the default profile
+// whose suffix ends the file's stem, or the primary one
+EncoderProfile GuessProfile(const std::string& filename) {
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = filename.size();
+    }
+    std::string stem = filename.substr(0, dot);
+    std::vector<EncoderProfile> profiles = DefaultEncoderProfiles();
+    EncoderProfile primary = profiles.front();
+    for (const EncoderProfile& profile : profiles) {
+        if (profile.suffix.empty()) {
+            primary = profile;
+        } else if (stem.size() > profile.suffix.size() &&
+                   stem.compare(stem.size() - profile.suffix.size(), std::string::npos, profile.suffix) == 0) {
+            return profile;
+        }
+    }
+    return primary;
+}
+
+// Decoder for the source plus an encoder set up to produce packets that can
+// sit in the same stream as the copied ones
+struct EdgeEncoder {
+    AVCodecContext* decoder = nullptr;
+    AVCodecContext* encoder = nullptr;
+    AVFrame* frame = nullptr;
+    AVPacket* packet = nullptr;
+    AVRational streamTimeBase = {1, 1};
+
+    ~EdgeEncoder() {
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+        avcodec_free_context(&encoder);
+        avcodec_free_context(&decoder);
+    }
+
+    // The stream headers depend on the preset, reference frames, B-frames,
+    // rate control and the timing in the VUI, so the encoder is configured the
+    // way VideoEncoder configured the source: the profile's settings and a
+    // time base of one frame
+    bool Open(const AVStream* stream, bool globalHeader, const EncoderProfile& profile) {
+        const AVCodecParameters* parameters = stream->codecpar;
+        const AVCodec* decoderCodec = avcodec_find_decoder(parameters->codec_id);
+        const AVCodec* encoderCodec = avcodec_find_encoder_by_name(profile.codec.c_str());
+        if (!encoderCodec || encoderCodec->id != parameters->codec_id) {
+            encoderCodec = avcodec_find_encoder(parameters->codec_id);
+        }
+        if (!decoderCodec || !encoderCodec) {
+            return false;
+        }
+        decoder = avcodec_alloc_context3(decoderCodec);
+        if (!decoder || avcodec_parameters_to_context(decoder, parameters) < 0 ||
+            avcodec_open2(decoder, decoderCodec, NULL) < 0) {
+            return false;
+        }
+
+        AVRational frameRate = stream->avg_frame_rate.num > 0 ? stream->avg_frame_rate : stream->r_frame_rate;
+        if (frameRate.num <= 0 || frameRate.den <= 0) {
+            return false;
+        }
+        encoder = avcodec_alloc_context3(encoderCodec);
+        if (!encoder) {
+            return false;
+        }
+        streamTimeBase = stream->time_base;
+        encoder->width = parameters->width;
+        encoder->height = parameters->height;
+        encoder->pix_fmt = static_cast<AVPixelFormat>(parameters->format);
+        encoder->sample_aspect_ratio = parameters->sample_aspect_ratio;
+        encoder->time_base = AVRational{1, static_cast<int>(std::lround(av_q2d(frameRate)))};
+        encoder->profile = parameters->profile;
+        encoder->level = parameters->level;
+        encoder->gop_size = profile.gopSize;
+        encoder->max_b_frames = profile.maxBFrames;
+        if (profile.threads > 0) {
+            encoder->thread_count = profile.threads;
+        }
+        if (globalHeader) {
+            encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+        if (profile.crf >= 0) {
+            av_opt_set_int(encoder->priv_data, "crf", profile.crf, 0);
+        } else {
+            encoder->bit_rate = profile.bitRate;
+            encoder->qmin = 10;
+            encoder->qmax = 51;
+        }
+        if (!profile.preset.empty()) {
+            av_opt_set(encoder->priv_data, "preset", profile.preset.c_str(), 0);
+        }
+        AVDictionary* options = NULL;
+        if (!profile.options.empty()) {
+            av_dict_parse_string(&options, profile.options.c_str(), "=", ":", 0);
+        }
+        int ret = avcodec_open2(encoder, encoderCodec, &options);
+        av_dict_free(&options);
+        if (ret < 0) {
+            return false;
+        }
+
+        frame = av_frame_alloc();
+        packet = av_packet_alloc();
+        return frame && packet;
+    }
+
+    // The re-encoded GOP can only share a stream with copied packets when the
+    // encoder produces the same stream headers
+    bool MatchesSource(const AVCodecParameters* parameters) const {
+        return SameExtradata(encoder->extradata, encoder->extradata_size,
+                             parameters->extradata, parameters->extradata_size);
+    }
+
+    // Decodes one packet (or flushes with NULL) and encodes the frames in
+    // [from, to); encoded packets are appended to out
+    bool Feed(const AVPacket* input, int64_t from, int64_t to, std::vector<AVPacket*>& out) {
+        if (avcodec_send_packet(decoder, input) < 0) {
+            return false;
+        }
+        int ret;
+        while ((ret = avcodec_receive_frame(decoder, frame)) >= 0) {
+            int64_t pts = frame->best_effort_timestamp;
+            if (pts != AV_NOPTS_VALUE && pts >= from && pts < to) {
+                frame->pts = av_rescale_q(pts, streamTimeBase, encoder->time_base);
+                frame->pict_type = AV_PICTURE_TYPE_NONE;
+                if (avcodec_send_frame(encoder, frame) < 0 || !Drain(out)) {
+                    av_frame_unref(frame);
+                    return false;
+                }
+            }
+            av_frame_unref(frame);
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+            return false;
+        }
+        if (!input) {
+            return avcodec_send_frame(encoder, NULL) >= 0 && Drain(out);
+        }
+        return true;
+    }
+
+    bool Drain(std::vector<AVPacket*>& out) {
+        int ret;
+        while ((ret = avcodec_receive_packet(encoder, packet)) >= 0) {
+            AVPacket* copy = av_packet_clone(packet);
+            av_packet_unref(packet);
+            if (!copy) {
+                return false;
+            }
+            av_packet_rescale_ts(copy, encoder->time_base, streamTimeBase);
+            out.push_back(copy);
+        }
+        return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+    }
+};
+
+void FreePackets(std::vector<AVPacket*>& packets) {
+    for (AVPacket*& packet : packets) {
+        av_packet_free(&packet);
+    }
+    packets.clear();
+}
+
+} // namespace
+
+bool TrimRecording(const std::string& input, const std::string& output,
+                   double startSeconds, double endSeconds, bool smartCut, const EncoderProfile* profile) {
+    StreamLayout layout;
+    if (!ScanStream(input, layout)) {
+        LogDebug("Remux: no keyframes found in " + input);
+        return false;
+    }
+
+    InputFile source;
+    if (!source.Open(input)) {
+        return false;
+    }
+    AVRational timeBase = source.stream->time_base;
+    int64_t startTs = layout.firstPts + static_cast<int64_t>(std::max(0.0, startSeconds) / av_q2d(timeBase));
+    int64_t endTs = INT64_MAX;
+    if (endSeconds > 0) {
+        endTs = layout.firstPts + static_cast<int64_t>(endSeconds / av_q2d(timeBase));
+    } else if (endSeconds < 0) {
+        endTs = layout.end + static_cast<int64_t>(endSeconds / av_q2d(timeBase));
+    }
+    if (endTs <= startTs) {
+        LogDebug("Remux: empty trim range for " + input);
+        return false;
+    }
+
+    // Keyframe at or before the start, and the first one after it
+    auto after = std::upper_bound(layout.keyframes.begin(), layout.keyframes.end(), startTs);
+    int64_t before = after == layout.keyframes.begin() ? layout.keyframes.front() : *(after - 1);
+    bool haveNext = after != layout.keyframes.end() && *after < endTs;
+
+    OutputFile out;
+    EdgeEncoder edge;
+    bool reencodeHead = smartCut && after != layout.keyframes.begin() && before != startTs && haveNext;
+    if (reencodeHead) {
+        AVOutputFormat const* format = av_guess_format(NULL, output.c_str(), NULL);
+        bool globalHeader = format && (format->flags & AVFMT_GLOBALHEADER);
+        if (!edge.Open(source.stream, globalHeader, profile ? *profile : GuessProfile(input)) || !edge.MatchesSource(source.stream->codecpar)) {
+            LogConcise("Remux", "Smart cut not possible for " + input + ", cutting at the previous keyframe");
+            reencodeHead = false;
+        }
+    }
+    int64_t copyFrom = reencodeHead ? *after : before;
+    int64_t offset = reencodeHead ? startTs : before;
+
+    if (!out.Open(output, source.stream->codecpar, timeBase)) {
+        std::remove(output.c_str());
+        return false;
+    }
+
+    AVPacket* packet = av_packet_alloc();
+    std::vector<AVPacket*> head;
+    bool ok = packet != nullptr;
+    bool started = false;
+    bool copying = false;
+    int64_t lastDts = INT64_MIN;
+    int64_t copied = 0;
+    while (ok && av_read_frame(source.format, packet) >= 0) {
+        if (packet->stream_index != source.streamIndex) {
+            av_packet_unref(packet);
+            continue;
+        }
+        bool key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+        if (!started) {
+            started = key && packet->pts == before;
+        }
+        if (started && !copying && key && packet->pts == copyFrom) {
+            copying = true;
+            if (reencodeHead) {
+                // Finish the partial GOP and slot it in just before the first copied packet
+                ok = edge.Feed(NULL, startTs, copyFrom, head);
+                int64_t firstCopiedDts = PacketTime(packet) - offset;
+                int64_t shift = 0;
+                for (const AVPacket* encoded : head) {
+                    shift = std::max(shift, PacketTime(encoded) - offset - firstCopiedDts + 1);
+                }
+                for (AVPacket* encoded : head) {
+                    if (!ok) break;
+                    if (encoded->pts != AV_NOPTS_VALUE) encoded->pts -= offset;
+                    encoded->dts = (encoded->dts != AV_NOPTS_VALUE ? encoded->dts : encoded->pts + offset) - offset - shift;
+                    lastDts = encoded->dts;
+                    ok = out.Write(encoded, timeBase);
+                }
+                LogConcise("Remux", "Re-encoded " + std::to_string(head.size()) + " edge frames of " + input);
+                FreePackets(head);
+            }
+        }
+
+        if (ok && started && !copying && reencodeHead) {
+            ok = edge.Feed(packet, startTs, copyFrom, head);
+        } else if (ok && copying) {
+            // Cut the end in decode order so every copied frame still decodes
+            if (PacketTime(packet) >= endTs) {
+                av_packet_unref(packet);
+                break;
+            }
+            if (packet->pts != AV_NOPTS_VALUE) packet->pts -= offset;
+            if (packet->dts != AV_NOPTS_VALUE) {
+                packet->dts = std::max(packet->dts - offset, lastDts + 1);
+                lastDts = packet->dts;
+            }
+            ok = out.Write(packet, timeBase);
+            copied++;
+        }
+        av_packet_unref(packet);
+    }
+    FreePackets(head);
+    av_packet_free(&packet);
+
+    if (!out.Close()) {
+        ok = false;
+    }
+    if (!ok || copied == 0) {
+        LogDebug("Remux: trimming " + input + " failed");
+        std::remove(output.c_str());
+        return false;
+    }
+    LogConcise("Remux", "Trimmed " + input + " to " + output + ", " + std::to_string(copied) + " packets copied");
+    return true;
+}
+
+bool ConcatRecordings(const std::vector<std::string>& inputs, const std::string& output) {
+    if (inputs.empty()) {
+        return false;
+    }
+    InputFile first;
+    if (!first.Open(inputs.front())) {
+        return false;
+    }
+    OutputFile out;
+    if (!out.Open(output, first.stream->codecpar, first.stream->time_base)) {
+        std::remove(output.c_str());
+        return false;
+    }
+    const AVCodecParameters* reference = first.stream->codecpar;
+
+    AVPacket* packet = av_packet_alloc();
+    bool ok = packet != nullptr;
+    int64_t nextStart = 0;  // output time base
+    for (size_t i = 0; ok && i < inputs.size(); i++) {
+        InputFile input;
+        if (!input.Open(inputs[i])) {
+            ok = false;
+            break;
+        }
+        const AVCodecParameters* parameters = input.stream->codecpar;
+        if (parameters->codec_id != reference->codec_id || parameters->width != reference->width ||
+            parameters->height != reference->height || parameters->format != reference->format ||
+            !SameExtradata(parameters->extradata, parameters->extradata_size,
+                           reference->extradata, reference->extradata_size)) {
+            LogDebug("Remux: " + inputs[i] + " does not match the codec parameters of " + inputs.front());
+            ok = false;
+            break;
+        }
+
+        // Shift each file so its first packet decodes right after the previous file ends
+        AVRational outBase = out.stream->time_base;
+        int64_t frameDuration = std::max<int64_t>(1, av_rescale_q(input.FrameDuration(), input.stream->time_base, outBase));
+        int64_t offset = 0;
+        bool first = true;
+        int64_t end = nextStart;
+        while (ok && av_read_frame(input.format, packet) >= 0) {
+            if (packet->stream_index == input.streamIndex) {
+                av_packet_rescale_ts(packet, input.stream->time_base, outBase);
+                if (first) {
+                    offset = nextStart - PacketTime(packet);
+                    first = false;
+                }
+                if (packet->pts != AV_NOPTS_VALUE) packet->pts += offset;
+                if (packet->dts != AV_NOPTS_VALUE) packet->dts += offset;
+                end = std::max(end, packet->pts + (packet->duration > 0 ? packet->duration : frameDuration));
+                ok = out.Write(packet, outBase);
+            }
+            av_packet_unref(packet);
+        }
+        nextStart = end;
+    }
+    av_packet_free(&packet);
+
+    if (!out.Close()) {
+        ok = false;
+    }
+    if (!ok) {
+        LogDebug("Remux: concatenation into " + output + " failed");
+        std::remove(output.c_str());
+        return false;
+    }
+    LogConcise("Remux", "Concatenated " + std::to_string(inputs.size()) + " recordings into " + output);
+    return true;
+}
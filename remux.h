@@ -0,0 +1,22 @@
+// remux.h
+#pragma once
+
+#include "encoder.h"
+
+#include <string>
+#include <vector>
+
+// Cuts a recording to [startSeconds, endSeconds) by stream copy. endSeconds
+// of 0 keeps everything to the end; a negative value counts back from the
+// end. With smartCut the partial GOP before the first keyframe is
+// re-encoded so the cut lands exactly on startSeconds; otherwise, or when
+// the re-encoded headers would not match the source, the cut moves back to
+// the previous keyframe. The end is cut in decode order, which never needs
+// re-encoding. profile is the one the input was recorded with; without it
+// the profile is guessed from the filename suffix.
+bool TrimRecording(const std::string& input, const std::string& output,
+                   double startSeconds, double endSeconds, bool smartCut,
+                   const EncoderProfile* profile = nullptr);
+
+// Joins recordings with identical codec parameters back to back by stream copy.
+bool ConcatRecordings(const std::vector<std::string>& inputs, const std::string& output);
@@ -0,0 +1,167 @@
+// replay.cpp
+#include "replay.h"
+#include "log.h"
+
+#include <cstdio>
+#include <vector>
+
+ReplayRing::ReplayRing(int seconds, int64_t maxBytes)
+        : m_seconds(seconds), m_maxBytes(maxBytes), m_parameters(nullptr),
+          m_timeBase{1, 1}, m_bytes(0), m_gopsDropped(0) {
+}
+
+ReplayRing::~ReplayRing() {
+    Clear();
+    avcodec_parameters_free(&m_parameters);
+}
+
+void ReplayRing::OnStreamOpened(const AVCodecContext* context) {
+    // A new recording may use different codec settings; older packets cannot be mixed in
+    Clear();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_parameters) {
+        m_parameters = avcodec_parameters_alloc();
+    }
+    if (!m_parameters || avcodec_parameters_from_context(m_parameters, context) < 0) {
+        LogDebug("Replay: could not copy codec parameters");
+        avcodec_parameters_free(&m_parameters);
+    }
+    m_timeBase = context->time_base;
+}
+
+void ReplayRing::OnPacket(const AVPacket* packet, AVRational timeBase) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // The ring has to start on a keyframe to be decodable
+    if (m_packets.empty() && !(packet->flags & AV_PKT_FLAG_KEY)) {
+        return;
+    }
+    AVPacket* ref = av_packet_clone(packet);
+    if (!ref) {
+        LogDebug("Replay: could not reference packet");
+        return;
+    }
+    m_timeBase = timeBase;
+    m_packets.push_back(ref);
+    m_bytes += ref->size;
+    Trim();
+}
+
+void ReplayRing::Trim() {
+    while (DurationLocked() > m_seconds || m_bytes > m_maxBytes) {
+        // Find where the second GOP starts; the newest GOP is never dropped
+        size_t next = 1;
+        while (next < m_packets.size() && !(m_packets[next]->flags & AV_PKT_FLAG_KEY)) {
+            next++;
+        }
+        if (next >= m_packets.size()) {
+            return;
+        }
+        for (size_t i = 0; i < next; i++) {
+            m_bytes -= m_packets.front()->size;
+            av_packet_free(&m_packets.front());
+            m_packets.pop_front();
+        }
+        m_gopsDropped++;
+    }
+}
+
+double ReplayRing::DurationLocked() const {
+    if (m_packets.size() < 2) {
+        return 0.0;
+    }
+    return (m_packets.back()->pts - m_packets.front()->pts) * av_q2d(m_timeBase);
+}
+
+void ReplayRing::Clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (AVPacket*& packet : m_packets) {
+        av_packet_free(&packet);
+    }
+    m_packets.clear();
+    m_bytes = 0;
+}
+
+double ReplayRing::Seconds() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return DurationLocked();
+}
+
+int64_t ReplayRing::Bytes() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+}
+
+bool ReplayRing::Save(const std::string& filename) {
+    // Take new references under the lock and mux outside it, so the encoder
+    // is never held up by the disk
+    std::vector<AVPacket*> packets;
+    AVCodecParameters* parameters = avcodec_parameters_alloc();
+    AVRational timeBase;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_packets.empty() || !m_parameters || !parameters) {
+            avcodec_parameters_free(&parameters);
+            LogDebug("Replay: nothing to save");
+            return false;
+        }
+        avcodec_parameters_copy(parameters, m_parameters);
+        timeBase = m_timeBase;
+        for (const AVPacket* packet : m_packets) {
+            AVPacket* ref = av_packet_clone(packet);
+            if (ref) packets.push_back(ref);
+        }
+    }
+    if (packets.empty()) {
+        avcodec_parameters_free(&parameters);
+        return false;
+    }
+
+    AVFormatContext* formatContext = NULL;
+    bool ok = false;
+    int ret;
+    avformat_alloc_output_context2(&formatContext, NULL, NULL, filename.c_str());
+    AVStream* stream = formatContext ? avformat_new_stream(formatContext, NULL) : NULL;
+    if (!stream) {
+        LogDebug("Replay: could not allocate output for " + filename);
+    } else if (avcodec_parameters_copy(stream->codecpar, parameters) < 0) {
+        LogDebug("Replay: could not copy codec parameters");
+    } else if ((ret = avio_open(&formatContext->pb, filename.c_str(), AVIO_FLAG_WRITE)) < 0) {
+        LogDebug("Replay: could not open " + filename);
+    } else if ((ret = avformat_write_header(formatContext, NULL)) < 0) {
+        LogDebug("Replay: could not write header to " + filename);
+    } else {
+        // Start the clip at 0; decode order starts at the first keyframe's dts
+        int64_t start = packets.front()->dts != AV_NOPTS_VALUE ? packets.front()->dts : packets.front()->pts;
+        ok = true;
+        for (AVPacket* packet : packets) {
+            if (packet->pts != AV_NOPTS_VALUE) packet->pts -= start;
+            if (packet->dts != AV_NOPTS_VALUE) packet->dts -= start;
+            av_packet_rescale_ts(packet, timeBase, stream->time_base);
+            packet->stream_index = stream->index;
+            if (av_interleaved_write_frame(formatContext, packet) < 0) {
+                LogDebug("Replay: error writing packet");
+                ok = false;
+                break;
+            }
+        }
+        if (av_write_trailer(formatContext) < 0) {
+            ok = false;
+        }
+    }
+
+    for (AVPacket*& packet : packets) {
+        av_packet_free(&packet);
+    }
+    avcodec_parameters_free(&parameters);
+    if (formatContext) {
+        avio_closep(&formatContext->pb);
+        avformat_free_context(formatContext);
+    }
+    if (ok) {
+        LogConcise("Replay", "Saved " + std::to_string(packets.size()) + " packets to " + filename + ", " +
+                             std::to_string(m_gopsDropped.load()) + " GOPs aged out so far");
+    } else {
+        std::remove(filename.c_str());
+    }
+    return ok;
+}
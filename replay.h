@@ -0,0 +1,47 @@
+// replay.h
+#pragma once
+
+#include "encoder.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+
+#define REPLAY_DEFAULT_SECONDS 60
+#define REPLAY_DEFAULT_MAX_BYTES (256LL * 1024 * 1024)
+
+// Keeps the last few seconds of encoded packets in memory so they can be
+// saved after the fact. Memory is bounded by the compressed size: whole GOPs
+// are dropped from the front once the time or byte budget is exceeded, so
+// the ring always starts on a keyframe.
+class ReplayRing : public PacketObserver {
+public:
+    ReplayRing(int seconds, int64_t maxBytes);
+    ~ReplayRing() override;
+
+    void OnStreamOpened(const AVCodecContext* context) override;
+    void OnPacket(const AVPacket* packet, AVRational timeBase) override;
+
+    // Muxes the current contents to a file without re-encoding. Safe to call
+    // from any thread while packets keep arriving.
+    bool Save(const std::string& filename);
+    void Clear();
+
+    double Seconds() const;
+    int64_t Bytes() const;
+
+private:
+    void Trim();
+    double DurationLocked() const;
+
+    int m_seconds;
+    int64_t m_maxBytes;
+
+    mutable std::mutex m_mutex;
+    std::deque<AVPacket*> m_packets;
+    AVCodecParameters* m_parameters;
+    AVRational m_timeBase;
+    int64_t m_bytes;
+    std::atomic<int64_t> m_gopsDropped;   // read by Save without the lock
+};
@@ -0,0 +1,56 @@
+// rowhash.h
+#pragma once
+
+// The pixel hash behind scroll detection (one hash per row) and damage
+// tracking (one per tile). Both compare hashes they computed themselves, but
+// keeping one kernel means a fix or a faster loop lands in both at once.
+// Pixels feed four 32-bit lanes in turn, so the SSE2 loop and the scalar
+// tail produce the same lanes.
+
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ROWHASH_USE_SSE2 1
+#endif
+
+inline void InitHashLanes(uint32_t lanes[4]) {
+    static const uint32_t SEEDS[4] = { 0x9E3779B9u, 0x7F4A7C15u, 0x94D049BBu, 0xBF58476Du };
+    std::copy(SEEDS, SEEDS + 4, lanes);
+}
+
+inline uint32_t MixHashLane(uint32_t h, uint32_t v) {
+    uint32_t t = h ^ v;
+    return ((t << 7) | (t >> 25)) + v;
+}
+
+// Folds count BGRA pixels into the lanes, pixel x of this call into lane x % 4
+inline void MixHashLanes(uint32_t lanes[4], const uint32_t* pixels, int count) {
+    int x = 0;
+#ifdef ROWHASH_USE_SSE2
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes));
+    for (; x + 4 <= count; x += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + x));
+        __m128i t = _mm_xor_si128(h, v);
+        h = _mm_add_epi32(_mm_or_si128(_mm_slli_epi32(t, 7), _mm_srli_epi32(t, 25)), v);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), h);
+#endif
+    for (; x < count; x++) {
+        lanes[x & 3] = MixHashLane(lanes[x & 3], pixels[x]);
+    }
+}
+
+inline uint32_t FinishHashLanes(const uint32_t lanes[4]) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 4; i++) {
+        h = (h ^ lanes[i]) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
@@ -0,0 +1,141 @@
+// scroll.cpp
+#include "scroll.h"
+#include "rowhash.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <unordered_map>
+
+namespace {
+
+uint32_t HashRow(const uint8_t* row, int width) {
+    uint32_t lanes[4];
+    InitHashLanes(lanes);
+    MixHashLanes(lanes, reinterpret_cast<const uint32_t*>(row), width);
+    return FinishHashLanes(lanes);
+}
+
+} // namespace
+
+void HashRows(const uint8_t* pixels, int width, int height, int stride, std::vector<uint32_t>& hashes) {
+    hashes.resize(height);
+    for (int y = 0; y < height; y++) {
+        hashes[y] = HashRow(pixels + static_cast<size_t>(y) * stride, width);
+    }
+}
+
+ScrollEstimate EstimateVerticalShift(const std::vector<uint32_t>& prevHashes,
+                                     const std::vector<uint32_t>& curHashes,
+                                     int maxShift) {
+    ScrollEstimate result = {0, 0, 0, 0, 0, false};
+    int height = static_cast<int>(curHashes.size());
+    if (height == 0 || prevHashes.size() != curHashes.size()) {
+        return result;
+    }
+    maxShift = std::min(maxShift, height - 1);
+
+    // Rows whose hash occurs once in the previous frame; repeated rows such as
+    // blank lines would match at every shift and carry no evidence.
+    std::unordered_map<uint32_t, int> prevRows;
+    prevRows.reserve(height * 2);
+    for (int y = 0; y < height; y++) {
+        auto it = prevRows.find(prevHashes[y]);
+        if (it == prevRows.end()) {
+            prevRows.emplace(prevHashes[y], y);
+        } else {
+            it->second = -1;
+        }
+    }
+
+    std::vector<int> votes(2 * maxShift + 1, 0);
+    int firstChanged = -1;
+    int lastChanged = -1;
+    for (int y = 0; y < height; y++) {
+        if (curHashes[y] == prevHashes[y]) {
+            continue;
+        }
+        if (firstChanged < 0) firstChanged = y;
+        lastChanged = y;
+        if (y > 0 && curHashes[y] == curHashes[y - 1]) {
+            continue;
+        }
+        result.changedRows++;
+        auto it = prevRows.find(curHashes[y]);
+        if (it == prevRows.end() || it->second < 0) {
+            continue;
+        }
+        int shift = it->second - y;
+        if (shift != 0 && std::abs(shift) <= maxShift) {
+            votes[shift + maxShift]++;
+        }
+    }
+
+    if (result.changedRows == 0) {
+        return result;
+    }
+
+    int best = static_cast<int>(std::max_element(votes.begin(), votes.end()) - votes.begin());
+    result.shift = best - maxShift;
+    result.movedRows = votes[best];
+
+    // Everything that changed, apart from the band scrolled into view, should
+    // be explained by the shift.
+    int exposed = std::min(std::abs(result.shift), result.changedRows);
+    int explainable = result.changedRows - exposed;
+    result.isScroll = result.movedRows >= SCROLL_MIN_EVIDENCE_ROWS &&
+                      result.movedRows * 100 >= explainable * SCROLL_MIN_MATCH_PERCENT;
+
+    if (!result.isScroll) {
+        result.shift = 0;
+        return result;
+    }
+
+    if (result.shift > 0) {
+        result.exposedBottom = lastChanged + 1;
+        result.exposedTop = std::max(firstChanged, result.exposedBottom - result.shift);
+    } else {
+        result.exposedTop = firstChanged;
+        result.exposedBottom = std::min(lastChanged + 1, result.exposedTop - result.shift);
+    }
+    return result;
+}
+
+int SuggestMotionRange(const std::vector<ScrollEstimate>& estimates) {
+    int scrolls = 0;
+    int changed = 0;
+    int maxShift = 0;
+    for (const ScrollEstimate& estimate : estimates) {
+        if (estimate.changedRows > 0) changed++;
+        if (estimate.isScroll) {
+            scrolls++;
+            maxShift = std::max(maxShift, std::abs(estimate.shift));
+        }
+    }
+    // Only worth constraining when scrolling dominates the motion
+    if (scrolls == 0 || scrolls * 2 < changed) {
+        return 0;
+    }
+    return std::min(std::max(maxShift + 2, 4), 64);
+}
+
+bool AttachScrollRoi(AVFrame* frame, const ScrollEstimate& estimate) {
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if (!estimate.isScroll || estimate.exposedBottom <= estimate.exposedTop) {
+        return false;
+    }
+
+    AVFrameSideData* sideData = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                                       sizeof(AVRegionOfInterest));
+    if (!sideData) {
+        return false;
+    }
+
+    AVRegionOfInterest* roi = reinterpret_cast<AVRegionOfInterest*>(sideData->data);
+    roi->self_size = sizeof(AVRegionOfInterest);
+    roi->top = estimate.exposedTop;
+    roi->bottom = std::min(estimate.exposedBottom, frame->height);
+    roi->left = 0;
+    roi->right = frame->width;
+    roi->qoffset = av_make_q(SCROLL_ROI_QOFFSET, 100);
+    return true;
+}
@@ -0,0 +1,42 @@
+// scroll.h
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#define SCROLL_MAX_SHIFT 256
+#define SCROLL_MIN_EVIDENCE_ROWS 8
+#define SCROLL_MIN_MATCH_PERCENT 90
+#define SCROLL_ROI_QOFFSET -10  // in 1/100ths, applied to the newly exposed band
+
+// Result of comparing two consecutive frames for a pure vertical scroll.
+// A positive shift means content moved up (row y of the current frame shows
+// row y + shift of the previous one), negative means it moved down.
+struct ScrollEstimate {
+    int shift;
+    int movedRows;      // rows explained by the shift
+    int changedRows;    // distinctive rows that differ from the previous frame
+    int exposedTop;     // newly exposed band in the current frame, [top, bottom)
+    int exposedBottom;
+    bool isScroll;
+};
+
+// One 32-bit hash per row of a BGRA image. Uses SSE2 when available; the
+// scalar path produces identical hashes.
+void HashRows(const uint8_t* pixels, int width, int height, int stride, std::vector<uint32_t>& hashes);
+
+ScrollEstimate EstimateVerticalShift(const std::vector<uint32_t>& prevHashes,
+                                     const std::vector<uint32_t>& curHashes,
+                                     int maxShift = SCROLL_MAX_SHIFT);
+
+// Motion search range that covers the detected scrolls, or 0 to keep the
+// encoder default.
+int SuggestMotionRange(const std::vector<ScrollEstimate>& estimates);
+
+// Attaches a region-of-interest hint for the newly exposed band of a scrolled
+// frame. Any previous ROI side data on the frame is removed first.
+bool AttachScrollRoi(AVFrame* frame, const ScrollEstimate& estimate);
@@ -0,0 +1,122 @@
+// segment.cpp
+#include "segment.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+SegmentPlaylist::SegmentPlaylist(const std::string& playlistFile, const SegmentPolicy& policy,
+                                 double keyframeSeconds, int64_t bitRate)
+        : m_playlistFile(playlistFile), m_policy(policy), m_nextIndex(0), m_mediaSequence(0),
+          m_keyframeSeconds(keyframeSeconds), m_targetDuration(1), m_totalBytes(0) {
+    // Segments end on a keyframe, so a duration limit runs over by up to one
+    // GOP; a byte limit alone becomes the time the expected bitrate needs to fill it
+    double seconds = policy.durationSeconds;
+    if (seconds <= 0 && policy.maxBytes > 0 && bitRate > 0) {
+        seconds = policy.maxBytes * 8.0 / bitRate;
+    }
+    if (keyframeSeconds > 0) {
+        seconds = std::max(1.0, std::ceil(seconds / keyframeSeconds - SEGMENT_TIME_EPSILON)) * keyframeSeconds;
+    }
+    m_targetDuration = std::max(1, static_cast<int>(std::ceil(seconds - SEGMENT_TIME_EPSILON)));
+    LogConcise("Segment", playlistFile + " target duration " + std::to_string(m_targetDuration) + " s");
+
+    size_t dot = playlistFile.find_last_of('.');
+    size_t slash = playlistFile.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = playlistFile.size();
+    }
+    m_stem = playlistFile.substr(0, dot);
+}
+
+std::string SegmentPlaylist::NextSegmentFilename() {
+    std::stringstream ss;
+    ss << m_stem << "_" << std::setw(5) << std::setfill('0') << m_nextIndex++ << SEGMENT_EXTENSION;
+    return ss.str();
+}
+
+bool SegmentPlaylist::ShouldRotate(double segmentSeconds, int64_t segmentBytes) const {
+    if (m_policy.durationSeconds > 0 && segmentSeconds >= m_policy.durationSeconds) {
+        return true;
+    }
+    if (m_keyframeSeconds > 0 && segmentSeconds + m_keyframeSeconds > m_targetDuration + SEGMENT_TIME_EPSILON) {
+        return true;
+    }
+    return m_policy.maxBytes > 0 && segmentBytes >= m_policy.maxBytes;
+}
+
+bool SegmentPlaylist::AddSegment(const std::string& filename, double durationSeconds, int64_t bytes) {
+    if (bytes == 0) {
+        std::remove(filename.c_str());
+        return WritePlaylist(false);
+    }
+    m_segments.push_back(Segment{filename, durationSeconds, bytes});
+    m_totalBytes += bytes;
+    if (std::lround(durationSeconds) > m_targetDuration) {
+        LogDebug("Segment " + filename + " runs past the playlist target duration");
+    }
+    LogConcise("Segment", filename + " " + std::to_string(durationSeconds) + " s, " + std::to_string(bytes) + " bytes");
+    ApplyRetention();
+    return WritePlaylist(false);
+}
+
+bool SegmentPlaylist::Finish() {
+    return WritePlaylist(true);
+}
+
+void SegmentPlaylist::ApplyRetention() {
+    // Always keep the newest segment, whatever the limits say
+    while (m_segments.size() > 1 &&
+           ((m_policy.maxSegments > 0 && static_cast<int>(m_segments.size()) > m_policy.maxSegments) ||
+            (m_policy.maxTotalBytes > 0 && m_totalBytes > m_policy.maxTotalBytes))) {
+        const Segment& oldest = m_segments.front();
+        if (std::remove(oldest.filename.c_str()) != 0) {
+            LogDebug("Could not delete old segment " + oldest.filename);
+        }
+        LogConcise("Segment", "Deleted " + oldest.filename);
+        m_totalBytes -= oldest.bytes;
+        m_segments.pop_front();
+        m_mediaSequence++;
+    }
+}
+
+bool SegmentPlaylist::WritePlaylist(bool ended) {
+    // Written beside the playlist and swapped in, so readers never see half a file
+    std::string tempFile = m_playlistFile + ".tmp";
+    {
+        std::ofstream playlist(tempFile, std::ios::trunc);
+        if (!playlist) {
+            LogDebug("Could not write playlist " + tempFile);
+            return false;
+        }
+        playlist << "#EXTM3U\n";
+        playlist << "#EXT-X-VERSION:3\n";
+        playlist << "#EXT-X-TARGETDURATION:" << m_targetDuration << "\n";
+        playlist << "#EXT-X-MEDIA-SEQUENCE:" << m_mediaSequence << "\n";
+        if (m_policy.maxSegments == 0 && m_policy.maxTotalBytes == 0) {
+            playlist << "#EXT-X-PLAYLIST-TYPE:EVENT\n";
+        }
+        for (const Segment& segment : m_segments) {
+            size_t slash = segment.filename.find_last_of("/\\");
+            std::string name = slash == std::string::npos ? segment.filename : segment.filename.substr(slash + 1);
+            playlist << "#EXTINF:" << std::fixed << std::setprecision(3) << segment.duration << ",\n" << name << "\n";
+        }
+        if (ended) {
+            playlist << "#EXT-X-ENDLIST\n";
+        }
+        if (!playlist) {
+            LogDebug("Could not write playlist " + tempFile);
+            return false;
+        }
+    }
+    std::remove(m_playlistFile.c_str());
+    if (std::rename(tempFile.c_str(), m_playlistFile.c_str()) != 0) {
+        LogDebug("Could not replace playlist " + m_playlistFile);
+        return false;
+    }
+    return true;
+}
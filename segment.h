@@ -0,0 +1,66 @@
+// segment.h
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#define SEGMENT_EXTENSION ".ts"
+#define SEGMENT_PLAYLIST_EXTENSION ".m3u8"
+#define SEGMENT_TIME_EPSILON 0.001   // seconds; absorbs pts rounding at segment boundaries
+
+// How a long recording is split into segment files. A segment is cut at the
+// first keyframe once either limit is reached; the retention limits delete
+// the oldest segments, 0 keeps everything.
+struct SegmentPolicy {
+    int durationSeconds = 0;
+    int64_t maxBytes = 0;
+    int maxSegments = 0;
+    int64_t maxTotalBytes = 0;
+
+    bool Enabled() const { return durationSeconds > 0 || maxBytes > 0; }
+};
+
+// Names the segments of one output, keeps its HLS playlist up to date and
+// enforces the retention limits. Knows nothing about muxing.
+class SegmentPlaylist {
+public:
+    // keyframeSeconds is the longest keyframe interval the encoder produces and
+    // bitRate what it is expected to average; together they fix the playlist's
+    // target duration before the first segment is written
+    SegmentPlaylist(const std::string& playlistFile, const SegmentPolicy& policy, double keyframeSeconds,
+                    int64_t bitRate);
+
+    // Filename for the segment that is about to be written
+    std::string NextSegmentFilename();
+    // Asked at each keyframe; also cuts early when waiting for the next
+    // keyframe would run past the target duration
+    bool ShouldRotate(double segmentSeconds, int64_t segmentBytes) const;
+    // Records a completed segment; empty ones are deleted instead
+    bool AddSegment(const std::string& filename, double durationSeconds, int64_t bytes);
+    // Marks the playlist complete
+    bool Finish();
+
+    const std::string& PlaylistFile() const { return m_playlistFile; }
+    int64_t TotalBytes() const { return m_totalBytes; }
+
+private:
+    struct Segment {
+        std::string filename;
+        double duration;
+        int64_t bytes;
+    };
+
+    void ApplyRetention();
+    bool WritePlaylist(bool ended);
+
+    std::string m_playlistFile;
+    std::string m_stem;
+    SegmentPolicy m_policy;
+    std::deque<Segment> m_segments;
+    int m_nextIndex;
+    int m_mediaSequence;
+    double m_keyframeSeconds;
+    int m_targetDuration;         // seconds; RFC 8216 does not let it change
+    int64_t m_totalBytes;
+};
@@ -0,0 +1,317 @@
+// shmring.cpp
+#include "shmring.h"
+#include "log.h"
+
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const intptr_t NO_MAPPING = -1;
+
+size_t AlignUp(size_t value) {
+    return (value + SHMRING_ALIGNMENT - 1) & ~static_cast<size_t>(SHMRING_ALIGNMENT - 1);
+}
+
+std::string MappingPath(const std::string& name) {
+#ifdef _WIN32
+    return "Local\\" + name;
+#else
+    return "/" + name;
+#endif
+}
+
+// Maps an existing or new mapping of the given size; size 0 opens read-only
+// at whatever size it already has
+uint8_t* MapShared(const std::string& name, size_t& size, intptr_t& mapping) {
+    std::string path = MappingPath(name);
+#ifdef _WIN32
+    HANDLE handle;
+    if (size > 0) {
+        handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                    static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                    static_cast<DWORD>(size & 0xFFFFFFFF), path.c_str());
+    } else {
+        handle = OpenFileMappingA(FILE_MAP_READ, FALSE, path.c_str());
+    }
+    if (!handle) {
+        LogDebug("Shared frames: could not open mapping " + path + ". Error: " + std::to_string(GetLastError()));
+        return nullptr;
+    }
+    void* view = MapViewOfFile(handle, size > 0 ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, size);
+    if (!view) {
+        LogDebug("Shared frames: could not map " + path + ". Error: " + std::to_string(GetLastError()));
+        CloseHandle(handle);
+        return nullptr;
+    }
+    if (size == 0) {
+        size = static_cast<const SharedRingHeader*>(view)->firstSlotOffset +
+               static_cast<const SharedRingHeader*>(view)->slotCount *
+               static_cast<const SharedRingHeader*>(view)->slotSize;
+    }
+    mapping = reinterpret_cast<intptr_t>(handle);
+    return static_cast<uint8_t*>(view);
+#else
+    bool create = size > 0;
+    int fd = shm_open(path.c_str(), create ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+    if (fd < 0) {
+        LogDebug("Shared frames: could not open " + path + ". Error: " + std::to_string(errno));
+        return nullptr;
+    }
+    if (create && ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        LogDebug("Shared frames: could not size " + path + ". Error: " + std::to_string(errno));
+        close(fd);
+        return nullptr;
+    }
+    if (!create) {
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(SharedRingHeader))) {
+            close(fd);
+            return nullptr;
+        }
+        size = static_cast<size_t>(info.st_size);
+    }
+    void* view = mmap(nullptr, size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED) {
+        LogDebug("Shared frames: could not map " + path + ". Error: " + std::to_string(errno));
+        close(fd);
+        return nullptr;
+    }
+    mapping = fd;
+    return static_cast<uint8_t*>(view);
+#endif
+}
+
+void UnmapShared(const void* view, size_t size, intptr_t mapping) {
+#ifdef _WIN32
+    (void)size;
+    if (view) UnmapViewOfFile(view);
+    if (mapping != NO_MAPPING) CloseHandle(reinterpret_cast<HANDLE>(mapping));
+#else
+    if (view) munmap(const_cast<void*>(view), size);
+    if (mapping != NO_MAPPING) close(static_cast<int>(mapping));
+#endif
+}
+
+} // namespace
+
+SharedFrameRing::SharedFrameRing()
+        : FrameWorker("Shared frames"), m_mapping(NO_MAPPING), m_view(nullptr), m_viewSize(0),
+          m_ring(nullptr), m_frameRate(0) {
+}
+
+SharedFrameRing::~SharedFrameRing() {
+    Finish();
+    Close();
+}
+
+bool SharedFrameRing::Open(const std::string& name, int width, int height, int frameRate) {
+    Close();
+    m_name = name;
+    m_frameRate = frameRate;
+
+    // Planes are padded to cache lines so readers can use aligned loads
+    size_t chromaWidth = (width + 1) / 2;
+    size_t chromaHeight = (height + 1) / 2;
+    size_t headerSize = AlignUp(sizeof(SharedFrameHeader));
+    size_t lumaSize = AlignUp(width) * height;
+    size_t chromaSize = AlignUp(chromaWidth) * chromaHeight;
+    size_t slotSize = AlignUp(headerSize + lumaSize + 2 * AlignUp(chromaSize));
+    size_t firstSlot = AlignUp(sizeof(SharedRingHeader));
+    m_viewSize = firstSlot + SHMRING_SLOTS * slotSize;
+
+    m_view = MapShared(name, m_viewSize, m_mapping);
+    if (!m_view) {
+        m_mapping = NO_MAPPING;
+        m_viewSize = 0;
+        return false;
+    }
+
+    // Readers check the magic last, so they never see a half-initialised ring
+    m_ring = new (m_view) SharedRingHeader();
+    m_ring->version = SHMRING_VERSION;
+    m_ring->slotCount = SHMRING_SLOTS;
+    m_ring->width = width;
+    m_ring->height = height;
+    m_ring->frameRate = frameRate;
+    m_ring->slotSize = slotSize;
+    m_ring->firstSlotOffset = firstSlot;
+    m_ring->published.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < SHMRING_SLOTS; i++) {
+        SharedFrameHeader* slot = new (m_view + firstSlot + i * slotSize) SharedFrameHeader();
+        slot->sequence.store(0, std::memory_order_relaxed);
+        slot->format = AV_PIX_FMT_YUV420P;
+        slot->width = width;
+        slot->height = height;
+        slot->planeCount = 3;
+        slot->stride[0] = static_cast<uint32_t>(AlignUp(width));
+        slot->stride[1] = slot->stride[2] = static_cast<uint32_t>(AlignUp(chromaWidth));
+        slot->planeOffset[0] = headerSize;
+        slot->planeOffset[1] = headerSize + lumaSize;
+        slot->planeOffset[2] = headerSize + lumaSize + AlignUp(chromaSize);
+    }
+    m_ring->writerActive.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_ring->magic.store(SHMRING_MAGIC, std::memory_order_release);
+
+    SetMaxQueueDepth(SHMRING_QUEUE_DEPTH);
+    LogConcise("SharedFrames", "Publishing " + std::to_string(width) + "x" + std::to_string(height) + " to " +
+                               MappingPath(name) + ", " + std::to_string(SHMRING_SLOTS) + " slots of " +
+                               std::to_string(slotSize) + " bytes");
+    Start();
+    return true;
+}
+
+bool SharedFrameRing::ProcessFrame(AVFrame* frame) {
+    if (frame->width != static_cast<int>(m_ring->width) || frame->height != static_cast<int>(m_ring->height)) {
+        return true;
+    }
+    uint64_t index = m_ring->published.load(std::memory_order_relaxed);
+    uint8_t* base = m_view + m_ring->firstSlotOffset + (index % m_ring->slotCount) * m_ring->slotSize;
+    SharedFrameHeader* slot = reinterpret_cast<SharedFrameHeader*>(base);
+
+    // Odd sequence first, so a reader still looking at the old frame sees it change
+    uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+    slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->frameIndex = index;
+    slot->ptsUs = m_frameRate > 0 ? frame->pts * 1000000 / m_frameRate : frame->pts;
+    const int rows[3] = {frame->height, (frame->height + 1) / 2, (frame->height + 1) / 2};
+    const size_t bytes[3] = {static_cast<size_t>(frame->width), static_cast<size_t>(frame->width + 1) / 2,
+                             static_cast<size_t>(frame->width + 1) / 2};
+    for (int plane = 0; plane < 3; plane++) {
+        uint8_t* dst = base + slot->planeOffset[plane];
+        const uint8_t* src = frame->data[plane];
+        for (int y = 0; y < rows[plane]; y++) {
+            memcpy(dst, src, bytes[plane]);
+            dst += slot->stride[plane];
+            src += frame->linesize[plane];
+        }
+    }
+
+    slot->sequence.store(sequence + 2, std::memory_order_release);
+    m_ring->published.store(index + 1, std::memory_order_release);
+    return true;
+}
+
+bool SharedFrameRing::OnFinish() {
+    if (m_ring) {
+        m_ring->writerActive.store(0, std::memory_order_release);
+        LogConcise("SharedFrames", "Published " + std::to_string(m_ring->published.load()) + " frames, dropped " +
+                                   std::to_string(Dropped()));
+    }
+    return true;
+}
+
+void SharedFrameRing::Close() {
+    if (!m_view) {
+        return;
+    }
+    UnmapShared(m_view, m_viewSize, m_mapping);
+#ifndef _WIN32
+    // Readers that still have it mapped keep their view; new ones wait for the next recording
+    shm_unlink(MappingPath(m_name).c_str());
+#endif
+    m_view = nullptr;
+    m_ring = nullptr;
+    m_viewSize = 0;
+    m_mapping = NO_MAPPING;
+}
+
+SharedFrameReader::SharedFrameReader()
+        : m_mapping(NO_MAPPING), m_view(nullptr), m_viewSize(0), m_ring(nullptr), m_nextIndex(0) {
+}
+
+SharedFrameReader::~SharedFrameReader() {
+    Close();
+}
+
+bool SharedFrameReader::Open(const std::string& name) {
+    Close();
+    size_t size = 0;
+    const uint8_t* view = MapShared(name, size, m_mapping);
+    if (!view) {
+        m_mapping = NO_MAPPING;
+        return false;
+    }
+    const SharedRingHeader* ring = reinterpret_cast<const SharedRingHeader*>(view);
+    if (ring->magic.load(std::memory_order_acquire) != SHMRING_MAGIC || ring->version != SHMRING_VERSION ||
+        size < ring->firstSlotOffset + ring->slotCount * ring->slotSize) {
+        LogDebug("Shared frames: " + name + " is not a frame ring this reader understands");
+        UnmapShared(view, size, m_mapping);
+        m_mapping = NO_MAPPING;
+        return false;
+    }
+    m_view = view;
+    m_viewSize = size;
+    m_ring = ring;
+    m_nextIndex = 0;
+    return true;
+}
+
+void SharedFrameReader::Close() {
+    if (m_view) {
+        UnmapShared(m_view, m_viewSize, m_mapping);
+    }
+    m_view = nullptr;
+    m_ring = nullptr;
+    m_viewSize = 0;
+    m_mapping = NO_MAPPING;
+}
+
+bool SharedFrameReader::Acquire(SharedFrameView& view) {
+    if (!m_ring) {
+        return false;
+    }
+    // Always jump to the newest frame; anything older has been skipped
+    uint64_t published = m_ring->published.load(std::memory_order_acquire);
+    if (published == 0 || published <= m_nextIndex) {
+        return false;
+    }
+    uint64_t index = published - 1;
+    const uint8_t* base = m_view + m_ring->firstSlotOffset + (index % m_ring->slotCount) * m_ring->slotSize;
+    const SharedFrameHeader* slot = reinterpret_cast<const SharedFrameHeader*>(base);
+    uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    if ((sequence & 1) || slot->frameIndex != index) {
+        // Lapped by the writer between the two loads; the caller just tries again
+        return false;
+    }
+
+    view.frameIndex = index;
+    view.ptsUs = slot->ptsUs;
+    view.width = static_cast<int>(slot->width);
+    view.height = static_cast<int>(slot->height);
+    view.format = static_cast<int>(slot->format);
+    for (int plane = 0; plane < 4; plane++) {
+        bool present = plane < static_cast<int>(slot->planeCount);
+        view.planes[plane] = present ? base + slot->planeOffset[plane] : nullptr;
+        view.strides[plane] = present ? static_cast<int>(slot->stride[plane]) : 0;
+    }
+    view.skipped = index - m_nextIndex;
+    view.slot = slot;
+    view.sequence = sequence;
+    m_nextIndex = index + 1;
+    return Validate(view);
+}
+
+bool SharedFrameReader::Validate(const SharedFrameView& view) const {
+    // Everything read from the slot has to happen before the second sample
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return view.slot && view.slot->sequence.load(std::memory_order_relaxed) == view.sequence;
+}
+
+bool SharedFrameReader::WriterActive() const {
+    return m_ring && m_ring->writerActive.load(std::memory_order_acquire) != 0;
+}
@@ -0,0 +1,112 @@
+// shmring.h
+#pragma once
+
+#include "pipeline.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#define SHMRING_DEFAULT_NAME "ScreenRecorderFrames"
+#define SHMRING_MAGIC 0x53524346u      // "FCRS"
+#define SHMRING_VERSION 1
+#define SHMRING_SLOTS 4                // readers have this many frames before a slot is reused
+#define SHMRING_ALIGNMENT 64
+#define SHMRING_QUEUE_DEPTH 2          // publishing is best effort; frames beyond this are dropped
+
+// Layout of the shared mapping, shared with reader processes. Everything is
+// fixed-size so both sides agree regardless of compiler. The ring header is
+// followed by slotCount slots of slotSize bytes, each starting with a
+// SharedFrameHeader and holding the planes at the offsets it gives.
+struct SharedRingHeader {
+    std::atomic<uint32_t> magic;          // written last, once the rest is valid
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t width;
+    uint32_t height;
+    uint32_t frameRate;
+    uint64_t slotSize;
+    uint64_t firstSlotOffset;
+    std::atomic<uint32_t> writerActive;   // 0 once the recording ends; readers should reopen
+    uint32_t reserved;
+    std::atomic<uint64_t> published;      // frames published so far; the newest is published - 1
+};
+
+// Per-slot seqlock: sequence is odd while the writer fills the slot and
+// moves on by two for every frame. A reader samples it before and after
+// using the pixels and discards the frame if the two differ.
+struct SharedFrameHeader {
+    std::atomic<uint64_t> sequence;
+    uint64_t frameIndex;
+    int64_t ptsUs;
+    uint32_t format;                      // AVPixelFormat, YUV420P today
+    uint32_t width;
+    uint32_t height;
+    uint32_t planeCount;
+    uint32_t stride[4];
+    uint64_t planeOffset[4];              // from the start of the slot
+};
+
+// Publishes converted frames into a named shared-memory ring for other
+// processes (shm_open on POSIX, a named file mapping on Windows). The writer
+// never waits for readers: slots are overwritten in turn and readers detect
+// torn frames through the slot's sequence.
+class SharedFrameRing : public FrameWorker {
+public:
+    SharedFrameRing();
+    ~SharedFrameRing() override;
+
+    bool Open(const std::string& name, int width, int height, int frameRate);
+    const std::string& MappingName() const { return m_name; }
+
+protected:
+    bool ProcessFrame(AVFrame* frame) override;
+    bool OnFinish() override;
+
+private:
+    void Close();
+
+    std::string m_name;
+    intptr_t m_mapping;    // mapping HANDLE on Windows, shm descriptor elsewhere
+    uint8_t* m_view;
+    size_t m_viewSize;
+    SharedRingHeader* m_ring;
+    int m_frameRate;
+};
+
+// What a reader sees of one frame; the planes point into the mapping.
+struct SharedFrameView {
+    uint64_t frameIndex;
+    int64_t ptsUs;
+    int width;
+    int height;
+    int format;
+    const uint8_t* planes[4];
+    int strides[4];
+    uint64_t skipped;      // frames published since the previous Acquire that were never seen
+    const SharedFrameHeader* slot;
+    uint64_t sequence;
+};
+
+// Reader side, for analysis processes. Acquire returns the newest frame in
+// place, without copying; Validate afterwards says whether it stayed intact
+// while it was being used.
+class SharedFrameReader {
+public:
+    SharedFrameReader();
+    ~SharedFrameReader();
+
+    bool Open(const std::string& name);
+    void Close();
+    // False when there is no frame newer than the last one acquired
+    bool Acquire(SharedFrameView& view);
+    bool Validate(const SharedFrameView& view) const;
+    bool WriterActive() const;
+
+private:
+    intptr_t m_mapping;
+    const uint8_t* m_view;
+    size_t m_viewSize;
+    const SharedRingHeader* m_ring;
+    uint64_t m_nextIndex;
+};
@@ -0,0 +1,151 @@
+// stats.cpp
+#include "stats.h"
+#include "log.h"
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+const char* STAGE_NAMES[STAGE_COUNT] = {
+    "capture", "copy", "analyze", "convert", "encode_send", "encode_receive", "mux", "glass_to_packet"
+};
+
+std::string JsonString(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            quoted += ' ';
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+} // namespace
+
+LatencyHistogram::LatencyHistogram() {
+    Reset();
+}
+
+int LatencyHistogram::BucketIndex(int64_t us) {
+    if (us < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return us < 0 ? 0 : static_cast<int>(us);
+    }
+    int shift = 0;
+    while (us >= 2 * HISTOGRAM_SUB_BUCKETS) {
+        us >>= 1;
+        shift++;
+    }
+    int index = (shift + 1) * HISTOGRAM_SUB_BUCKETS + static_cast<int>(us - HISTOGRAM_SUB_BUCKETS);
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+int64_t LatencyHistogram::BucketMidpoint(int index) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    int64_t low = static_cast<int64_t>(index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+    return low + (static_cast<int64_t>(1) << shift) / 2;
+}
+
+void LatencyHistogram::Record(int64_t us) {
+    m_buckets[BucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sumUs.fetch_add(us, std::memory_order_relaxed);
+    int64_t max = m_maxUs.load(std::memory_order_relaxed);
+    while (us > max && !m_maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::Reset() {
+    for (std::atomic<uint32_t>& bucket : m_buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_sumUs.store(0, std::memory_order_relaxed);
+    m_maxUs.store(0, std::memory_order_relaxed);
+}
+
+LatencySummary LatencyHistogram::Summary() const {
+    LatencySummary summary = {0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    // Count the buckets themselves so the percentiles agree with each other
+    int64_t count = 0;
+    for (const std::atomic<uint32_t>& bucket : m_buckets) {
+        count += bucket.load(std::memory_order_relaxed);
+    }
+    if (count == 0) {
+        return summary;
+    }
+    int64_t maxUs = m_maxUs.load(std::memory_order_relaxed);
+    const double fractions[3] = {0.50, 0.90, 0.99};
+    double* targets[3] = {&summary.p50Ms, &summary.p90Ms, &summary.p99Ms};
+    int64_t seen = 0;
+    int next = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS && next < 3; i++) {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        while (next < 3 && seen >= static_cast<int64_t>(fractions[next] * count + 0.5) && seen > 0) {
+            int64_t value = BucketMidpoint(i);
+            *targets[next++] = (value < maxUs ? value : maxUs) / 1000.0;
+        }
+    }
+    summary.count = count;
+    summary.meanMs = m_sumUs.load(std::memory_order_relaxed) / 1000.0 / count;
+    summary.maxMs = maxUs / 1000.0;
+    return summary;
+}
+
+const char* StageName(PipelineStage stage) {
+    return stage >= 0 && stage < STAGE_COUNT ? STAGE_NAMES[stage] : "unknown";
+}
+
+std::string StatsFilename(const std::string& output) {
+    size_t dot = output.find_last_of('.');
+    size_t slash = output.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = output.size();
+    }
+    return output.substr(0, dot) + STATS_EXTENSION;
+}
+
+StageStats& StageStats::Instance() {
+    static StageStats instance;
+    return instance;
+}
+
+void StageStats::Reset() {
+    for (LatencyHistogram& stage : m_stages) {
+        stage.Reset();
+    }
+}
+
+bool StageStats::WriteSummary(const std::string& filename, const std::string& recording, int64_t frames) const {
+    std::ofstream file(filename, std::ios::trunc);
+    file << std::fixed << std::setprecision(3);
+    file << "{\n  \"recording\": " << JsonString(recording) << ",\n  \"frames\": " << frames
+         << ",\n  \"stages\": {";
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        LatencySummary s = m_stages[i].Summary();
+        file << (i > 0 ? ",\n" : "\n") << "    \"" << STAGE_NAMES[i] << "\": {\"count\": " << s.count
+             << ", \"mean_ms\": " << s.meanMs << ", \"p50_ms\": " << s.p50Ms << ", \"p90_ms\": " << s.p90Ms
+             << ", \"p99_ms\": " << s.p99Ms << ", \"max_ms\": " << s.maxMs << "}";
+        if (s.count > 0) {
+            std::stringstream ss;
+            ss << std::fixed << std::setprecision(2) << STAGE_NAMES[i] << ": " << s.count << " samples, p50 "
+               << s.p50Ms << " ms, p90 " << s.p90Ms << " ms, p99 " << s.p99Ms << " ms, max " << s.maxMs << " ms";
+            LogConcise("Stages", ss.str());
+        }
+    }
+    file << "\n  }\n}\n";
+    if (!file) {
+        LogDebug("Could not write " + filename);
+        return false;
+    }
+    return true;
+}
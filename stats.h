@@ -0,0 +1,110 @@
+// stats.h
+#pragma once
+
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#define HISTOGRAM_SUB_BITS 5                      // 32 buckets per power of two, under 3% error
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXPONENT 40                 // up to 2^40 us; longer values land in the last bucket
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+#define STATS_EXTENSION "_stats.json"
+
+struct LatencySummary {
+    int64_t count;
+    double meanMs;
+    double p50Ms;
+    double p90Ms;
+    double p99Ms;
+    double maxMs;
+};
+
+// Log-linear histogram of latencies in microseconds, in the manner of
+// HdrHistogram: exact below 64 us, then 32 buckets per power of two.
+// Recording is a few relaxed atomic operations, so any number of threads can
+// record at once without locks; a summary taken meanwhile may miss the
+// latest values but never blocks them.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void Record(int64_t us);
+    // Not safe while other threads record
+    void Reset();
+    int64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+    // Percentiles are bucket midpoints, capped at the exact maximum
+    LatencySummary Summary() const;
+
+private:
+    static int BucketIndex(int64_t us);
+    static int64_t BucketMidpoint(int index);
+
+    std::atomic<uint32_t> m_buckets[HISTOGRAM_BUCKETS];
+    std::atomic<int64_t> m_count;
+    std::atomic<int64_t> m_sumUs;
+    std::atomic<int64_t> m_maxUs;
+};
+
+enum PipelineStage {
+    STAGE_CAPTURE,          // BitBlt from the screen
+    STAGE_COPY,             // GetDIBits into the frame buffer
+    STAGE_ANALYZE,          // scroll and damage hashing
+    STAGE_CONVERT,          // BGRA to YUV
+    STAGE_ENCODE_SEND,      // avcodec_send_frame, all encoders
+    STAGE_ENCODE_RECEIVE,   // avcodec_receive_packet calls that returned a packet
+    STAGE_MUX,              // av_interleaved_write_frame
+    STAGE_GLASS_TO_PACKET,  // capture to muxed packet, end to end
+    STAGE_COUNT
+};
+
+const char* StageName(PipelineStage stage);
+
+// The sidecar summary of an output: same name, STATS_EXTENSION.
+std::string StatsFilename(const std::string& output);
+
+// Histograms of every pipeline stage. Instance() belongs to the current
+// recording and is what its summary and /metrics report; work that runs
+// beside it, such as a background transcode, records into its own.
+class StageStats {
+public:
+    static StageStats& Instance();
+
+    StageStats() {}
+
+    void Record(PipelineStage stage, int64_t us) { m_stages[stage].Record(us); }
+    const LatencyHistogram& Stage(PipelineStage stage) const { return m_stages[stage]; }
+    // Call between recordings, while nothing records
+    void Reset();
+    // Logs one line per stage and writes them all to a JSON file
+    bool WriteSummary(const std::string& filename, const std::string& recording, int64_t frames) const;
+
+private:
+    LatencyHistogram m_stages[STAGE_COUNT];
+};
+
+// Records the time since start under a stage, and on the trace timeline
+inline void RecordStage(PipelineStage stage, std::chrono::steady_clock::time_point start,
+                        StageStats& stats = StageStats::Instance()) {
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    stats.Record(stage, std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+#ifdef SCREENRECORDER_TRACING
+    TraceComplete(StageName(stage), start, end, -1);
+#endif
+}
+
+// Records the time from construction to destruction under a stage
+class ScopedStageTimer {
+public:
+    explicit ScopedStageTimer(PipelineStage stage, StageStats& stats = StageStats::Instance())
+            : m_stage(stage), m_stats(stats), m_start(std::chrono::steady_clock::now()) {}
+    ~ScopedStageTimer() { RecordStage(m_stage, m_start, m_stats); }
+
+private:
+    PipelineStage m_stage;
+    StageStats& m_stats;
+    std::chrono::steady_clock::time_point m_start;
+};
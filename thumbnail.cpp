@@ -0,0 +1,299 @@
+// thumbnail.cpp
+#include "thumbnail.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+namespace {
+
+std::string VttTime(double seconds) {
+    int64_t ms = static_cast<int64_t>(seconds * 1000.0 + 0.5);
+    std::stringstream ss;
+    ss << std::setfill('0') << std::setw(2) << ms / 3600000 << ":" << std::setw(2) << (ms / 60000) % 60 << ":"
+       << std::setw(2) << (ms / 1000) % 60 << "." << std::setw(3) << ms % 1000;
+    return ss.str();
+}
+
+std::string BaseName(const std::string& path) {
+    size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+} // namespace
+
+ThumbnailWorker::ThumbnailWorker()
+        : FrameWorker("Thumbnails"), m_frameRate(0), m_intervalTicks(0), m_webp(false),
+          m_thumbWidth(0), m_thumbHeight(0), m_thumbScaler(nullptr), m_posterScaler(nullptr),
+          m_sheet(nullptr), m_latest(nullptr), m_posterTaken(false), m_sheetIndex(0), m_sheetCount(0),
+          m_lastTakenPts(AV_NOPTS_VALUE), m_lastPts(AV_NOPTS_VALUE) {
+}
+
+ThumbnailWorker::~ThumbnailWorker() {
+    Finish();
+    Release();
+}
+
+bool ThumbnailWorker::Open(const std::string& baseFilename, int width, int height, int frameRate,
+                           int intervalSeconds, bool webp) {
+    Release();
+    size_t dot = baseFilename.find_last_of('.');
+    size_t slash = baseFilename.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = baseFilename.size();
+    }
+    m_stem = baseFilename.substr(0, dot);
+    m_webp = webp && avcodec_find_encoder(AV_CODEC_ID_WEBP) != nullptr;
+    if (webp && !m_webp) {
+        LogDebug("Thumbnails: no WebP encoder in this FFmpeg build, writing JPEG");
+    }
+    m_extension = m_webp ? ".webp" : ".jpg";
+    m_frameRate = frameRate;
+    m_intervalTicks = (intervalSeconds > 0 ? intervalSeconds : THUMBNAIL_DEFAULT_SECONDS) * frameRate;
+    m_sheetIndex = 0;
+    m_sheetCount = 0;
+    m_thumbnails.clear();
+    m_lastTakenPts = AV_NOPTS_VALUE;
+    m_lastPts = AV_NOPTS_VALUE;
+    m_posterTaken = false;
+
+    // Even sizes keep the chroma planes of the sheet aligned with the luma tiles
+    m_thumbWidth = (width < THUMBNAIL_WIDTH ? width : THUMBNAIL_WIDTH) & ~1;
+    m_thumbHeight = static_cast<int>(static_cast<int64_t>(height) * m_thumbWidth / width) & ~1;
+    if (m_thumbWidth < 2 || m_thumbHeight < 2) {
+        return false;
+    }
+    // JPEG wants full-range YUV; the converter's frames are limited range
+    AVPixelFormat format = m_webp ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_YUVJ420P;
+    m_thumbScaler = sws_getContext(width, height, AV_PIX_FMT_YUV420P, m_thumbWidth, m_thumbHeight, format,
+                                   SWS_AREA, NULL, NULL, NULL);
+    m_sheet = av_frame_alloc();
+    if (!m_thumbScaler || !m_sheet) {
+        LogDebug("Thumbnails: could not set up the scaler");
+        Release();
+        return false;
+    }
+    m_sheet->format = format;
+    m_sheet->width = m_thumbWidth * THUMBNAIL_COLUMNS;
+    m_sheet->height = m_thumbHeight * THUMBNAIL_ROWS;
+    if (av_frame_get_buffer(m_sheet, 32) < 0) {
+        LogDebug("Thumbnails: could not allocate a sprite sheet");
+        Release();
+        return false;
+    }
+
+    SetLowPriority(true);
+    // Frames only need a look now and then; never let them pile up
+    SetMaxQueueDepth(2);
+    Start();
+    return true;
+}
+
+bool ThumbnailWorker::ProcessFrame(AVFrame* frame) {
+    m_lastPts = frame->pts;
+    if (!m_posterTaken) {
+        if (frame->pts >= static_cast<int64_t>(THUMBNAIL_POSTER_SECONDS) * m_frameRate) {
+            TakePoster(frame);
+        } else {
+            if (!m_latest) m_latest = av_frame_alloc();
+            av_frame_unref(m_latest);
+            if (m_latest) av_frame_ref(m_latest, frame);
+        }
+    }
+
+    bool take = m_lastTakenPts == AV_NOPTS_VALUE || frame->pts - m_lastTakenPts >= m_intervalTicks;
+    CaptureInfo info;
+    if (!take && GetCaptureInfo(frame, info) && info.totalTiles > 0 &&
+        frame->pts - m_lastTakenPts >= static_cast<int64_t>(THUMBNAIL_MIN_SECONDS) * m_frameRate &&
+        info.changedTiles * 100 >= info.totalTiles * THUMBNAIL_SCENE_PERCENT) {
+        take = true;
+    }
+    // A failed sheet costs thumbnails, not the recording
+    if (take && !AddThumbnail(frame)) {
+        LogDebug("Thumbnails: could not add frame " + std::to_string(frame->pts));
+    }
+    return true;
+}
+
+bool ThumbnailWorker::AddThumbnail(const AVFrame* frame) {
+    if (m_sheetCount == 0) {
+        // Black, in whichever range the sheet uses
+        if (av_frame_make_writable(m_sheet) < 0) {
+            return false;
+        }
+        uint8_t black = m_sheet->format == AV_PIX_FMT_YUVJ420P ? 0 : 16;
+        memset(m_sheet->data[0], black, static_cast<size_t>(m_sheet->linesize[0]) * m_sheet->height);
+        memset(m_sheet->data[1], 128, static_cast<size_t>(m_sheet->linesize[1]) * (m_sheet->height / 2));
+        memset(m_sheet->data[2], 128, static_cast<size_t>(m_sheet->linesize[2]) * (m_sheet->height / 2));
+    }
+
+    // Scale straight into the sheet
+    int x = (m_sheetCount % THUMBNAIL_COLUMNS) * m_thumbWidth;
+    int y = (m_sheetCount / THUMBNAIL_COLUMNS) * m_thumbHeight;
+    uint8_t* dst[4] = {
+        m_sheet->data[0] + static_cast<size_t>(y) * m_sheet->linesize[0] + x,
+        m_sheet->data[1] + static_cast<size_t>(y / 2) * m_sheet->linesize[1] + x / 2,
+        m_sheet->data[2] + static_cast<size_t>(y / 2) * m_sheet->linesize[2] + x / 2,
+        nullptr
+    };
+    int dstStride[4] = { m_sheet->linesize[0], m_sheet->linesize[1], m_sheet->linesize[2], 0 };
+    sws_scale(m_thumbScaler, frame->data, frame->linesize, 0, frame->height, dst, dstStride);
+
+    m_thumbnails.push_back(Thumbnail{frame->pts, m_sheetIndex, x, y});
+    m_lastTakenPts = frame->pts;
+    if (++m_sheetCount == THUMBNAIL_COLUMNS * THUMBNAIL_ROWS) {
+        return WriteSheet();
+    }
+    return true;
+}
+
+bool ThumbnailWorker::TakePoster(const AVFrame* frame) {
+    m_posterTaken = true;
+    av_frame_free(&m_latest);
+    int posterWidth = (frame->width < THUMBNAIL_POSTER_WIDTH ? frame->width : THUMBNAIL_POSTER_WIDTH) & ~1;
+    int posterHeight = static_cast<int>(static_cast<int64_t>(frame->height) * posterWidth / frame->width) & ~1;
+    if (posterWidth < 2 || posterHeight < 2) {
+        return false;
+    }
+    m_posterScaler = sws_getCachedContext(m_posterScaler, frame->width, frame->height, AV_PIX_FMT_YUV420P,
+                                          posterWidth, posterHeight, static_cast<AVPixelFormat>(m_sheet->format),
+                                          SWS_AREA, NULL, NULL, NULL);
+    AVFrame* poster = av_frame_alloc();
+    bool ok = false;
+    if (m_posterScaler && poster) {
+        poster->format = m_sheet->format;
+        poster->width = posterWidth;
+        poster->height = posterHeight;
+        if (av_frame_get_buffer(poster, 32) >= 0) {
+            sws_scale(m_posterScaler, frame->data, frame->linesize, 0, frame->height, poster->data, poster->linesize);
+            ok = WriteImage(poster, m_stem + "_poster" + m_extension);
+        }
+    }
+    av_frame_free(&poster);
+    return ok;
+}
+
+bool ThumbnailWorker::WriteSheet() {
+    if (m_sheetCount == 0) {
+        return true;
+    }
+    // A partly filled sheet is cropped to the rows (or, for one row, the
+    // columns) it actually uses
+    AVFrame* used = av_frame_alloc();
+    if (!used || av_frame_ref(used, m_sheet) < 0) {
+        av_frame_free(&used);
+        return false;
+    }
+    int rows = (m_sheetCount + THUMBNAIL_COLUMNS - 1) / THUMBNAIL_COLUMNS;
+    used->height = rows * m_thumbHeight;
+    if (rows == 1) {
+        used->width = m_sheetCount * m_thumbWidth;
+    }
+    bool ok = WriteImage(used, SheetFilename(m_sheetIndex));
+    av_frame_free(&used);
+    m_sheetIndex++;
+    m_sheetCount = 0;
+    return ok;
+}
+
+bool ThumbnailWorker::WriteImage(const AVFrame* image, const std::string& filename) {
+    const AVCodec* codec = avcodec_find_encoder(m_webp ? AV_CODEC_ID_WEBP : AV_CODEC_ID_MJPEG);
+    AVCodecContext* context = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!context) {
+        LogDebug("Thumbnails: no image encoder");
+        return false;
+    }
+    context->width = image->width;
+    context->height = image->height;
+    context->pix_fmt = static_cast<AVPixelFormat>(image->format);
+    context->time_base = AVRational{1, 1};
+    AVDictionary* options = NULL;
+    if (m_webp) {
+        av_dict_set(&options, "quality", "75", 0);
+    } else {
+        context->flags |= AV_CODEC_FLAG_QSCALE;
+        context->global_quality = FF_QP2LAMBDA * THUMBNAIL_JPEG_QUALITY;
+    }
+
+    bool ok = false;
+    AVPacket* packet = av_packet_alloc();
+    if (packet && avcodec_open2(context, codec, &options) >= 0) {
+        AVFrame* input = av_frame_clone(image);
+        if (input) {
+            input->quality = context->global_quality;
+            input->pts = 0;
+        }
+        if (input && avcodec_send_frame(context, input) >= 0 && avcodec_send_frame(context, NULL) >= 0 &&
+            avcodec_receive_packet(context, packet) >= 0) {
+            FILE* file = fopen(filename.c_str(), "wb");
+            ok = file && fwrite(packet->data, 1, packet->size, file) == static_cast<size_t>(packet->size);
+            if (file && fclose(file) != 0) ok = false;
+        }
+        av_frame_free(&input);
+    }
+    av_dict_free(&options);
+    av_packet_free(&packet);
+    avcodec_free_context(&context);
+    if (!ok) {
+        LogDebug("Thumbnails: could not write " + filename);
+        std::remove(filename.c_str());
+    }
+    return ok;
+}
+
+bool ThumbnailWorker::WriteTrack() {
+    std::ofstream track(m_stem + "_thumbs.vtt", std::ios::trunc);
+    if (!track) {
+        LogDebug("Thumbnails: could not write " + m_stem + "_thumbs.vtt");
+        return false;
+    }
+    track << "WEBVTT\n";
+    for (size_t i = 0; i < m_thumbnails.size(); i++) {
+        const Thumbnail& thumb = m_thumbnails[i];
+        int64_t end = i + 1 < m_thumbnails.size() ? m_thumbnails[i + 1].pts : m_lastPts + 1;
+        track << "\n" << VttTime(static_cast<double>(thumb.pts) / m_frameRate) << " --> "
+              << VttTime(static_cast<double>(end) / m_frameRate) << "\n"
+              << BaseName(SheetFilename(thumb.sheet)) << "#xywh=" << thumb.x << "," << thumb.y << ","
+              << m_thumbWidth << "," << m_thumbHeight << "\n";
+    }
+    return static_cast<bool>(track);
+}
+
+bool ThumbnailWorker::OnFinish() {
+    if (m_lastPts == AV_NOPTS_VALUE) {
+        return true;
+    }
+    // Shorter than the poster delay: the last frame will have to do
+    if (!m_posterTaken && m_latest) {
+        TakePoster(m_latest);
+    }
+    bool ok = WriteSheet();
+    ok = WriteTrack() && ok;
+    LogConcise("Thumbnails", std::to_string(m_thumbnails.size()) + " thumbnails on " + std::to_string(m_sheetIndex) +
+                             " sheets for " + m_stem + ", " + std::to_string(Dropped()) + " frames skipped");
+    // Thumbnails are best effort; never fail the recording over them
+    (void)ok;
+    return true;
+}
+
+std::string ThumbnailWorker::SheetFilename(int sheet) const {
+    std::stringstream ss;
+    ss << m_stem << "_sprite_" << std::setw(3) << std::setfill('0') << sheet << m_extension;
+    return ss.str();
+}
+
+void ThumbnailWorker::Release() {
+    sws_freeContext(m_thumbScaler);
+    m_thumbScaler = nullptr;
+    sws_freeContext(m_posterScaler);
+    m_posterScaler = nullptr;
+    av_frame_free(&m_sheet);
+    av_frame_free(&m_latest);
+}
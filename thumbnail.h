@@ -0,0 +1,76 @@
+// thumbnail.h
+#pragma once
+
+#include "pipeline.h"
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#define THUMBNAIL_WIDTH 160
+#define THUMBNAIL_COLUMNS 10
+#define THUMBNAIL_ROWS 10               // a new sheet starts once one is full
+#define THUMBNAIL_DEFAULT_SECONDS 10
+#define THUMBNAIL_MIN_SECONDS 1         // scene changes never come closer together than this
+#define THUMBNAIL_SCENE_PERCENT 40      // share of changed tiles that counts as a scene change
+#define THUMBNAIL_POSTER_WIDTH 640
+#define THUMBNAIL_POSTER_SECONDS 2      // skip the first moments, which usually show the selection
+#define THUMBNAIL_JPEG_QUALITY 4        // mjpeg qscale, lower is better
+
+// Builds thumbnails from frames already in the pipeline: one every few
+// seconds and one at every scene change, downscaled into sprite sheets, plus
+// a larger poster frame and a WebVTT track that maps times to sprites.
+// Nothing is captured or decoded for it, and it runs at background priority.
+//
+// For recording.mp4 it writes recording_sprite_000.jpg (or .webp),
+// recording_poster.jpg and recording_thumbs.vtt.
+class ThumbnailWorker : public FrameWorker {
+public:
+    ThumbnailWorker();
+    ~ThumbnailWorker() override;
+
+    bool Open(const std::string& baseFilename, int width, int height, int frameRate,
+              int intervalSeconds, bool webp);
+
+protected:
+    bool ProcessFrame(AVFrame* frame) override;
+    bool OnFinish() override;
+
+private:
+    struct Thumbnail {
+        int64_t pts;
+        int sheet;
+        int x;
+        int y;
+    };
+
+    bool AddThumbnail(const AVFrame* frame);
+    bool TakePoster(const AVFrame* frame);
+    bool WriteSheet();
+    bool WriteImage(const AVFrame* image, const std::string& filename);
+    bool WriteTrack();
+    std::string SheetFilename(int sheet) const;
+    void Release();
+
+    std::string m_stem;
+    std::string m_extension;
+    int m_frameRate;
+    int m_intervalTicks;
+    bool m_webp;
+    int m_thumbWidth;
+    int m_thumbHeight;
+
+    SwsContext* m_thumbScaler;
+    SwsContext* m_posterScaler;
+    AVFrame* m_sheet;
+    AVFrame* m_latest;              // poster candidate until THUMBNAIL_POSTER_SECONDS
+    bool m_posterTaken;
+    int m_sheetIndex;
+    int m_sheetCount;               // thumbnails on the current sheet
+    std::vector<Thumbnail> m_thumbnails;
+    int64_t m_lastTakenPts;
+    int64_t m_lastPts;
+};
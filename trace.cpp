@@ -0,0 +1,232 @@
+// trace.cpp
+#include "trace.h"
+#include "log.h"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::string TraceFilename(const std::string& output) {
+    size_t dot = output.find_last_of('.');
+    size_t slash = output.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = output.size();
+    }
+    return output.substr(0, dot) + TRACE_EXTENSION;
+}
+
+#ifdef SCREENRECORDER_TRACING
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    int64_t startUs;
+    int64_t durationUs;
+    int64_t frame;
+};
+
+// The low half of a buffer position counts events, the high half how often
+// the buffer has been rewound
+const uint64_t TRACE_INDEX_MASK = 0xffffffffu;
+
+// Written by one thread only; the position is published after each event, so
+// a reader sees whole events even while the thread keeps going. WriteTrace
+// never touches the position: it copies the events and publishes how far it
+// got in consumed, and the owning thread rewinds once everything is taken.
+struct TraceBuffer {
+    std::unique_ptr<TraceEvent[]> events;
+    std::atomic<uint64_t> size;
+    std::atomic<uint64_t> consumed;
+    std::atomic<int64_t> dropped;
+    std::atomic<bool> retired;    // the thread is gone; free after the next write
+    std::string threadName;
+    int threadId;
+};
+
+std::atomic<bool> g_tracing(false);
+std::mutex g_registryMutex;
+std::vector<std::unique_ptr<TraceBuffer>> g_buffers;
+int g_nextThreadId = 1;
+std::chrono::steady_clock::time_point g_origin;
+
+int64_t SinceOrigin(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(time - g_origin).count();
+}
+
+// Marks the thread's buffer as retired when the thread exits
+struct ThreadTrace {
+    TraceBuffer* buffer = nullptr;
+    ~ThreadTrace() {
+        if (buffer) buffer->retired = true;
+    }
+};
+
+thread_local ThreadTrace t_trace;
+
+TraceBuffer* ThreadBuffer() {
+    if (!t_trace.buffer) {
+        std::unique_ptr<TraceBuffer> buffer(new TraceBuffer());
+        buffer->events.reset(new TraceEvent[TRACE_EVENTS_PER_THREAD]);
+        buffer->size = 0;
+        buffer->consumed = 0;
+        buffer->dropped = 0;
+        buffer->retired = false;
+        std::lock_guard<std::mutex> lock(g_registryMutex);
+        buffer->threadId = g_nextThreadId++;
+        buffer->threadName = "Thread " + std::to_string(buffer->threadId);
+        t_trace.buffer = buffer.get();
+        g_buffers.push_back(std::move(buffer));
+    }
+    return t_trace.buffer;
+}
+
+// One thread's events, copied out so the file is written without the lock
+struct TraceSnapshot {
+    int threadId;
+    std::string threadName;
+    std::vector<TraceEvent> events;
+};
+
+std::string JsonString(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (static_cast<unsigned char>(c) >= 0x20) {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+} // namespace
+
+bool StartTrace() {
+    std::lock_guard<std::mutex> lock(g_registryMutex);
+    if (!g_tracing) {
+        g_origin = std::chrono::steady_clock::now();
+        g_tracing = true;
+        LogDebug("Tracing enabled; a trace is written next to each recording");
+    }
+    return true;
+}
+
+void StopTrace() {
+    g_tracing = false;
+}
+
+bool TracingActive() {
+    return g_tracing.load(std::memory_order_relaxed);
+}
+
+void TraceComplete(const char* name, std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end, int64_t frame) {
+    if (!g_tracing.load(std::memory_order_relaxed)) {
+        return;
+    }
+    TraceBuffer* buffer = ThreadBuffer();
+    uint64_t size = buffer->size.load(std::memory_order_relaxed);
+    if ((size & TRACE_INDEX_MASK) != 0 && buffer->consumed.load(std::memory_order_acquire) == size) {
+        size = ((size >> 32) + 1) << 32;
+    }
+    size_t index = static_cast<size_t>(size & TRACE_INDEX_MASK);
+    if (index >= TRACE_EVENTS_PER_THREAD) {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    buffer->events[index] = TraceEvent{name, SinceOrigin(start), SinceOrigin(end) - SinceOrigin(start), frame};
+    buffer->size.store(size + 1, std::memory_order_release);
+}
+
+void TraceThreadName(const std::string& name) {
+    if (!g_tracing.load(std::memory_order_relaxed)) {
+        return;
+    }
+    TraceBuffer* buffer = ThreadBuffer();
+    std::lock_guard<std::mutex> lock(g_registryMutex);
+    buffer->threadName = name;
+}
+
+bool WriteTrace(const std::string& filename) {
+    // Copy out what each thread has published under the lock, then format
+    // and write without it so no thread waits on the disk to register
+    std::vector<TraceSnapshot> snapshots;
+    size_t events = 0;
+    int64_t dropped = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_registryMutex);
+        for (size_t i = 0; i < g_buffers.size();) {
+            TraceBuffer* buffer = g_buffers[i].get();
+            // Checked first, so a thread that retires meanwhile keeps its buffer until next time
+            bool retired = buffer->retired;
+            uint64_t size = buffer->size.load(std::memory_order_acquire);
+            uint64_t consumed = buffer->consumed.load(std::memory_order_relaxed);
+            // A rewind since the last write means everything before it was taken
+            size_t first = (size >> 32) == (consumed >> 32) ? static_cast<size_t>(consumed & TRACE_INDEX_MASK) : 0;
+            size_t last = static_cast<size_t>(size & TRACE_INDEX_MASK);
+            if (last > first) {
+                snapshots.push_back(TraceSnapshot{buffer->threadId, buffer->threadName,
+                                                  std::vector<TraceEvent>(&buffer->events[first], &buffer->events[last])});
+                events += last - first;
+            }
+            buffer->consumed.store(size, std::memory_order_release);
+            dropped += buffer->dropped.exchange(0);
+            if (retired) {
+                g_buffers.erase(g_buffers.begin() + i);
+                continue;
+            }
+            i++;
+        }
+    }
+    if (snapshots.empty() && !g_tracing) {
+        return false;
+    }
+
+    std::ofstream file(filename, std::ios::trunc);
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"ScreenRecorder\"}}";
+    for (const TraceSnapshot& snapshot : snapshots) {
+        file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << snapshot.threadId
+             << ",\"args\":{\"name\":" << JsonString(snapshot.threadName) << "}}";
+        for (const TraceEvent& event : snapshot.events) {
+            file << ",\n{\"name\":" << JsonString(event.name) << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << snapshot.threadId
+                 << ",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs;
+            if (event.frame >= 0) {
+                file << ",\"args\":{\"frame\":" << event.frame << "}";
+            }
+            file << "}";
+        }
+    }
+    file << "\n]}\n";
+    if (!file) {
+        LogDebug("Could not write " + filename);
+        return false;
+    }
+    LogConcise("Trace", std::to_string(events) + " events written to " + filename +
+                        (dropped > 0 ? ", " + std::to_string(dropped) + " dropped" : ""));
+    return true;
+}
+
+#else
+
+bool StartTrace() {
+    LogDebug("This build has no tracing; configure with ENABLE_TRACING");
+    return false;
+}
+
+void StopTrace() {
+}
+
+bool TracingActive() {
+    return false;
+}
+
+bool WriteTrace(const std::string&) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,61 @@
+// trace.h
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#define TRACE_EXTENSION "_trace.json"
+#define TRACE_EVENTS_PER_THREAD (1 << 17)   // about 4 MB per traced thread; later events are counted and dropped
+
+// Timeline of what every pipeline thread did, written as Chrome trace-event
+// JSON that chrome://tracing and ui.perfetto.dev open directly.
+//
+// Each thread appends complete ("X") events to its own fixed buffer, so
+// recording an event takes no lock and no allocation. Built without
+// SCREENRECORDER_TRACING, the macros below compile to nothing; built with it
+// but not started, each costs one relaxed atomic load.
+
+// Starts collecting events; false when built without tracing
+bool StartTrace();
+// Stops collecting; what was collected stays until the next WriteTrace
+void StopTrace();
+bool TracingActive();
+// Writes everything collected since the last call. Traced threads may keep
+// going meanwhile; what they add after the snapshot goes into the next trace.
+bool WriteTrace(const std::string& filename);
+// The trace that belongs to an output: same name, TRACE_EXTENSION.
+std::string TraceFilename(const std::string& output);
+
+#ifdef SCREENRECORDER_TRACING
+
+// name must outlive the trace; string literals and StageName() do
+void TraceComplete(const char* name, std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end, int64_t frame);
+void TraceThreadName(const std::string& name);
+
+class TraceScope {
+public:
+    explicit TraceScope(const char* name, int64_t frame = -1)
+            : m_name(name), m_frame(frame), m_start(std::chrono::steady_clock::now()) {}
+    ~TraceScope() { TraceComplete(m_name, m_start, std::chrono::steady_clock::now(), m_frame); }
+
+private:
+    const char* m_name;
+    int64_t m_frame;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_SCOPE_FRAME(name, frame) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name, frame)
+#define TRACE_THREAD_NAME(name) TraceThreadName(name)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_SCOPE_FRAME(name, frame) do {} while (0)
+#define TRACE_THREAD_NAME(name) do {} while (0)
+
+#endif
@@ -0,0 +1,219 @@
+// transcode.cpp
+#include "transcode.h"
+#include "log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+
+TranscodeJob::TranscodeJob(const std::string& inputFile, const std::string& baseFilename,
+                           const std::vector<EncoderProfile>& profiles)
+        : m_inputFile(inputFile), m_baseFilename(baseFilename), m_profiles(profiles),
+          m_maxFramesPerSecond(0), m_keepInput(false),
+          m_running(false), m_cancelled(false), m_succeeded(false), m_progress(0.0) {
+}
+
+TranscodeJob::~TranscodeJob() {
+    Cancel();
+    Wait();
+}
+
+bool TranscodeJob::Start(ProgressCallback onProgress, DoneCallback onDone) {
+    if (m_thread.joinable()) {
+        return false;
+    }
+    m_onProgress = onProgress;
+    m_onDone = onDone;
+    m_cancelled = false;
+    m_running = true;
+    m_thread = std::thread(&TranscodeJob::Run, this);
+    return true;
+}
+
+bool TranscodeJob::Wait() {
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    return m_succeeded;
+}
+
+void TranscodeJob::Run() {
+    LowerCurrentThreadPriority();
+    LogConcise("Transcode", "Starting " + m_inputFile);
+
+    m_succeeded = Transcode();
+    if (m_succeeded) {
+        LogConcise("Transcode", "Finished " + m_inputFile);
+        if (!m_keepInput) {
+            std::remove(m_inputFile.c_str());
+        }
+    } else {
+        for (const std::string& output : m_outputs) {
+            std::remove(output.c_str());
+        }
+        LogConcise("Transcode", std::string(m_cancelled ? "Cancelled " : "Failed ") + m_inputFile);
+    }
+
+    m_running = false;
+    if (m_onDone) {
+        m_onDone(m_succeeded, m_outputs);
+    }
+}
+
+bool TranscodeJob::Transcode() {
+    AVFormatContext* input = NULL;
+    AVCodecContext* decoder = NULL;
+    AVPacket* packet = NULL;
+    AVFrame* frame = NULL;
+    std::vector<std::unique_ptr<VideoEncoder>> encoders;
+
+    auto cleanup = [&](bool result) {
+        for (auto& encoder : encoders) {
+            if (!encoder->Finish()) result = false;
+        }
+        av_frame_free(&frame);
+        av_packet_free(&packet);
+        avcodec_free_context(&decoder);
+        avformat_close_input(&input);
+        return result;
+    };
+
+    int ret = avformat_open_input(&input, m_inputFile.c_str(), NULL, NULL);
+    if (ret < 0 || avformat_find_stream_info(input, NULL) < 0) {
+        LogDebug("Transcode: could not open " + m_inputFile);
+        return cleanup(false);
+    }
+
+    const AVCodec* decoderCodec = NULL;
+    int streamIndex = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, &decoderCodec, 0);
+    if (streamIndex < 0 || !decoderCodec) {
+        LogDebug("Transcode: no decodable video stream in " + m_inputFile);
+        return cleanup(false);
+    }
+    AVStream* stream = input->streams[streamIndex];
+
+    decoder = avcodec_alloc_context3(decoderCodec);
+    if (!decoder || avcodec_parameters_to_context(decoder, stream->codecpar) < 0) {
+        LogDebug("Transcode: could not allocate decoder");
+        return cleanup(false);
+    }
+    decoder->thread_count = TRANSCODE_ENCODER_THREADS;
+    if (avcodec_open2(decoder, decoderCodec, NULL) < 0) {
+        LogDebug("Transcode: could not open decoder");
+        return cleanup(false);
+    }
+
+    AVRational frameRate = stream->avg_frame_rate.num > 0 ? stream->avg_frame_rate : stream->r_frame_rate;
+    if (frameRate.num <= 0 || frameRate.den <= 0) {
+        frameRate = av_make_q(30, 1);
+    }
+    AVRational encoderTimeBase = av_inv_q(frameRate);
+
+    double duration = 0.0;
+    if (stream->duration > 0) {
+        duration = stream->duration * av_q2d(stream->time_base);
+    } else if (input->duration > 0) {
+        duration = input->duration / static_cast<double>(AV_TIME_BASE);
+    }
+
+    m_outputs.clear();
+    for (const EncoderProfile& source : m_profiles) {
+        EncoderProfile profile = source;
+        profile.threads = TRANSCODE_ENCODER_THREADS;
+        std::unique_ptr<VideoEncoder> encoder(new VideoEncoder());
+        encoder->SetPooled(false);
+        encoder->SetStageStats(&m_stageStats);
+        std::string output = ProfileFilename(m_baseFilename, profile);
+        if (!encoder->Open(output, decoder->width, decoder->height, frameRate.num / frameRate.den,
+                           profile, 0)) {
+            LogDebug("Transcode: could not open the " + profile.name + " encoder");
+            return cleanup(false);
+        }
+        m_outputs.push_back(output);
+        encoders.push_back(std::move(encoder));
+    }
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!packet || !frame) {
+        return cleanup(false);
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    int64_t framesDone = 0;
+    int64_t firstPts = AV_NOPTS_VALUE;
+    double lastReported = -1.0;
+    bool inputDone = false;
+
+    while (!m_cancelled) {
+        if (!inputDone) {
+            ret = av_read_frame(input, packet);
+            if (ret < 0) {
+                inputDone = true;
+                ret = avcodec_send_packet(decoder, NULL);
+            } else {
+                ret = packet->stream_index == streamIndex ? avcodec_send_packet(decoder, packet) : 0;
+                av_packet_unref(packet);
+            }
+            // A damaged packet costs the frames up to the next keyframe, not the job
+            if (ret == AVERROR_INVALIDDATA) {
+                LogDebug("Transcode: skipping a damaged packet in " + m_inputFile);
+            } else if (ret < 0) {
+                LogDebug("Transcode: could not send a packet to the decoder");
+                return cleanup(false);
+            }
+        }
+
+        while (!m_cancelled && (ret = avcodec_receive_frame(decoder, frame)) >= 0) {
+            int64_t timestamp = frame->best_effort_timestamp;
+            if (timestamp == AV_NOPTS_VALUE) {
+                frame->pts = framesDone;
+            } else {
+                if (firstPts == AV_NOPTS_VALUE) firstPts = timestamp;
+                frame->pts = av_rescale_q(timestamp - firstPts, stream->time_base, encoderTimeBase);
+                double position = timestamp * av_q2d(stream->time_base);
+                if (duration > 0.0) {
+                    m_progress = std::min(1.0, std::max(0.0, position / duration));
+                }
+            }
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+            for (auto& encoder : encoders) {
+                if (!encoder->Encode(frame)) {
+                    av_frame_unref(frame);
+                    return cleanup(false);
+                }
+            }
+            av_frame_unref(frame);
+            framesDone++;
+
+            if (m_progress - lastReported >= 0.01) {
+                lastReported = m_progress;
+                if (m_onProgress) m_onProgress(m_progress);
+            }
+
+            // Stay under the configured decode rate so the job never competes
+            // with a live recording for long bursts
+            if (m_maxFramesPerSecond > 0) {
+                auto due = startTime + std::chrono::microseconds(framesDone * 1000000 / m_maxFramesPerSecond);
+                std::this_thread::sleep_until(due);
+            }
+        }
+        if (ret == AVERROR_EOF) {
+            break;
+        }
+        if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            LogDebug("Transcode: decoding failed");
+            return cleanup(false);
+        }
+    }
+
+    if (m_cancelled) {
+        return cleanup(false);
+    }
+    m_progress = 1.0;
+    if (m_onProgress) m_onProgress(1.0);
+    LogConcise("Transcode", "Transcoded " + std::to_string(framesDone) + " frames from " + m_inputFile);
+    return cleanup(true);
+}
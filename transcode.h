@@ -0,0 +1,58 @@
+// transcode.h
+#pragma once
+
+#include "encoder.h"
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TRANSCODE_ENCODER_THREADS 2
+
+// Re-encodes a finished intermediate recording into the delivery profiles on
+// a low-priority background thread. The source is decoded once and every
+// output is fed from the same decoded frame.
+class TranscodeJob {
+public:
+    typedef std::function<void(double progress)> ProgressCallback;
+    typedef std::function<void(bool success, const std::vector<std::string>& outputs)> DoneCallback;
+
+    TranscodeJob(const std::string& inputFile, const std::string& baseFilename,
+                 const std::vector<EncoderProfile>& profiles);
+    ~TranscodeJob();
+
+    // Limits decoded frames per second; 0 runs as fast as the low priority allows.
+    void SetThrottle(int maxFramesPerSecond) { m_maxFramesPerSecond = maxFramesPerSecond; }
+    void SetKeepInput(bool keepInput) { m_keepInput = keepInput; }
+
+    bool Start(ProgressCallback onProgress, DoneCallback onDone);
+    void Cancel() { m_cancelled = true; }
+    bool Wait();
+
+    bool IsRunning() const { return m_running; }
+    double Progress() const { return m_progress; }
+    const std::string& InputFile() const { return m_inputFile; }
+
+private:
+    void Run();
+    bool Transcode();
+
+    std::string m_inputFile;
+    std::string m_baseFilename;
+    std::vector<EncoderProfile> m_profiles;
+    std::vector<std::string> m_outputs;
+    int m_maxFramesPerSecond;
+    bool m_keepInput;
+
+    ProgressCallback m_onProgress;
+    DoneCallback m_onDone;
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_cancelled;
+    std::atomic<bool> m_succeeded;
+    std::atomic<double> m_progress;
+    // Kept apart from the recording that may be running meanwhile
+    StageStats m_stageStats;
+};
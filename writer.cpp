@@ -0,0 +1,404 @@
+// writer.cpp
+#include "writer.h"
+#include "log.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#include <malloc.h>
+#else
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+uint8_t* AlignedAlloc(size_t size) {
+#ifdef _WIN32
+    return static_cast<uint8_t*>(_aligned_malloc(size, WRITER_ALIGNMENT));
+#else
+    void* data = nullptr;
+    return posix_memalign(&data, WRITER_ALIGNMENT, size) == 0 ? static_cast<uint8_t*>(data) : nullptr;
+#endif
+}
+
+void AlignedFree(uint8_t* data) {
+#ifdef _WIN32
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
+
+double Percentile(const std::vector<double>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()));
+    return sorted[index];
+}
+
+} // namespace
+
+AsyncFileWriter::AsyncFileWriter()
+        : m_context(nullptr), m_current(nullptr), m_position(0), m_end(0), m_writeThrough(false), m_observer(nullptr),
+          m_file(-1), m_directFile(-1), m_allocated(0), m_preallocateStep(0),
+          m_closing(false), m_failed(false), m_stats{0, 0, 0, 0.0, 0.0, 0.0, 0.0} {
+}
+
+AsyncFileWriter::~AsyncFileWriter() {
+    Close();
+}
+
+bool AsyncFileWriter::Open(const std::string& filename, int64_t projectedBitRate, bool directIo) {
+    m_filename = filename;
+    m_position = 0;
+    m_end = 0;
+    m_allocated = 0;
+    m_preallocateStep = projectedBitRate / 8 * WRITER_PREALLOCATE_SECONDS;
+    m_closing = false;
+    m_failed = false;
+    m_latencies.clear();
+    m_stats = WriteLatencyStats{0, 0, 0, 0.0, 0.0, 0.0, 0.0};
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        LogDebug("Could not create " + filename + ". Error: " + std::to_string(GetLastError()));
+        return false;
+    }
+    m_file = reinterpret_cast<intptr_t>(file);
+    if (directIo) {
+        HANDLE direct = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                    OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+        m_directFile = reinterpret_cast<intptr_t>(direct);
+    }
+#else
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LogDebug("Could not create " + filename + ": " + std::string(strerror(errno)));
+        return false;
+    }
+    m_file = fd;
+#ifdef O_DIRECT
+    if (directIo) {
+        m_directFile = open(filename.c_str(), O_WRONLY | O_DIRECT);
+    }
+#endif
+#endif
+    if (directIo && m_directFile == -1) {
+        LogDebug("Unbuffered output not available for " + filename + ", using the OS cache");
+    }
+
+    uint8_t* ioBuffer = static_cast<uint8_t*>(av_malloc(WRITER_IO_BUFFER_SIZE));
+    if (ioBuffer) {
+        m_context = avio_alloc_context(ioBuffer, WRITER_IO_BUFFER_SIZE, 1, this, NULL,
+                                       &AsyncFileWriter::WritePacket, &AsyncFileWriter::Seek);
+    }
+    if (!m_context) {
+        LogDebug("Could not allocate the output I/O context");
+        av_free(ioBuffer);
+        CloseFiles();
+        return false;
+    }
+
+    m_thread = std::thread(&AsyncFileWriter::Run, this);
+    return true;
+}
+
+bool AsyncFileWriter::Close() {
+    if (!m_context) {
+        return !m_failed;
+    }
+
+    // Push out the I/O buffer and the partly filled chunk, then let the thread drain
+    avio_flush(m_context);
+    SubmitCurrent();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closing = true;
+    }
+    m_condition.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+#if defined(__linux__)
+    // Space reserved past the end of the data stays allocated until truncated
+    if (m_allocated > m_end && ftruncate(static_cast<int>(m_file), m_end) != 0) {
+        LogDebug(m_filename + ": could not release preallocated space");
+    }
+#endif
+    CloseFiles();
+    FreeChunks();
+    av_freep(&m_context->buffer);
+    avio_context_free(&m_context);
+
+    std::sort(m_latencies.begin(), m_latencies.end());
+    m_stats.writes = static_cast<int64_t>(m_latencies.size());
+    m_stats.p50Ms = Percentile(m_latencies, 0.50);
+    m_stats.p90Ms = Percentile(m_latencies, 0.90);
+    m_stats.p99Ms = Percentile(m_latencies, 0.99);
+    m_stats.maxMs = m_latencies.empty() ? 0.0 : m_latencies.back();
+
+    std::stringstream ss;
+    ss.precision(2);
+    ss << std::fixed << m_filename << ": " << m_stats.writes << " writes, " << m_stats.bytes << " bytes, latency p50 "
+       << m_stats.p50Ms << " ms, p90 " << m_stats.p90Ms << " ms, p99 " << m_stats.p99Ms << " ms, max "
+       << m_stats.maxMs << " ms, " << m_stats.stalls << " stalls";
+    LogConcise("Writer", ss.str());
+    return !m_failed;
+}
+
+int AsyncFileWriter::WritePacket(void* opaque, AvioWriteBuffer buffer, int size) {
+    return static_cast<AsyncFileWriter*>(opaque)->Write(buffer, size);
+}
+
+int64_t AsyncFileWriter::Seek(void* opaque, int64_t offset, int whence) {
+    AsyncFileWriter* writer = static_cast<AsyncFileWriter*>(opaque);
+    if (whence & AVSEEK_SIZE) {
+        return writer->m_end;
+    }
+    // avio has already written out its buffer; the next write starts a new chunk
+    switch (whence & ~AVSEEK_FORCE) {
+        case SEEK_SET: writer->m_position = offset; break;
+        case SEEK_CUR: writer->m_position += offset; break;
+        case SEEK_END: writer->m_position = writer->m_end + offset; break;
+        default: return AVERROR(EINVAL);
+    }
+    return writer->m_position;
+}
+
+int AsyncFileWriter::Write(const uint8_t* data, int size) {
+    if (m_failed) {
+        return AVERROR(EIO);
+    }
+    if (m_observer) {
+        m_observer->OnWrite(m_position, data, size);
+    }
+    if (m_current && m_position != m_current->offset + static_cast<int64_t>(m_current->size)) {
+        SubmitCurrent();
+    }
+
+    int remaining = size;
+    while (remaining > 0) {
+        if (!m_current) {
+            m_current = TakeFreeChunk();
+            if (!m_current) {
+                return AVERROR(EIO);
+            }
+            m_current->offset = m_position;
+            m_current->size = 0;
+        }
+        size_t count = std::min(static_cast<size_t>(remaining), WRITER_CHUNK_SIZE - m_current->size);
+        memcpy(m_current->data + m_current->size, data, count);
+        m_current->size += count;
+        m_position += count;
+        data += count;
+        remaining -= static_cast<int>(count);
+        if (m_current->size == WRITER_CHUNK_SIZE) {
+            SubmitCurrent();
+        }
+    }
+    m_end = std::max(m_end, m_position);
+    return size;
+}
+
+void AsyncFileWriter::Flush() {
+    if (!m_writeThrough || !m_context) {
+        return;
+    }
+    avio_flush(m_context);
+    SubmitCurrent();
+}
+
+void AsyncFileWriter::SubmitCurrent() {
+    if (!m_current) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(m_current);
+    }
+    m_current = nullptr;
+    m_condition.notify_all();
+}
+
+AsyncFileWriter::Chunk* AsyncFileWriter::TakeFreeChunk() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_freeChunks.empty() && m_chunks.size() < WRITER_MAX_CHUNKS) {
+        uint8_t* data = AlignedAlloc(WRITER_CHUNK_SIZE);
+        if (!data) {
+            LogDebug(m_filename + ": could not allocate an output chunk");
+            m_failed = true;
+            return nullptr;
+        }
+        m_chunks.push_back(new Chunk{data, 0, 0});
+        return m_chunks.back();
+    }
+    if (m_freeChunks.empty()) {
+        // Every chunk is queued: the disk is behind, so the muxer waits here
+        m_stats.stalls++;
+        m_condition.wait(lock, [this] { return !m_freeChunks.empty() || m_failed; });
+        if (m_freeChunks.empty()) {
+            return nullptr;
+        }
+    }
+    Chunk* chunk = m_freeChunks.back();
+    m_freeChunks.pop_back();
+    return chunk;
+}
+
+void AsyncFileWriter::Run() {
+    TRACE_THREAD_NAME("Writer " + m_filename);
+    std::vector<Chunk*> batch;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this] { return m_closing || !m_queue.empty(); });
+            if (m_queue.empty()) {
+                break;
+            }
+            batch.assign(m_queue.begin(), m_queue.end());
+            m_queue.clear();
+        }
+
+        // Contiguous chunks that go through the same handle become a single gathered write
+        size_t start = 0;
+        for (size_t i = 0; i < batch.size(); i++) {
+            bool last = i + 1 == batch.size();
+            if (last || batch[i + 1]->offset != batch[i]->offset + static_cast<int64_t>(batch[i]->size) ||
+                CanWriteDirect(batch[i + 1]) != CanWriteDirect(batch[i])) {
+                TRACE_SCOPE("WriteRun");
+                if (!m_failed && !WriteRun(&batch[start], i + 1 - start)) {
+                    m_failed = true;
+                }
+                start = i + 1;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_freeChunks.insert(m_freeChunks.end(), batch.begin(), batch.end());
+        }
+        m_condition.notify_all();
+    }
+}
+
+bool AsyncFileWriter::CanWriteDirect(const Chunk* chunk) const {
+    return m_directFile != -1 && chunk->offset % WRITER_ALIGNMENT == 0 && chunk->size % WRITER_ALIGNMENT == 0;
+}
+
+bool AsyncFileWriter::WriteRun(Chunk* const* chunks, size_t count) {
+    int64_t offset = chunks[0]->offset;
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes += chunks[i]->size;
+    }
+    Preallocate(offset + static_cast<int64_t>(bytes));
+    intptr_t file = CanWriteDirect(chunks[0]) ? m_directFile : m_file;
+
+    auto start = std::chrono::steady_clock::now();
+#ifdef _WIN32
+    for (size_t i = 0; i < count; i++) {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(chunks[i]->offset & 0xFFFFFFFF);
+        overlapped.OffsetHigh = static_cast<DWORD>(chunks[i]->offset >> 32);
+        DWORD written = 0;
+        if (!WriteFile(reinterpret_cast<HANDLE>(file), chunks[i]->data, static_cast<DWORD>(chunks[i]->size),
+                       &written, &overlapped) || written != chunks[i]->size) {
+            LogDebug(m_filename + ": write failed. Error: " + std::to_string(GetLastError()));
+            return false;
+        }
+    }
+#else
+    struct iovec vectors[WRITER_MAX_CHUNKS];
+    for (size_t i = 0; i < count; i++) {
+        vectors[i].iov_base = chunks[i]->data;
+        vectors[i].iov_len = chunks[i]->size;
+    }
+    struct iovec* pending = vectors;
+    int remaining = static_cast<int>(count);
+    while (remaining > 0) {
+        ssize_t written = pwritev(static_cast<int>(file), pending, remaining, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            LogDebug(m_filename + ": write failed: " + std::string(strerror(errno)));
+            return false;
+        }
+        offset += written;
+        while (remaining > 0 && static_cast<size_t>(written) >= pending->iov_len) {
+            written -= pending->iov_len;
+            pending++;
+            remaining--;
+        }
+        if (remaining > 0) {
+            pending->iov_base = static_cast<uint8_t*>(pending->iov_base) + written;
+            pending->iov_len -= written;
+        }
+    }
+#endif
+    m_latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    m_stats.bytes += bytes;
+    return true;
+}
+
+void AsyncFileWriter::Preallocate(int64_t end) {
+    if (m_preallocateStep <= 0 || end <= m_allocated) {
+        return;
+    }
+    // Reserve space without moving the end of file, so a short recording
+    // never ends up padded
+    int64_t target = end + m_preallocateStep;
+#ifdef _WIN32
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = target;
+    bool ok = SetFileInformationByHandle(reinterpret_cast<HANDLE>(m_file), FileAllocationInfo, &info, sizeof(info)) != 0;
+#elif defined(__linux__)
+    bool ok = fallocate(static_cast<int>(m_file), FALLOC_FL_KEEP_SIZE, 0, target) == 0;
+#else
+    bool ok = false;
+#endif
+    if (!ok) {
+        LogDebug(m_filename + ": preallocation not supported, writing without it");
+        m_preallocateStep = 0;
+        return;
+    }
+    m_allocated = target;
+}
+
+void AsyncFileWriter::CloseFiles() {
+#ifdef _WIN32
+    if (m_directFile != -1) CloseHandle(reinterpret_cast<HANDLE>(m_directFile));
+    if (m_file != -1) CloseHandle(reinterpret_cast<HANDLE>(m_file));
+#else
+    if (m_directFile != -1) close(static_cast<int>(m_directFile));
+    if (m_file != -1) close(static_cast<int>(m_file));
+#endif
+    m_directFile = -1;
+    m_file = -1;
+}
+
+void AsyncFileWriter::FreeChunks() {
+    if (m_current) {
+        m_freeChunks.push_back(m_current);
+        m_current = nullptr;
+    }
+    for (Chunk* chunk : m_chunks) {
+        AlignedFree(chunk->data);
+        delete chunk;
+    }
+    m_chunks.clear();
+    m_freeChunks.clear();
+    m_queue.clear();
+}
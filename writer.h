@@ -0,0 +1,124 @@
+// writer.h
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#define WRITER_CHUNK_SIZE (4 * 1024 * 1024)
+#define WRITER_MAX_CHUNKS 8              // chunks in flight before the muxer has to wait
+#define WRITER_ALIGNMENT 4096            // chunk alignment, as unbuffered I/O requires
+#define WRITER_IO_BUFFER_SIZE 65536      // AVIOContext buffer in front of the chunks
+#define WRITER_PREALLOCATE_SECONDS 10    // disk space reserved ahead of the data
+
+// The write callback lost its non-const buffer in libavformat 61
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+typedef const uint8_t* AvioWriteBuffer;
+#else
+typedef uint8_t* AvioWriteBuffer;
+#endif
+
+struct WriteLatencyStats {
+    int64_t writes;
+    int64_t bytes;
+    int64_t stalls;    // times the muxer waited for a free chunk
+    double p50Ms;
+    double p90Ms;
+    double p99Ms;
+    double maxMs;
+};
+
+// Sees every byte the muxer writes, at its file offset, on the muxing thread
+class WriteObserver {
+public:
+    virtual ~WriteObserver() {}
+    virtual void OnWrite(int64_t offset, const uint8_t* data, int size) = 0;
+};
+
+// Muxer output that never touches the disk on the encoding thread. Bytes are
+// gathered into large aligned chunks that a dedicated thread writes at their
+// file offsets, so a muxer seeking back to patch a header just starts a new
+// chunk at the new position.
+class AsyncFileWriter {
+public:
+    AsyncFileWriter();
+    ~AsyncFileWriter();
+
+    // projectedBitRate sizes the preallocation, 0 skips it. directIo bypasses
+    // the OS cache for aligned chunks where the platform supports it.
+    bool Open(const std::string& filename, int64_t projectedBitRate, bool directIo);
+    // Writes out everything, waits for the writer thread and frees the context.
+    bool Close();
+
+    // With write-through, Flush hands the partly filled chunk to the writer
+    // thread instead of waiting for it to fill, so completed fragments reach
+    // the file while recording.
+    void SetWriteThrough(bool writeThrough) { m_writeThrough = writeThrough; }
+    // Call after each muxed packet. A fragmenting muxer only produces bytes
+    // when it completes a fragment, so this submits once per fragment rather
+    // than once per I/O buffer.
+    void Flush();
+    // Must outlive the writer or be cleared before Close
+    void SetObserver(WriteObserver* observer) { m_observer = observer; }
+
+    AVIOContext* Context() const { return m_context; }
+    const std::string& Filename() const { return m_filename; }
+    // Valid after Close
+    const WriteLatencyStats& Stats() const { return m_stats; }
+
+private:
+    struct Chunk {
+        uint8_t* data;
+        size_t size;
+        int64_t offset;
+    };
+
+    static int WritePacket(void* opaque, AvioWriteBuffer buffer, int size);
+    static int64_t Seek(void* opaque, int64_t offset, int whence);
+
+    int Write(const uint8_t* data, int size);
+    void SubmitCurrent();
+    Chunk* TakeFreeChunk();
+    void Run();
+    bool CanWriteDirect(const Chunk* chunk) const;
+    bool WriteRun(Chunk* const* chunks, size_t count);
+    void Preallocate(int64_t end);
+    void CloseFiles();
+    void FreeChunks();
+
+    std::string m_filename;
+    AVIOContext* m_context;
+
+    // Used only by the muxing thread
+    Chunk* m_current;
+    int64_t m_position;
+    int64_t m_end;
+    bool m_writeThrough;
+    WriteObserver* m_observer;
+
+    // Used only by the writer thread
+    intptr_t m_file;         // HANDLE on Windows, descriptor elsewhere; -1 when closed
+    intptr_t m_directFile;   // second unbuffered handle, -1 when not in use
+    int64_t m_allocated;
+    int64_t m_preallocateStep;
+    std::vector<double> m_latencies;
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<Chunk*> m_queue;
+    std::vector<Chunk*> m_freeChunks;
+    std::vector<Chunk*> m_chunks;
+    bool m_closing;
+    std::atomic<bool> m_failed;
+    WriteLatencyStats m_stats;
+};